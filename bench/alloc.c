@@ -0,0 +1,105 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Count heap allocations by wrapping the allocator of the C library.
+ *
+ * common/mem.h only sees what t2play asks for itself, while most of the heap
+ * traffic of a frame comes from pango, cairo and glib. glibc exports its
+ * allocator as __libc_*(), so malloc() and friends can be defined here on
+ * top of it and catch every library linked in. Elsewhere, nothing is counted.
+ */
+#include <errno.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include "bench.h"
+
+#ifdef __GLIBC__
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void __libc_free(void *ptr);
+
+static atomic_uint_fast64_t calls, bytes;
+
+static void
+count(size_t size)
+{
+	atomic_fetch_add_explicit(&calls, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&bytes, size, memory_order_relaxed);
+}
+
+void *
+malloc(size_t size)
+{
+	count(size);
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+	count(n * size);
+	return __libc_calloc(n, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	count(size);
+	return __libc_realloc(ptr, size);
+}
+
+void
+free(void *ptr)
+{
+	__libc_free(ptr);
+}
+
+void *
+memalign(size_t alignment, size_t size)
+{
+	count(size);
+	return __libc_memalign(alignment, size);
+}
+
+void *
+aligned_alloc(size_t alignment, size_t size)
+{
+	count(size);
+	return __libc_memalign(alignment, size);
+}
+
+int
+posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+	if (alignment % sizeof(void *) || (alignment & (alignment - 1))) {
+		return EINVAL;
+	}
+	count(size);
+	void *p = __libc_memalign(alignment, size);
+	if (!p) {
+		return ENOMEM;
+	}
+	*ptr = p;
+	return 0;
+}
+
+bool
+alloc_counts_get(struct alloc_counts *counts)
+{
+	counts->calls = atomic_load_explicit(&calls, memory_order_relaxed);
+	counts->bytes = atomic_load_explicit(&bytes, memory_order_relaxed);
+	return true;
+}
+
+#else
+
+bool
+alloc_counts_get(struct alloc_counts *counts)
+{
+	*counts = (struct alloc_counts){ 0 };
+	return false;
+}
+
+#endif
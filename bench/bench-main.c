@@ -0,0 +1,96 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * main.c, built into the harness with its main() renamed, so that frames go
+ * through the same code as in t2play. The globals are stub proxies instead
+ * of being bound from the registry.
+ */
+#define main t2play_main
+#include "../src/main.c"
+#undef main
+
+#include "bench.h"
+#include "stub.h"
+
+void
+bench_panel_init(struct panel *panel, struct conf *conf)
+{
+	*panel = (struct panel){ .conf = conf, .scale = 1 };
+	for (int i = 0; i < NR_FDS; i++) {
+		panel->pollfds[i].fd = -1;
+	}
+
+	/* Without a worker, loading and decoding happen inline */
+	desktop_entry_init(panel);
+	panel->timers = timers_create();
+
+	wl_list_init(&panel->outputs);
+	wl_list_init(&panel->seats);
+	wl_list_init(&panel->bars);
+	wl_list_init(&panel->widgets);
+	wl_list_init(&panel->ext_toplevels);
+	wl_list_init(&panel->thumbnail_lru);
+	slab_init(&panel->toplevel_slab, sizeof(struct toplevel));
+	slab_init(&panel->ext_toplevel_slab, sizeof(struct ext_toplevel));
+	panel->app_ids = intern_create();
+
+	panel->compositor = (struct wl_compositor *)stub_proxy_create(
+		&wl_compositor_interface, 4);
+	panel->shm = (struct wl_shm *)stub_proxy_create(&wl_shm_interface, 1);
+	panel->layer_shell = (struct zwlr_layer_shell_v1 *)stub_proxy_create(
+		&zwlr_layer_shell_v1_interface, 1);
+	panel->toplevel_manager = (struct zwlr_foreign_toplevel_manager_v1 *)
+		stub_proxy_create(&zwlr_foreign_toplevel_manager_v1_interface, 3);
+	plugin_taskbar_init(panel);
+
+	init_plugins(panel);
+	panel->run_display = true;
+}
+
+void
+bench_panel_finish(struct panel *panel)
+{
+	desktop_entry_finish(panel);
+	panel_destroy(panel);
+}
+
+struct output *
+bench_output_create(struct panel *panel)
+{
+	struct output *output = znew(*output);
+	output->wl_output = (struct wl_output *)stub_proxy_create(
+		&wl_output_interface, 4);
+	output->scale = 1;
+	output->panel = panel;
+	wl_list_insert(&panel->outputs, &output->link);
+	wl_output_add_listener(output->wl_output, &output_listener, output);
+	return output;
+}
+
+struct output *
+bench_output_add(struct panel *panel, const char *name, int width, int scale)
+{
+	struct output *output = bench_output_create(panel);
+	output_name(output, output->wl_output, name);
+	output_scale(output, output->wl_output, scale);
+	output_done(output, output->wl_output);
+	if (output->bar) {
+		layer_surface_configure(output->bar, output->bar->layer_surface,
+			0, width, panel->conf->panel_breadth);
+	}
+	return output;
+}
+
+void
+bench_flush_frame(struct panel *panel)
+{
+	panel_flush_frame(panel);
+}
+
+void
+bench_damage_all(struct panel *panel)
+{
+	struct bar *bar;
+	wl_list_for_each(bar, &panel->bars, link) {
+		bar_damage_box(bar, &bar->box);
+	}
+}
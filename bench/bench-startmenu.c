@@ -0,0 +1,35 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/* The start menu plugin, built into the harness to reach its search */
+#include "../src/plugin-startmenu.c"
+
+#include "bench.h"
+
+struct startmenu *
+bench_startmenu_find(struct panel *panel)
+{
+	struct widget *widget;
+	wl_list_for_each(widget, &panel->widgets, link) {
+		if (widget->type == WIDGET_STARTMENU) {
+			return (struct startmenu *)widget;
+		}
+	}
+	return NULL;
+}
+
+void
+bench_startmenu_load(struct startmenu *menu)
+{
+	if (!menu->apps_loaded) {
+		load_apps(menu);
+	}
+}
+
+/* As if @query had just been typed in, returns the number of matches */
+int
+bench_startmenu_search(struct startmenu *menu, const char *query)
+{
+	snprintf(menu->search, sizeof(menu->search), "%s", query);
+	menu->search_len = strlen(menu->search);
+	update_filtered(menu);
+	return menu->n_filtered;
+}
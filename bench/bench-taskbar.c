@@ -0,0 +1,45 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/* The taskbar plugin, built into the harness to reach its static functions */
+#include "../src/plugin-taskbar.c"
+
+#include "bench.h"
+#include "stub.h"
+
+/* Map a window the way the compositor announces it, without a frame */
+struct toplevel *
+bench_toplevel_open(struct panel *panel, const char *app_id, const char *title,
+	struct wl_output *output)
+{
+	struct zwlr_foreign_toplevel_handle_v1 *handle =
+		(struct zwlr_foreign_toplevel_handle_v1 *)stub_proxy_create(
+			&zwlr_foreign_toplevel_handle_v1_interface, 3);
+	handle_toplevel_manager_toplevel(panel, panel->toplevel_manager, handle);
+	struct toplevel *toplevel =
+		zwlr_foreign_toplevel_handle_v1_get_user_data(handle);
+
+	handle_toplevel_app_id(toplevel, handle, app_id);
+	handle_toplevel_title(toplevel, handle, title);
+	if (output) {
+		handle_toplevel_output_enter(toplevel, handle, output);
+	}
+	handle_toplevel_done(toplevel, handle);
+	return toplevel;
+}
+
+void
+bench_toplevel_set_title(struct toplevel *toplevel, const char *title)
+{
+	handle_toplevel_title(toplevel, toplevel->handle, title);
+}
+
+void
+bench_toplevel_update(struct toplevel *toplevel)
+{
+	toplevel_update_surface(toplevel);
+}
+
+void
+bench_toplevel_done(struct toplevel *toplevel)
+{
+	handle_toplevel_done(toplevel, toplevel->handle);
+}
@@ -0,0 +1,463 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Microbenchmarks of the hot paths of t2play, run headless against stub
+ * proxies (see stub.c) with widgets, layout and compositing all real.
+ *
+ * Each benchmark times a number of operations and reports the time and the
+ * heap allocations per operation, both all of them (see alloc.c) and those
+ * of t2play itself, through common/mem.h.
+ */
+#include <cairo.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common/log.h"
+#include "common/mem.h"
+#include "common/scale.h"
+#include "conf.h"
+#include "desktop-entry.h"
+#include "panel.h"
+#include "stats.h"
+#include "bench.h"
+#include "stub.h"
+
+#define N_TOPLEVELS 500
+#define N_APPS 5000
+#define N_ICONS 1000
+#define N_WINDOW_APPS 250 /* apps that the toplevels are of */
+#define OUTPUT_WIDTH 3840
+
+/* A window capture scaled to a thumbnail, and an icon to the task button */
+#define CAPTURE_WIDTH 3840
+#define CAPTURE_HEIGHT 2160
+#define THUMBNAIL_WIDTH 200
+#define ICON_SOURCE_SIZE 256
+#define ICON_TARGET_SIZE 22
+
+struct harness {
+	struct panel panel;
+	struct conf conf;
+	struct startmenu *menu;
+	struct toplevel *toplevels[N_TOPLEVELS];
+	cairo_surface_t *scratch; /* for text and icons */
+	cairo_t *cairo;
+	char text[128];
+
+	/* Sources and destinations of the scaling benchmarks */
+	cairo_surface_t *capture, *thumbnail;
+	cairo_surface_t *icon, *icon_scaled;
+};
+
+struct benchmark {
+	const char *name;
+	void (*run)(struct harness *harness, long i);
+	long iterations;
+	long warmup;
+	const char *kernel; /* box scaler kernel to run with, if not NULL */
+};
+
+static void
+format_title(struct harness *harness, long i)
+{
+	snprintf(harness->text, sizeof(harness->text),
+		"~/src/t2play: make -j8 (step %ld)", i);
+}
+
+static void
+bench_text_measure(struct harness *harness, long i)
+{
+	/* Every string is new, as with a title that keeps changing */
+	format_title(harness, i);
+	get_text_size(harness->conf.font_description, harness->text);
+}
+
+static void
+bench_text_render(struct harness *harness, long i)
+{
+	format_title(harness, i);
+	cairo_move_to(harness->cairo, 0, 0);
+	render_text(harness->cairo, harness->conf.font_description, 1.0, false,
+		"%s", harness->text);
+}
+
+static void
+bench_toplevel_update_surface(struct harness *harness, long i)
+{
+	struct toplevel *toplevel = harness->toplevels[i % N_TOPLEVELS];
+	format_title(harness, i);
+	bench_toplevel_set_title(toplevel, harness->text);
+	bench_toplevel_update(toplevel);
+}
+
+/* The compositor is done with the frame and wants the next one */
+static void
+complete_frame(void)
+{
+	stub_release_buffers();
+	stub_complete_callbacks();
+}
+
+static void
+bench_render_frame(struct harness *harness, long i)
+{
+	struct toplevel *toplevel = harness->toplevels[i % N_TOPLEVELS];
+	format_title(harness, i);
+	bench_toplevel_set_title(toplevel, harness->text);
+	bench_toplevel_done(toplevel);
+	bench_flush_frame(&harness->panel);
+	complete_frame();
+}
+
+static void
+bench_render_frame_full(struct harness *harness, long i)
+{
+	bench_damage_all(&harness->panel);
+	bench_flush_frame(&harness->panel);
+	complete_frame();
+}
+
+/* Typed one key at a time, so most searches narrow the previous one */
+static const char *const queries[] = {
+	"t", "te", "ter", "term", "termi", "termin", "termina", "terminal",
+	"m", "mu", "mus", "musi", "music", "music p", "music pl",
+	"v", "vi", "vid", "vide", "video", "video e", "video ed",
+	"ed", "edi", "edit", "edito", "editor", "web", "browser", "xyzzy",
+};
+
+#define N_QUERIES (long)(sizeof(queries) / sizeof(queries[0]))
+
+static void
+bench_update_filtered(struct harness *harness, long i)
+{
+	bench_startmenu_search(harness->menu, queries[i % N_QUERIES]);
+}
+
+static void
+load_icon(struct harness *harness, long app)
+{
+	snprintf(harness->text, sizeof(harness->text), "bench-app-%ld", app);
+	desktop_entry_load_icon_from_app_id(harness->cairo, &harness->panel,
+		harness->text, DESKTOP_ICON_SIZE, 1.0);
+}
+
+/* Apps with an icon that none of the toplevels has loaded yet */
+static void
+bench_icon_lookup_cold(struct harness *harness, long i)
+{
+	load_icon(harness, N_WINDOW_APPS + i % (N_ICONS - N_WINDOW_APPS));
+}
+
+static void
+bench_icon_lookup_cached(struct harness *harness, long i)
+{
+	load_icon(harness, i % N_WINDOW_APPS);
+}
+
+static void
+bench_scale_box_thumbnail(struct harness *harness, long i)
+{
+	scale_surface_box(harness->thumbnail, harness->capture, NULL);
+}
+
+static void
+bench_scale_box_icon(struct harness *harness, long i)
+{
+	scale_surface_box(harness->icon_scaled, harness->icon, NULL);
+}
+
+/* What thumbnails and icons were scaled with before the box filter */
+static void
+scale_cairo(cairo_surface_t *dst, cairo_surface_t *src)
+{
+	double factor = (double)cairo_image_surface_get_width(dst)
+		/ cairo_image_surface_get_width(src);
+	cairo_t *cairo = cairo_create(dst);
+	cairo_scale(cairo, factor, factor);
+	cairo_set_source_surface(cairo, src, 0, 0);
+	cairo_pattern_set_filter(cairo_get_source(cairo), CAIRO_FILTER_GOOD);
+	cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
+	cairo_paint(cairo);
+	cairo_destroy(cairo);
+}
+
+static void
+bench_scale_cairo_thumbnail(struct harness *harness, long i)
+{
+	scale_cairo(harness->thumbnail, harness->capture);
+}
+
+static void
+bench_scale_cairo_icon(struct harness *harness, long i)
+{
+	scale_cairo(harness->icon_scaled, harness->icon);
+}
+
+static const struct benchmark benchmarks[] = {
+	{ "text-measure", bench_text_measure, 20000, 100, NULL },
+	{ "text-render", bench_text_render, 20000, 100, NULL },
+	{ "toplevel-update", bench_toplevel_update_surface, 20000, 100, NULL },
+	{ "render-frame", bench_render_frame, 5000, 10, NULL },
+	{ "render-frame-full", bench_render_frame_full, 500, 10, NULL },
+	{ "update-filtered", bench_update_filtered, 3000, N_QUERIES, NULL },
+	{ "icon-lookup-cold", bench_icon_lookup_cold, N_ICONS - N_WINDOW_APPS, 0, NULL },
+	{ "icon-lookup-cached", bench_icon_lookup_cached, 20000, 0, NULL },
+	{ "scale-box-thumbnail-c", bench_scale_box_thumbnail, 50, 2, "C" },
+	{ "scale-box-thumbnail-sse2", bench_scale_box_thumbnail, 50, 2, "SSE2" },
+	{ "scale-box-thumbnail-avx2", bench_scale_box_thumbnail, 50, 2, "AVX2" },
+	{ "scale-box-thumbnail-neon", bench_scale_box_thumbnail, 50, 2, "NEON" },
+	{ "scale-cairo-thumbnail", bench_scale_cairo_thumbnail, 50, 2, NULL },
+	{ "scale-box-icon-c", bench_scale_box_icon, 5000, 50, "C" },
+	{ "scale-box-icon-sse2", bench_scale_box_icon, 5000, 50, "SSE2" },
+	{ "scale-box-icon-avx2", bench_scale_box_icon, 5000, 50, "AVX2" },
+	{ "scale-box-icon-neon", bench_scale_box_icon, 5000, 50, "NEON" },
+	{ "scale-cairo-icon", bench_scale_cairo_icon, 5000, 50, NULL },
+};
+
+struct sample {
+	uint64_t ns;
+	bool counted; /* allocs is valid */
+	struct alloc_counts allocs;
+	uint64_t mem_bytes;
+};
+
+static void
+sample(struct sample *s)
+{
+	s->counted = alloc_counts_get(&s->allocs);
+	s->mem_bytes = stats.bytes_allocated;
+	s->ns = stats_now();
+}
+
+static void
+report(const char *name, long n, const struct sample *start,
+		const struct sample *end)
+{
+	double ops = n > 0 ? n : 1;
+	printf("%-26s %8ld ops %12.0f ns/op", name, n,
+		(end->ns - start->ns) / ops);
+	if (end->counted) {
+		printf(" %9.1f allocs/op %10.0f B/op",
+			(end->allocs.calls - start->allocs.calls) / ops,
+			(end->allocs.bytes - start->allocs.bytes) / ops);
+	}
+	printf(" %10.0f mem.h B/op\n", (end->mem_bytes - start->mem_bytes) / ops);
+}
+
+/* Something other than flat colour, with some transparency */
+static cairo_surface_t *
+test_image(int width, int height)
+{
+	cairo_surface_t *surface =
+		cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+	cairo_t *cairo = cairo_create(surface);
+	cairo_pattern_t *gradient = cairo_pattern_create_linear(0, 0,
+		width, height);
+	cairo_pattern_add_color_stop_rgba(gradient, 0, 0.9, 0.2, 0.1, 1);
+	cairo_pattern_add_color_stop_rgba(gradient, 1, 0.1, 0.3, 0.8, 0.5);
+	cairo_set_source(cairo, gradient);
+	cairo_paint(cairo);
+	cairo_pattern_destroy(gradient);
+	cairo_destroy(cairo);
+	return surface;
+}
+
+static void
+harness_init(struct harness *harness)
+{
+	conf_init(&harness->conf);
+	/* The battery would depend on the host */
+	xstrdup_replace(harness->conf.panel_items, "STKC");
+	bench_panel_init(&harness->panel, &harness->conf);
+	harness->scratch = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+		1024, 64);
+	harness->cairo = cairo_create(harness->scratch);
+
+	harness->capture = test_image(CAPTURE_WIDTH, CAPTURE_HEIGHT);
+	harness->thumbnail = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+		THUMBNAIL_WIDTH, CAPTURE_HEIGHT * THUMBNAIL_WIDTH / CAPTURE_WIDTH);
+	harness->icon = test_image(ICON_SOURCE_SIZE, ICON_SOURCE_SIZE);
+	harness->icon_scaled = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+		ICON_TARGET_SIZE, ICON_TARGET_SIZE);
+}
+
+static void
+harness_finish(struct harness *harness)
+{
+	cairo_surface_destroy(harness->capture);
+	cairo_surface_destroy(harness->thumbnail);
+	cairo_surface_destroy(harness->icon);
+	cairo_surface_destroy(harness->icon_scaled);
+	cairo_destroy(harness->cairo);
+	cairo_surface_destroy(harness->scratch);
+	bench_panel_finish(&harness->panel);
+}
+
+static void
+harness_populate(struct harness *harness)
+{
+	struct output *output = bench_output_add(&harness->panel, "BENCH-1",
+		OUTPUT_WIDTH, 1);
+	for (int i = 0; i < N_TOPLEVELS; i++) {
+		char app_id[64], title[64];
+		snprintf(app_id, sizeof(app_id), "bench-app-%d",
+			i % N_WINDOW_APPS);
+		snprintf(title, sizeof(title), "Window %d", i);
+		harness->toplevels[i] = bench_toplevel_open(&harness->panel,
+			app_id, title, output->wl_output);
+	}
+	bench_flush_frame(&harness->panel);
+	complete_frame();
+
+	harness->menu = bench_startmenu_find(&harness->panel);
+	if (!harness->menu) {
+		die("no start menu");
+	}
+	bench_startmenu_load(harness->menu);
+	if (harness->menu->n_apps != N_APPS) {
+		warn("%d apps loaded instead of %d", harness->menu->n_apps,
+			N_APPS);
+	}
+}
+
+static int
+run_benchmarks(const char *filter, long iterations)
+{
+	struct harness *harness = znew(*harness);
+	harness_init(harness);
+	harness_populate(harness);
+
+	int n = 0;
+	for (size_t b = 0; b < sizeof(benchmarks) / sizeof(benchmarks[0]); b++) {
+		const struct benchmark *bench = &benchmarks[b];
+		if (filter && !strstr(bench->name, filter)) {
+			continue;
+		}
+		if (bench->kernel && !scale_set_kernel(bench->kernel)) {
+			printf("%-26s not supported here\n", bench->name);
+			continue;
+		}
+		long count = iterations > 0 ? iterations : bench->iterations;
+		for (long i = 0; i < bench->warmup; i++) {
+			bench->run(harness, i);
+		}
+		struct sample start, end;
+		sample(&start);
+		for (long i = 0; i < count; i++) {
+			bench->run(harness, bench->warmup + i);
+		}
+		sample(&end);
+		report(bench->name, count, &start, &end);
+		if (bench->kernel) {
+			scale_set_kernel(NULL);
+		}
+		n++;
+	}
+
+	harness_finish(harness);
+	free(harness);
+	return n;
+}
+
+static int
+run_replay(const char *path, long iterations)
+{
+	struct harness *harness = znew(*harness);
+	harness_init(harness);
+	struct replay *replay = replay_load(&harness->panel, path);
+	if (!replay) {
+		die("cannot read %s", path);
+	}
+
+	/* Once to warm up the caches, as t2play would have been running */
+	long events = replay_run(replay);
+	if (iterations <= 0) {
+		iterations = 20;
+	}
+	struct sample start, end;
+	uint64_t frames = stats.frames_rendered;
+	sample(&start);
+	for (long i = 0; i < iterations; i++) {
+		replay_run(replay);
+	}
+	sample(&end);
+	frames = stats.frames_rendered - frames;
+
+	printf("%s: %ld events, %.1f frames per replay\n", path, events,
+		(double)frames / iterations);
+	report("replay-event", events * iterations, &start, &end);
+	report("replay-frame", frames, &start, &end);
+
+	replay_destroy(replay);
+	harness_finish(harness);
+	free(harness);
+	return 1;
+}
+
+static const struct option long_options[] = {
+	{"filter", required_argument, NULL, 'f'},
+	{"help", no_argument, NULL, 'h'},
+	{"iterations", required_argument, NULL, 'n'},
+	{"replay", required_argument, NULL, 'r'},
+	{0, 0, 0, 0}
+};
+
+static const char usage_message[] =
+	"Usage: t2play-bench [options...]\n"
+	"  -f, --filter <name>      Only run benchmarks whose name contains this\n"
+	"  -h, --help               Show help message and quit\n"
+	"  -n, --iterations <n>     Run this many operations per benchmark\n"
+	"  -r, --replay <file>      Replay a WAYLAND_DEBUG=1 log of t2play\n";
+
+static void
+usage(void)
+{
+	printf("%s", usage_message);
+	exit(0);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *filter = NULL;
+	const char *replay = NULL;
+	long iterations = 0;
+
+	int c;
+	while (1) {
+		int index = 0;
+		c = getopt_long(argc, argv, "f:hn:r:", long_options, &index);
+		if (c == -1) {
+			break;
+		}
+		switch (c) {
+		case 'f':
+			filter = optarg;
+			break;
+		case 'n':
+			iterations = atol(optarg);
+			break;
+		case 'r':
+			replay = optarg;
+			break;
+		case 'h':
+		default:
+			usage();
+		}
+	}
+	if (optind < argc) {
+		usage();
+	}
+
+	log_init(LOG_ERROR);
+	char *root = fixture_create(N_APPS, N_ICONS);
+	int n = replay ? run_replay(replay, iterations)
+		: run_benchmarks(filter, iterations);
+	fixture_destroy(root);
+
+	if (!n) {
+		warn("no benchmark matches '%s'", filter);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
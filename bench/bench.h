@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef BENCH_H
+#define BENCH_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct conf;
+struct output;
+struct panel;
+struct replay;
+struct startmenu;
+struct toplevel;
+struct wl_output;
+
+/* Heap use since the start of the process, see alloc.c */
+struct alloc_counts {
+	uint64_t calls; /* malloc, calloc, realloc and friends */
+	uint64_t bytes;
+};
+
+/* False if allocations cannot be counted with this C library */
+bool alloc_counts_get(struct alloc_counts *counts);
+
+/*
+ * A throwaway XDG tree of @n_apps .desktop files, @n_icons of which have a
+ * hicolor icon. The XDG_* variables point into it, so this has to be called
+ * before desktop_entry_init().
+ */
+char *fixture_create(int n_apps, int n_icons);
+void fixture_destroy(char *root);
+
+/* bench-main.c: main.c with the Wayland connection stubbed out */
+void bench_panel_init(struct panel *panel, struct conf *conf);
+void bench_panel_finish(struct panel *panel);
+struct output *bench_output_create(struct panel *panel);
+struct output *bench_output_add(struct panel *panel, const char *name,
+	int width, int scale);
+void bench_flush_frame(struct panel *panel);
+void bench_damage_all(struct panel *panel);
+
+/* bench-taskbar.c */
+struct toplevel *bench_toplevel_open(struct panel *panel, const char *app_id,
+	const char *title, struct wl_output *output);
+void bench_toplevel_set_title(struct toplevel *toplevel, const char *title);
+void bench_toplevel_update(struct toplevel *toplevel);
+void bench_toplevel_done(struct toplevel *toplevel);
+
+/* bench-startmenu.c */
+struct startmenu *bench_startmenu_find(struct panel *panel);
+void bench_startmenu_load(struct startmenu *menu);
+int bench_startmenu_search(struct startmenu *menu, const char *query);
+
+/*
+ * A log of WAYLAND_DEBUG=1 t2play, to be fed to @panel again. Returns NULL
+ * if @path cannot be read.
+ */
+struct replay *replay_load(struct panel *panel, const char *path);
+
+/*
+ * Send all events of the log, rendering frames as the main loop would.
+ * Returns the number of events sent.
+ */
+long replay_run(struct replay *replay);
+void replay_destroy(struct replay *replay);
+
+#endif /* BENCH_H */
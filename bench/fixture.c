@@ -0,0 +1,156 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Synthetic desktop entries and icons in a temporary XDG tree, so that the
+ * numbers do not depend on what happens to be installed.
+ */
+#include <cairo.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "common/log.h"
+#include "bench.h"
+
+/* Name parts, so that queries match a realistic share of the apps */
+static const char *const words[] = {
+	"Audio", "Browser", "Calculator", "Calendar", "Chat", "Clock",
+	"Disk", "Document", "Editor", "Files", "Font", "Game", "Image",
+	"Mail", "Manager", "Maps", "Monitor", "Music", "Notes", "Office",
+	"Paint", "Player", "Printer", "Recorder", "Settings", "System",
+	"Terminal", "Text", "Video", "Viewer", "Web", "Writer",
+};
+
+#define N_WORDS (sizeof(words) / sizeof(words[0]))
+
+static void
+write_file(const char *path, const char *contents)
+{
+	GError *err = NULL;
+	if (!g_file_set_contents(path, contents, -1, &err)) {
+		die("cannot write %s: %s", path, err->message);
+	}
+}
+
+static void
+make_dir(const char *path)
+{
+	if (g_mkdir_with_parents(path, 0700) < 0) {
+		die("cannot create %s", path);
+	}
+}
+
+static void
+write_icon(const char *path, int i)
+{
+	cairo_surface_t *surface =
+		cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 22, 22);
+	cairo_t *cairo = cairo_create(surface);
+	cairo_set_source_rgb(cairo, (i % 7) / 7.0, (i % 5) / 5.0,
+		(i % 3) / 3.0);
+	cairo_arc(cairo, 11, 11, 9, 0, 2 * G_PI);
+	cairo_fill(cairo);
+	cairo_destroy(cairo);
+	if (cairo_surface_write_to_png(surface, path) != CAIRO_STATUS_SUCCESS) {
+		die("cannot write %s", path);
+	}
+	cairo_surface_destroy(surface);
+}
+
+char *
+fixture_create(int n_apps, int n_icons)
+{
+	GError *err = NULL;
+	char *root = g_dir_make_tmp("t2play-bench-XXXXXX", &err);
+	if (!root) {
+		die("cannot create fixture: %s", err->message);
+	}
+
+	char *data = g_build_filename(root, "data", NULL);
+	char *apps = g_build_filename(data, "applications", NULL);
+	char *icons = g_build_filename(data, "icons", "hicolor", NULL);
+	char *icon_dir = g_build_filename(icons, "22x22", "apps", NULL);
+	make_dir(apps);
+	make_dir(icon_dir);
+
+	/* Only the fixture is searched, not the apps of the host */
+	g_setenv("XDG_DATA_HOME", data, true);
+	g_setenv("XDG_DATA_DIRS", data, true);
+	char *dir = g_build_filename(root, "cache", NULL);
+	g_setenv("XDG_CACHE_HOME", dir, true);
+	g_free(dir);
+	dir = g_build_filename(root, "config", NULL);
+	g_setenv("XDG_CONFIG_HOME", dir, true);
+	g_free(dir);
+	dir = g_build_filename(root, "state", NULL);
+	g_setenv("XDG_STATE_HOME", dir, true);
+	g_free(dir);
+
+	char *path = g_build_filename(icons, "index.theme", NULL);
+	write_file(path, "[Icon Theme]\n"
+		"Name=Hicolor\n"
+		"Directories=22x22/apps\n"
+		"\n"
+		"[22x22/apps]\n"
+		"Size=22\n"
+		"Type=Fixed\n");
+	g_free(path);
+
+	for (int i = 0; i < n_icons; i++) {
+		char name[64];
+		snprintf(name, sizeof(name), "bench-app-%d.png", i);
+		path = g_build_filename(icon_dir, name, NULL);
+		write_icon(path, i);
+		g_free(path);
+	}
+
+	for (int i = 0; i < n_apps; i++) {
+		char name[64];
+		snprintf(name, sizeof(name), "bench-app-%d.desktop", i);
+		char *entry = g_strdup_printf("[Desktop Entry]\n"
+			"Type=Application\n"
+			"Name=%s %s %d\n"
+			"Exec=bench-app-%d %%U\n"
+			"Icon=bench-app-%d\n"
+			"StartupWMClass=bench-app-%d\n"
+			"Keywords=%s;%s;\n",
+			words[i % N_WORDS], words[(i / N_WORDS) % N_WORDS], i,
+			i, i, i,
+			words[(i * 7) % N_WORDS], words[(i * 13) % N_WORDS]);
+		path = g_build_filename(apps, name, NULL);
+		write_file(path, entry);
+		g_free(path);
+		g_free(entry);
+	}
+
+	g_free(icon_dir);
+	g_free(icons);
+	g_free(apps);
+	g_free(data);
+	return root;
+}
+
+static void
+remove_tree(const char *path)
+{
+	GDir *dir = g_dir_open(path, 0, NULL);
+	if (dir) {
+		const char *name;
+		while ((name = g_dir_read_name(dir))) {
+			char *child = g_build_filename(path, name, NULL);
+			remove_tree(child);
+			g_free(child);
+		}
+		g_dir_close(dir);
+	}
+	g_remove(path);
+}
+
+void
+fixture_destroy(char *root)
+{
+	if (!root) {
+		return;
+	}
+	remove_tree(root);
+	g_free(root);
+}
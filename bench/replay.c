@@ -0,0 +1,367 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Replay a session recorded with WAYLAND_DEBUG=1.
+ *
+ * libwayland logs every message as
+ *
+ *   [1234567.890] {Default Queue} zwlr_foreign_toplevel_handle_v1#41.title("foot")
+ *   [1234567.891] {Default Queue}  -> wl_surface#3.frame(new id wl_callback#52)
+ *
+ * with '@' instead of '#' and no queue name before 1.23. Events that t2play
+ * acts on are sent to it again through the stub proxies. Messages logged
+ * within the same millisecond are taken as one dispatch, after which the main
+ * loop would flush a frame, and frame callbacks of the log let the next frame
+ * through. The log only has the size of arrays, so toplevel states are sent
+ * empty.
+ */
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wayland-client.h>
+#include "common/array.h"
+#include "common/mem.h"
+#include "wlr-foreign-toplevel-management-unstable-v1-client-protocol.h"
+#include "wlr-layer-shell-unstable-v1-client-protocol.h"
+#include "panel.h"
+#include "bench.h"
+#include "stub.h"
+
+struct message {
+	char *time;
+	bool request;
+	char *interface;
+	uint32_t id;
+	char *name;
+	char *args;
+};
+
+struct replay {
+	struct panel *panel;
+	struct wl_array messages; /* struct message */
+	GHashTable *objects; /* id in the log -> stub proxy */
+	GHashTable *toplevels; /* id -> handle, of windows still open */
+	GHashTable *frame_callbacks; /* ids of wl_surface.frame callbacks */
+};
+
+static char *
+skip_space(char *p)
+{
+	while (*p == ' ' || *p == '\t') {
+		p++;
+	}
+	return p;
+}
+
+static bool
+parse_line(char *line, struct message *msg)
+{
+	if (*line != '[') {
+		return false;
+	}
+	char *p = strchr(line, ']');
+	if (!p) {
+		return false;
+	}
+	*p = '\0';
+	char *time = line + 1;
+	p = skip_space(p + 1);
+	if (*p == '{') {
+		p = strchr(p, '}');
+		if (!p) {
+			return false;
+		}
+		p = skip_space(p + 1);
+	}
+	bool request = !strncmp(p, "->", 2);
+	if (request) {
+		p = skip_space(p + 2);
+	}
+
+	char *interface = p;
+	p += strcspn(p, "@#");
+	if (!*p) {
+		return false;
+	}
+	*p = '\0';
+	uint32_t id = strtoul(p + 1, &p, 10);
+	if (*p != '.') {
+		return false;
+	}
+	char *name = p + 1;
+	char *open = strchr(name, '(');
+	char *close = strrchr(name, ')');
+	if (!open || !close || close < open) {
+		return false;
+	}
+	*open = *close = '\0';
+
+	*msg = (struct message){
+		.time = xstrdup(skip_space(time)),
+		.request = request,
+		.interface = xstrdup(interface),
+		.id = id,
+		.name = xstrdup(name),
+		.args = xstrdup(open + 1),
+	};
+	return true;
+}
+
+/* The string argument of a one-argument message, or NULL if nil */
+static const char *
+arg_string(char *args, char *buf, size_t size)
+{
+	size_t len = strlen(args);
+	if (len < 2 || args[0] != '"' || args[len - 1] != '"') {
+		return NULL;
+	}
+	snprintf(buf, size, "%.*s", (int)(len - 2), args + 1);
+	return buf;
+}
+
+/* The id of the last object argument, 0 if nil */
+static uint32_t
+arg_object(const char *args)
+{
+	const char *p = strrchr(args, '#');
+	const char *at = strrchr(args, '@');
+	if (!p || (at && at > p)) {
+		p = at;
+	}
+	return p ? strtoul(p + 1, NULL, 10) : 0;
+}
+
+static void *
+lookup(struct replay *replay, uint32_t id)
+{
+	return g_hash_table_lookup(replay->objects, GUINT_TO_POINTER(id));
+}
+
+static void
+insert(struct replay *replay, uint32_t id, void *proxy)
+{
+	g_hash_table_insert(replay->objects, GUINT_TO_POINTER(id), proxy);
+}
+
+static gboolean
+is_proxy(gpointer key, gpointer value, gpointer proxy)
+{
+	return value == proxy;
+}
+
+/* Outputs are bound by t2play itself, so they first show up in events */
+static struct wl_output *
+lookup_output(struct replay *replay, uint32_t id)
+{
+	struct wl_output *wl_output = lookup(replay, id);
+	if (!wl_output && id) {
+		wl_output = bench_output_create(replay->panel)->wl_output;
+		insert(replay, id, wl_output);
+	}
+	return wl_output;
+}
+
+/* Layer surfaces are matched up with the bars in the order they were made */
+static struct zwlr_layer_surface_v1 *
+lookup_layer_surface(struct replay *replay, uint32_t id)
+{
+	struct zwlr_layer_surface_v1 *surface = lookup(replay, id);
+	if (surface) {
+		return surface;
+	}
+	struct bar *bar;
+	wl_list_for_each(bar, &replay->panel->bars, link) {
+		if (!g_hash_table_find(replay->objects, is_proxy,
+				bar->layer_surface)) {
+			insert(replay, id, bar->layer_surface);
+			return bar->layer_surface;
+		}
+	}
+	return NULL;
+}
+
+static void
+send_toplevel_event(struct replay *replay, struct message *msg)
+{
+	struct zwlr_foreign_toplevel_handle_v1 *handle =
+		g_hash_table_lookup(replay->toplevels, GUINT_TO_POINTER(msg->id));
+	if (!handle) {
+		return;
+	}
+	void *data;
+	const struct zwlr_foreign_toplevel_handle_v1_listener *listener =
+		stub_listener((struct wl_proxy *)handle, &data);
+	char buf[4096];
+	if (!strcmp(msg->name, "title")) {
+		const char *title = arg_string(msg->args, buf, sizeof(buf));
+		listener->title(data, handle, title ? title : "");
+	} else if (!strcmp(msg->name, "app_id")) {
+		const char *app_id = arg_string(msg->args, buf, sizeof(buf));
+		listener->app_id(data, handle, app_id ? app_id : "");
+	} else if (!strcmp(msg->name, "output_enter")) {
+		listener->output_enter(data, handle,
+			lookup_output(replay, arg_object(msg->args)));
+	} else if (!strcmp(msg->name, "output_leave")) {
+		listener->output_leave(data, handle,
+			lookup_output(replay, arg_object(msg->args)));
+	} else if (!strcmp(msg->name, "state")) {
+		struct wl_array state;
+		wl_array_init(&state);
+		listener->state(data, handle, &state);
+	} else if (!strcmp(msg->name, "done")) {
+		listener->done(data, handle);
+	} else if (!strcmp(msg->name, "closed")) {
+		g_hash_table_remove(replay->toplevels, GUINT_TO_POINTER(msg->id));
+		listener->closed(data, handle);
+	}
+}
+
+static void
+send_event(struct replay *replay, struct message *msg)
+{
+	struct panel *panel = replay->panel;
+	void *data;
+	char buf[256];
+
+	if (!strcmp(msg->interface, "zwlr_foreign_toplevel_manager_v1")) {
+		if (strcmp(msg->name, "toplevel") || !panel->toplevel_manager) {
+			return;
+		}
+		struct wl_proxy *handle = stub_proxy_create(
+			&zwlr_foreign_toplevel_handle_v1_interface, 3);
+		g_hash_table_insert(replay->toplevels,
+			GUINT_TO_POINTER(arg_object(msg->args)), handle);
+		const struct zwlr_foreign_toplevel_manager_v1_listener *listener =
+			stub_listener((struct wl_proxy *)panel->toplevel_manager,
+				&data);
+		listener->toplevel(data, panel->toplevel_manager,
+			(struct zwlr_foreign_toplevel_handle_v1 *)handle);
+	} else if (!strcmp(msg->interface, "zwlr_foreign_toplevel_handle_v1")) {
+		send_toplevel_event(replay, msg);
+	} else if (!strcmp(msg->interface, "wl_output")) {
+		struct wl_output *wl_output = lookup_output(replay, msg->id);
+		const struct wl_output_listener *listener =
+			stub_listener((struct wl_proxy *)wl_output, &data);
+		if (!strcmp(msg->name, "name")) {
+			const char *name = arg_string(msg->args, buf, sizeof(buf));
+			listener->name(data, wl_output, name ? name : "");
+		} else if (!strcmp(msg->name, "scale")) {
+			listener->scale(data, wl_output, atoi(msg->args));
+		} else if (!strcmp(msg->name, "done")) {
+			listener->done(data, wl_output);
+		}
+	} else if (!strcmp(msg->interface, "zwlr_layer_surface_v1")) {
+		struct zwlr_layer_surface_v1 *surface =
+			lookup_layer_surface(replay, msg->id);
+		if (!surface) {
+			return;
+		}
+		const struct zwlr_layer_surface_v1_listener *listener =
+			stub_listener((struct wl_proxy *)surface, &data);
+		unsigned int serial, width, height;
+		if (!strcmp(msg->name, "configure") && sscanf(msg->args,
+				"%u, %u, %u", &serial, &width, &height) == 3) {
+			listener->configure(data, surface, serial, width, height);
+		} else if (!strcmp(msg->name, "closed")) {
+			g_hash_table_remove(replay->objects,
+				GUINT_TO_POINTER(msg->id));
+			listener->closed(data, surface);
+		}
+	} else if (!strcmp(msg->interface, "wl_callback")) {
+		if (!strcmp(msg->name, "done") && g_hash_table_remove(
+				replay->frame_callbacks, GUINT_TO_POINTER(msg->id))) {
+			stub_release_buffers();
+			stub_complete_callbacks();
+		}
+	}
+}
+
+struct replay *
+replay_load(struct panel *panel, const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		return NULL;
+	}
+	struct replay *replay = znew(*replay);
+	replay->panel = panel;
+	wl_array_init(&replay->messages);
+	replay->objects = g_hash_table_new(NULL, NULL);
+	replay->toplevels = g_hash_table_new(NULL, NULL);
+	replay->frame_callbacks = g_hash_table_new(NULL, NULL);
+
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	while ((len = getline(&line, &size, f)) > 0) {
+		if (line[len - 1] == '\n') {
+			line[len - 1] = '\0';
+		}
+		struct message msg;
+		if (parse_line(line, &msg)) {
+			array_add(&replay->messages, msg);
+		}
+	}
+	free(line);
+	fclose(f);
+	return replay;
+}
+
+/* Close windows left open at the end, so that the log can be sent again */
+static void
+close_toplevels(struct replay *replay)
+{
+	GList *handles = g_hash_table_get_values(replay->toplevels);
+	g_hash_table_remove_all(replay->toplevels);
+	for (GList *l = handles; l; l = l->next) {
+		void *data;
+		const struct zwlr_foreign_toplevel_handle_v1_listener *listener =
+			stub_listener(l->data, &data);
+		listener->closed(data, l->data);
+	}
+	g_list_free(handles);
+}
+
+long
+replay_run(struct replay *replay)
+{
+	long events = 0;
+	const char *batch = NULL;
+	struct message *msg;
+	wl_array_for_each(msg, &replay->messages) {
+		if (batch && strcmp(batch, msg->time)) {
+			bench_flush_frame(replay->panel);
+		}
+		batch = msg->time;
+		if (msg->request) {
+			if (!strcmp(msg->interface, "wl_surface")
+					&& !strcmp(msg->name, "frame")) {
+				g_hash_table_add(replay->frame_callbacks,
+					GUINT_TO_POINTER(arg_object(msg->args)));
+			}
+			continue;
+		}
+		send_event(replay, msg);
+		events++;
+	}
+	close_toplevels(replay);
+	bench_flush_frame(replay->panel);
+	return events;
+}
+
+void
+replay_destroy(struct replay *replay)
+{
+	struct message *msg;
+	wl_array_for_each(msg, &replay->messages) {
+		free(msg->time);
+		free(msg->interface);
+		free(msg->name);
+		free(msg->args);
+	}
+	wl_array_release(&replay->messages);
+	g_hash_table_destroy(replay->objects);
+	g_hash_table_destroy(replay->toplevels);
+	g_hash_table_destroy(replay->frame_callbacks);
+	free(replay);
+}
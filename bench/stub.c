@@ -0,0 +1,150 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Just enough of libwayland-client to run the panel without a compositor.
+ *
+ * The generated protocol headers sit on top of a handful of wl_proxy_*()
+ * functions. Defining them here shadows those of libwayland-client, which
+ * is still linked for wl_list, wl_array and the interface descriptions.
+ * Requests go nowhere, but objects created by them are tracked so that the
+ * harness can send events back through their listeners.
+ */
+#include <stdarg.h>
+#include <stdlib.h>
+#include <wayland-client.h>
+#include "common/mem.h"
+#include "stub.h"
+
+struct stub_proxy {
+	const struct wl_interface *interface;
+	uint32_t version;
+	const void *listener;
+	void *data;
+	struct wl_list link;
+};
+
+static struct wl_list proxies = { &proxies, &proxies };
+
+struct wl_proxy *
+stub_proxy_create(const struct wl_interface *interface, uint32_t version)
+{
+	struct stub_proxy *proxy = znew(*proxy);
+	proxy->interface = interface;
+	proxy->version = version;
+	wl_list_insert(&proxies, &proxy->link);
+	return (struct wl_proxy *)proxy;
+}
+
+const void *
+stub_listener(struct wl_proxy *wl_proxy, void **data)
+{
+	struct stub_proxy *proxy = (struct stub_proxy *)wl_proxy;
+	*data = proxy->data;
+	return proxy->listener;
+}
+
+void
+stub_release_buffers(void)
+{
+	struct stub_proxy *proxy, *tmp;
+	wl_list_for_each_safe(proxy, tmp, &proxies, link) {
+		if (proxy->interface != &wl_buffer_interface
+				|| !proxy->listener) {
+			continue;
+		}
+		const struct wl_buffer_listener *listener = proxy->listener;
+		listener->release(proxy->data, (struct wl_buffer *)proxy);
+	}
+}
+
+int
+stub_complete_callbacks(void)
+{
+	/* Handlers destroy their callback and may request the next one */
+	struct wl_list pending;
+	wl_list_init(&pending);
+	struct stub_proxy *proxy, *tmp;
+	wl_list_for_each_safe(proxy, tmp, &proxies, link) {
+		if (proxy->interface == &wl_callback_interface
+				&& proxy->listener) {
+			wl_list_remove(&proxy->link);
+			wl_list_insert(pending.prev, &proxy->link);
+		}
+	}
+
+	int n = 0;
+	while (!wl_list_empty(&pending)) {
+		proxy = wl_container_of(pending.next, proxy, link);
+		wl_list_remove(&proxy->link);
+		wl_list_insert(&proxies, &proxy->link);
+		const struct wl_callback_listener *listener = proxy->listener;
+		listener->done(proxy->data, (struct wl_callback *)proxy, 0);
+		n++;
+	}
+	return n;
+}
+
+int
+stub_live_proxies(void)
+{
+	return wl_list_length(&proxies);
+}
+
+struct wl_proxy *
+wl_proxy_marshal_flags(struct wl_proxy *wl_proxy, uint32_t opcode,
+	const struct wl_interface *interface, uint32_t version,
+	uint32_t flags, ...)
+{
+	struct wl_proxy *created = NULL;
+	if (interface) {
+		created = stub_proxy_create(interface, version);
+	}
+	if (flags & WL_MARSHAL_FLAG_DESTROY) {
+		wl_proxy_destroy(wl_proxy);
+	}
+	return created;
+}
+
+void
+wl_proxy_destroy(struct wl_proxy *wl_proxy)
+{
+	struct stub_proxy *proxy = (struct stub_proxy *)wl_proxy;
+	wl_list_remove(&proxy->link);
+	free(proxy);
+}
+
+int
+wl_proxy_add_listener(struct wl_proxy *wl_proxy,
+	void (**implementation)(void), void *data)
+{
+	struct stub_proxy *proxy = (struct stub_proxy *)wl_proxy;
+	if (proxy->listener) {
+		return -1;
+	}
+	proxy->listener = implementation;
+	proxy->data = data;
+	return 0;
+}
+
+const void *
+wl_proxy_get_listener(struct wl_proxy *wl_proxy)
+{
+	return ((struct stub_proxy *)wl_proxy)->listener;
+}
+
+void
+wl_proxy_set_user_data(struct wl_proxy *wl_proxy, void *user_data)
+{
+	((struct stub_proxy *)wl_proxy)->data = user_data;
+}
+
+void *
+wl_proxy_get_user_data(struct wl_proxy *wl_proxy)
+{
+	return ((struct stub_proxy *)wl_proxy)->data;
+}
+
+uint32_t
+wl_proxy_get_version(struct wl_proxy *wl_proxy)
+{
+	return ((struct stub_proxy *)wl_proxy)->version;
+}
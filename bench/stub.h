@@ -0,0 +1,28 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef STUB_H
+#define STUB_H
+#include <stdint.h>
+
+struct wl_interface;
+struct wl_proxy;
+
+/*
+ * A stand-in for a server-side object, as a proxy that its events can be
+ * sent through with stub_listener().
+ */
+struct wl_proxy *stub_proxy_create(const struct wl_interface *interface,
+	uint32_t version);
+
+/* The listener of @proxy, and the data it was added with, or NULL */
+const void *stub_listener(struct wl_proxy *proxy, void **data);
+
+/* Send wl_buffer.release for all buffers, as if the compositor was done */
+void stub_release_buffers(void);
+
+/* Send wl_callback.done for all pending callbacks, returns how many */
+int stub_complete_callbacks(void);
+
+/* Proxies created and not yet destroyed, to catch leaks in the harness */
+int stub_live_proxies(void);
+
+#endif /* STUB_H */
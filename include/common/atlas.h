@@ -0,0 +1,47 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef ATLAS_H
+#define ATLAS_H
+#include <cairo.h>
+#include <pango/pangocairo.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+struct atlas;
+
+/*
+ * A strip of pre-rasterized text in one font and color, so that labels made
+ * up of a small, fixed alphabet can be drawn by copying pixels rather than
+ * going through pango. It holds single ASCII characters, seeded with digits
+ * and the punctuation of clock and battery labels, and whole words added
+ * with atlas_add().
+ *
+ * Text is rasterized at @scale pixels per logical pixel. Sizes and positions
+ * are in logical pixels all the same.
+ */
+struct atlas *atlas_create(const PangoFontDescription *desc, uint32_t color,
+	int scale);
+void atlas_destroy(struct atlas *atlas);
+
+/* True if @atlas was rasterized for @desc, @color and @scale */
+bool atlas_matches(struct atlas *atlas, const PangoFontDescription *desc,
+	uint32_t color, int scale);
+
+/* Rasterize @word as a single entry */
+void atlas_add(struct atlas *atlas, const char *word);
+
+/*
+ * Get the size of @text when drawn from @atlas. Returns false if @text is
+ * neither a word in the atlas nor made up of characters that are.
+ */
+bool atlas_measure(struct atlas *atlas, const char *text, int *width,
+	int *height);
+
+/*
+ * Copy @text into @dst at @x, @y. @dst must be CAIRO_FORMAT_ARGB32 at the
+ * scale of @atlas and clear underneath, as pixels are copied rather than
+ * blended. Returns false without drawing if atlas_measure() would.
+ */
+bool atlas_draw(struct atlas *atlas, cairo_surface_t *dst, int x, int y,
+	const char *text);
+
+#endif /* ATLAS_H */
@@ -9,5 +9,6 @@ struct box {
 
 bool box_contains_point(const struct box *box, double x, double y);
 bool box_empty(const struct box *box);
+bool box_equal(const struct box *a, const struct box *b);
 
 #endif /* BOX_H */
@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef BUF_H
+#define BUF_H
+#include <stddef.h>
+
+/*
+ * Growable byte buffer. Since @data moves as the buffer grows, callers that
+ * build tables in it should record offsets and resolve them at the end.
+ */
+struct buf {
+	char *data;
+	size_t alloc;
+	size_t len;
+};
+
+/* Append @len bytes and return the offset they were stored at */
+size_t buf_add(struct buf *s, const void *data, size_t len);
+
+/* Append @str including its NUL terminator and return its offset */
+size_t buf_add_str(struct buf *s, const char *str);
+
+/* Free the buffer and reset it to its initial, empty state */
+void buf_reset(struct buf *s);
+
+#endif /* BUF_H */
@@ -0,0 +1,14 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef HASH_H
+#define HASH_H
+#include <stddef.h>
+#include <stdint.h>
+
+/* 64-bit FNV-1a, used to fingerprint widget content */
+#define HASH_INIT 0xcbf29ce484222325ULL
+
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t len);
+uint64_t hash_str(uint64_t hash, const char *str);
+uint64_t hash_u64(uint64_t hash, uint64_t value);
+
+#endif /* HASH_H */
@@ -0,0 +1,21 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef INTERN_H
+#define INTERN_H
+
+struct intern;
+
+/*
+ * Reference-counted string table. Strings that repeat across many objects,
+ * such as the app_id of every window of an app, are stored once, and equal
+ * strings from the same table are the same pointer.
+ */
+struct intern *intern_create(void);
+void intern_destroy(struct intern *intern);
+
+/* Take a reference to the copy of @str in @intern, adding it if needed */
+const char *intern_get(struct intern *intern, const char *str);
+
+/* Drop a reference from intern_get(), @str may be NULL */
+void intern_put(struct intern *intern, const char *str);
+
+#endif /* INTERN_H */
@@ -12,6 +12,7 @@ enum log_importance {
 };
 
 void log_init(enum log_importance verbosity);
+enum log_importance log_get_importance(void);
 void _log(enum log_importance verbosity, const char *format, ...);
 const char *_strip_path(const char *path);
 
@@ -2,12 +2,16 @@
 #ifndef LABWC_MEM_H
 #define LABWC_MEM_H
 
+#include <stdarg.h>
 #include <stdlib.h>
 
 void die_if_null(void *ptr);
 void *xzalloc(size_t size);
 #define znew(expr)       ((__typeof__(expr) *)xzalloc(sizeof(expr)))
 
+/* Like realloc() but dies on failure; frees @ptr and returns NULL if !size */
+void *xrealloc(void *ptr, size_t size);
+
 char *xstrdup(const char *str);
 #define xstrdup_replace(ptr, str) do { \
 	free(ptr); (ptr) = xstrdup(str); \
@@ -17,4 +21,49 @@ char *xstrdup(const char *str);
 	free(ptr); (ptr) = NULL; \
 } while (0)
 
+/*
+ * Copy @str into *@ptr, which holds *@size bytes. The buffer only grows, so a
+ * string that keeps changing, like a window title, stops allocating.
+ */
+void xstrset(char **ptr, size_t *size, const char *str);
+
+/*
+ * Bump allocator for scratch memory that is all released at once by
+ * arena_reset(). When a cycle needed more than one block, they are merged
+ * into one on reset, so an arena settles at the size of the largest cycle
+ * and from then on does not allocate. Zero-initialize to use.
+ */
+struct arena_block;
+
+struct arena {
+	struct arena_block *block; /* current, linked to the older ones */
+	size_t used; /* of the current block */
+	size_t total; /* allocated in this cycle, across blocks */
+};
+
+/* Uninitialized memory aligned for any type, valid until the next reset */
+void *arena_alloc(struct arena *arena, size_t size);
+char *arena_vprintf(struct arena *arena, const char *fmt, va_list args);
+void arena_reset(struct arena *arena);
+void arena_finish(struct arena *arena);
+
+/*
+ * Pool of fixed-size objects for things that come and go all the time, such
+ * as windows. Freed objects are reused before new chunks are allocated, and
+ * chunks are only given back by slab_finish().
+ */
+struct slab_chunk;
+
+struct slab {
+	size_t size;
+	void *free_list;
+	struct slab_chunk *chunks;
+};
+
+void slab_init(struct slab *slab, size_t size);
+/* Zeroed like znew() */
+void *slab_alloc(struct slab *slab);
+void slab_free(struct slab *slab, void *ptr);
+void slab_finish(struct slab *slab);
+
 #endif /* LABWC_MEM_H */
@@ -0,0 +1,28 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef SCALE_H
+#define SCALE_H
+#include <cairo.h>
+#include <stdbool.h>
+
+struct box;
+
+/*
+ * Downscale @src into @dst with an area-averaging (box) filter. Only the part
+ * of @dst within @rect is written, or all of it if @rect is NULL.
+ *
+ * @src must be CAIRO_FORMAT_ARGB32 or CAIRO_FORMAT_RGB24 and @dst
+ * CAIRO_FORMAT_ARGB32, no larger than @src in either direction. Returns
+ * false without touching @dst otherwise, so that callers can fall back to
+ * cairo.
+ */
+bool scale_surface_box(cairo_surface_t *dst, cairo_surface_t *src,
+	const struct box *rect);
+
+/*
+ * Use the "C", "SSE2", "AVX2" or "NEON" kernel, or with a NULL @name the
+ * fastest one this CPU has. Returns false if the kernel is not available
+ * here. For benchmarks, so not to be called while anything is scaling.
+ */
+bool scale_set_kernel(const char *name);
+
+#endif /* SCALE_H */
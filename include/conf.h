@@ -25,6 +25,7 @@ struct conf {
 	int taskbar_spacing;
 
 	int task_padding;
+	int thumbnail_cache_size; /* KiB */
 
 	/* startmenu */
 	char *startmenu_layout;
@@ -2,13 +2,67 @@
 #ifndef DESKTOP_ENTRY_H
 #define DESKTOP_ENTRY_H
 #include <cairo.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 struct panel;
+struct sfdo_string;
+
+/* Size of the icon resolved ahead of time for each app (task buttons) */
+#define DESKTOP_ICON_SIZE 22
+
+/*
+ * One .desktop file, as resolved by a full rescan or read back from the
+ * cache. Strings are NULL when the key is absent.
+ */
+struct desktop_app {
+	const char *id;        /* desktop ID, e.g. "org.gnome.Nautilus" */
+	const char *name;
+	const char *exec;      /* exec arg0 */
+	const char *icon;      /* Icon= as written in the file */
+	const char *icon_path; /* icon file for DESKTOP_ICON_SIZE at scale 1 */
+	const char *wm_class;  /* StartupWMClass */
+	const char *keywords;  /* Keywords=, separated by ';' */
+	bool application;      /* Type=Application */
+	bool no_display;
+};
+
+/*
+ * All desktop entries, backed by a single block in the cache file format,
+ * which is either mmap()ed from disk or built in memory by a rescan.
+ */
+struct desktop_apps {
+	struct desktop_app *apps;
+	size_t n_apps;
+	void *data;
+	size_t size;
+	bool mapped;
+};
 
 void desktop_entry_init(struct panel *panel);
 void desktop_entry_finish(struct panel *panel);
 void desktop_entry_load_icon(cairo_t *cairo, struct panel *panel, const char *icon_name, int size, float scale);
 void desktop_entry_load_icon_from_app_id(cairo_t *cairo, struct panel *panel, const char *app_id, int size, float scale);
 const char *desktop_entry_name_lookup(struct panel *panel, const char *app_id);
+const struct desktop_app *desktop_entry_get_apps(struct panel *panel, size_t *n_apps);
+int desktop_entry_watch(struct panel *panel);
+bool desktop_entry_handle_watch(struct panel *panel, int fd);
+void desktop_entry_reload(struct panel *panel);
+
+/* desktop-cache.c */
+struct desktop_cache_builder;
+uint64_t desktop_cache_stamp(const struct sfdo_string *data_dirs,
+	size_t n_data_dirs, const char *icon_theme);
+struct desktop_cache_builder *desktop_cache_builder_create(void);
+void desktop_cache_builder_add(struct desktop_cache_builder *builder,
+	const struct desktop_app *app);
+bool desktop_cache_builder_finish(struct desktop_cache_builder *builder,
+	struct desktop_apps *apps, uint64_t stamp);
+/* @stale is set if the cache is valid but its stamp is not @stamp */
+bool desktop_cache_load(struct desktop_apps *apps, const char *path,
+	uint64_t stamp, bool *stale);
+void desktop_cache_save(const struct desktop_apps *apps, const char *path);
+void desktop_apps_finish(struct desktop_apps *apps);
 
 #endif /* DESKTOP_ENTRY_H */
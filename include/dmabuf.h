@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef DMABUF_H
+#define DMABUF_H
+#include <cairo.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct dmabuf;
+struct gbm_bo;
+struct wl_buffer;
+struct zwp_linux_dmabuf_v1;
+
+/* A GPU buffer shared with the compositor and sampled through EGL */
+struct dmabuf_buffer {
+	struct wl_buffer *buffer;
+	struct gbm_bo *bo;
+	uint32_t width, height;
+	uint32_t format; /* DRM fourcc */
+	void *egl_image;
+	unsigned int texture;
+};
+
+/*
+ * Open the render node for @device and set up a surfaceless GLES context on
+ * it. Returns NULL if any of that is not possible, in which case the caller
+ * is expected to stick to SHM.
+ */
+struct dmabuf *dmabuf_create(struct zwp_linux_dmabuf_v1 *linux_dmabuf,
+	dev_t device);
+dev_t dmabuf_get_device(struct dmabuf *dmabuf);
+void dmabuf_destroy(struct dmabuf *dmabuf);
+
+struct dmabuf_buffer *dmabuf_buffer_create(struct dmabuf *dmabuf,
+	uint32_t width, uint32_t height, uint32_t format,
+	const uint64_t *modifiers, size_t n_modifiers);
+void dmabuf_buffer_destroy(struct dmabuf *dmabuf, struct dmabuf_buffer *buffer);
+
+/* Scale the content of @buffer down to the size of @image on the GPU */
+bool dmabuf_buffer_scale(struct dmabuf *dmabuf, struct dmabuf_buffer *buffer,
+	cairo_surface_t *image);
+
+#endif /* DMABUF_H */
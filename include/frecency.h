@@ -0,0 +1,28 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef FRECENCY_H
+#define FRECENCY_H
+#include <time.h>
+
+/*
+ * How often and how recently each application was launched, kept in
+ * $XDG_STATE_HOME/t2play/launches. Every launch adds one to a count that
+ * halves every FRECENCY_HALF_LIFE seconds, so an app used daily outranks one
+ * that was used a lot a month ago.
+ */
+#define FRECENCY_HALF_LIFE (7 * 24 * 60 * 60)
+
+struct frecency;
+struct worker;
+
+/* Read the launch history, starting empty if there is none */
+struct frecency *frecency_load(void);
+void frecency_destroy(struct frecency *frecency);
+
+/* Decayed launch count of desktop entry @id at @now */
+double frecency_get(struct frecency *frecency, const char *id, time_t now);
+
+/* Count a launch of @id at @now and save the history on @worker */
+void frecency_record(struct frecency *frecency, struct worker *worker,
+	const char *id, time_t now);
+
+#endif /* FRECENCY_H */
@@ -0,0 +1,66 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef LAYOUT_H
+#define LAYOUT_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "common/box.h"
+
+struct bar;
+struct panel;
+struct widget;
+
+/*
+ * One box in a row: the width it would like, its limits, and weights for
+ * how much of any space left over (@grow) or missing (@shrink) it takes.
+ * @max_width is 0 for no limit.
+ */
+struct layout_item {
+	int natural, min_width, max_width;
+	int grow, shrink;
+	int width; /* result */
+};
+
+/*
+ * Fit @items into @available pixels with @spacing between them. Space left
+ * over is shared by @grow weight. Missing space is taken from the widest
+ * shrinkable items first, so that long titles give way before short ones.
+ * Items never go below @min_width, so they can still overflow.
+ */
+void layout_row(struct layout_item *items, size_t n, int available,
+	int spacing);
+
+/* A widget as placed on a bar */
+struct layout_hit {
+	struct box box;
+	struct widget *widget; /* NULL once freed */
+	uint32_t generation; /* of widget.surface when last damaged */
+};
+
+/*
+ * Position the plugins across each bar and the task buttons, of the windows
+ * on its output, within the taskbar. Bars are only laid out again when their
+ * size, the set of widgets or their size hints changed since last time, and
+ * whatever moved or was redrawn is damaged.
+ *
+ * A task button shown on several bars is drawn at the narrowest width it
+ * gets on any of them. Widgets whose width changed are told through
+ * widget_impl.on_resize.
+ */
+void layout_update(struct panel *panel);
+void layout_destroy(struct bar *bar);
+
+/* The widgets on @bar as of the last layout_update(), left to right */
+const struct layout_hit *layout_hits(struct bar *bar, size_t *n);
+
+/* The widget under @x, @y on @bar, or NULL */
+struct widget *layout_widget_at(struct bar *bar, int x, int y);
+
+/* Where @widget is on @bar. Returns false if it is not shown there. */
+bool layout_widget_box(struct bar *bar, struct widget *widget,
+	struct box *box);
+
+/* Drop @widget from all bars, damaging where it was, before freeing it */
+void layout_forget(struct panel *panel, struct widget *widget);
+
+#endif /* LAYOUT_H */
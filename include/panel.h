@@ -2,19 +2,28 @@
 #ifndef PANEL_H
 #define PANEL_H
 #include <cairo.h>
+#include <glib.h>
 #include <pango/pangocairo.h>
 #include <poll.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/types.h>
 #include <wayland-client.h>
 #include <xkbcommon/xkbcommon.h>
 #include "common/box.h"
+#include "common/mem.h"
 #include "xdg-shell-client-protocol.h"
 
 struct panel;
 struct seat;
 struct widget;
+struct bar;
+struct layout;
 struct thumbnail;
+struct desktop_apps;
+struct dmabuf;
+struct dmabuf_buffer;
+struct zwp_linux_dmabuf_v1;
 
 /* Forward declarations for Wayland protocol types used in struct definitions */
 struct ext_foreign_toplevel_handle_v1;
@@ -32,8 +41,26 @@ struct pool_buffer {
 	PangoContext *pango;
 	uint32_t width, height;
 	void *data;
-	size_t size;
+	size_t offset, size; /* within the pool */
 	bool busy;
+
+	/* Area (in buffer pixels) that lags behind the last committed buffer */
+	cairo_region_t *stale;
+};
+
+#define POOL_MAX_BUFFERS 4
+
+/*
+ * Buffers of one surface, sub-allocated from a single wl_shm_pool. Starts
+ * out empty when zero-initialized; see get_next_buffer().
+ */
+struct pool {
+	struct wl_shm_pool *shm_pool;
+	int fd;
+	void *data;
+	size_t size;
+	struct pool_buffer buffers[POOL_MAX_BUFFERS];
+	size_t nr_buffers;
 };
 
 enum widget_type {
@@ -52,13 +79,37 @@ enum widget_type {
 
 struct widget_impl {
 	void (*on_left_button_press)(struct widget *widget, struct seat *seat);
+	/* box.width has been changed by the layout */
+	void (*on_resize)(struct widget *widget);
 };
 
 /* Base class */
 struct widget {
+	/*
+	 * The size @surface is drawn at, and its y within a bar. Widgets are
+	 * shared by all bars, and where each bar shows them is up to its
+	 * layout, so box.x is not used.
+	 */
 	struct box box;
 	enum widget_type type;
 	cairo_surface_t *surface;
+	cairo_t *cairo; /* long-lived context for @surface */
+
+	/* Bumped whenever @surface is redrawn, for damage tracking */
+	uint32_t generation;
+
+	/* Fingerprint of what @surface was last drawn from */
+	uint64_t key;
+
+	/*
+	 * Size hints for layout.c. Widgets with neither @grow nor @shrink
+	 * keep the box.width they were drawn at, the others are measured at
+	 * @natural_width and then stretched or squeezed by weight within
+	 * @min_width and @max_width (0 for no limit).
+	 */
+	int natural_width, min_width, max_width;
+	int grow, shrink;
+
 	const struct widget_impl *impl;
 	struct panel *panel;
 	struct wl_list link; /* panel.widgets */
@@ -67,29 +118,52 @@ struct widget {
 /* Derived classes */
 struct clock {
 	struct widget base;
+	struct timer *timer;
 };
 
 struct kbdlayout {
 	struct widget base;
 };
 
+/* A system battery in /sys/class/power_supply, with its attributes open */
+struct power_supply {
+	char *name;
+	int capacity_fd, status_fd; /* -1 if the driver lacks them */
+	int now_fd, full_fd, rate_fd; /* energy_now, energy_full, power_now */
+	bool energy; /* false for charge_now, charge_full, current_now */
+};
+
 struct battery {
 	struct widget base;
+	struct power_supply *supplies;
+	int n_supplies;
+	bool reading; /* supplies are being read in the background */
+	bool pending; /* a uevent arrived during the read */
+	bool rescan; /* a power supply was added or removed */
+	struct timer *poll_timer; /* only armed without uevents */
 };
 
 struct taskbar {
 	struct widget base;
 };
 
+/* What one row of the start menu list shows, see startmenu_render_popup() */
+struct menu_row {
+	int app_idx; /* or MENU_ROW_EMPTY, MENU_ROW_NO_RESULTS */
+	uint32_t flags; /* enum menu_row_flags */
+};
+
 struct startmenu {
 	struct widget base;
 	int hover;    /* highlighted item under mouse pointer, or -1 */
 	int selected; /* highlighted item via keyboard, or -1 */
 	bool popup_open;
+	struct bar *bar; /* the popup is attached to */
 	struct wl_surface *popup_surface;
 	struct xdg_surface *xdg_surface;
 	struct xdg_popup *xdg_popup;
-	struct pool_buffer popup_buffers[2];
+	struct pool popup_pool;
+	bool configured; /* nothing may be attached before the first configure */
 
 	/*
 	 * Popup UI layout (internal to plugin-startmenu.c).
@@ -99,10 +173,28 @@ struct startmenu {
 	void *ui_root;
 	struct box ui_search;
 	struct box ui_list;
+	int popup_height;
+	int layout_visible; /* n_visible the layout is for, 0 if none */
 
-	/* Application list loaded from .desktop files */
-	char **app_names;  /* display names */
-	char **app_execs;  /* executable paths (exec arg0) */
+	/*
+	 * What the last committed popup buffer shows, so that only rows that
+	 * changed are redrawn. Rows that scrolled are copied from @popup_front,
+	 * others are painted from @row_cache.
+	 */
+	struct pool_buffer *popup_front;
+	struct menu_row *drawn_rows;
+	int n_drawn_rows;
+	char *drawn_search; /* NULL if the search box needs drawing */
+	struct wl_list row_cache; /* struct row_surface, most recent first */
+	int row_cache_size;
+
+	/* Application list loaded from .desktop files on first open */
+	bool apps_loaded;
+	char *app_strings; /* backing store for app_names and app_execs */
+	const char **app_names;  /* display names */
+	const char **app_execs;  /* executable paths (exec arg0) */
+	const char **app_ids;    /* desktop IDs */
+	const char **app_keywords; /* ';'-separated, or NULL */
 	int n_apps;        /* total number of apps */
 
 	/* Type-to-search state */
@@ -110,8 +202,14 @@ struct startmenu {
 	int search_len;
 
 	/* Filtered / scrollable view */
-	int *filtered;      /* indices into app_names/app_execs that match search */
+	struct search_index *search_index; /* over app_names */
+	char *search_folded; /* what matches[] is for, see update_filtered() */
+	int *matches;       /* apps that match search_folded, alphabetically */
+	int n_matches;
+	int *filtered;      /* matches[] in display order, best first */
+	int *scores;        /* of filtered[] */
 	int n_filtered;     /* number of matching apps */
+	struct frecency *frecency; /* launch history */
 	int scroll_offset;  /* index of first visible item in filtered[] */
 	int n_visible;      /* max items shown at once (set when popup opens) */
 };
@@ -120,41 +218,84 @@ struct toplevel {
 	struct widget base;
 	struct zwlr_foreign_toplevel_handle_v1 *handle;
 	char *title;
-	char *app_id;
+	size_t title_size; /* of the buffer, see xstrset() */
+	const char *app_id; /* in panel.app_ids */
 	bool active;
+	struct wl_array outputs; /* struct wl_output *, the window is on */
+	struct ext_toplevel *ext; /* same window in ext-foreign-toplevel-list */
+};
+
+enum capture_state {
+	CAPTURE_NONE,
+	CAPTURE_CONSTRAINTS,
+	CAPTURE_IDLE,
+	CAPTURE_FRAME,
 };
 
 /*
  * Tracks an ext_foreign_toplevel_handle_v1 object (from ext-foreign-toplevel-list-v1)
- * alongside its title and app_id for matching against wlr toplevel handles.
+ * alongside its title and app_id for pairing with wlr toplevel handles.
  */
 struct ext_toplevel {
 	struct ext_foreign_toplevel_handle_v1 *handle;
+	char *identifier;
 	char *title;
-	char *app_id;
+	size_t title_size;
+	const char *app_id; /* in panel.app_ids */
+	bool done; /* initial state received */
+	struct toplevel *toplevel; /* paired wlr toplevel, if any */
+	struct panel *panel;
+
+	/* Capture session, kept while the taskbar is hovered */
+	enum capture_state capture_state;
+	bool capture_pending; /* capture once constraints are known */
+	struct ext_image_copy_capture_session_v1 *session;
+	struct ext_image_copy_capture_frame_v1 *frame;
+	struct pool capture_pool;
+	struct pool_buffer *capture_buffer; /* attached to @frame */
+	cairo_region_t *frame_damage; /* reported for @frame so far */
+	uint32_t capture_width;
+	uint32_t capture_height;
+	uint64_t capture_start; /* stats_now() when the frame was requested */
+	bool has_shm_format;
+	bool constraints_done; /* the next constraint starts a new batch */
+
+	/* dmabuf constraints and buffer, used with HAVE_DMABUF */
+	dev_t dmabuf_device;
+	uint32_t dmabuf_format; /* DRM fourcc, 0 if none usable */
+	struct wl_array dmabuf_modifiers; /* uint64_t */
+	struct dmabuf_buffer *dmabuf_buffer;
+	bool dmabuf_failed; /* use SHM for the rest of the session */
+
+	/* Last scaled thumbnail, or NULL if not cached */
+	cairo_surface_t *image;
+	size_t image_size;
+	struct wl_list lru_link; /* panel.thumbnail_lru */
+
 	struct wl_list link; /* panel.ext_toplevels */
 };
 
+enum thumbnail_state {
+	THUMBNAIL_PENDING, /* waiting for the first image */
+	THUMBNAIL_SHOWN,
+};
+
 /* Thumbnail popup shown when hovering over a taskbar task */
 struct thumbnail {
 	struct panel *panel;
+	struct toplevel *toplevel;
+	struct ext_toplevel *ext;
+	struct bar *bar; /* with the task button the popup is for */
+	enum thumbnail_state state;
 
 	/* Popup surfaces */
 	struct wl_surface *popup_surface;
 	struct xdg_surface *xdg_surface;
 	struct xdg_popup *xdg_popup;
-	struct pool_buffer popup_buffers[2];
-
-	/* Capture session state */
-	struct ext_image_copy_capture_session_v1 *session;
-	struct ext_image_copy_capture_frame_v1 *frame;
-	struct pool_buffer capture_buffers[2];
-	bool got_constraints;
-	bool frame_done;
-	bool frame_failed;
-	uint32_t capture_width;
-	uint32_t capture_height;
-	bool has_shm_format;
+	struct pool popup_pool;
+	bool configured;
+	struct wl_callback *frame_callback; /* paces the live preview */
+	uint32_t last_refresh; /* ms, from frame callbacks */
 
 	/* Scaled thumbnail image rendered into popup */
 	cairo_surface_t *image;
@@ -172,6 +313,7 @@ struct pointer {
 	int y;
 	uint32_t button_serial;
 	struct wl_surface *focus_surface;
+	struct bar *bar; /* if @focus_surface is one */
 };
 
 struct seat {
@@ -192,23 +334,59 @@ struct output {
 	uint32_t wl_name;
 	uint32_t scale;
 	struct panel *panel;
+	struct bar *bar; /* NULL if the panel is not shown here */
 	struct wl_list link; /* panel.outputs */
 };
 
+/*
+ * The panel as shown on one output. Widgets are shared by all bars, each
+ * only has its own layout of them and composites them at its own scale.
+ */
+struct bar {
+	struct panel *panel;
+	struct output *output;
+	struct wl_surface *surface;
+	struct zwlr_layer_surface_v1 *layer_surface;
+
+	struct box box;
+	int32_t scale;
+	struct pool pool;
+	struct pool_buffer *current_buffer;
+
+	/* Frame scheduling, see panel_schedule_frame() */
+	struct wl_callback *frame_callback;
+	bool dirty;
+	cairo_region_t *damage; /* surface-local, repainted on next frame */
+
+	struct layout *layout; /* where the widgets are, see layout.h */
+	struct wl_list link; /* panel.bars */
+};
+
 enum {
 	FD_WAYLAND,
 	FD_SIGNAL,
-	FD_CLOCK,
-	FD_BATTERY,
+	FD_TIMER, /* all periodic and delayed work, see timer.h */
+	FD_UEVENT, /* power_supply changes */
+	FD_INOTIFY, /* .desktop files and icon themes */
+	FD_WORKER, /* finished background jobs */
 
 	NR_FDS,
 };
 
 struct sfdo {
+	struct sfdo_basedir_ctx *basedir_ctx;
 	struct sfdo_desktop_ctx *desktop_ctx;
 	struct sfdo_icon_ctx *icon_ctx;
-	struct sfdo_desktop_db *desktop_db;
-	struct sfdo_icon_theme *icon_theme;
+	struct sfdo_icon_theme *icon_theme; /* loaded on first lookup */
+	bool icon_theme_failed;
+	struct desktop_apps *apps;
+	struct desktop_index *index; /* app_id lookups, rebuilt with apps */
+	GHashTable *watches; /* inotify wd -> enum watch_kind */
+	struct watch_dir *watch_dirs; /* all watched dirs, even missing ones */
+	int n_watch_dirs;
+	bool apps_dirty, icons_dirty; /* pending reload */
+	GHashTable *icon_cache; /* "app:<app_id>|size|scale" or "icon:..." */
+	bool reloading; /* desktop_entry_reload() job in flight */
 };
 
 struct panel {
@@ -220,15 +398,16 @@ struct panel {
 	struct wl_shm *shm;
 	struct wl_list outputs;
 	struct wl_list seats;
-	struct output *output;
+	struct wl_list bars; /* struct bar.link, one per output shown on */
 	struct zwlr_layer_shell_v1 *layer_shell;
-	struct zwlr_layer_surface_v1 *layer_surface;
 	struct wp_cursor_shape_manager_v1 *cursor_shape_manager;
-	struct wl_surface *surface;
 	struct xdg_wm_base *xdg_wm_base;
 
 	struct zwlr_foreign_toplevel_manager_v1 *toplevel_manager;
 	struct wl_list widgets; /* struct widget.link */
+	struct slab toplevel_slab; /* struct toplevel */
+	struct slab ext_toplevel_slab; /* struct ext_toplevel */
+	struct intern *app_ids; /* of toplevels and ext_toplevels */
 	struct startmenu *open_popup; /* currently open start menu popup */
 
 	/* ext-foreign-toplevel-list: parallel list used for thumbnail capture */
@@ -238,31 +417,42 @@ struct panel {
 	/* Capture protocol managers */
 	struct ext_foreign_toplevel_image_capture_source_manager_v1 *ext_image_capture_source_mgr;
 	struct ext_image_copy_capture_manager_v1 *ext_image_copy_capture_mgr;
+	struct zwp_linux_dmabuf_v1 *linux_dmabuf;
+	struct dmabuf *dmabuf; /* GPU used for dmabuf captures */
+	bool dmabuf_failed;
 
 	/* Thumbnail popup (shown on task hover) */
 	struct thumbnail *thumbnail;
 	struct toplevel *hovered_toplevel;
+	struct wl_list thumbnail_lru; /* struct ext_toplevel.lru_link */
+	size_t thumbnail_cache_size; /* bytes */
 
-	struct box box;
-	int32_t scale;
-	struct pool_buffer buffers[2];
-	struct pool_buffer *current_buffer;
+	int height; /* of the bars, which widgets are drawn for */
+	int32_t scale; /* widgets are drawn at, the largest of the bars */
+	struct arena frame_arena; /* scratch, reset after every frame */
 
 	char kbd_layout[64]; /* current keyboard layout name */
-	char battery_path[64]; /* path to battery capacity file */
 
 	struct conf *conf;
 	char *message;
 	struct pollfd pollfds[NR_FDS];
 
 	struct sfdo *sfdo;
+	struct atlas *atlas; /* glyphs of the clock, battery and kbdlayout */
+	struct worker *worker; /* blocking I/O and decoding, see worker.h */
+	struct timers *timers;
+	struct timer *reload_timer; /* debounces FD_INOTIFY */
 };
 
-void render_frame(struct panel *panel);
+void panel_schedule_frame(struct panel *panel);
+void bar_damage_box(struct bar *bar, const struct box *box);
 
-struct pool_buffer *get_next_buffer(struct wl_shm *shm,
-	struct pool_buffer pool[static 2], uint32_t width, uint32_t height);
-void destroy_buffer(struct pool_buffer *buffer);
+struct pool_buffer *get_next_buffer(struct wl_shm *shm, struct pool *pool,
+	uint32_t width, uint32_t height);
+void pool_finish(struct pool *pool);
+void buffer_copy_forward(struct pool_buffer *buffer, struct pool_buffer *front);
+void pool_commit_damage(struct pool *pool, struct pool_buffer *buffer,
+	const cairo_region_t *damage);
 
 void render_text(cairo_t *cairo, const PangoFontDescription *desc, double scale,
 	bool markup, const char *fmt, ...);
@@ -274,7 +464,12 @@ void rounded_rect(cairo_t *cairo, double w, double h, double r);
 
 void plugin_taskbar_init(struct panel *panel);
 void plugin_taskbar_create(struct panel *panel);
+void plugin_taskbar_update(struct panel *panel);
+void plugin_taskbar_invalidate_app_id(struct panel *panel, const char *app_id);
+void plugin_taskbar_output_destroy(struct panel *panel,
+	struct wl_output *output);
 void toplevel_destroy(struct toplevel *toplevel);
+bool toplevel_on_output(struct toplevel *toplevel, struct output *output);
 struct toplevel *toplevel_from_widget(struct widget *widget);
 
 void plugin_clock_update(struct panel *panel);
@@ -285,10 +480,15 @@ void plugin_kbdlayout_create(struct panel *panel);
 
 void plugin_battery_create(struct panel *panel);
 void plugin_battery_update(struct panel *panel);
+int plugin_battery_watch(struct panel *panel);
+void plugin_battery_handle_uevent(struct panel *panel, int fd);
+void plugin_battery_destroy(struct battery *battery);
 
 void plugin_startmenu_create(struct panel *panel);
 void plugin_startmenu_update(struct panel *panel);
+void plugin_startmenu_reload(struct panel *panel);
 void plugin_startmenu_destroy(struct startmenu *menu);
+void plugin_startmenu_close(struct startmenu *menu);
 void plugin_startmenu_key(struct panel *panel, uint32_t key);
 void plugin_startmenu_text_input(struct panel *panel, const char *utf8);
 void plugin_startmenu_pointer_motion(struct startmenu *menu, int y);
@@ -298,14 +498,26 @@ void plugin_startmenu_scroll(struct startmenu *menu, double delta);
 
 void thumbnail_init(struct panel *panel);
 void thumbnail_bind_ext_toplevel_list(struct panel *panel);
-void thumbnail_show(struct panel *panel, struct toplevel *toplevel);
+void thumbnail_toplevel_done(struct toplevel *toplevel);
+void thumbnail_toplevel_destroy(struct toplevel *toplevel);
+void thumbnail_show(struct panel *panel, struct bar *bar,
+	struct toplevel *toplevel);
 void thumbnail_hide(struct panel *panel);
+void thumbnail_end_hover(struct panel *panel);
 void thumbnail_destroy_all(struct panel *panel);
 
 void widget_on_left_button_press(struct widget *widget, struct seat *seat);
 char *widget_type(enum widget_type type);
 bool widget_is_plugin(struct widget *widget);
+void widget_finish(struct widget *widget);
 void widget_free(struct widget *widget);
+uint64_t widget_label_key(struct widget *widget, const char *label);
+bool widget_key_update(struct widget *widget, uint64_t key);
+void widget_invalidate(struct widget *widget);
+cairo_t *widget_surface_begin(struct widget *widget, int width, int height);
+void widget_surface_end(struct widget *widget);
+struct atlas *widget_atlas(struct panel *panel);
+void widget_draw_label(struct widget *widget, int padding, const char *label);
 void widgets_free(struct panel *panel);
 
 #endif /* PANEL_H */
@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef SEARCH_H
+#define SEARCH_H
+#include <stddef.h>
+
+/*
+ * Fuzzy search over a fixed set of items, such as the start menu's
+ * applications. Each item has a name, an executable and keywords, any of
+ * which may be NULL. A query matches an item if its characters appear in
+ * that order in one of them. Everything is compared case-folded and in
+ * Unicode compatibility decomposition, so "E" finds "é" and "ﬁ" finds "fi".
+ */
+struct search_index;
+
+/* Fold @str for matching. Free the result with free() */
+char *search_fold(const char *str);
+
+struct search_index *search_index_create(const char *const *names,
+	const char *const *execs, const char *const *keywords, size_t n);
+void search_index_destroy(struct search_index *index);
+
+/*
+ * Store the items that match @folded, as returned by search_fold(), into
+ * @out in ascending order with their scores in @scores, and return their
+ * number. Higher scores are better matches: prefixes, word starts and runs
+ * of consecutive characters count most, matches in names more than in
+ * executables and keywords.
+ *
+ * If @candidates is not NULL, only those @n items are considered. That is
+ * used when a query grows, as its matches are then a subset of the previous
+ * ones. Otherwise all items are. @out (and @scores) must have room for all
+ * candidates, and @out may be @candidates.
+ */
+size_t search_index_match(struct search_index *index, const char *folded,
+	const int *candidates, size_t n, int *out, int *scores);
+
+/*
+ * Move the @k best of the @n @items to the front, best first, and leave the
+ * rest in their original order behind them. @scores is reordered along.
+ * Ties go to the item that came first.
+ */
+void search_rank(int *items, int *scores, size_t n, size_t k);
+
+#endif /* SEARCH_H */
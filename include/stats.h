@@ -0,0 +1,64 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef STATS_H
+#define STATS_H
+#include <stdint.h>
+#include "common/log.h"
+
+/* Wall time spent in one piece of code, from the monotonic clock */
+struct stats_timer {
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t max_ns;
+};
+
+/*
+ * Process-wide counters used to confirm that steady-state updates do not
+ * allocate and to see where time goes. Dumped at debug level on exit and
+ * unconditionally on SIGUSR1.
+ */
+struct stats {
+	uint64_t widget_surface_allocs;
+	uint64_t widget_surface_reuses;
+	uint64_t icon_cache_hits;
+	uint64_t icon_cache_misses;
+	uint64_t thumbnail_cache_hits;
+	uint64_t thumbnail_cache_misses;
+	uint64_t thumbnail_cache_evictions;
+	uint64_t text_cache_hits;
+	uint64_t text_cache_misses;
+	uint64_t menu_rows_copied; /* scrolled within the popup buffer */
+	uint64_t menu_row_cache_hits;
+	uint64_t menu_row_cache_misses;
+
+	uint64_t frames_rendered;
+	uint64_t layouts; /* passes that were not skipped */
+	uint64_t frames_dropped; /* no free buffer, retried later */
+	uint64_t roundtrips;
+	uint64_t bytes_allocated; /* requested through common/mem.h */
+
+	struct stats_timer render_frame;
+	struct stats_timer clock_update;
+	struct stats_timer battery_update;
+	struct stats_timer kbdlayout_update;
+	struct stats_timer startmenu_update;
+	struct stats_timer taskbar_update;
+	struct stats_timer capture; /* from frame request to scaled image */
+	struct stats_timer load_apps;
+	struct stats_timer desktop_entry_init;
+};
+
+extern struct stats stats;
+
+/* Monotonic time in nanoseconds */
+uint64_t stats_now(void);
+
+/* Account the time since @start, as returned by stats_now(), to @timer */
+void stats_timer_add(struct stats_timer *timer, uint64_t start);
+
+/* Log all counters and timers at @importance, LOG_SILENT to always print */
+void stats_log(enum log_importance importance);
+
+/* Log a one-line summary at debug level */
+void stats_log_summary(void);
+
+#endif /* STATS_H */
@@ -0,0 +1,47 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef TIMER_H
+#define TIMER_H
+#include <stdint.h>
+
+/*
+ * All periodic and delayed work shares one timerfd, so that widgets firing
+ * at the same time cost a single wakeup and a single frame.
+ *
+ * Periodic timers are aligned to multiples of their interval in wall clock
+ * time, so a 60 s timer fires on the minute and a 30 s one at :00 and :30,
+ * together with it. Each timer may also fire up to its slack late; a wakeup
+ * is put off as long as that allows, and then runs everything that is due.
+ * The alignment is redone when the system clock is set, while one-shot
+ * timers keep their delay.
+ *
+ * Callbacks may arm, disarm and remove timers, including their own.
+ */
+struct timers;
+struct timer;
+
+struct timers *timers_create(void);
+
+/* Also removes any timers that are left */
+void timers_destroy(struct timers *timers);
+
+/* Readable when a timer may be due, for panel->pollfds */
+int timers_get_fd(struct timers *timers);
+
+/* Run the callbacks of all due timers */
+void timers_dispatch(struct timers *timers);
+
+/* Add a timer, initially disarmed */
+struct timer *timer_add(struct timers *timers, void (*callback)(void *data),
+	void *data);
+void timer_remove(struct timer *timer);
+
+void timer_set_periodic(struct timer *timer, uint32_t interval_ms,
+	uint32_t slack_ms);
+
+/* Fire once, @delay_ms from now. Re-arming moves the deadline. */
+void timer_set_oneshot(struct timer *timer, uint32_t delay_ms,
+	uint32_t slack_ms);
+
+void timer_disarm(struct timer *timer);
+
+#endif /* TIMER_H */
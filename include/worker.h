@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef WORKER_H
+#define WORKER_H
+#include <stdbool.h>
+
+/*
+ * Jobs that may block on the filesystem or take a while to compute, run on
+ * a background thread so that they never hold up the Wayland event loop.
+ *
+ * @work runs on the worker thread and must only touch its @data. @done then
+ * runs on the main thread from worker_dispatch() to apply the result, and
+ * must free @data. If the worker is destroyed first, @done is called with
+ * @cancelled set and should only free @data.
+ *
+ * There is a single thread, so jobs run one at a time in the order they
+ * were submitted. That is what lets them share libsfdo state, which the
+ * main thread then leaves alone.
+ */
+struct worker;
+
+struct worker *worker_create(void);
+void worker_destroy(struct worker *worker);
+
+/* Readable when there are finished jobs, for panel->pollfds */
+int worker_get_fd(struct worker *worker);
+
+/* With a NULL @worker the job is simply run there and then */
+void worker_submit(struct worker *worker, void (*work)(void *data),
+	void (*done)(void *data, bool cancelled), void *data);
+
+/* Call @done for the jobs that have finished */
+void worker_dispatch(struct worker *worker);
+
+#endif /* WORKER_H */
@@ -0,0 +1,246 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Glyph strip for fixed-alphabet labels.
+ *
+ * Entries are laid out side by side in one ARGB32 surface that is grown as
+ * words are added. Characters are drawn at their rounded advance, which can
+ * differ from pango's subpixel positioning by a fraction of a pixel per
+ * character. For the tabular digits of the labels this is used for, that is
+ * not visible.
+ */
+#include <glib.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common/atlas.h"
+#include "common/log.h"
+#include "common/mem.h"
+#include "panel.h"
+
+#define ATLAS_CHARS "0123456789:%-.,+ "
+
+struct atlas_entry {
+	int x, width, height;
+};
+
+struct atlas_word {
+	char *text;
+	struct atlas_entry entry;
+};
+
+struct atlas {
+	PangoFontDescription *desc;
+	uint32_t color;
+	int scale;
+
+	/* With a device scale, so that it is drawn to in logical pixels */
+	cairo_surface_t *surface;
+	int width, height; /* logical */
+
+	struct atlas_entry chars[128]; /* width 0 if not rasterized */
+	struct atlas_word *words;
+	size_t nr_words;
+};
+
+/* Append @text to the strip and describe where it went in @entry */
+static void
+rasterize(struct atlas *atlas, const char *text, struct atlas_entry *entry)
+{
+	PangoRectangle rect = get_text_size(atlas->desc, text);
+	int width = MAX(rect.width, 1);
+	int height = MAX(rect.height, atlas->height);
+
+	cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+		(atlas->width + width) * atlas->scale, height * atlas->scale);
+	cairo_surface_set_device_scale(surface, atlas->scale, atlas->scale);
+	cairo_t *cairo = cairo_create(surface);
+	if (atlas->surface) {
+		cairo_set_source_surface(cairo, atlas->surface, 0, 0);
+		cairo_paint(cairo);
+		cairo_surface_destroy(atlas->surface);
+	}
+	cairo_rectangle(cairo, atlas->width, 0, width, height);
+	cairo_clip(cairo);
+	cairo_set_source_u32(cairo, atlas->color);
+	cairo_move_to(cairo, atlas->width, 0);
+	render_text(cairo, atlas->desc, 1, false, "%s", text);
+	cairo_destroy(cairo);
+	cairo_surface_flush(surface);
+
+	entry->x = atlas->width;
+	entry->width = width;
+	entry->height = rect.height;
+	atlas->surface = surface;
+	atlas->width += width;
+	atlas->height = height;
+}
+
+struct atlas *
+atlas_create(const PangoFontDescription *desc, uint32_t color, int scale)
+{
+	struct atlas *atlas = znew(*atlas);
+	atlas->desc = pango_font_description_copy(desc);
+	atlas->color = color;
+	atlas->scale = MAX(scale, 1);
+	for (const char *c = ATLAS_CHARS; *c; c++) {
+		char str[2] = { *c, '\0' };
+		rasterize(atlas, str, &atlas->chars[(unsigned char)*c]);
+	}
+	return atlas;
+}
+
+void
+atlas_destroy(struct atlas *atlas)
+{
+	if (!atlas) {
+		return;
+	}
+	for (size_t i = 0; i < atlas->nr_words; i++) {
+		free(atlas->words[i].text);
+	}
+	free(atlas->words);
+	cairo_surface_destroy(atlas->surface);
+	pango_font_description_free(atlas->desc);
+	free(atlas);
+}
+
+bool
+atlas_matches(struct atlas *atlas, const PangoFontDescription *desc,
+		uint32_t color, int scale)
+{
+	return atlas->color == color && atlas->scale == MAX(scale, 1)
+		&& pango_font_description_equal(atlas->desc, desc);
+}
+
+static const struct atlas_entry *
+find_word(struct atlas *atlas, const char *text)
+{
+	for (size_t i = 0; i < atlas->nr_words; i++) {
+		if (!strcmp(atlas->words[i].text, text)) {
+			return &atlas->words[i].entry;
+		}
+	}
+	return NULL;
+}
+
+void
+atlas_add(struct atlas *atlas, const char *word)
+{
+	if (find_word(atlas, word)) {
+		return;
+	}
+	atlas->words = xrealloc(atlas->words,
+		(atlas->nr_words + 1) * sizeof(*atlas->words));
+	struct atlas_word *w = &atlas->words[atlas->nr_words++];
+	w->text = xstrdup(word);
+	rasterize(atlas, word, &w->entry);
+	debug("atlas: added '%s', strip now %dx%d", word, atlas->width,
+		atlas->height);
+}
+
+/*
+ * Call @fn for each entry that makes up @text, or return false if some part
+ * of it is not in the atlas. @fn may be NULL to only check.
+ */
+static bool
+for_each_entry(struct atlas *atlas, const char *text,
+		void (*fn)(const struct atlas_entry *entry, void *data), void *data)
+{
+	const struct atlas_entry *word = find_word(atlas, text);
+	if (word) {
+		if (fn) {
+			fn(word, data);
+		}
+		return true;
+	}
+	for (const unsigned char *c = (const unsigned char *)text; *c; c++) {
+		if (*c >= 128 || !atlas->chars[*c].width) {
+			return false;
+		}
+	}
+	if (fn) {
+		for (const unsigned char *c = (const unsigned char *)text; *c; c++) {
+			fn(&atlas->chars[*c], data);
+		}
+	}
+	return true;
+}
+
+static void
+add_size(const struct atlas_entry *entry, void *data)
+{
+	int *size = data;
+	size[0] += entry->width;
+	size[1] = MAX(size[1], entry->height);
+}
+
+bool
+atlas_measure(struct atlas *atlas, const char *text, int *width, int *height)
+{
+	int size[2] = {0};
+	if (!for_each_entry(atlas, text, add_size, size)) {
+		return false;
+	}
+	*width = size[0];
+	*height = size[1];
+	return true;
+}
+
+/* In pixels, unlike the entries */
+struct blit {
+	struct atlas *atlas;
+	uint8_t *dst;
+	int dst_width, dst_height, dst_stride;
+	int x, y;
+};
+
+static void
+blit_entry(const struct atlas_entry *entry, void *data)
+{
+	struct blit *blit = data;
+	struct atlas *atlas = blit->atlas;
+	const uint8_t *src = cairo_image_surface_get_data(atlas->surface);
+	int src_stride = cairo_image_surface_get_stride(atlas->surface);
+
+	/* Clip to @dst */
+	int scale = atlas->scale;
+	int sx = entry->x * scale, dx = blit->x, w = entry->width * scale;
+	if (dx < 0) {
+		sx -= dx;
+		w += dx;
+		dx = 0;
+	}
+	w = MIN(w, blit->dst_width - dx);
+	int y0 = MAX(blit->y, 0);
+	int y1 = MIN(blit->y + atlas->height * scale, blit->dst_height);
+
+	for (int y = y0; w > 0 && y < y1; y++) {
+		memcpy(blit->dst + (size_t)y * blit->dst_stride + (size_t)dx * 4,
+			src + (size_t)(y - blit->y) * src_stride + (size_t)sx * 4,
+			(size_t)w * 4);
+	}
+	blit->x += entry->width * scale;
+}
+
+bool
+atlas_draw(struct atlas *atlas, cairo_surface_t *dst, int x, int y,
+		const char *text)
+{
+	if (cairo_image_surface_get_format(dst) != CAIRO_FORMAT_ARGB32
+			|| !for_each_entry(atlas, text, NULL, NULL)) {
+		return false;
+	}
+	cairo_surface_flush(dst);
+	struct blit blit = {
+		.atlas = atlas,
+		.dst = cairo_image_surface_get_data(dst),
+		.dst_width = cairo_image_surface_get_width(dst),
+		.dst_height = cairo_image_surface_get_height(dst),
+		.dst_stride = cairo_image_surface_get_stride(dst),
+		.x = x * atlas->scale,
+		.y = y * atlas->scale,
+	};
+	for_each_entry(atlas, text, blit_entry, &blit);
+	cairo_surface_mark_dirty(dst);
+	return true;
+}
@@ -6,6 +6,13 @@ box_empty(const struct box *box)
 	return !box || box->width <= 0 || box->height <= 0;
 }
 
+bool
+box_equal(const struct box *a, const struct box *b)
+{
+	return a->x == b->x && a->y == b->y
+		&& a->width == b->width && a->height == b->height;
+}
+
 bool box_contains_point(const struct box *box, double x, double y) {
 	if (box_empty(box)) {
 		return false;
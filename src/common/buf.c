@@ -0,0 +1,33 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#include <string.h>
+#include "common/buf.h"
+#include "common/mem.h"
+
+size_t
+buf_add(struct buf *s, const void *data, size_t len)
+{
+	if (s->len + len > s->alloc) {
+		s->alloc = s->alloc * 2 > s->len + len ? s->alloc * 2 : s->len + len;
+		s->data = xrealloc(s->data, s->alloc);
+	}
+	size_t offset = s->len;
+	if (len) {
+		memcpy(s->data + offset, data, len);
+	}
+	s->len += len;
+	return offset;
+}
+
+size_t
+buf_add_str(struct buf *s, const char *str)
+{
+	return buf_add(s, str, strlen(str) + 1);
+}
+
+void
+buf_reset(struct buf *s)
+{
+	zfree(s->data);
+	s->alloc = 0;
+	s->len = 0;
+}
@@ -0,0 +1,32 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#include <string.h>
+#include "common/hash.h"
+
+#define FNV_PRIME 0x100000001b3ULL
+
+uint64_t
+hash_bytes(uint64_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+/* NULL and "" hash differently so that an unset field is a distinct state */
+uint64_t
+hash_str(uint64_t hash, const char *str)
+{
+	if (!str) {
+		return hash_u64(hash, 0);
+	}
+	return hash_bytes(hash, str, strlen(str) + 1);
+}
+
+uint64_t
+hash_u64(uint64_t hash, uint64_t value)
+{
+	return hash_bytes(hash, &value, sizeof(value));
+}
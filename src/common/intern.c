@@ -0,0 +1,68 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#include <assert.h>
+#include <glib.h>
+#include <string.h>
+#include "common/intern.h"
+#include "common/mem.h"
+
+struct interned {
+	unsigned int refs;
+	char str[];
+};
+
+struct intern {
+	GHashTable *table; /* str -> struct interned, keyed by its own str */
+};
+
+struct intern *
+intern_create(void)
+{
+	struct intern *intern = znew(*intern);
+	intern->table = g_hash_table_new(g_str_hash, g_str_equal);
+	return intern;
+}
+
+void
+intern_destroy(struct intern *intern)
+{
+	if (!intern) {
+		return;
+	}
+	GHashTableIter iter;
+	gpointer value;
+	g_hash_table_iter_init(&iter, intern->table);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		free(value);
+	}
+	g_hash_table_destroy(intern->table);
+	free(intern);
+}
+
+const char *
+intern_get(struct intern *intern, const char *str)
+{
+	assert(str);
+	struct interned *entry = g_hash_table_lookup(intern->table, str);
+	if (!entry) {
+		size_t len = strlen(str) + 1;
+		entry = xzalloc(sizeof(*entry) + len);
+		memcpy(entry->str, str, len);
+		g_hash_table_insert(intern->table, entry->str, entry);
+	}
+	entry->refs++;
+	return entry->str;
+}
+
+void
+intern_put(struct intern *intern, const char *str)
+{
+	if (!str) {
+		return;
+	}
+	struct interned *entry = g_hash_table_lookup(intern->table, str);
+	assert(entry && entry->str == str);
+	if (--entry->refs == 0) {
+		g_hash_table_remove(intern->table, str);
+		free(entry);
+	}
+}
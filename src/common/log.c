@@ -19,6 +19,12 @@ log_init(enum log_importance verbosity)
 	log_importance = verbosity;
 }
 
+enum log_importance
+log_get_importance(void)
+{
+	return log_importance;
+}
+
 void
 _log(enum log_importance verbosity, const char *fmt, ...)
 {
@@ -2,8 +2,18 @@
 #define _POSIX_C_SOURCE 200809L
 #include "common/mem.h"
 #include <assert.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
+#include "stats.h"
+
+/* Background jobs allocate too, see worker.h */
+static void
+count_bytes(size_t size)
+{
+	__atomic_fetch_add(&stats.bytes_allocated, size, __ATOMIC_RELAXED);
+}
 
 void
 die_if_null(void *ptr)
@@ -22,6 +32,20 @@ xzalloc(size_t size)
 	}
 	void *ptr = calloc(1, size);
 	die_if_null(ptr);
+	count_bytes(size);
+	return ptr;
+}
+
+void *
+xrealloc(void *ptr, size_t size)
+{
+	if (!size) {
+		free(ptr);
+		return NULL;
+	}
+	ptr = realloc(ptr, size);
+	die_if_null(ptr);
+	count_bytes(size);
 	return ptr;
 }
 
@@ -31,5 +55,168 @@ xstrdup(const char *str)
 	assert(str);
 	char *copy = strdup(str);
 	die_if_null(copy);
+	count_bytes(strlen(copy) + 1);
 	return copy;
 }
+
+void
+xstrset(char **ptr, size_t *size, const char *str)
+{
+	assert(str);
+	size_t len = strlen(str) + 1;
+	if (len > *size) {
+		*ptr = xrealloc(*ptr, len);
+		*size = len;
+	}
+	memcpy(*ptr, str, len);
+}
+
+#define ALIGNMENT _Alignof(max_align_t)
+#define ALIGN_UP(size) (((size) + ALIGNMENT - 1) & ~(ALIGNMENT - 1))
+
+#define ARENA_BLOCK_SIZE 4096
+
+struct arena_block {
+	struct arena_block *prev;
+	size_t size;
+	max_align_t data[];
+};
+
+static void
+arena_push_block(struct arena *arena, size_t size)
+{
+	struct arena_block *block = xzalloc(sizeof(*block) + size);
+	block->prev = arena->block;
+	block->size = size;
+	arena->block = block;
+	arena->used = 0;
+}
+
+void *
+arena_alloc(struct arena *arena, size_t size)
+{
+	size = ALIGN_UP(size);
+	struct arena_block *block = arena->block;
+	if (!block || block->size - arena->used < size) {
+		size_t block_size = block ? 2 * block->size : ARENA_BLOCK_SIZE;
+		arena_push_block(arena, block_size > size ? block_size : size);
+		block = arena->block;
+	}
+	void *ptr = (char *)block->data + arena->used;
+	arena->used += size;
+	arena->total += size;
+	return ptr;
+}
+
+char *
+arena_vprintf(struct arena *arena, const char *fmt, va_list args)
+{
+	/* Usually fits in what is left of the block, so format only once */
+	struct arena_block *block = arena->block;
+	size_t avail = block ? block->size - arena->used : 0;
+	char *str = block ? (char *)block->data + arena->used : NULL;
+	va_list copy;
+	va_copy(copy, args);
+	int len = vsnprintf(str, avail, fmt, copy);
+	va_end(copy);
+	if (len < 0) {
+		return NULL;
+	}
+	if ((size_t)len < avail) {
+		return arena_alloc(arena, len + 1);
+	}
+	str = arena_alloc(arena, len + 1);
+	vsnprintf(str, len + 1, fmt, args);
+	return str;
+}
+
+static void
+arena_free_blocks(struct arena *arena)
+{
+	struct arena_block *block = arena->block;
+	while (block) {
+		struct arena_block *prev = block->prev;
+		free(block);
+		block = prev;
+	}
+	arena->block = NULL;
+}
+
+void
+arena_reset(struct arena *arena)
+{
+	if (arena->block && arena->block->prev) {
+		size_t size = arena->block->size > arena->total
+			? arena->block->size : arena->total;
+		arena_free_blocks(arena);
+		arena_push_block(arena, size);
+	}
+	arena->used = 0;
+	arena->total = 0;
+}
+
+void
+arena_finish(struct arena *arena)
+{
+	arena_free_blocks(arena);
+	*arena = (struct arena){ 0 };
+}
+
+#define SLAB_CHUNK_OBJECTS 32
+
+struct slab_chunk {
+	struct slab_chunk *next;
+	max_align_t data[];
+};
+
+void
+slab_init(struct slab *slab, size_t size)
+{
+	size = size > sizeof(void *) ? size : sizeof(void *);
+	*slab = (struct slab){ .size = ALIGN_UP(size) };
+}
+
+void *
+slab_alloc(struct slab *slab)
+{
+	assert(slab->size);
+	if (!slab->free_list) {
+		struct slab_chunk *chunk = xzalloc(sizeof(*chunk)
+			+ SLAB_CHUNK_OBJECTS * slab->size);
+		chunk->next = slab->chunks;
+		slab->chunks = chunk;
+		for (int i = SLAB_CHUNK_OBJECTS - 1; i >= 0; i--) {
+			void **obj = (void **)((char *)chunk->data
+				+ i * slab->size);
+			*obj = slab->free_list;
+			slab->free_list = obj;
+		}
+	}
+	void **obj = slab->free_list;
+	slab->free_list = *obj;
+	memset(obj, 0, slab->size);
+	return obj;
+}
+
+void
+slab_free(struct slab *slab, void *ptr)
+{
+	if (!ptr) {
+		return;
+	}
+	*(void **)ptr = slab->free_list;
+	slab->free_list = ptr;
+}
+
+void
+slab_finish(struct slab *slab)
+{
+	struct slab_chunk *chunk = slab->chunks;
+	while (chunk) {
+		struct slab_chunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	slab->chunks = NULL;
+	slab->free_list = NULL;
+}
@@ -0,0 +1,343 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Area-averaging downscaler for ARGB32 images.
+ *
+ * Every destination pixel is the coverage-weighted mean of the source pixels
+ * underneath it. Cairo's filters only sample a few source pixels per output
+ * pixel and alias badly at the ratios of a window thumbnail (3840 -> 200).
+ * Premultiplied channels can be averaged as they are, and since each channel
+ * goes through the same weights and rounding, colour never exceeds alpha.
+ *
+ * The filter is separable. Source rows are first accumulated into a row of
+ * 32-bit sums, which is the hot loop and has SSE2, AVX2 and NEON variants
+ * picked at run time. The result is then reduced horizontally, which only
+ * happens once per destination row and stays scalar.
+ */
+#include <glib.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common/box.h"
+#include "common/log.h"
+#include "common/mem.h"
+#include "common/scale.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCALE_X86 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#define SCALE_NEON 1
+#include <arm_neon.h>
+#endif
+
+/*
+ * Weights are 1.15 fixed point so that they fit the 16-bit multipliers of
+ * the SIMD kernels. Vertical sums are at most 255 << 15 and are narrowed to
+ * 8.8 fixed point, horizontal sums then peak just below 1 << 31.
+ */
+#define WEIGHT_BITS 15
+#define WEIGHT_ONE (1u << WEIGHT_BITS)
+#define ROW_SHIFT (WEIGHT_BITS - 8)
+
+struct span {
+	int start; /* first source pixel */
+	int count;
+	const uint16_t *weights;
+};
+
+struct axis {
+	struct span *spans;
+	uint16_t *weights;
+};
+
+/* Split source pixels over destination pixels by how much they overlap */
+static void
+axis_init(struct axis *axis, int src, int dst)
+{
+	axis->spans = xzalloc(dst * sizeof(*axis->spans));
+	axis->weights = xzalloc((src + dst) * sizeof(*axis->weights));
+
+	/* Positions are in units of 1/dst source pixels */
+	uint16_t *w = axis->weights;
+	for (int d = 0; d < dst; d++) {
+		uint64_t lo = (uint64_t)d * src;
+		uint64_t hi = (uint64_t)(d + 1) * src;
+		int first = lo / dst;
+		int last = (hi - 1) / dst;
+
+		struct span *span = &axis->spans[d];
+		span->start = first;
+		span->count = last - first + 1;
+		span->weights = w;
+
+		uint32_t sum = 0;
+		int heaviest = 0;
+		for (int i = 0; i < span->count; i++) {
+			uint64_t p0 = (uint64_t)(first + i) * dst;
+			uint64_t p1 = p0 + dst;
+			uint64_t overlap = (p1 < hi ? p1 : hi) - (p0 > lo ? p0 : lo);
+			w[i] = overlap * WEIGHT_ONE / src;
+			sum += w[i];
+			if (w[i] > w[heaviest]) {
+				heaviest = i;
+			}
+		}
+		/* Make the weights add up exactly so flat areas stay flat */
+		w[heaviest] += WEIGHT_ONE - sum;
+		w += span->count;
+	}
+}
+
+static void
+axis_finish(struct axis *axis)
+{
+	free(axis->spans);
+	free(axis->weights);
+}
+
+/* acc[i] += src[i] * weight for @n bytes */
+static void
+accumulate_c(uint32_t *acc, const uint8_t *src, size_t n, uint16_t weight)
+{
+	for (size_t i = 0; i < n; i++) {
+		acc[i] += (uint32_t)src[i] * weight;
+	}
+}
+
+#if SCALE_X86
+__attribute__((target("sse2")))
+static void
+accumulate_sse2(uint32_t *acc, const uint8_t *src, size_t n, uint16_t weight)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i w = _mm_set1_epi16((short)weight);
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i halves[2] = {
+			_mm_unpacklo_epi8(v, zero),
+			_mm_unpackhi_epi8(v, zero),
+		};
+		for (int h = 0; h < 2; h++) {
+			/* 16x16 -> 32 bit products from their low and high words */
+			__m128i lo = _mm_mullo_epi16(halves[h], w);
+			__m128i hi = _mm_mulhi_epu16(halves[h], w);
+			__m128i *a = (__m128i *)(acc + i + h * 8);
+			_mm_storeu_si128(a, _mm_add_epi32(_mm_loadu_si128(a),
+				_mm_unpacklo_epi16(lo, hi)));
+			_mm_storeu_si128(a + 1, _mm_add_epi32(_mm_loadu_si128(a + 1),
+				_mm_unpackhi_epi16(lo, hi)));
+		}
+	}
+	accumulate_c(acc + i, src + i, n - i, weight);
+}
+
+/*
+ * As the SSE2 kernel, with twice the words per multiply. Unpacking works
+ * within 128-bit lanes, so the products are put back in order before they
+ * are added.
+ */
+__attribute__((target("avx2")))
+static void
+accumulate_avx2(uint32_t *acc, const uint8_t *src, size_t n, uint16_t weight)
+{
+	const __m256i w = _mm256_set1_epi16((short)weight);
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m256i v = _mm256_cvtepu8_epi16(
+			_mm_loadu_si128((const __m128i *)(src + i)));
+		__m256i lo = _mm256_mullo_epi16(v, w);
+		__m256i hi = _mm256_mulhi_epu16(v, w);
+		__m256i p0 = _mm256_unpacklo_epi16(lo, hi); /* 0-3, 8-11 */
+		__m256i p1 = _mm256_unpackhi_epi16(lo, hi); /* 4-7, 12-15 */
+		__m256i *a = (__m256i *)(acc + i);
+		_mm256_storeu_si256(a, _mm256_add_epi32(_mm256_loadu_si256(a),
+			_mm256_permute2x128_si256(p0, p1, 0x20)));
+		_mm256_storeu_si256(a + 1, _mm256_add_epi32(_mm256_loadu_si256(a + 1),
+			_mm256_permute2x128_si256(p0, p1, 0x31)));
+	}
+	accumulate_c(acc + i, src + i, n - i, weight);
+}
+#endif
+
+#if SCALE_NEON
+static void
+accumulate_neon(uint32_t *acc, const uint8_t *src, size_t n, uint16_t weight)
+{
+	const uint16x4_t w = vdup_n_u16(weight);
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		uint8x16_t v = vld1q_u8(src + i);
+		uint16x8_t lo = vmovl_u8(vget_low_u8(v));
+		uint16x8_t hi = vmovl_u8(vget_high_u8(v));
+		uint32_t *a = acc + i;
+		vst1q_u32(a, vmlal_u16(vld1q_u32(a), vget_low_u16(lo), w));
+		vst1q_u32(a + 4, vmlal_u16(vld1q_u32(a + 4), vget_high_u16(lo), w));
+		vst1q_u32(a + 8, vmlal_u16(vld1q_u32(a + 8), vget_low_u16(hi), w));
+		vst1q_u32(a + 12, vmlal_u16(vld1q_u32(a + 12), vget_high_u16(hi), w));
+	}
+	accumulate_c(acc + i, src + i, n - i, weight);
+}
+#endif
+
+typedef void (*accumulate_fn)(uint32_t *acc, const uint8_t *src, size_t n,
+	uint16_t weight);
+
+struct kernel {
+	const char *name;
+	accumulate_fn accumulate;
+};
+
+/* Fastest first, as measured with t2play-bench --filter scale-box */
+static const struct kernel kernels[] = {
+#if SCALE_X86
+	{ "AVX2", accumulate_avx2 },
+	{ "SSE2", accumulate_sse2 },
+#elif SCALE_NEON
+	{ "NEON", accumulate_neon },
+#endif
+	{ "C", accumulate_c },
+};
+
+static accumulate_fn accumulate;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static bool
+kernel_supported(const struct kernel *kernel)
+{
+#if SCALE_X86
+	__builtin_cpu_init();
+	if (kernel->accumulate == accumulate_avx2) {
+		return __builtin_cpu_supports("avx2");
+	}
+	if (kernel->accumulate == accumulate_sse2) {
+		return __builtin_cpu_supports("sse2");
+	}
+#endif
+	return true;
+}
+
+static void
+select_kernel(void)
+{
+	for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+		if (kernel_supported(&kernels[i])) {
+			accumulate = kernels[i].accumulate;
+			debug("box scaler: using %s kernel", kernels[i].name);
+			return;
+		}
+	}
+}
+
+bool
+scale_set_kernel(const char *name)
+{
+	pthread_once(&once, select_kernel);
+	if (!name) {
+		select_kernel();
+		return true;
+	}
+	for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+		if (!g_ascii_strcasecmp(kernels[i].name, name)) {
+			if (!kernel_supported(&kernels[i])) {
+				return false;
+			}
+			accumulate = kernels[i].accumulate;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool
+scale_surface_box(cairo_surface_t *dst, cairo_surface_t *src,
+		const struct box *rect)
+{
+	cairo_format_t src_format = cairo_image_surface_get_format(src);
+	if ((src_format != CAIRO_FORMAT_ARGB32 && src_format != CAIRO_FORMAT_RGB24)
+			|| cairo_image_surface_get_format(dst) != CAIRO_FORMAT_ARGB32) {
+		return false;
+	}
+	int src_w = cairo_image_surface_get_width(src);
+	int src_h = cairo_image_surface_get_height(src);
+	int dst_w = cairo_image_surface_get_width(dst);
+	int dst_h = cairo_image_surface_get_height(dst);
+	if (dst_w < 1 || dst_h < 1 || dst_w > src_w || dst_h > src_h) {
+		return false;
+	}
+
+	int x0 = 0, y0 = 0, x1 = dst_w, y1 = dst_h;
+	if (rect) {
+		x0 = MAX(rect->x, 0);
+		y0 = MAX(rect->y, 0);
+		x1 = MIN(rect->x + rect->width, dst_w);
+		y1 = MIN(rect->y + rect->height, dst_h);
+		if (x0 >= x1 || y0 >= y1) {
+			return true;
+		}
+	}
+
+	/* Icons are decoded on the worker thread */
+	pthread_once(&once, select_kernel);
+
+	struct axis xaxis, yaxis;
+	axis_init(&xaxis, src_w, dst_w);
+	axis_init(&yaxis, src_h, dst_h);
+
+	/* Only the source columns under x0..x1 are needed */
+	int col0 = xaxis.spans[x0].start;
+	int col1 = xaxis.spans[x1 - 1].start + xaxis.spans[x1 - 1].count;
+	size_t n = (size_t)(col1 - col0) * 4;
+	uint32_t *acc = xzalloc(n * sizeof(*acc));
+	uint16_t *row = xzalloc(n * sizeof(*row));
+
+	cairo_surface_flush(src);
+	cairo_surface_flush(dst);
+	const uint8_t *src_data = cairo_image_surface_get_data(src);
+	uint8_t *dst_data = cairo_image_surface_get_data(dst);
+	int src_stride = cairo_image_surface_get_stride(src);
+	int dst_stride = cairo_image_surface_get_stride(dst);
+
+	for (int y = y0; y < y1; y++) {
+		const struct span *vspan = &yaxis.spans[y];
+		memset(acc, 0, n * sizeof(*acc));
+		for (int i = 0; i < vspan->count; i++) {
+			const uint8_t *line = src_data
+				+ (size_t)(vspan->start + i) * src_stride
+				+ (size_t)col0 * 4;
+			accumulate(acc, line, n, vspan->weights[i]);
+		}
+		for (size_t i = 0; i < n; i++) {
+			row[i] = (acc[i] + (1u << (ROW_SHIFT - 1))) >> ROW_SHIFT;
+		}
+
+		uint32_t *out = (uint32_t *)(dst_data + (size_t)y * dst_stride);
+		for (int x = x0; x < x1; x++) {
+			const struct span *hspan = &xaxis.spans[x];
+			const uint16_t *p = row + (size_t)(hspan->start - col0) * 4;
+			uint32_t sum[4] = {0};
+			for (int i = 0; i < hspan->count; i++, p += 4) {
+				for (int c = 0; c < 4; c++) {
+					sum[c] += (uint32_t)p[c] * hspan->weights[i];
+				}
+			}
+			uint8_t *pixel = (uint8_t *)&out[x];
+			for (int c = 0; c < 4; c++) {
+				pixel[c] = (sum[c] + (1u << (WEIGHT_BITS + 7)))
+					>> (WEIGHT_BITS + 8);
+			}
+			/* The unused byte of RGB24 is undefined, not opaque */
+			if (src_format == CAIRO_FORMAT_RGB24) {
+				out[x] |= 0xff000000;
+			}
+		}
+	}
+	cairo_surface_mark_dirty_rectangle(dst, x0, y0, x1 - x0, y1 - y0);
+
+	free(acc);
+	free(row);
+	axis_finish(&xaxis);
+	axis_finish(&yaxis);
+	return true;
+}
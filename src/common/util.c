@@ -1,66 +1,78 @@
 // SPDX-License-Identifier: GPL-2.0-only
+#include <glib.h>
+#include <string.h>
 #include "panel.h"
 #include "common/log.h"
+#include "common/mem.h"
 #include "common/string-helpers.h"
 #include "pango/pango-layout.h"
-
-static PangoContext *text_measure_context;
-static PangoLayout *text_measure_layout;
-
-static void
-text_measure_init(void)
+#include "stats.h"
+
+/*
+ * Shaped layouts are cached so that a label is shaped once, rather than once
+ * to measure it and again every time it is drawn. Entries are keyed by
+ * everything that affects shaping and evicted least recently used first.
+ */
+#define TEXT_CACHE_SIZE 256
+
+struct text_layout {
+	/* key */
+	char *text;
+	PangoFontDescription *desc;
+	double scale;
+	bool markup;
+
+	PangoLayout *layout;
+	struct wl_list link; /* text_cache.lru, most recently used first */
+};
+
+static struct {
+	GHashTable *table; /* struct text_layout -> itself */
+	struct wl_list lru;
+	unsigned int count;
+	struct arena scratch; /* the formatted text of render_text() */
+} text_cache;
+
+static guint
+text_layout_hash(gconstpointer data)
 {
-	if (!text_measure_context) {
-		PangoFontMap *fontmap = pango_cairo_font_map_get_default();
-
-		text_measure_context = pango_font_map_create_context(fontmap);
-		pango_context_set_round_glyph_positions(
-			text_measure_context, false);
-		text_measure_layout = pango_layout_new(text_measure_context);
-	}
+	const struct text_layout *t = data;
+	guint hash = g_str_hash(t->text);
+	hash = hash * 31 + pango_font_description_hash(t->desc);
+	hash = hash * 31 + (guint)(t->scale * 1024);
+	return hash * 31 + t->markup;
 }
 
-void
-text_measure_fini(void)
+static gboolean
+text_layout_equal(gconstpointer a, gconstpointer b)
 {
-	if (text_measure_layout) {
-		g_object_unref(text_measure_layout);
-		text_measure_layout = NULL;
-	}
-	if (text_measure_context) {
-		g_object_unref(text_measure_context);
-		text_measure_context = NULL;
-	}
+	const struct text_layout *x = a, *y = b;
+	return x->scale == y->scale && x->markup == y->markup
+		&& !strcmp(x->text, y->text)
+		&& pango_font_description_equal(x->desc, y->desc);
 }
 
-PangoRectangle
-get_text_size(const PangoFontDescription *desc, const char *string)
+static void
+text_layout_destroy(struct text_layout *t)
 {
-	PangoRectangle rect = {0};
-	if (string_null_or_empty(string)) {
-		return rect;
-	}
-
-	text_measure_init();
-
-	pango_layout_set_font_description(text_measure_layout, desc);
-	pango_layout_set_text(text_measure_layout, string, -1);
-	pango_layout_set_single_paragraph_mode(text_measure_layout, TRUE);
-	pango_layout_set_width(text_measure_layout, -1);
-	pango_layout_set_ellipsize(text_measure_layout, PANGO_ELLIPSIZE_MIDDLE);
-	pango_layout_get_extents(text_measure_layout, NULL, &rect);
-	pango_extents_to_pixels(&rect, NULL);
-
-	return rect;
+	wl_list_remove(&t->link);
+	g_object_unref(t->layout);
+	pango_font_description_free(t->desc);
+	free(t->text);
+	free(t);
+	text_cache.count--;
 }
 
 static PangoLayout *
-get_pango_layout(cairo_t *cairo, const PangoFontDescription *desc,
-	const char *text, double scale, bool markup)
+create_layout(const PangoFontDescription *desc, const char *text,
+		double scale, bool markup)
 {
-	PangoLayout *layout = pango_cairo_create_layout(cairo);
-	pango_context_set_round_glyph_positions(
-		pango_layout_get_context(layout), false);
+	/* Each layout gets its own context as rendering adjusts it */
+	PangoContext *context =
+		pango_font_map_create_context(pango_cairo_font_map_get_default());
+	pango_context_set_round_glyph_positions(context, false);
+	PangoLayout *layout = pango_layout_new(context);
+	g_object_unref(context);
 
 	PangoAttrList *attrs;
 	if (markup) {
@@ -91,28 +103,111 @@ get_pango_layout(cairo_t *cairo, const PangoFontDescription *desc,
 	return layout;
 }
 
+static PangoLayout *
+get_pango_layout(const PangoFontDescription *desc, const char *text,
+		double scale, bool markup)
+{
+	if (!text_cache.table) {
+		text_cache.table = g_hash_table_new(text_layout_hash,
+			text_layout_equal);
+		wl_list_init(&text_cache.lru);
+	}
+
+	struct text_layout key = {
+		.text = (char *)text,
+		.desc = (PangoFontDescription *)desc,
+		.scale = scale,
+		.markup = markup,
+	};
+	struct text_layout *t = g_hash_table_lookup(text_cache.table, &key);
+	if (t) {
+		stats.text_cache_hits++;
+		wl_list_remove(&t->link);
+		wl_list_insert(&text_cache.lru, &t->link);
+		return t->layout;
+	}
+	stats.text_cache_misses++;
+
+	if (text_cache.count >= TEXT_CACHE_SIZE) {
+		struct text_layout *oldest =
+			wl_container_of(text_cache.lru.prev, oldest, link);
+		g_hash_table_remove(text_cache.table, oldest);
+		text_layout_destroy(oldest);
+	}
+
+	t = znew(*t);
+	t->text = xstrdup(text);
+	t->desc = pango_font_description_copy(desc);
+	t->scale = scale;
+	t->markup = markup;
+	t->layout = create_layout(desc, text, scale, markup);
+	wl_list_insert(&text_cache.lru, &t->link);
+	g_hash_table_add(text_cache.table, t);
+	text_cache.count++;
+	return t->layout;
+}
+
+void
+text_measure_fini(void)
+{
+	arena_finish(&text_cache.scratch);
+	if (!text_cache.table) {
+		return;
+	}
+	struct text_layout *t, *next;
+	wl_list_for_each_safe(t, next, &text_cache.lru, link) {
+		text_layout_destroy(t);
+	}
+	g_hash_table_destroy(text_cache.table);
+	text_cache.table = NULL;
+}
+
+PangoRectangle
+get_text_size(const PangoFontDescription *desc, const char *string)
+{
+	PangoRectangle rect = {0};
+	if (string_null_or_empty(string)) {
+		return rect;
+	}
+
+	PangoLayout *layout = get_pango_layout(desc, string, 1, false);
+	pango_layout_get_extents(layout, NULL, &rect);
+	pango_extents_to_pixels(&rect, NULL);
+
+	return rect;
+}
+
 void
 render_text(cairo_t *cairo, const PangoFontDescription *desc, double scale,
 		bool markup, const char *fmt, ...)
 {
 	va_list args;
 	va_start(args, fmt);
-	gchar *buf = g_strdup_vprintf(fmt, args);
+	char *buf = arena_vprintf(&text_cache.scratch, fmt, args);
 	va_end(args);
 	if (!buf) {
 		return;
 	}
 
-	PangoLayout *layout = get_pango_layout(cairo, desc, buf, scale, markup);
+	PangoLayout *layout = get_pango_layout(desc, buf, scale, markup);
+	PangoContext *context = pango_layout_get_context(layout);
+
+	/*
+	 * Only touch the context when the target differs from what the layout
+	 * was last shaped for, as any change makes pango shape it again.
+	 */
 	cairo_font_options_t *fo = cairo_font_options_create();
 	cairo_get_font_options(cairo, fo);
-	pango_cairo_context_set_font_options(pango_layout_get_context(layout), fo);
+	const cairo_font_options_t *current =
+		pango_cairo_context_get_font_options(context);
+	if (!current || !cairo_font_options_equal(current, fo)) {
+		pango_cairo_context_set_font_options(context, fo);
+	}
 	cairo_font_options_destroy(fo);
 	pango_cairo_update_layout(cairo, layout);
 	pango_cairo_show_layout(cairo, layout);
-	g_object_unref(layout);
 
-	g_free(buf);
+	arena_reset(&text_cache.scratch);
 }
 
 void
@@ -27,6 +27,7 @@ struct yaml_conf {
 	int taskbar_padding;
 	int taskbar_spacing;
 	int task_padding;
+	int thumbnail_cache_size;
 
 	/* startmenu */
 	char *startmenu_layout;
@@ -54,6 +55,7 @@ static const cyaml_schema_field_t yaml_conf_fields[] = {
 	CYAML_FIELD_INT("taskbar_padding", CYAML_FLAG_OPTIONAL | CYAML_FLAG_POINTER, struct yaml_conf, taskbar_padding),
 	CYAML_FIELD_INT("taskbar_spacing", CYAML_FLAG_OPTIONAL | CYAML_FLAG_POINTER, struct yaml_conf, taskbar_spacing),
 	CYAML_FIELD_INT("task_padding", CYAML_FLAG_OPTIONAL | CYAML_FLAG_POINTER, struct yaml_conf, task_padding),
+	CYAML_FIELD_INT("thumbnail_cache_size", CYAML_FLAG_OPTIONAL | CYAML_FLAG_POINTER, struct yaml_conf, thumbnail_cache_size),
 
 	CYAML_FIELD_STRING_PTR("startmenu_layout", CYAML_FLAG_OPTIONAL, struct yaml_conf, startmenu_layout, 0, CYAML_UNLIMITED),
 	CYAML_FIELD_INT("startmenu_padding", CYAML_FLAG_OPTIONAL | CYAML_FLAG_POINTER, struct yaml_conf, startmenu_padding),
@@ -96,6 +98,7 @@ parse(struct conf *conf, struct yaml_conf *data)
 	PARSE_INT(taskbar_padding);
 	PARSE_INT(taskbar_spacing);
 	PARSE_INT(task_padding);
+	PARSE_INT(thumbnail_cache_size);
 
 	PARSE_STR(startmenu_layout);
 	PARSE_INT(startmenu_padding);
@@ -207,6 +210,7 @@ conf_init(struct conf *conf)
 	conf->taskbar_padding = 8;
 	conf->taskbar_spacing = 6;
 	conf->task_padding = 8;
+	conf->thumbnail_cache_size = 4096;
 
 	conf->startmenu_layout = xstrdup("<vbox><search/><applist/></vbox>");
 	conf->startmenu_padding = 8;
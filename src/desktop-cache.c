@@ -0,0 +1,353 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * On-disk cache of resolved desktop entries, so that startup does not have to
+ * parse every .desktop file and icon theme index. The file is one block:
+ *
+ *   struct cache_header
+ *   struct cache_record[n_apps]
+ *   string table (NUL-terminated strings referenced by offset)
+ *
+ * A rescan builds the very same block in memory, so both paths share one
+ * parser. The cache is validated against a stamp over the mtimes of the
+ * directories that .desktop files and icon themes are read from. That catches
+ * files being added, removed or replaced (which is how package managers and
+ * most editors write), though not in-place edits. A cache with the wrong
+ * stamp is still good to show until a rescan has replaced it.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sfdo-common.h>
+#include "common/buf.h"
+#include "common/hash.h"
+#include "common/log.h"
+#include "common/mem.h"
+#include "desktop-entry.h"
+
+#define CACHE_MAGIC "T2PDAPPS"
+#define CACHE_VERSION 2
+
+enum cache_flags {
+	CACHE_APPLICATION = 1 << 0,
+	CACHE_NO_DISPLAY = 1 << 1,
+};
+
+struct cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t n_apps;
+	uint64_t stamp;
+	uint64_t strings_size;
+};
+
+/* String fields are offsets into the string table; 0 means NULL */
+struct cache_record {
+	uint32_t id;
+	uint32_t name;
+	uint32_t exec;
+	uint32_t icon;
+	uint32_t icon_path;
+	uint32_t wm_class;
+	uint32_t keywords;
+	uint32_t flags;
+};
+
+struct desktop_cache_builder {
+	struct buf records;
+	struct buf strings;
+	uint32_t n_apps;
+};
+
+static uint64_t
+stamp_dir(uint64_t stamp, const char *path)
+{
+	struct stat st;
+	stamp = hash_str(stamp, path);
+	if (stat(path, &st) < 0) {
+		return hash_u64(stamp, 0);
+	}
+	stamp = hash_u64(stamp, st.st_mtim.tv_sec);
+	return hash_u64(stamp, st.st_mtim.tv_nsec);
+}
+
+/*
+ * Fingerprint the directories whose contents end up in the cache. The list
+ * of data dirs is part of it too, so a changed $XDG_DATA_DIRS invalidates
+ * the cache even if no directory was touched.
+ */
+uint64_t
+desktop_cache_stamp(const struct sfdo_string *data_dirs, size_t n_data_dirs,
+		const char *icon_theme)
+{
+	static const char *const subdirs[] = {
+		"applications",
+		"icons",
+		"icons/hicolor",
+		"icons/%s",
+	};
+
+	uint64_t stamp = hash_u64(HASH_INIT, CACHE_VERSION);
+	stamp = hash_str(stamp, icon_theme);
+	for (size_t i = 0; i < n_data_dirs; i++) {
+		for (size_t j = 0; j < sizeof(subdirs) / sizeof(subdirs[0]); j++) {
+			char subdir[256];
+			char path[4096];
+			snprintf(subdir, sizeof(subdir), subdirs[j], icon_theme);
+			snprintf(path, sizeof(path), "%s%s", data_dirs[i].data,
+				subdir);
+			stamp = stamp_dir(stamp, path);
+		}
+	}
+	return stamp;
+}
+
+struct desktop_cache_builder *
+desktop_cache_builder_create(void)
+{
+	struct desktop_cache_builder *builder = znew(*builder);
+	/* Offset 0 is reserved for NULL */
+	buf_add(&builder->strings, "", 1);
+	return builder;
+}
+
+static uint32_t
+add_string(struct desktop_cache_builder *builder, const char *str)
+{
+	if (!str) {
+		return 0;
+	}
+	return buf_add_str(&builder->strings, str);
+}
+
+void
+desktop_cache_builder_add(struct desktop_cache_builder *builder,
+		const struct desktop_app *app)
+{
+	struct cache_record record = {
+		.id = add_string(builder, app->id),
+		.name = add_string(builder, app->name),
+		.exec = add_string(builder, app->exec),
+		.icon = add_string(builder, app->icon),
+		.icon_path = add_string(builder, app->icon_path),
+		.wm_class = add_string(builder, app->wm_class),
+		.keywords = add_string(builder, app->keywords),
+		.flags = (app->application ? CACHE_APPLICATION : 0)
+			| (app->no_display ? CACHE_NO_DISPLAY : 0),
+	};
+	buf_add(&builder->records, &record, sizeof(record));
+	builder->n_apps++;
+}
+
+static const char *
+get_string(const char *strings, uint32_t offset)
+{
+	return offset ? strings + offset : NULL;
+}
+
+/* Point @apps into a cache block after checking that it is well-formed */
+static bool
+parse(struct desktop_apps *apps, void *data, size_t size)
+{
+	const struct cache_header *header = data;
+	if (size < sizeof(*header)
+			|| memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic))
+			|| header->version != CACHE_VERSION) {
+		return false;
+	}
+	size_t records_size = (size_t)header->n_apps * sizeof(struct cache_record);
+	if (header->strings_size == 0
+			|| sizeof(*header) + records_size + header->strings_size != size) {
+		return false;
+	}
+
+	const struct cache_record *records = (const void *)(header + 1);
+	const char *strings = (const char *)records + records_size;
+	if (strings[header->strings_size - 1] != '\0') {
+		return false;
+	}
+
+	struct desktop_app *out = xzalloc(header->n_apps * sizeof(*out));
+	for (uint32_t i = 0; i < header->n_apps; i++) {
+		const struct cache_record *r = &records[i];
+		uint32_t offsets[] = { r->id, r->name, r->exec, r->icon,
+			r->icon_path, r->wm_class, r->keywords };
+		for (size_t j = 0; j < sizeof(offsets) / sizeof(offsets[0]); j++) {
+			if (offsets[j] >= header->strings_size) {
+				free(out);
+				return false;
+			}
+		}
+		if (!r->id) {
+			free(out);
+			return false;
+		}
+		out[i] = (struct desktop_app){
+			.id = get_string(strings, r->id),
+			.name = get_string(strings, r->name),
+			.exec = get_string(strings, r->exec),
+			.icon = get_string(strings, r->icon),
+			.icon_path = get_string(strings, r->icon_path),
+			.wm_class = get_string(strings, r->wm_class),
+			.keywords = get_string(strings, r->keywords),
+			.application = r->flags & CACHE_APPLICATION,
+			.no_display = r->flags & CACHE_NO_DISPLAY,
+		};
+	}
+
+	apps->apps = out;
+	apps->n_apps = header->n_apps;
+	apps->data = data;
+	apps->size = size;
+	return true;
+}
+
+/* Turn the builder into a cache block in memory and free the builder */
+bool
+desktop_cache_builder_finish(struct desktop_cache_builder *builder,
+		struct desktop_apps *apps, uint64_t stamp)
+{
+	bool ret = false;
+	if (builder->strings.len > UINT32_MAX) {
+		warn("desktop cache string table too large");
+		goto out;
+	}
+
+	struct cache_header header = {
+		.version = CACHE_VERSION,
+		.n_apps = builder->n_apps,
+		.stamp = stamp,
+		.strings_size = builder->strings.len,
+	};
+	memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+
+	struct buf block = {0};
+	buf_add(&block, &header, sizeof(header));
+	buf_add(&block, builder->records.data, builder->records.len);
+	buf_add(&block, builder->strings.data, builder->strings.len);
+
+	ret = parse(apps, block.data, block.len);
+	if (ret) {
+		apps->mapped = false;
+	} else {
+		buf_reset(&block);
+	}
+out:
+	buf_reset(&builder->records);
+	buf_reset(&builder->strings);
+	free(builder);
+	return ret;
+}
+
+bool
+desktop_cache_load(struct desktop_apps *apps, const char *path, uint64_t stamp,
+		bool *stale)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno != ENOENT) {
+			warn("cannot open desktop cache %s: %s", path,
+				strerror(errno));
+		}
+		return false;
+	}
+
+	bool ret = false;
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct cache_header)) {
+		goto out;
+	}
+	void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		warn("cannot mmap desktop cache %s: %s", path, strerror(errno));
+		goto out;
+	}
+	ret = parse(apps, data, st.st_size);
+	if (ret) {
+		apps->mapped = true;
+		*stale = ((const struct cache_header *)data)->stamp != stamp;
+	} else {
+		munmap(data, st.st_size);
+	}
+out:
+	close(fd);
+	if (!ret) {
+		info("desktop cache %s is invalid", path);
+	} else if (*stale) {
+		info("desktop cache %s is stale", path);
+	}
+	return ret;
+}
+
+/* Create the directories leading up to @path, like mkdir -p $(dirname path) */
+static void
+mkdir_parents(const char *path)
+{
+	char *dir = xstrdup(path);
+	for (char *p = dir + 1; *p; p++) {
+		if (*p != '/') {
+			continue;
+		}
+		*p = '\0';
+		if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+			break;
+		}
+		*p = '/';
+	}
+	free(dir);
+}
+
+/* Write @apps to @path atomically via a temporary file and rename() */
+void
+desktop_cache_save(const struct desktop_apps *apps, const char *path)
+{
+	mkdir_parents(path);
+
+	char tmp[4096];
+	if ((size_t)snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= sizeof(tmp)) {
+		return;
+	}
+	int fd = mkstemp(tmp);
+	if (fd < 0) {
+		warn("cannot create %s: %s", tmp, strerror(errno));
+		return;
+	}
+
+	const char *p = apps->data;
+	size_t left = apps->size;
+	while (left > 0) {
+		ssize_t n = write(fd, p, left);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			warn("cannot write %s: %s", tmp, strerror(errno));
+			close(fd);
+			unlink(tmp);
+			return;
+		}
+		p += n;
+		left -= n;
+	}
+	if (close(fd) < 0 || rename(tmp, path) < 0) {
+		warn("cannot save desktop cache %s: %s", path, strerror(errno));
+		unlink(tmp);
+		return;
+	}
+	debug("saved %zu desktop entries to %s", apps->n_apps, path);
+}
+
+void
+desktop_apps_finish(struct desktop_apps *apps)
+{
+	free(apps->apps);
+	if (apps->mapped) {
+		munmap(apps->data, apps->size);
+	} else {
+		free(apps->data);
+	}
+	*apps = (struct desktop_apps){0};
+}
@@ -2,6 +2,8 @@
 #include "desktop-entry.h"
 #include <assert.h>
 #include <cairo.h>
+#include <errno.h>
+#include <glib.h>
 #include <math.h>
 #include <sfdo-common.h>
 #include <sfdo-desktop.h>
@@ -11,11 +13,20 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/inotify.h>
+#include <unistd.h>
 #include "conf.h"
+#include "common/buf.h"
 #include "common/log.h"
 #include "common/mem.h"
+#include "common/scale.h"
 #include "common/string-helpers.h"
 #include "panel.h"
+#include "stats.h"
+#include "worker.h"
+
+// TODO: Make icon theme name configurable
+#define ICON_THEME "Papirus"
 
 static const char *debug_libsfdo;
 
@@ -34,22 +45,294 @@ log_handler(enum sfdo_log_level level, const char *fmt, va_list args, void *tag)
 	___log(buf, args);
 }
 
+/*
+ * Index over the desktop entries for the app_id lookups below. Values in
+ * the hash tables are entry indices + 1 so that 0 (NULL) means "absent", and
+ * each key maps to the lowest index so that the first entry in DB order wins.
+ */
+struct desktop_prefix {
+	char *base; /* lower-cased portion of the desktop ID after the last '.' */
+	size_t index;
+};
+
+struct desktop_index {
+	const struct desktop_app *entries;
+	size_t n_entries;
+	GHashTable *by_id;
+	GHashTable *by_base;
+	GHashTable *by_wm_class;
+	struct desktop_prefix *prefixes; /* sorted by base, then index */
+	GHashTable *memo; /* app_id -> struct desktop_app, or NULL if unresolved */
+};
+
+static const char *
+desktop_id_base(const struct desktop_app *entry)
+{
+	const char *dot = strrchr(entry->id, '.');
+	return dot ? (dot + 1) : entry->id;
+}
+
+static void
+index_add(GHashTable *table, const char *str, size_t index)
+{
+	char *key = g_ascii_strdown(str, -1);
+	if (g_hash_table_contains(table, key)) {
+		g_free(key);
+		return;
+	}
+	g_hash_table_insert(table, key, GUINT_TO_POINTER(index + 1));
+}
+
+/* Return the entry index for @key, or SIZE_MAX if there is none */
+static size_t
+index_get(GHashTable *table, const char *key)
+{
+	guint value = GPOINTER_TO_UINT(g_hash_table_lookup(table, key));
+	return value ? value - 1 : SIZE_MAX;
+}
+
+static int
+prefix_cmp(const void *a, const void *b)
+{
+	const struct desktop_prefix *pa = a, *pb = b;
+	int ret = strcmp(pa->base, pb->base);
+	if (ret) {
+		return ret;
+	}
+	return (pa->index > pb->index) - (pa->index < pb->index);
+}
+
+static struct desktop_index *
+desktop_index_create(const struct desktop_apps *apps)
+{
+	struct desktop_index *index = znew(*index);
+	index->entries = apps->apps;
+	index->n_entries = apps->n_apps;
+	index->by_id = g_hash_table_new(g_str_hash, g_str_equal);
+	index->by_base = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	index->by_wm_class = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	index->memo = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	index->prefixes = xzalloc(MAX(index->n_entries, 1) * sizeof(*index->prefixes));
+
+	for (size_t i = 0; i < index->n_entries; i++) {
+		const struct desktop_app *entry = &index->entries[i];
+		if (!g_hash_table_contains(index->by_id, entry->id)) {
+			g_hash_table_insert(index->by_id, (gpointer)entry->id,
+				(gpointer)entry);
+		}
+		const char *base = desktop_id_base(entry);
+		index_add(index->by_base, base, i);
+		index->prefixes[i].base = g_ascii_strdown(base, -1);
+		index->prefixes[i].index = i;
+
+		if (entry->application && entry->wm_class) {
+			index_add(index->by_wm_class, entry->wm_class, i);
+		}
+	}
+	qsort(index->prefixes, index->n_entries, sizeof(*index->prefixes),
+		prefix_cmp);
+	return index;
+}
+
+static void
+desktop_index_destroy(struct desktop_index *index)
+{
+	if (!index) {
+		return;
+	}
+	for (size_t i = 0; i < index->n_entries; i++) {
+		g_free(index->prefixes[i].base);
+	}
+	free(index->prefixes);
+	g_hash_table_destroy(index->by_id);
+	g_hash_table_destroy(index->by_base);
+	g_hash_table_destroy(index->by_wm_class);
+	g_hash_table_destroy(index->memo);
+	free(index);
+}
+
+/*
+ * We set some relaxed load options to accommodate delinquent themes in
+ * the wild, namely:
+ *
+ * - SFDO_ICON_THEME_LOAD_OPTION_RELAXED to "impose less restrictions
+ *   on the format of icon theme files"
+ *
+ * - SFDO_ICON_THEME_LOAD_OPTION_ALLOW_MISSING to "continue loading
+ *   even if it fails to find a theme or one of its dependencies."
+ *
+ * The theme is only loaded once an icon has to be looked up, which with a
+ * valid desktop cache is typically never for task buttons.
+ */
+static struct sfdo_icon_theme *
+get_icon_theme(struct sfdo *sfdo)
+{
+	if (sfdo->icon_theme || sfdo->icon_theme_failed) {
+		return sfdo->icon_theme;
+	}
+
+	int load_options = SFDO_ICON_THEME_LOAD_OPTIONS_DEFAULT
+		| SFDO_ICON_THEME_LOAD_OPTION_RELAXED
+		| SFDO_ICON_THEME_LOAD_OPTION_ALLOW_MISSING;
+
+	sfdo->icon_theme = sfdo_icon_theme_load(sfdo->icon_ctx, ICON_THEME, load_options);
+	if (!sfdo->icon_theme) {
+		warn("Failed to load icon theme %s, falling back to 'hicolor'", ICON_THEME);
+		sfdo->icon_theme = sfdo_icon_theme_load(sfdo->icon_ctx, "hicolor", load_options);
+	}
+	if (!sfdo->icon_theme) {
+		warn("Failed to load icon theme");
+		sfdo->icon_theme_failed = true;
+	}
+	return sfdo->icon_theme;
+}
+
+static char *resolve_icon_path(struct sfdo *sfdo, const char *icon_name);
+
+/* Parse all .desktop files and turn them into the cache format */
+static bool
+rescan_apps(struct sfdo *sfdo, struct desktop_apps *apps, uint64_t stamp)
+{
+	char *locale = NULL;
+	struct sfdo_desktop_db *db = sfdo_desktop_db_load(sfdo->desktop_ctx, locale);
+	if (!db) {
+		return false;
+	}
+
+	size_t n_entries;
+	struct sfdo_desktop_entry **entries = sfdo_desktop_db_get_entries(db, &n_entries);
+	struct desktop_cache_builder *builder = desktop_cache_builder_create();
+	for (size_t i = 0; i < n_entries; i++) {
+		struct sfdo_desktop_entry *entry = entries[i];
+		struct desktop_app app = {
+			.id = sfdo_desktop_entry_get_id(entry, NULL),
+			.name = sfdo_desktop_entry_get_name(entry, NULL),
+			.icon = sfdo_desktop_entry_get_icon(entry, NULL),
+			.application = sfdo_desktop_entry_get_type(entry)
+				== SFDO_DESKTOP_ENTRY_APPLICATION,
+			.no_display = sfdo_desktop_entry_get_no_display(entry),
+		};
+
+		/*
+		 * sfdo_desktop_entry_get_startup_wm_class() and _get_exec()
+		 * assert against entries that are not APPLICATION
+		 */
+		struct sfdo_desktop_exec_command *cmd = NULL;
+		struct buf keywords = {0};
+		if (app.application) {
+			app.wm_class = sfdo_desktop_entry_get_startup_wm_class(entry, NULL);
+
+			size_t n_keywords;
+			const struct sfdo_string *kw =
+				sfdo_desktop_entry_get_keywords(entry, &n_keywords);
+			for (size_t k = 0; k < n_keywords; k++) {
+				buf_add(&keywords, kw[k].data, kw[k].len);
+				buf_add(&keywords, k + 1 < n_keywords ? ";" : "", 1);
+			}
+			app.keywords = keywords.data;
+
+			struct sfdo_desktop_exec *exec_tmpl =
+				sfdo_desktop_entry_get_exec(entry);
+			/*
+			 * Format the exec template without a file argument to
+			 * get a concrete argv list, then take args[0] as the
+			 * executable. This uses only the stable libsfdo API
+			 * available in all releases, avoiding
+			 * sfdo_desktop_entry_get_exec_arg0() which was added
+			 * later.
+			 */
+			cmd = exec_tmpl ? sfdo_desktop_exec_format(exec_tmpl, NULL) : NULL;
+			if (cmd) {
+				size_t n_args;
+				const char **args =
+					sfdo_desktop_exec_command_get_args(cmd, &n_args);
+				if (n_args > 0 && args && !string_null_or_empty(args[0])) {
+					app.exec = args[0];
+				}
+			}
+		}
+
+		char *icon_path = NULL;
+		if (!string_null_or_empty(app.icon)) {
+			icon_path = resolve_icon_path(sfdo, app.icon);
+			app.icon_path = icon_path;
+		}
+
+		desktop_cache_builder_add(builder, &app);
+		buf_reset(&keywords);
+		free(icon_path);
+		if (cmd) {
+			sfdo_desktop_exec_command_destroy(cmd);
+		}
+	}
+	sfdo_desktop_db_destroy(db);
+
+	return desktop_cache_builder_finish(builder, apps, stamp);
+}
+
+static uint64_t
+current_stamp(struct sfdo *sfdo)
+{
+	size_t n_dirs;
+	const struct sfdo_string *dirs =
+		sfdo_basedir_get_data_dirs(sfdo->basedir_ctx, &n_dirs);
+	return desktop_cache_stamp(dirs, n_dirs, ICON_THEME);
+}
+
+static char *
+cache_path(struct sfdo *sfdo)
+{
+	size_t len;
+	const char *cache_home = sfdo_basedir_get_cache_home(sfdo->basedir_ctx, &len);
+	return g_strdup_printf("%.*st2play/desktop-apps.cache", (int)len,
+		cache_home);
+}
+
+/*
+ * Load the desktop entries from the cache file. If it is out of date, it is
+ * used anyway and a reload is left pending, for desktop_entry_reload() to
+ * pick up once the worker is running. Only without a usable cache are the
+ * entries scanned here and now.
+ */
+static bool
+load_apps(struct sfdo *sfdo)
+{
+	uint64_t stamp = current_stamp(sfdo);
+	char *path = cache_path(sfdo);
+
+	sfdo->apps = znew(*sfdo->apps);
+	bool ret = true;
+	bool stale = false;
+	if (desktop_cache_load(sfdo->apps, path, stamp, &stale)) {
+		debug("loaded %zu desktop entries from %s", sfdo->apps->n_apps, path);
+		sfdo->apps_dirty = sfdo->icons_dirty = stale;
+	} else if (rescan_apps(sfdo, sfdo->apps, stamp)) {
+		desktop_cache_save(sfdo->apps, path);
+	} else {
+		zfree(sfdo->apps);
+		ret = false;
+	}
+	g_free(path);
+	return ret;
+}
+
 void
 desktop_entry_init(struct panel *panel)
 {
+	uint64_t start = stats_now();
 	struct sfdo *sfdo = znew(*sfdo);
 
 	debug_libsfdo = getenv("LABWC_DEBUG_LIBSFDO");
 
-	struct sfdo_basedir_ctx *basedir_ctx = sfdo_basedir_ctx_create();
-	if (!basedir_ctx) {
+	sfdo->basedir_ctx = sfdo_basedir_ctx_create();
+	if (!sfdo->basedir_ctx) {
 		goto err_basedir_ctx;
 	}
-	sfdo->desktop_ctx = sfdo_desktop_ctx_create(basedir_ctx);
+	sfdo->desktop_ctx = sfdo_desktop_ctx_create(sfdo->basedir_ctx);
 	if (!sfdo->desktop_ctx) {
 		goto err_desktop_ctx;
 	}
-	sfdo->icon_ctx = sfdo_icon_ctx_create(basedir_ctx);
+	sfdo->icon_ctx = sfdo_icon_ctx_create(sfdo->basedir_ctx);
 	if (!sfdo->icon_ctx) {
 		goto err_icon_ctx;
 	}
@@ -59,57 +342,34 @@ desktop_entry_init(struct panel *panel)
 	sfdo_desktop_ctx_set_log_handler(sfdo->desktop_ctx, level, log_handler, "sfdo-desktop");
 	sfdo_icon_ctx_set_log_handler(sfdo->icon_ctx, level, log_handler, "sfdo-icon");
 
-	char *locale = NULL;
-
-	sfdo->desktop_db = sfdo_desktop_db_load(sfdo->desktop_ctx, locale);
-	if (!sfdo->desktop_db) {
-		goto err_desktop_db;
+	if (!load_apps(sfdo)) {
+		goto err_apps;
 	}
 
-	/*
-	 * We set some relaxed load options to accommodate delinquent themes in
-	 * the wild, namely:
-	 *
-	 * - SFDO_ICON_THEME_LOAD_OPTION_RELAXED to "impose less restrictions
-	 *   on the format of icon theme files"
-	 *
-	 * - SFDO_ICON_THEME_LOAD_OPTION_ALLOW_MISSING to "continue loading
-	 *   even if it fails to find a theme or one of its dependencies."
-	 */
-	int load_options = SFDO_ICON_THEME_LOAD_OPTIONS_DEFAULT
-		| SFDO_ICON_THEME_LOAD_OPTION_RELAXED
-		| SFDO_ICON_THEME_LOAD_OPTION_ALLOW_MISSING;
-
-	// TODO: Make icon theme name configurable
-	char *icon_theme = "Papirus";
-	sfdo->icon_theme = sfdo_icon_theme_load(sfdo->icon_ctx, icon_theme, load_options);
-	if (!sfdo->icon_theme) {
-		warn("Failed to load icon theme %s, falling back to 'hicolor'", icon_theme);
-		sfdo->icon_theme = sfdo_icon_theme_load(sfdo->icon_ctx, "hicolor", load_options);
-	}
-	if (!sfdo->icon_theme) {
-		goto err_icon_theme;
-	}
-
-	/* basedir_ctx is not referenced by other objects */
-	sfdo_basedir_ctx_destroy(basedir_ctx);
+	sfdo->index = desktop_index_create(sfdo->apps);
+	sfdo->icon_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+		(GDestroyNotify)cairo_surface_destroy);
 
 	panel->sfdo = sfdo;
+	stats_timer_add(&stats.desktop_entry_init, start);
 	return;
 
-err_icon_theme:
-	sfdo_desktop_db_destroy(sfdo->desktop_db);
-err_desktop_db:
+err_apps:
+	if (sfdo->icon_theme) {
+		sfdo_icon_theme_destroy(sfdo->icon_theme);
+	}
 	sfdo_icon_ctx_destroy(sfdo->icon_ctx);
 err_icon_ctx:
 	sfdo_desktop_ctx_destroy(sfdo->desktop_ctx);
 err_desktop_ctx:
-	sfdo_basedir_ctx_destroy(basedir_ctx);
+	sfdo_basedir_ctx_destroy(sfdo->basedir_ctx);
 err_basedir_ctx:
 	free(sfdo);
 	warn("Failed to initialize icon loader");
 }
 
+static void free_watches(struct sfdo *sfdo);
+
 void
 desktop_entry_finish(struct panel *panel)
 {
@@ -118,14 +378,32 @@ desktop_entry_finish(struct panel *panel)
 		return;
 	}
 
-	sfdo_icon_theme_destroy(sfdo->icon_theme);
-	sfdo_desktop_db_destroy(sfdo->desktop_db);
+	free_watches(sfdo);
+	g_hash_table_destroy(sfdo->icon_cache);
+	desktop_index_destroy(sfdo->index);
+	desktop_apps_finish(sfdo->apps);
+	free(sfdo->apps);
+	if (sfdo->icon_theme) {
+		sfdo_icon_theme_destroy(sfdo->icon_theme);
+	}
 	sfdo_icon_ctx_destroy(sfdo->icon_ctx);
 	sfdo_desktop_ctx_destroy(sfdo->desktop_ctx);
+	sfdo_basedir_ctx_destroy(sfdo->basedir_ctx);
 	free(sfdo);
 	panel->sfdo = NULL;
 }
 
+const struct desktop_app *
+desktop_entry_get_apps(struct panel *panel, size_t *n_apps)
+{
+	if (!panel->sfdo) {
+		*n_apps = 0;
+		return NULL;
+	}
+	*n_apps = panel->sfdo->apps->n_apps;
+	return panel->sfdo->apps->apps;
+}
+
 struct icon_ctx {
 	char *path;
 	enum sfdo_icon_file_format format;
@@ -165,9 +443,13 @@ process_rel_name(struct icon_ctx *ctx, const char *icon_name,
 	 * but some .desktop files include one anyway. libsfdo does not
 	 * allow this in lookups, so strip the extension first.
 	 */
+	struct sfdo_icon_theme *theme = get_icon_theme(sfdo);
+	if (!theme) {
+		return -1;
+	}
 	size_t name_len = length_without_extension(icon_name);
 	struct sfdo_icon_file *icon_file = sfdo_icon_theme_lookup(
-		sfdo->icon_theme, icon_name, name_len, size, scale,
+		theme, icon_name, name_len, size, scale,
 		lookup_options);
 	if (!icon_file || icon_file == SFDO_ICON_FILE_INVALID) {
 		ret = -1;
@@ -200,130 +482,169 @@ err:
 	return -1;
 }
 
+/* Lowest index of an entry whose base starts with @prefix, or SIZE_MAX */
+static size_t
+index_find_prefixed(struct desktop_index *index, const char *prefix)
+{
+	size_t len = strlen(prefix);
+	size_t lo = 0, hi = index->n_entries;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (strcmp(index->prefixes[mid].base, prefix) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	size_t best = SIZE_MAX;
+	for (size_t i = lo; i < index->n_entries; i++) {
+		if (strncmp(index->prefixes[i].base, prefix, len)) {
+			break;
+		}
+		best = MIN(best, index->prefixes[i].index);
+	}
+	return best;
+}
+
 /*
  * Looks up an application desktop entry using fuzzy matching
  * (e.g. "thunderbird" matches "org.mozilla.Thunderbird.desktop"
  * and "XTerm" matches "xterm.desktop"). This is not per any spec
  * but is needed to find icons for existing applications.
  *
- * The second loop tries to match more partial strings, for
+ * The second step tries to match more partial strings, for
  * example "gimp-2.0" would match "org.something.gimp.desktop".
+ * In both steps the first matching entry in DB order wins.
  */
-static struct sfdo_desktop_entry *
-get_db_entry_by_id_fuzzy(struct sfdo_desktop_db *db, const char *app_id)
+static const struct desktop_app *
+get_db_entry_by_id_fuzzy(struct desktop_index *index, const char *app_id)
 {
-	size_t n_entries;
-	struct sfdo_desktop_entry **entries = sfdo_desktop_db_get_entries(db, &n_entries);
+	char *lower = g_ascii_strdown(app_id, -1);
+	const struct desktop_app *entry = NULL;
 
 	/* Would match "org.foobar.xterm" when given app-id "XTerm" */
-	for (size_t i = 0; i < n_entries; i++) {
-		struct sfdo_desktop_entry *entry = entries[i];
-		const char *desktop_id = sfdo_desktop_entry_get_id(entry, NULL);
-		/* Get portion of desktop ID after last '.' */
-		const char *dot = strrchr(desktop_id, '.');
-		const char *desktop_id_base = dot ? (dot + 1) : desktop_id;
-
-		if (!strcasecmp(app_id, desktop_id_base)) {
+	size_t by_base = index_get(index->by_base, lower);
+	size_t by_wm_class = index_get(index->by_wm_class, lower);
+	if (by_base != SIZE_MAX || by_wm_class != SIZE_MAX) {
+		entry = &index->entries[MIN(by_base, by_wm_class)];
+		const char *desktop_id = entry->id;
+		if (by_base <= by_wm_class) {
 			warn("'%s' to '%s.desktop' via case-insensitive match", app_id, desktop_id);
-			return entry;
-		}
-
-		/* sfdo_desktop_entry_get_startup_wm_class() asserts against APPLICATION */
-		if (sfdo_desktop_entry_get_type(entry) != SFDO_DESKTOP_ENTRY_APPLICATION) {
-			continue;
-		}
-
-		/* Try desktop entry's StartupWMClass also */
-		const char *wm_class =
-			sfdo_desktop_entry_get_startup_wm_class(entry, NULL);
-		if (wm_class && !strcasecmp(app_id, wm_class)) {
+		} else {
 			warn("'%s' to '%s.desktop' via StartupWMClass", app_id, desktop_id);
-			return entry;
 		}
+		goto out;
 	}
 
-	/* Would match "org.foobar.xterm-unicode" when given app-id "XTerm" */
-	const int app_id_len = strlen(app_id);
-	for (size_t i = 0; i < n_entries; i++) {
-		struct sfdo_desktop_entry *entry = entries[i];
-		const char *desktop_id = sfdo_desktop_entry_get_id(entry, NULL);
-		const char *dot = strrchr(desktop_id, '.');
-		const char *desktop_id_base = dot ? (dot + 1) : desktop_id;
-		const int dlen = strlen(desktop_id_base);
-		const int cmp_len = MIN(app_id_len, dlen);
-		if (cmp_len < 3) {
-			/*
-			 * Without this check, app-id "foot" would match
-			 * "something.f" and any app-id would match "R.E.P.O."
-			 */
-			continue;
-		}
-		if (!strncasecmp(app_id, desktop_id_base, cmp_len)) {
-			debug("'%s' to '%s.desktop' via partial match", app_id, desktop_id);
-			return entry;
+	/*
+	 * Would match "org.foobar.xterm-unicode" when given app-id "XTerm".
+	 * The shorter of the two strings must be a prefix of the other and at
+	 * least 3 characters long. Without that minimum, app-id "foot" would
+	 * match "something.f" and any app-id would match "R.E.P.O."
+	 */
+	size_t best = SIZE_MAX;
+	size_t len = strlen(lower);
+	if (len >= 3) {
+		/* desktop ID base is a prefix of the app-id, or equal to it */
+		for (size_t n = 3; n <= len; n++) {
+			char c = lower[n];
+			lower[n] = '\0';
+			best = MIN(best, index_get(index->by_base, lower));
+			lower[n] = c;
 		}
+		/* app-id is a prefix of the desktop ID base */
+		best = MIN(best, index_find_prefixed(index, lower));
 	}
-
-	return NULL;
+	if (best != SIZE_MAX) {
+		entry = &index->entries[best];
+		debug("'%s' to '%s.desktop' via partial match", app_id, entry->id);
+	}
+out:
+	g_free(lower);
+	return entry;
 }
 
-static struct sfdo_desktop_entry *
+static const struct desktop_app *
 get_desktop_entry(struct sfdo *sfdo, const char *app_id)
 {
 	assert(sfdo);
-	struct sfdo_desktop_entry *entry = sfdo_desktop_db_get_entry_by_id(sfdo->desktop_db, app_id, SFDO_NT);
+	struct desktop_index *index = sfdo->index;
+	gpointer memo;
+	if (g_hash_table_lookup_extended(index->memo, app_id, NULL, &memo)) {
+		return memo;
+	}
+
+	const struct desktop_app *entry = g_hash_table_lookup(index->by_id, app_id);
 	if (entry) {
 		debug("matched '%s.desktop' via exact match", app_id);
-		return entry;
+	} else {
+		entry = get_db_entry_by_id_fuzzy(index, app_id);
 	}
-	entry = get_db_entry_by_id_fuzzy(sfdo->desktop_db, app_id);
 	if (!entry) {
 		debug("failed to find .desktop file for '%s'", app_id);
 	}
+	g_hash_table_insert(index->memo, g_strdup(app_id), (gpointer)entry);
 	return entry;
 }
 
-static void
-add_png(cairo_t *cairo, struct panel *panel, const char *filename, int icon_size)
+/*
+ * Decode a png and scale it once to @size x @scale pixels (along its longest
+ * side), so that painting it later is a plain blit.
+ */
+static cairo_surface_t *
+load_png(const char *filename, int size, float scale)
 {
-	cairo_save(cairo);
 	cairo_surface_t *image = cairo_image_surface_create_from_png(filename);
 	if (cairo_surface_status(image)) {
 		cairo_surface_destroy(image);
 		warn("bad png icon (%s)", filename);
-		return;
+		return NULL;
 	}
 
-	cairo_translate(cairo, panel->conf->task_padding, 0);
+	int w = cairo_image_surface_get_width(image);
+	int h = cairo_image_surface_get_height(image);
+	int max = MAX(w, h);
+	int target = lroundf(size * scale);
+	if (max == target) {
+		return image;
+	}
 
-	/* TODO: use cairo_image_surface_scale() */
-	double w, h, max;
-	w = cairo_image_surface_get_width(image);
-	h = cairo_image_surface_get_height(image);
-	max = h > w ? h : w;
-	if (max != icon_size) {
-		cairo_scale(cairo, icon_size / max, icon_size / max);
+	double factor = (double)target / max;
+	cairo_surface_t *scaled = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+		MAX(lround(w * factor), 1), MAX(lround(h * factor), 1));
+	if (scale_surface_box(scaled, image, NULL)) {
+		cairo_surface_destroy(image);
+		return scaled;
 	}
+
+	/* Upscaling, or a format the box filter does not handle */
+	cairo_t *cairo = cairo_create(scaled);
+	cairo_scale(cairo, factor, factor);
 	cairo_set_source_surface(cairo, image, 0, 0);
-	cairo_paint_with_alpha(cairo, 1.0);
+	cairo_pattern_set_filter(cairo_get_source(cairo), CAIRO_FILTER_GOOD);
+	cairo_paint(cairo);
+	cairo_destroy(cairo);
 	cairo_surface_destroy(image);
-	cairo_restore(cairo);
+	return scaled;
 }
 
-void
-desktop_entry_load_icon(cairo_t *cairo, struct panel *panel, const char *icon_name,
-		int size, float scale)
+/* Look up the file for @icon_name at DESKTOP_ICON_SIZE and scale 1 */
+static char *
+resolve_icon_path(struct sfdo *sfdo, const char *icon_name)
 {
-	/* static analyzer isn't able to detect the NULL check in string_null_or_empty() */
-	if (string_null_or_empty(icon_name) || !icon_name) {
-		return;
-	}
-
-	struct sfdo *sfdo = panel->sfdo;
-	if (!sfdo) {
-		return;
+	struct icon_ctx ctx = {0};
+	int ret;
+	if (icon_name[0] == '/') {
+		ret = process_abs_name(&ctx, icon_name);
+	} else {
+		ret = process_rel_name(&ctx, icon_name, sfdo, DESKTOP_ICON_SIZE, 1);
 	}
+	return ret < 0 ? NULL : ctx.path;
+}
 
+static cairo_surface_t *
+load_icon(struct sfdo *sfdo, const char *icon_name, int size, float scale)
+{
 	/*
 	 * libsfdo doesn't support loading icons for fractional scales,
 	 * so round down and increase the icon size to compensate.
@@ -336,20 +657,192 @@ desktop_entry_load_icon(cairo_t *cairo, struct panel *panel, const char *icon_na
 	if (icon_name[0] == '/') {
 		ret = process_abs_name(&ctx, icon_name);
 	} else {
-		ret = process_rel_name(&ctx, icon_name, sfdo, lookup_size, lookup_scale);
+		ret = process_rel_name(&ctx, icon_name, sfdo, lookup_size,
+			lookup_scale);
 	}
 	if (ret < 0) {
 		info("failed to load icon file %s", icon_name);
-		return;
+		return NULL;
 	}
 
 	debug("loading icon file %s", ctx.path);
+	cairo_surface_t *surface = NULL;
 	if (ctx.format == SFDO_ICON_FILE_FORMAT_PNG) {
-		add_png(cairo, panel, ctx.path, 22);
+		surface = load_png(ctx.path, size, scale);
 	}
 	// TODO: Handle SVG too
 
 	free(ctx.path);
+	return surface;
+}
+
+/*
+ * Icon lookups and decoding run on the worker, the icon theme is only ever
+ * touched from there. Until the job is done the cache holds NULL for the
+ * key, as for an icon that does not exist, so it is only queued once.
+ */
+struct icon_load {
+	struct panel *panel;
+	char *key; /* in sfdo->icon_cache */
+	char *app_id; /* whose task buttons to redraw, or NULL */
+	char *icon_name; /* to look up in the icon theme, or NULL */
+	char *path; /* already resolved, if not */
+	int size;
+	float scale;
+	cairo_surface_t *icon;
+};
+
+static void
+icon_load(void *data)
+{
+	struct icon_load *load = data;
+	if (load->icon_name) {
+		load->icon = load_icon(load->panel->sfdo, load->icon_name,
+			load->size, load->scale);
+	} else if (str_endswith_ignore_case(load->path, ".png")) {
+		debug("loading icon file %s", load->path);
+		load->icon = load_png(load->path, load->size, load->scale);
+	}
+}
+
+static void
+icon_load_done(void *data, bool cancelled)
+{
+	struct icon_load *load = data;
+	struct sfdo *sfdo = load->panel->sfdo;
+	gpointer value = NULL;
+
+	/* The entry is gone if the cache was invalidated in the meantime */
+	if (!cancelled && load->icon && g_hash_table_lookup_extended(
+			sfdo->icon_cache, load->key, NULL, &value) && !value) {
+		g_hash_table_insert(sfdo->icon_cache, g_strdup(load->key),
+			load->icon);
+		load->icon = NULL;
+		if (!load->panel->worker) {
+			/* Loaded synchronously, see queue_icon_load() */
+		} else if (load->app_id) {
+			plugin_taskbar_invalidate_app_id(load->panel,
+				load->app_id);
+		} else {
+			panel_schedule_frame(load->panel);
+		}
+	}
+	cairo_surface_destroy(load->icon);
+	g_free(load->key);
+	free(load->app_id);
+	free(load->icon_name);
+	free(load->path);
+	free(load);
+}
+
+/*
+ * Queue loading an icon for @key, which takes ownership of it. Returns the
+ * icon if it could be loaded straight away, which is only the case without
+ * a worker thread.
+ */
+static cairo_surface_t *
+queue_icon_load(struct panel *panel, char *key, const char *app_id,
+		const char *icon_name, const char *path, int size, float scale)
+{
+	g_hash_table_insert(panel->sfdo->icon_cache, key, NULL);
+
+	struct icon_load *load = znew(*load);
+	load->panel = panel;
+	load->key = g_strdup(key);
+	load->app_id = app_id ? xstrdup(app_id) : NULL;
+	load->icon_name = icon_name ? xstrdup(icon_name) : NULL;
+	load->path = path ? xstrdup(path) : NULL;
+	load->size = size;
+	load->scale = scale;
+	worker_submit(panel->worker, icon_load, icon_load_done, load);
+	return g_hash_table_lookup(panel->sfdo->icon_cache, key);
+}
+
+static void
+paint_icon(cairo_t *cairo, struct panel *panel, cairo_surface_t *icon,
+		float scale)
+{
+	if (!icon) {
+		return;
+	}
+	cairo_save(cairo);
+	cairo_translate(cairo, panel->conf->task_padding, 0);
+	if (scale != 1.0f) {
+		cairo_scale(cairo, 1.0 / scale, 1.0 / scale);
+	}
+	cairo_set_source_surface(cairo, icon, 0, 0);
+	cairo_paint(cairo);
+	cairo_restore(cairo);
+}
+
+/*
+ * Icons are cached by name or app_id together with size and scale, so that
+ * redrawing a task button never touches the filesystem or the png decoder.
+ * Failed lookups are cached as NULL surfaces.
+ */
+static cairo_surface_t *
+icon_cache_lookup(struct sfdo *sfdo, const char *key, bool *found)
+{
+	gpointer value = NULL;
+	*found = g_hash_table_lookup_extended(sfdo->icon_cache, key, NULL, &value);
+	if (*found) {
+		stats.icon_cache_hits++;
+	} else {
+		stats.icon_cache_misses++;
+	}
+	return value;
+}
+
+/*
+ * Format the cache key of an icon into @buf, which is enough for all but
+ * very long names. Those get a key of their own, which is returned instead
+ * and has to be freed with g_free().
+ */
+static char *
+icon_cache_key(char *buf, size_t len, const char *kind, const char *name,
+		int size, float scale)
+{
+	int n = snprintf(buf, len, "%s:%s|%d|%g", kind, name, size, scale);
+	if (n >= 0 && (size_t)n < len) {
+		return buf;
+	}
+	return g_strdup_printf("%s:%s|%d|%g", kind, name, size, scale);
+}
+
+/* @key from icon_cache_key(), as an allocated copy for the cache to own */
+static char *
+icon_cache_key_steal(char *key, const char *buf)
+{
+	return key == buf ? g_strdup(key) : key;
+}
+
+void
+desktop_entry_load_icon(cairo_t *cairo, struct panel *panel, const char *icon_name,
+		int size, float scale)
+{
+	/* static analyzer isn't able to detect the NULL check in string_null_or_empty() */
+	if (string_null_or_empty(icon_name) || !icon_name) {
+		return;
+	}
+
+	struct sfdo *sfdo = panel->sfdo;
+	if (!sfdo) {
+		return;
+	}
+
+	/* Redrawn with every title change, so hits must not allocate */
+	bool found;
+	char buf[256];
+	char *key = icon_cache_key(buf, sizeof(buf), "icon", icon_name, size,
+		scale);
+	cairo_surface_t *icon = icon_cache_lookup(sfdo, key, &found);
+	if (!found) {
+		icon = queue_icon_load(panel, icon_cache_key_steal(key, buf),
+			NULL, icon_name, NULL, size, scale);
+	} else if (key != buf) {
+		g_free(key);
+	}
+	paint_icon(cairo, panel, icon, scale);
 }
 
 void
@@ -365,18 +858,38 @@ desktop_entry_load_icon_from_app_id(cairo_t *cairo, struct panel *panel, const c
 		return;
 	}
 
-	const char *icon_name = NULL;
-	struct sfdo_desktop_entry *entry = get_desktop_entry(sfdo, app_id);
-	if (entry) {
-		icon_name = sfdo_desktop_entry_get_icon(entry, NULL);
+	bool found;
+	char buf[256];
+	char *key = icon_cache_key(buf, sizeof(buf), "app", app_id, size,
+		scale);
+	cairo_surface_t *icon = icon_cache_lookup(sfdo, key, &found);
+	if (found) {
+		if (key != buf) {
+			g_free(key);
+		}
+		paint_icon(cairo, panel, icon, scale);
+		return;
 	}
 
-	desktop_entry_load_icon(cairo, panel, icon_name, size, scale);
+	key = icon_cache_key_steal(key, buf);
+	const struct desktop_app *entry = get_desktop_entry(sfdo, app_id);
+	if (!entry || string_null_or_empty(entry->icon)) {
+		/* Nothing to load */
+		g_hash_table_insert(sfdo->icon_cache, key, NULL);
+	} else if (entry->icon_path && size == DESKTOP_ICON_SIZE && scale == 1.0f) {
+		/* Resolved ahead of time, so no icon theme lookup needed */
+		icon = queue_icon_load(panel, key, app_id, NULL,
+			entry->icon_path, size, scale);
+	} else {
+		icon = queue_icon_load(panel, key, app_id, entry->icon, NULL,
+			size, scale);
+	}
 	// TODO
 	// if (above failed) {
 	// 	/* Icon not defined in .desktop file or could not be loaded */
-	// 	desktop_entry_load_icon(cairo, app_id, size, scale);
+	// 	icon = load_icon(panel, app_id, size, scale);
 	// }
+	paint_icon(cairo, panel, icon, scale);
 }
 
 const char *
@@ -391,16 +904,406 @@ desktop_entry_name_lookup(struct panel *panel, const char *app_id)
 		return NULL;
 	}
 
-	struct sfdo_desktop_entry *entry = get_desktop_entry(sfdo, app_id);
-	if (!entry) {
+	const struct desktop_app *entry = get_desktop_entry(sfdo, app_id);
+	if (!entry || string_null_or_empty(entry->name)) {
 		return NULL;
 	}
 
-	size_t len;
-	const char *name = sfdo_desktop_entry_get_name(entry, &len);
-	if (!len) {
-		return NULL;
+	return entry->name;
+}
+
+/* ------------------------------- Live reload ------------------------------ */
+
+enum watch_kind {
+	WATCH_PARENT = 1, /* ancestor of a missing dir */
+	WATCH_APPS,
+	WATCH_ICONS,
+};
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+	| IN_CLOSE_WRITE | IN_DELETE_SELF | IN_ONLYDIR)
+#define WATCH_PARENT_MASK (IN_CREATE | IN_MOVED_TO | IN_ONLYDIR)
+
+struct watch_dir {
+	char *path;
+	enum watch_kind kind;
+	int wd; /* -1 while the dir does not exist */
+};
+
+static int
+add_watch(struct sfdo *sfdo, int fd, const char *path, uint32_t mask,
+		enum watch_kind kind)
+{
+	int wd = inotify_add_watch(fd, path, mask);
+	if (wd < 0) {
+		if (errno != ENOENT && errno != ENOTDIR) {
+			warn("cannot watch %s: %s", path, strerror(errno));
+		}
+		return -1;
+	}
+	/* A dir may be both watched itself and the parent of a missing one */
+	gpointer old = g_hash_table_lookup(sfdo->watches, GINT_TO_POINTER(wd));
+	if (GPOINTER_TO_INT(old) < (int)kind) {
+		g_hash_table_insert(sfdo->watches, GINT_TO_POINTER(wd),
+			GINT_TO_POINTER(kind));
+	}
+	return wd;
+}
+
+/* Watch the closest existing ancestor of @path so we see it being created */
+static void
+add_parent_watch(struct sfdo *sfdo, int fd, const char *path)
+{
+	char *parent = xstrdup(path);
+	char *slash;
+	while ((slash = strrchr(parent, '/')) && slash != parent) {
+		*slash = '\0';
+		if (add_watch(sfdo, fd, parent, WATCH_PARENT_MASK | IN_MASK_ADD,
+				WATCH_PARENT) >= 0) {
+			break;
+		}
+	}
+	free(parent);
+}
+
+/*
+ * Watch those dirs which are missing, if they exist by now. Returns true
+ * if any did, as their contents are new to us.
+ */
+static bool
+retry_watches(struct sfdo *sfdo, int fd)
+{
+	bool added = false;
+	for (int i = 0; i < sfdo->n_watch_dirs; i++) {
+		struct watch_dir *dir = &sfdo->watch_dirs[i];
+		if (dir->wd >= 0) {
+			continue;
+		}
+		dir->wd = add_watch(sfdo, fd, dir->path, WATCH_MASK, dir->kind);
+		if (dir->wd < 0) {
+			add_parent_watch(sfdo, fd, dir->path);
+			/* It may have been created before the parent watch */
+			dir->wd = add_watch(sfdo, fd, dir->path, WATCH_MASK,
+				dir->kind);
+		}
+		if (dir->wd >= 0) {
+			if (dir->kind == WATCH_APPS) {
+				sfdo->apps_dirty = true;
+			} else {
+				sfdo->icons_dirty = true;
+			}
+			added = true;
+		}
+	}
+	return added;
+}
+
+static void
+want_watch(struct sfdo *sfdo, char *path, enum watch_kind kind)
+{
+	sfdo->watch_dirs = xrealloc(sfdo->watch_dirs,
+		(sfdo->n_watch_dirs + 1) * sizeof(*sfdo->watch_dirs));
+	sfdo->watch_dirs[sfdo->n_watch_dirs++] = (struct watch_dir){
+		.path = path,
+		.kind = kind,
+		.wd = -1,
+	};
+}
+
+/*
+ * Watch the applications dirs and the icon theme roots. Installing icons
+ * writes into theme subdirectories, which are not watched themselves, but
+ * package managers refresh icon-theme.cache in the theme root afterwards.
+ * Dirs which do not exist yet, like ~/.local/share/applications on a fresh
+ * account, are watched for through their closest existing ancestor.
+ * Return the inotify fd for the main loop, or -1.
+ */
+int
+desktop_entry_watch(struct panel *panel)
+{
+	struct sfdo *sfdo = panel->sfdo;
+	if (!sfdo) {
+		return -1;
+	}
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0) {
+		warn("inotify_init1() failed: %s", strerror(errno));
+		return -1;
+	}
+	sfdo->watches = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	size_t n_dirs;
+	const struct sfdo_string *dirs =
+		sfdo_basedir_get_data_dirs(sfdo->basedir_ctx, &n_dirs);
+	for (size_t i = 0; i < n_dirs; i++) {
+		want_watch(sfdo, g_strdup_printf("%sapplications", dirs[i].data),
+			WATCH_APPS);
+		want_watch(sfdo, g_strdup_printf("%sicons", dirs[i].data),
+			WATCH_ICONS);
+		want_watch(sfdo, g_strdup_printf("%sicons/hicolor", dirs[i].data),
+			WATCH_ICONS);
+		want_watch(sfdo, g_strdup_printf("%sicons/%s", dirs[i].data,
+			ICON_THEME), WATCH_ICONS);
+	}
+	/* What exists now has just been loaded, so it is not new */
+	bool apps_dirty = sfdo->apps_dirty, icons_dirty = sfdo->icons_dirty;
+	retry_watches(sfdo, fd);
+	sfdo->apps_dirty = apps_dirty;
+	sfdo->icons_dirty = icons_dirty;
+	return fd;
+}
+
+static void
+free_watches(struct sfdo *sfdo)
+{
+	if (sfdo->watches) {
+		g_hash_table_destroy(sfdo->watches);
+	}
+	for (int i = 0; i < sfdo->n_watch_dirs; i++) {
+		g_free(sfdo->watch_dirs[i].path);
+	}
+	free(sfdo->watch_dirs);
+}
+
+/* A watched dir was deleted or moved away, so wait for it to come back */
+static void
+forget_watch(struct sfdo *sfdo, int wd)
+{
+	g_hash_table_remove(sfdo->watches, GINT_TO_POINTER(wd));
+	for (int i = 0; i < sfdo->n_watch_dirs; i++) {
+		if (sfdo->watch_dirs[i].wd == wd) {
+			sfdo->watch_dirs[i].wd = -1;
+		}
+	}
+}
+
+/*
+ * Drain pending inotify events. Returns true if any of them warrants a
+ * reload, which the caller is expected to debounce.
+ */
+bool
+desktop_entry_handle_watch(struct panel *panel, int fd)
+{
+	struct sfdo *sfdo = panel->sfdo;
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	bool changed = false, retry = false;
+
+	for (;;) {
+		ssize_t len = read(fd, buf, sizeof(buf));
+		if (len <= 0) {
+			break;
+		}
+		for (char *p = buf; p < buf + len;) {
+			struct inotify_event *event = (struct inotify_event *)p;
+			p += sizeof(*event) + event->len;
+
+			if (event->mask & IN_Q_OVERFLOW) {
+				sfdo->apps_dirty = sfdo->icons_dirty = true;
+				changed = true;
+				retry = true;
+				continue;
+			}
+			enum watch_kind kind = GPOINTER_TO_INT(g_hash_table_lookup(
+				sfdo->watches, GINT_TO_POINTER(event->wd)));
+			if (event->mask & IN_IGNORED) {
+				forget_watch(sfdo, event->wd);
+				retry = true;
+			}
+			if ((event->mask & (IN_CREATE | IN_MOVED_TO))
+					&& (event->mask & IN_ISDIR)) {
+				retry = true;
+			}
+			if (kind == WATCH_APPS) {
+				if (event->len && !g_str_has_suffix(event->name, ".desktop")
+						&& !(event->mask & IN_ISDIR)) {
+					continue;
+				}
+				sfdo->apps_dirty = true;
+				changed = true;
+			} else if (kind == WATCH_ICONS) {
+				sfdo->icons_dirty = true;
+				changed = true;
+			}
+		}
+	}
+	if (retry && retry_watches(sfdo, fd)) {
+		changed = true;
+	}
+	return changed;
+}
+
+static gboolean
+icon_key_has_prefix(gpointer key, gpointer value, gpointer prefix)
+{
+	return g_str_has_prefix(key, prefix);
+}
+
+static gboolean
+icon_entry_is_negative(gpointer key, gpointer value, gpointer data)
+{
+	return !value || g_str_has_prefix(key, "icon:");
+}
+
+/* Whether @a and @b would be drawn with the same icon */
+static bool
+same_icon(const struct desktop_app *a, const struct desktop_app *b)
+{
+	if (!a || !b) {
+		return a == b;
+	}
+	return !g_strcmp0(a->icon, b->icon) && !g_strcmp0(a->icon_path, b->icon_path);
+}
+
+/* Whether @a and @b would show up the same in the start menu */
+static bool
+same_menu_entry(const struct desktop_app *a, const struct desktop_app *b)
+{
+	bool a_shown = a && a->application && !a->no_display && a->exec;
+	bool b_shown = b && b->application && !b->no_display && b->exec;
+	if (!a_shown || !b_shown) {
+		return a_shown == b_shown;
+	}
+	return !g_strcmp0(a->name, b->name) && !g_strcmp0(a->exec, b->exec);
+}
+
+struct reload {
+	struct panel *panel;
+	bool icons_dirty;
+	uint64_t stamp;
+	char *cache_path;
+	struct desktop_apps *apps; /* NULL if the rescan failed */
+};
+
+/* Parse the .desktop files on the worker and update the cache file */
+static void
+reload_rescan(void *data)
+{
+	struct reload *reload = data;
+	struct sfdo *sfdo = reload->panel->sfdo;
+
+	if (reload->icons_dirty && sfdo->icon_theme) {
+		if (!sfdo_icon_theme_rescan(sfdo->icon_theme)) {
+			warn("failed to rescan icon theme");
+		}
+	}
+
+	reload->apps = znew(*reload->apps);
+	if (!rescan_apps(sfdo, reload->apps, reload->stamp)) {
+		zfree(reload->apps);
+		return;
+	}
+	desktop_cache_save(reload->apps, reload->cache_path);
+}
+
+static void reload_done(void *data, bool cancelled);
+
+/*
+ * Re-read the desktop entries after a change on disk. libsfdo can only load
+ * a database as a whole, so the .desktop files are parsed again, but caches
+ * derived from them are only invalidated where an entry actually changed:
+ * decoded icons are kept unless the app_id now resolves to a different icon,
+ * and the start menu list is only rebuilt if a visible entry changed.
+ *
+ * The parsing is done on the worker. Changes that come in meanwhile are
+ * picked up by another reload once it is done.
+ */
+void
+desktop_entry_reload(struct panel *panel)
+{
+	struct sfdo *sfdo = panel->sfdo;
+	if (!sfdo || sfdo->reloading
+			|| (!sfdo->apps_dirty && !sfdo->icons_dirty)) {
+		return;
+	}
+
+	struct reload *reload = znew(*reload);
+	reload->panel = panel;
+	reload->icons_dirty = sfdo->icons_dirty;
+	reload->stamp = current_stamp(sfdo);
+	reload->cache_path = cache_path(sfdo);
+	sfdo->apps_dirty = sfdo->icons_dirty = false;
+	sfdo->reloading = true;
+	worker_submit(panel->worker, reload_rescan, reload_done, reload);
+}
+
+/* Swap in the new entries on the main thread */
+static void
+reload_done(void *data, bool cancelled)
+{
+	struct reload *reload = data;
+	struct panel *panel = reload->panel;
+	struct sfdo *sfdo = panel->sfdo;
+	struct desktop_apps *apps = reload->apps;
+	bool icons_dirty = reload->icons_dirty;
+	g_free(reload->cache_path);
+	free(reload);
+
+	sfdo->reloading = false;
+	if (cancelled) {
+		if (apps) {
+			desktop_apps_finish(apps);
+			free(apps);
+		}
+		return;
+	}
+	if (!apps) {
+		warn("failed to reload desktop entries");
+		return;
+	}
+
+	struct desktop_index *old_index = sfdo->index;
+	struct desktop_apps *old_apps = sfdo->apps;
+	sfdo->index = desktop_index_create(apps);
+	sfdo->apps = apps;
+
+	/* Did any entry as shown in the start menu appear, vanish or change? */
+	bool menu_changed = false;
+	for (size_t i = 0; i < apps->n_apps && !menu_changed; i++) {
+		const struct desktop_app *app = &apps->apps[i];
+		if (!same_menu_entry(app, g_hash_table_lookup(old_index->by_id, app->id))) {
+			menu_changed = true;
+		}
+	}
+	for (size_t i = 0; i < old_apps->n_apps && !menu_changed; i++) {
+		const struct desktop_app *app = &old_apps->apps[i];
+		if (!g_hash_table_contains(sfdo->index->by_id, app->id)
+				&& !same_menu_entry(app, NULL)) {
+			menu_changed = true;
+		}
+	}
+
+	/* Re-resolve every app_id seen so far and drop icons that changed */
+	GHashTableIter iter;
+	gpointer key, value;
+	g_hash_table_iter_init(&iter, old_index->memo);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		const char *app_id = key;
+		const struct desktop_app *entry = get_desktop_entry(sfdo, app_id);
+		if (same_icon(value, entry)) {
+			continue;
+		}
+		debug("icon for '%s' changed", app_id);
+		char *prefix = g_strdup_printf("app:%s|", app_id);
+		g_hash_table_foreach_remove(sfdo->icon_cache,
+			icon_key_has_prefix, prefix);
+		g_free(prefix);
+		plugin_taskbar_invalidate_app_id(panel, app_id);
+	}
+	if (icons_dirty) {
+		/* Icons looked up by name may have appeared or been replaced */
+		g_hash_table_foreach_remove(sfdo->icon_cache,
+			icon_entry_is_negative, NULL);
+	}
+
+	desktop_index_destroy(old_index);
+	desktop_apps_finish(old_apps);
+	free(old_apps);
+
+	info("reloaded %zu desktop entries", apps->n_apps);
+	if (menu_changed) {
+		plugin_startmenu_reload(panel);
 	}
 
-	return name;
+	/* Catch up with changes made while this reload was running */
+	desktop_entry_reload(panel);
 }
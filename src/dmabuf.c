@@ -0,0 +1,529 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Zero-copy thumbnail capture: the compositor copies the window into a GBM
+ * buffer on the GPU, which is then drawn into a small offscreen framebuffer
+ * with a box filter, so only THUMBNAIL_WIDTH-sized pixels are ever read back
+ * into CPU memory.
+ */
+#include <drm_fourcc.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <fcntl.h>
+#include <gbm.h>
+#include <GLES2/gl2.h>
+#include <GLES2/gl2ext.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <wayland-client.h>
+#include <xf86drm.h>
+#include "common/log.h"
+#include "common/mem.h"
+#include "dmabuf.h"
+#include "linux-dmabuf-v1-client-protocol.h"
+
+/* Taps per axis and output pixel, each one a bilinear sample */
+#define BOX_TAPS 4
+#define MAX_PLANES 4
+
+struct dmabuf {
+	struct zwp_linux_dmabuf_v1 *linux_dmabuf;
+	dev_t device;
+	int drm_fd;
+	struct gbm_device *gbm;
+
+	EGLDisplay display;
+	EGLContext context;
+	PFNEGLCREATEIMAGEKHRPROC create_image;
+	PFNEGLDESTROYIMAGEKHRPROC destroy_image;
+	PFNGLEGLIMAGETARGETTEXTURE2DOESPROC image_target_texture;
+	bool read_bgra;
+
+	GLuint program;
+	GLint pos_loc;
+	GLint tex_loc;
+	GLint step_loc;
+
+	/* Render target, resized to the thumbnail on demand */
+	GLuint fbo;
+	GLuint fbo_texture;
+	int fbo_width, fbo_height;
+};
+
+static const char vertex_shader[] =
+	"attribute vec2 pos;\n"
+	"varying vec2 uv;\n"
+	"void main() {\n"
+	"	uv = pos * 0.5 + 0.5;\n"
+	"	gl_Position = vec4(pos, 0.0, 1.0);\n"
+	"}\n";
+
+/* Average BOX_TAPS x BOX_TAPS samples spread over one output pixel */
+static const char fragment_shader[] =
+	"precision mediump float;\n"
+	"uniform sampler2D tex;\n"
+	"uniform vec2 step;\n"
+	"varying vec2 uv;\n"
+	"void main() {\n"
+	"	vec4 sum = vec4(0.0);\n"
+	"	for (int y = 0; y < TAPS; y++) {\n"
+	"		for (int x = 0; x < TAPS; x++) {\n"
+	"			vec2 off = vec2(float(x), float(y)) - float(TAPS - 1) * 0.5;\n"
+	"			sum += texture2D(tex, uv + off * step);\n"
+	"		}\n"
+	"	}\n"
+	"	gl_FragColor = sum / float(TAPS * TAPS);\n"
+	"}\n";
+
+static bool
+has_extension(const char *extensions, const char *name)
+{
+	size_t len = strlen(name);
+	for (const char *p = extensions; p && (p = strstr(p, name)); p += len) {
+		if ((p == extensions || p[-1] == ' ')
+				&& (p[len] == ' ' || p[len] == '\0')) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static int
+open_device(dev_t device)
+{
+	drmDevice *drm_device;
+	if (drmGetDeviceFromDevId(device, 0, &drm_device) != 0) {
+		debug("dmabuf: no DRM device for the advertised dev_t");
+		return -1;
+	}
+	const char *path = NULL;
+	if (drm_device->available_nodes & (1 << DRM_NODE_RENDER)) {
+		path = drm_device->nodes[DRM_NODE_RENDER];
+	} else if (drm_device->available_nodes & (1 << DRM_NODE_PRIMARY)) {
+		path = drm_device->nodes[DRM_NODE_PRIMARY];
+	}
+	int fd = path ? open(path, O_RDWR | O_CLOEXEC) : -1;
+	if (path && fd < 0) {
+		debug("dmabuf: cannot open %s", path);
+	}
+	drmFreeDevice(&drm_device);
+	return fd;
+}
+
+static GLuint
+compile_shader(GLenum type, const char *source)
+{
+	char header[64];
+	snprintf(header, sizeof(header), "#define TAPS %d\n", BOX_TAPS);
+	const char *sources[] = {
+		type == GL_FRAGMENT_SHADER ? header : "",
+		source,
+	};
+	GLuint shader = glCreateShader(type);
+	glShaderSource(shader, 2, sources, NULL);
+	glCompileShader(shader);
+	GLint ok;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+	if (!ok) {
+		char log[512];
+		glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+		warn("dmabuf: shader compile failed: %s", log);
+		glDeleteShader(shader);
+		return 0;
+	}
+	return shader;
+}
+
+static bool
+init_program(struct dmabuf *dmabuf)
+{
+	GLuint vs = compile_shader(GL_VERTEX_SHADER, vertex_shader);
+	GLuint fs = compile_shader(GL_FRAGMENT_SHADER, fragment_shader);
+	if (!vs || !fs) {
+		glDeleteShader(vs);
+		glDeleteShader(fs);
+		return false;
+	}
+	dmabuf->program = glCreateProgram();
+	glAttachShader(dmabuf->program, vs);
+	glAttachShader(dmabuf->program, fs);
+	glLinkProgram(dmabuf->program);
+	glDeleteShader(vs);
+	glDeleteShader(fs);
+
+	GLint ok;
+	glGetProgramiv(dmabuf->program, GL_LINK_STATUS, &ok);
+	if (!ok) {
+		warn("dmabuf: shader link failed");
+		return false;
+	}
+	dmabuf->pos_loc = glGetAttribLocation(dmabuf->program, "pos");
+	dmabuf->tex_loc = glGetUniformLocation(dmabuf->program, "tex");
+	dmabuf->step_loc = glGetUniformLocation(dmabuf->program, "step");
+	glGenFramebuffers(1, &dmabuf->fbo);
+	return true;
+}
+
+static bool
+init_egl(struct dmabuf *dmabuf)
+{
+	const char *client_exts = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+	PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+		(void *)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if (!has_extension(client_exts, "EGL_KHR_platform_gbm")
+			|| !get_platform_display) {
+		debug("dmabuf: EGL_KHR_platform_gbm not supported");
+		return false;
+	}
+	dmabuf->display = get_platform_display(EGL_PLATFORM_GBM_KHR,
+		dmabuf->gbm, NULL);
+	if (dmabuf->display == EGL_NO_DISPLAY
+			|| !eglInitialize(dmabuf->display, NULL, NULL)) {
+		debug("dmabuf: cannot initialize EGL display");
+		dmabuf->display = EGL_NO_DISPLAY;
+		return false;
+	}
+
+	const char *exts = eglQueryString(dmabuf->display, EGL_EXTENSIONS);
+	if (!has_extension(exts, "EGL_EXT_image_dma_buf_import")
+			|| !has_extension(exts, "EGL_EXT_image_dma_buf_import_modifiers")
+			|| !has_extension(exts, "EGL_KHR_surfaceless_context")
+			|| !has_extension(exts, "EGL_KHR_no_config_context")) {
+		debug("dmabuf: required EGL extensions missing");
+		return false;
+	}
+	dmabuf->create_image = (void *)eglGetProcAddress("eglCreateImageKHR");
+	dmabuf->destroy_image = (void *)eglGetProcAddress("eglDestroyImageKHR");
+	dmabuf->image_target_texture =
+		(void *)eglGetProcAddress("glEGLImageTargetTexture2DOES");
+	if (!dmabuf->create_image || !dmabuf->destroy_image
+			|| !dmabuf->image_target_texture) {
+		return false;
+	}
+
+	if (!eglBindAPI(EGL_OPENGL_ES_API)) {
+		return false;
+	}
+	static const EGLint attribs[] = {
+		EGL_CONTEXT_CLIENT_VERSION, 2,
+		EGL_NONE,
+	};
+	dmabuf->context = eglCreateContext(dmabuf->display, EGL_NO_CONFIG_KHR,
+		EGL_NO_CONTEXT, attribs);
+	if (dmabuf->context == EGL_NO_CONTEXT) {
+		debug("dmabuf: cannot create GLES context");
+		return false;
+	}
+	if (!eglMakeCurrent(dmabuf->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+			dmabuf->context)) {
+		debug("dmabuf: cannot make GLES context current");
+		return false;
+	}
+
+	const char *gl_exts = (const char *)glGetString(GL_EXTENSIONS);
+	if (!has_extension(gl_exts, "GL_OES_EGL_image")) {
+		debug("dmabuf: GL_OES_EGL_image not supported");
+		return false;
+	}
+	dmabuf->read_bgra = has_extension(gl_exts, "GL_EXT_read_format_bgra");
+	return init_program(dmabuf);
+}
+
+struct dmabuf *
+dmabuf_create(struct zwp_linux_dmabuf_v1 *linux_dmabuf, dev_t device)
+{
+	struct dmabuf *dmabuf = znew(*dmabuf);
+	dmabuf->linux_dmabuf = linux_dmabuf;
+	dmabuf->device = device;
+	dmabuf->display = EGL_NO_DISPLAY;
+	dmabuf->context = EGL_NO_CONTEXT;
+
+	dmabuf->drm_fd = open_device(device);
+	if (dmabuf->drm_fd < 0) {
+		goto err;
+	}
+	dmabuf->gbm = gbm_create_device(dmabuf->drm_fd);
+	if (!dmabuf->gbm) {
+		debug("dmabuf: cannot create GBM device");
+		goto err;
+	}
+	if (!init_egl(dmabuf)) {
+		goto err;
+	}
+	info("capturing thumbnails via dmabuf");
+	return dmabuf;
+err:
+	dmabuf_destroy(dmabuf);
+	return NULL;
+}
+
+dev_t
+dmabuf_get_device(struct dmabuf *dmabuf)
+{
+	return dmabuf->device;
+}
+
+void
+dmabuf_destroy(struct dmabuf *dmabuf)
+{
+	if (!dmabuf) {
+		return;
+	}
+	if (dmabuf->context != EGL_NO_CONTEXT) {
+		if (dmabuf->program) {
+			glDeleteProgram(dmabuf->program);
+		}
+		if (dmabuf->fbo) {
+			glDeleteFramebuffers(1, &dmabuf->fbo);
+		}
+		if (dmabuf->fbo_texture) {
+			glDeleteTextures(1, &dmabuf->fbo_texture);
+		}
+		eglMakeCurrent(dmabuf->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+			EGL_NO_CONTEXT);
+		eglDestroyContext(dmabuf->display, dmabuf->context);
+	}
+	if (dmabuf->display != EGL_NO_DISPLAY) {
+		eglTerminate(dmabuf->display);
+	}
+	if (dmabuf->gbm) {
+		gbm_device_destroy(dmabuf->gbm);
+	}
+	if (dmabuf->drm_fd >= 0) {
+		close(dmabuf->drm_fd);
+	}
+	free(dmabuf);
+}
+
+static void *
+import_image(struct dmabuf *dmabuf, struct gbm_bo *bo, uint32_t width,
+		uint32_t height, uint32_t format, const int *fds, int n_planes)
+{
+	static const EGLint plane_attribs[MAX_PLANES][5] = {
+		{ EGL_DMA_BUF_PLANE0_FD_EXT, EGL_DMA_BUF_PLANE0_OFFSET_EXT,
+		  EGL_DMA_BUF_PLANE0_PITCH_EXT, EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT,
+		  EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT },
+		{ EGL_DMA_BUF_PLANE1_FD_EXT, EGL_DMA_BUF_PLANE1_OFFSET_EXT,
+		  EGL_DMA_BUF_PLANE1_PITCH_EXT, EGL_DMA_BUF_PLANE1_MODIFIER_LO_EXT,
+		  EGL_DMA_BUF_PLANE1_MODIFIER_HI_EXT },
+		{ EGL_DMA_BUF_PLANE2_FD_EXT, EGL_DMA_BUF_PLANE2_OFFSET_EXT,
+		  EGL_DMA_BUF_PLANE2_PITCH_EXT, EGL_DMA_BUF_PLANE2_MODIFIER_LO_EXT,
+		  EGL_DMA_BUF_PLANE2_MODIFIER_HI_EXT },
+		{ EGL_DMA_BUF_PLANE3_FD_EXT, EGL_DMA_BUF_PLANE3_OFFSET_EXT,
+		  EGL_DMA_BUF_PLANE3_PITCH_EXT, EGL_DMA_BUF_PLANE3_MODIFIER_LO_EXT,
+		  EGL_DMA_BUF_PLANE3_MODIFIER_HI_EXT },
+	};
+
+	uint64_t modifier = gbm_bo_get_modifier(bo);
+	EGLint attribs[7 + MAX_PLANES * 10 + 1];
+	int n = 0;
+	attribs[n++] = EGL_WIDTH;
+	attribs[n++] = width;
+	attribs[n++] = EGL_HEIGHT;
+	attribs[n++] = height;
+	attribs[n++] = EGL_LINUX_DRM_FOURCC_EXT;
+	attribs[n++] = format;
+	for (int i = 0; i < n_planes; i++) {
+		attribs[n++] = plane_attribs[i][0];
+		attribs[n++] = fds[i];
+		attribs[n++] = plane_attribs[i][1];
+		attribs[n++] = gbm_bo_get_offset(bo, i);
+		attribs[n++] = plane_attribs[i][2];
+		attribs[n++] = gbm_bo_get_stride_for_plane(bo, i);
+		if (modifier != DRM_FORMAT_MOD_INVALID) {
+			attribs[n++] = plane_attribs[i][3];
+			attribs[n++] = (EGLint)(modifier & 0xffffffff);
+			attribs[n++] = plane_attribs[i][4];
+			attribs[n++] = (EGLint)(modifier >> 32);
+		}
+	}
+	attribs[n++] = EGL_NONE;
+
+	EGLImageKHR image = dmabuf->create_image(dmabuf->display,
+		EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, attribs);
+	return image == EGL_NO_IMAGE_KHR ? NULL : image;
+}
+
+struct dmabuf_buffer *
+dmabuf_buffer_create(struct dmabuf *dmabuf, uint32_t width, uint32_t height,
+		uint32_t format, const uint64_t *modifiers, size_t n_modifiers)
+{
+	/* A lone DRM_FORMAT_MOD_INVALID means implicit modifiers */
+	bool explicit = n_modifiers > 0
+		&& !(n_modifiers == 1 && modifiers[0] == DRM_FORMAT_MOD_INVALID);
+	struct gbm_bo *bo = explicit
+		? gbm_bo_create_with_modifiers(dmabuf->gbm, width, height,
+			format, modifiers, n_modifiers)
+		: gbm_bo_create(dmabuf->gbm, width, height, format,
+			GBM_BO_USE_RENDERING);
+	if (!bo) {
+		debug("dmabuf: cannot allocate %ux%u buffer", width, height);
+		return NULL;
+	}
+
+	int n_planes = gbm_bo_get_plane_count(bo);
+	if (n_planes < 1 || n_planes > MAX_PLANES) {
+		gbm_bo_destroy(bo);
+		return NULL;
+	}
+
+	struct dmabuf_buffer *buffer = znew(*buffer);
+	buffer->bo = bo;
+	buffer->width = width;
+	buffer->height = height;
+	buffer->format = format;
+
+	int fds[MAX_PLANES];
+	uint64_t modifier = gbm_bo_get_modifier(bo);
+	struct zwp_linux_buffer_params_v1 *params =
+		zwp_linux_dmabuf_v1_create_params(dmabuf->linux_dmabuf);
+	for (int i = 0; i < n_planes; i++) {
+		fds[i] = gbm_bo_get_fd_for_plane(bo, i);
+		if (fds[i] < 0) {
+			for (int j = 0; j < i; j++) {
+				close(fds[j]);
+			}
+			zwp_linux_buffer_params_v1_destroy(params);
+			dmabuf_buffer_destroy(dmabuf, buffer);
+			return NULL;
+		}
+		zwp_linux_buffer_params_v1_add(params, fds[i], i,
+			gbm_bo_get_offset(bo, i), gbm_bo_get_stride_for_plane(bo, i),
+			modifier >> 32, modifier & 0xffffffff);
+	}
+	buffer->buffer = zwp_linux_buffer_params_v1_create_immed(params,
+		width, height, format, 0);
+	zwp_linux_buffer_params_v1_destroy(params);
+
+	buffer->egl_image = import_image(dmabuf, bo, width, height, format,
+		fds, n_planes);
+	for (int i = 0; i < n_planes; i++) {
+		close(fds[i]);
+	}
+	if (!buffer->egl_image) {
+		debug("dmabuf: cannot import buffer into EGL");
+		dmabuf_buffer_destroy(dmabuf, buffer);
+		return NULL;
+	}
+
+	glGenTextures(1, &buffer->texture);
+	glBindTexture(GL_TEXTURE_2D, buffer->texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	dmabuf->image_target_texture(GL_TEXTURE_2D, buffer->egl_image);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	return buffer;
+}
+
+void
+dmabuf_buffer_destroy(struct dmabuf *dmabuf, struct dmabuf_buffer *buffer)
+{
+	if (!buffer) {
+		return;
+	}
+	if (buffer->texture) {
+		glDeleteTextures(1, &buffer->texture);
+	}
+	if (buffer->egl_image) {
+		dmabuf->destroy_image(dmabuf->display, buffer->egl_image);
+	}
+	if (buffer->buffer) {
+		wl_buffer_destroy(buffer->buffer);
+	}
+	gbm_bo_destroy(buffer->bo);
+	free(buffer);
+}
+
+static bool
+resize_target(struct dmabuf *dmabuf, int width, int height)
+{
+	if (dmabuf->fbo_texture && dmabuf->fbo_width == width
+			&& dmabuf->fbo_height == height) {
+		return true;
+	}
+	if (!dmabuf->fbo_texture) {
+		glGenTextures(1, &dmabuf->fbo_texture);
+	}
+	glBindTexture(GL_TEXTURE_2D, dmabuf->fbo_texture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA,
+		GL_UNSIGNED_BYTE, NULL);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, dmabuf->fbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+		GL_TEXTURE_2D, dmabuf->fbo_texture, 0);
+	bool ok = glCheckFramebufferStatus(GL_FRAMEBUFFER)
+		== GL_FRAMEBUFFER_COMPLETE;
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	if (!ok) {
+		warn("dmabuf: incomplete framebuffer");
+		return false;
+	}
+	dmabuf->fbo_width = width;
+	dmabuf->fbo_height = height;
+	return true;
+}
+
+bool
+dmabuf_buffer_scale(struct dmabuf *dmabuf, struct dmabuf_buffer *buffer,
+		cairo_surface_t *image)
+{
+	int width = cairo_image_surface_get_width(image);
+	int height = cairo_image_surface_get_height(image);
+	if (!resize_target(dmabuf, width, height)) {
+		return false;
+	}
+
+	static const GLfloat quad[] = {
+		-1.0f, -1.0f,
+		1.0f, -1.0f,
+		-1.0f, 1.0f,
+		1.0f, 1.0f,
+	};
+
+	glBindFramebuffer(GL_FRAMEBUFFER, dmabuf->fbo);
+	glViewport(0, 0, width, height);
+	glUseProgram(dmabuf->program);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, buffer->texture);
+	glUniform1i(dmabuf->tex_loc, 0);
+	glUniform2f(dmabuf->step_loc, 1.0f / (width * BOX_TAPS),
+		1.0f / (height * BOX_TAPS));
+	glVertexAttribPointer(dmabuf->pos_loc, 2, GL_FLOAT, GL_FALSE, 0, quad);
+	glEnableVertexAttribArray(dmabuf->pos_loc);
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	glDisableVertexAttribArray(dmabuf->pos_loc);
+
+	/*
+	 * Texture row 0 is the top of the window and ends up at the bottom of
+	 * the framebuffer, which is where glReadPixels() starts, so the rows
+	 * come out in cairo order.
+	 */
+	cairo_surface_flush(image);
+	unsigned char *data = cairo_image_surface_get_data(image);
+	int stride = cairo_image_surface_get_stride(image);
+	GLenum read_format = dmabuf->read_bgra ? GL_BGRA_EXT : GL_RGBA;
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	for (int y = 0; y < height; y++) {
+		glReadPixels(0, y, width, 1, read_format, GL_UNSIGNED_BYTE,
+			data + (size_t)y * stride);
+	}
+	if (!dmabuf->read_bgra) {
+		/* Cairo wants BGRA in memory, swap red and blue */
+		for (int y = 0; y < height; y++) {
+			unsigned char *p = data + (size_t)y * stride;
+			for (int x = 0; x < width; x++, p += 4) {
+				unsigned char r = p[0];
+				p[0] = p[2];
+				p[2] = r;
+			}
+		}
+	}
+	cairo_surface_mark_dirty(image);
+
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	return glGetError() == GL_NO_ERROR;
+}
@@ -0,0 +1,191 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Launch history for start menu ranking. The file has one line per desktop
+ * entry, "<count> <time of last launch> <desktop ID>", where the count was
+ * last decayed at that time. It is small and only written on launch, so it
+ * is simply rewritten in full.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <glib.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "common/buf.h"
+#include "common/log.h"
+#include "common/mem.h"
+#include "frecency.h"
+#include "worker.h"
+
+struct launches {
+	double count;
+	int64_t last; /* time of the last launch */
+};
+
+struct frecency {
+	char *path;
+	GHashTable *table; /* desktop ID -> struct launches */
+};
+
+static char *
+history_path(void)
+{
+	const char *state_home = getenv("XDG_STATE_HOME");
+	if (state_home && *state_home) {
+		return g_build_filename(state_home, "t2play", "launches", NULL);
+	}
+	const char *home = getenv("HOME");
+	if (!home) {
+		return NULL;
+	}
+	return g_build_filename(home, ".local", "state", "t2play", "launches",
+		NULL);
+}
+
+static double
+decay(const struct launches *l, time_t now)
+{
+	double age = MAX(now - l->last, 0);
+	return l->count * exp2(-age / FRECENCY_HALF_LIFE);
+}
+
+struct frecency *
+frecency_load(void)
+{
+	struct frecency *frecency = znew(*frecency);
+	frecency->path = history_path();
+	frecency->table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+		g_free);
+	if (!frecency->path) {
+		return frecency;
+	}
+
+	FILE *f = fopen(frecency->path, "r");
+	if (!f) {
+		if (errno != ENOENT) {
+			warn("cannot open %s: %s", frecency->path,
+				strerror(errno));
+		}
+		return frecency;
+	}
+	char line[512];
+	while (fgets(line, sizeof(line), f)) {
+		struct launches l;
+		char id[256];
+		if (sscanf(line, "%lf %" SCNd64 " %255s", &l.count, &l.last,
+				id) != 3 || !(l.count > 0)) {
+			continue;
+		}
+		struct launches *copy = g_new(struct launches, 1);
+		*copy = l;
+		g_hash_table_insert(frecency->table, g_strdup(id), copy);
+	}
+	fclose(f);
+	debug("loaded %u launch counts from %s",
+		g_hash_table_size(frecency->table), frecency->path);
+	return frecency;
+}
+
+void
+frecency_destroy(struct frecency *frecency)
+{
+	if (!frecency) {
+		return;
+	}
+	g_hash_table_destroy(frecency->table);
+	g_free(frecency->path);
+	free(frecency);
+}
+
+double
+frecency_get(struct frecency *frecency, const char *id, time_t now)
+{
+	const struct launches *l = id
+		? g_hash_table_lookup(frecency->table, id) : NULL;
+	return l ? decay(l, now) : 0;
+}
+
+struct save {
+	char *path;
+	struct buf contents;
+};
+
+/* Write the history atomically via a temporary file and rename() */
+static void
+save_write(void *data)
+{
+	struct save *save = data;
+	char *dir = g_path_get_dirname(save->path);
+	g_mkdir_with_parents(dir, 0700);
+	g_free(dir);
+
+	char *tmp = g_strconcat(save->path, ".tmp", NULL);
+	FILE *f = fopen(tmp, "w");
+	if (!f) {
+		warn("cannot create %s: %s", tmp, strerror(errno));
+		g_free(tmp);
+		return;
+	}
+	fwrite(save->contents.data, 1, save->contents.len, f);
+	if (fclose(f) != 0 || rename(tmp, save->path) < 0) {
+		warn("cannot save %s: %s", save->path, strerror(errno));
+		unlink(tmp);
+	}
+	g_free(tmp);
+}
+
+static void
+save_done(void *data, bool cancelled)
+{
+	struct save *save = data;
+	g_free(save->path);
+	buf_reset(&save->contents);
+	free(save);
+}
+
+/*
+ * The table is formatted here, so the worker only does the file I/O, which
+ * would otherwise hold up the click that launched the app.
+ */
+static void
+save(struct frecency *frecency, struct worker *worker)
+{
+	struct save *save = znew(*save);
+	save->path = g_strdup(frecency->path);
+
+	GHashTableIter iter;
+	gpointer key, value;
+	g_hash_table_iter_init(&iter, frecency->table);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		const struct launches *l = value;
+		char line[512];
+		int len = snprintf(line, sizeof(line), "%g %" PRId64 " %s\n",
+			l->count, l->last, (const char *)key);
+		if (len > 0 && (size_t)len < sizeof(line)) {
+			buf_add(&save->contents, line, len);
+		}
+	}
+	worker_submit(worker, save_write, save_done, save);
+}
+
+void
+frecency_record(struct frecency *frecency, struct worker *worker,
+		const char *id, time_t now)
+{
+	if (!id || strchr(id, ' ')) {
+		return;
+	}
+	struct launches *l = g_hash_table_lookup(frecency->table, id);
+	if (!l) {
+		l = g_new0(struct launches, 1);
+		g_hash_table_insert(frecency->table, g_strdup(id), l);
+	}
+	l->count = decay(l, now) + 1;
+	l->last = now;
+	if (frecency->path) {
+		save(frecency, worker);
+	}
+}
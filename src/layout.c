@@ -0,0 +1,501 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "common/box.h"
+#include "common/hash.h"
+#include "common/mem.h"
+#include "conf.h"
+#include "layout.h"
+#include "panel.h"
+#include "stats.h"
+
+struct layout {
+	uint64_t key; /* of the inputs of the last layout */
+	struct layout_item *items;
+	struct widget **widgets; /* of items[] */
+	size_t cap;
+	struct layout_hit *hits; /* left to right, not overlapping */
+	size_t n_hits;
+	struct layout_hit *prev; /* @hits before the last layout */
+	size_t n_prev;
+};
+
+static int
+clamp_width(const struct layout_item *item, int width)
+{
+	if (item->max_width && width > item->max_width) {
+		width = item->max_width;
+	}
+	return width < item->min_width ? item->min_width : width;
+}
+
+/* Share @extra out by grow weight, without exceeding max_width */
+static void
+grow_row(struct layout_item *items, size_t n, int extra)
+{
+	while (extra > 0) {
+		int weights = 0;
+		for (size_t i = 0; i < n; i++) {
+			if (items[i].grow && clamp_width(&items[i],
+					items[i].width + 1) > items[i].width) {
+				weights += items[i].grow;
+			}
+		}
+		if (!weights) {
+			return;
+		}
+		int given = 0;
+		for (size_t i = 0; i < n && given < extra; i++) {
+			struct layout_item *item = &items[i];
+			if (!item->grow || clamp_width(item, item->width + 1)
+					== item->width) {
+				continue;
+			}
+			/* Round up so that the remainder is not lost */
+			int share = (extra * item->grow + weights - 1) / weights;
+			share = MIN(share, extra - given);
+			int width = clamp_width(item, item->width + share);
+			given += width - item->width;
+			item->width = width;
+		}
+		extra -= given;
+	}
+}
+
+/*
+ * Take @missing away from shrinkable items by lowering a common cap on
+ * their width, so the widest give way first and the rest stay as they are.
+ */
+static void
+shrink_row(struct layout_item *items, size_t n, int missing)
+{
+	int widest = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (items[i].shrink) {
+			widest = MAX(widest, items[i].width);
+		}
+	}
+
+	/* Find the highest cap that saves enough */
+	int lo = 0, hi = widest;
+	while (lo < hi) {
+		int cap = lo + (hi - lo + 1) / 2;
+		int saved = 0;
+		for (size_t i = 0; i < n; i++) {
+			if (items[i].shrink && items[i].width > cap) {
+				saved += items[i].width
+					- MAX(cap, items[i].min_width);
+			}
+		}
+		if (saved >= missing) {
+			lo = cap;
+		} else {
+			hi = cap - 1;
+		}
+	}
+
+	int saved = 0;
+	for (size_t i = 0; i < n; i++) {
+		struct layout_item *item = &items[i];
+		if (item->shrink && item->width > lo) {
+			int width = MAX(lo, item->min_width);
+			saved += item->width - width;
+			item->width = width;
+		}
+	}
+	/* The cap is in whole pixels, so it may have saved a bit too much */
+	for (size_t i = 0; i < n && saved > missing; i++) {
+		struct layout_item *item = &items[i];
+		if (item->shrink && item->width == lo
+				&& clamp_width(item, item->width + 1) > item->width) {
+			item->width++;
+			saved--;
+		}
+	}
+}
+
+void
+layout_row(struct layout_item *items, size_t n, int available, int spacing)
+{
+	int used = n ? (int)(n - 1) * spacing : 0;
+	for (size_t i = 0; i < n; i++) {
+		items[i].width = clamp_width(&items[i], items[i].natural);
+		used += items[i].width;
+	}
+	if (used < available) {
+		grow_row(items, n, available - used);
+	} else if (used > available) {
+		shrink_row(items, n, used - available);
+	}
+}
+
+/* Widgets that stretch are measured by their hints, the rest as drawn */
+static void
+measure(struct widget *widget, struct layout_item *item)
+{
+	bool flexible = widget->grow || widget->shrink;
+	*item = (struct layout_item){
+		.natural = flexible ? widget->natural_width : widget->box.width,
+		.min_width = widget->min_width,
+		.max_width = widget->max_width,
+		.grow = widget->grow,
+		.shrink = widget->shrink,
+	};
+}
+
+/*
+ * Task buttons go on the bar of the output their window is on. Windows on
+ * outputs without a bar, or that the compositor has not placed yet, are
+ * shown everywhere.
+ */
+static bool
+shown_on(struct widget *widget, struct bar *bar)
+{
+	if (widget->type != WIDGET_TOPLEVEL) {
+		return true;
+	}
+	struct toplevel *toplevel = toplevel_from_widget(widget);
+	if (toplevel_on_output(toplevel, bar->output)) {
+		return true;
+	}
+	struct bar *other;
+	wl_list_for_each(other, &bar->panel->bars, link) {
+		if (toplevel_on_output(toplevel, other->output)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static uint64_t
+layout_key(struct bar *bar)
+{
+	struct panel *panel = bar->panel;
+	uint64_t key = hash_u64(HASH_INIT, bar->box.width);
+	key = hash_u64(key, bar->box.height);
+	key = hash_u64(key, panel->conf->taskbar_spacing);
+	struct widget *widget;
+	wl_list_for_each(widget, &panel->widgets, link) {
+		struct layout_item item;
+		measure(widget, &item);
+		key = hash_u64(key, (uintptr_t)widget);
+		key = hash_u64(key, widget->surface != NULL);
+		key = hash_u64(key, shown_on(widget, bar));
+		key = hash_u64(key, widget->box.y);
+		key = hash_u64(key, widget->box.height);
+		key = hash_bytes(key, &item, sizeof(item));
+	}
+	return key;
+}
+
+static void
+reserve(struct layout *layout, size_t n)
+{
+	if (n <= layout->cap) {
+		return;
+	}
+	layout->cap = MAX(n, 2 * layout->cap);
+	layout->items = xrealloc(layout->items,
+		layout->cap * sizeof(*layout->items));
+	layout->widgets = xrealloc(layout->widgets,
+		layout->cap * sizeof(*layout->widgets));
+	layout->hits = xrealloc(layout->hits,
+		layout->cap * sizeof(*layout->hits));
+	layout->prev = xrealloc(layout->prev,
+		layout->cap * sizeof(*layout->prev));
+}
+
+static void
+add_hit(struct layout *layout, struct widget *widget, struct box box)
+{
+	if (box_empty(&box)) {
+		return;
+	}
+	layout->hits[layout->n_hits++] = (struct layout_hit){
+		.box = box,
+		.widget = widget,
+	};
+}
+
+/* Lay out the task buttons of @bar within @taskbar and add them to the hits */
+static void
+arrange_taskbar(struct bar *bar, const struct box *taskbar)
+{
+	struct panel *panel = bar->panel;
+	struct layout *layout = bar->layout;
+	size_t n = 0;
+	struct widget *widget;
+	wl_list_for_each(widget, &panel->widgets, link) {
+		/* Buttons are only measured once they have been drawn */
+		if (widget->type != WIDGET_TOPLEVEL || !widget->surface
+				|| !shown_on(widget, bar)) {
+			continue;
+		}
+		measure(widget, &layout->items[n]);
+		layout->widgets[n++] = widget;
+	}
+
+	int spacing = panel->conf->taskbar_spacing;
+	int end = taskbar->x + taskbar->width;
+	layout_row(layout->items, n, taskbar->width, spacing);
+	int x = taskbar->x;
+	for (size_t i = 0; i < n; i++) {
+		widget = layout->widgets[i];
+		int width = layout->items[i].width;
+		if (x + width > end) {
+			/* Even at their minimum width, not all buttons fit */
+			break;
+		}
+		add_hit(layout, widget, (struct box){
+			.x = x,
+			.y = widget->box.y,
+			.width = width,
+			.height = widget->box.height,
+		});
+		x += width + spacing;
+	}
+}
+
+/* Damage whatever is not where it was before the last layout */
+static void
+damage_moved(struct bar *bar)
+{
+	struct layout *layout = bar->layout;
+	size_t n = MAX(layout->n_hits, layout->n_prev);
+	for (size_t i = 0; i < n; i++) {
+		struct layout_hit *old = i < layout->n_prev
+			? &layout->prev[i] : NULL;
+		struct layout_hit *hit = i < layout->n_hits
+			? &layout->hits[i] : NULL;
+		if (old && hit && old->widget == hit->widget
+				&& box_equal(&old->box, &hit->box)) {
+			hit->generation = old->generation;
+			continue;
+		}
+		if (old) {
+			bar_damage_box(bar, &old->box);
+		}
+		if (hit) {
+			bar_damage_box(bar, &hit->box);
+			hit->generation = hit->widget->generation;
+		}
+	}
+}
+
+static void
+arrange_bar(struct bar *bar)
+{
+	struct panel *panel = bar->panel;
+	struct layout *layout = bar->layout;
+	reserve(layout, wl_list_length(&panel->widgets));
+
+	struct layout_hit *prev = layout->prev;
+	layout->prev = layout->hits;
+	layout->n_prev = layout->n_hits;
+	layout->hits = prev;
+	layout->n_hits = 0;
+
+	/* The plugins across the whole bar */
+	size_t n = 0;
+	struct widget *widget;
+	wl_list_for_each(widget, &panel->widgets, link) {
+		if (!widget_is_plugin(widget)) {
+			continue;
+		}
+		measure(widget, &layout->items[n]);
+		layout->widgets[n++] = widget;
+	}
+	layout_row(layout->items, n, bar->box.width, 0);
+
+	/*
+	 * Hits go left to right, with the task buttons in place of the
+	 * taskbar. layout->items[] is reused for those, so keep the plugins.
+	 */
+	struct layout_hit *plugins = arena_alloc(&panel->frame_arena,
+		n * sizeof(*plugins));
+	int x = 0;
+	for (size_t i = 0; i < n; i++) {
+		plugins[i] = (struct layout_hit){
+			.box = {
+				.x = x,
+				.width = layout->items[i].width,
+				.height = bar->box.height,
+			},
+			.widget = layout->widgets[i],
+		};
+		x += layout->items[i].width;
+	}
+	for (size_t i = 0; i < n; i++) {
+		if (plugins[i].widget->type == WIDGET_TASKBAR) {
+			arrange_taskbar(bar, &plugins[i].box);
+		} else if (plugins[i].widget->surface) {
+			add_hit(layout, plugins[i].widget, plugins[i].box);
+		}
+	}
+
+	damage_moved(bar);
+}
+
+static void
+set_width(struct widget *widget, int width)
+{
+	if (widget->box.width == width) {
+		return;
+	}
+	widget->box.width = width;
+	if (widget->impl && widget->impl->on_resize) {
+		widget->impl->on_resize(widget);
+	}
+}
+
+/*
+ * Draw each task button at the narrowest width it got on any bar, so that
+ * one surface fits all of them. Buttons that are not shown anywhere keep
+ * their surface, but get a width of 0.
+ */
+static void
+resize_buttons(struct panel *panel)
+{
+	struct widget *widget;
+	wl_list_for_each(widget, &panel->widgets, link) {
+		if (widget->type != WIDGET_TOPLEVEL) {
+			continue;
+		}
+		int width = INT_MAX;
+		struct bar *bar;
+		wl_list_for_each(bar, &panel->bars, link) {
+			struct box box;
+			if (layout_widget_box(bar, widget, &box)) {
+				width = MIN(width, box.width);
+			}
+		}
+		set_width(widget, width == INT_MAX ? 0 : width);
+	}
+}
+
+/* Damage the widgets that have been redrawn since they were last damaged */
+static void
+damage_redrawn(struct bar *bar)
+{
+	struct layout *layout = bar->layout;
+	for (size_t i = 0; i < layout->n_hits; i++) {
+		struct layout_hit *hit = &layout->hits[i];
+		if (hit->widget && hit->generation != hit->widget->generation) {
+			bar_damage_box(bar, &hit->box);
+			hit->generation = hit->widget->generation;
+		}
+	}
+}
+
+void
+layout_update(struct panel *panel)
+{
+	bool changed = false;
+	struct bar *bar;
+	wl_list_for_each(bar, &panel->bars, link) {
+		if (!bar->layout) {
+			bar->layout = znew(*bar->layout);
+		}
+		uint64_t key = layout_key(bar);
+		if (key == bar->layout->key) {
+			continue;
+		}
+		stats.layouts++;
+		arrange_bar(bar);
+		/* on_resize handlers can change the hints, which is fine next time */
+		bar->layout->key = key;
+		changed = true;
+	}
+	if (changed) {
+		resize_buttons(panel);
+	}
+	wl_list_for_each(bar, &panel->bars, link) {
+		damage_redrawn(bar);
+	}
+}
+
+void
+layout_destroy(struct bar *bar)
+{
+	struct layout *layout = bar->layout;
+	if (!layout) {
+		return;
+	}
+	free(layout->items);
+	free(layout->widgets);
+	free(layout->hits);
+	free(layout->prev);
+	zfree(bar->layout);
+}
+
+const struct layout_hit *
+layout_hits(struct bar *bar, size_t *n)
+{
+	struct layout *layout = bar->layout;
+	*n = layout ? layout->n_hits : 0;
+	return layout ? layout->hits : NULL;
+}
+
+static int
+hit_cmp(const void *key, const void *element)
+{
+	int x = *(const int *)key;
+	const struct layout_hit *hit = element;
+	if (x < hit->box.x) {
+		return -1;
+	}
+	return x >= hit->box.x + hit->box.width;
+}
+
+struct widget *
+layout_widget_at(struct bar *bar, int x, int y)
+{
+	size_t n;
+	const struct layout_hit *hits = layout_hits(bar, &n);
+	if (!n) {
+		return NULL;
+	}
+	const struct layout_hit *hit = bsearch(&x, hits, n, sizeof(*hits),
+		hit_cmp);
+	if (!hit || !box_contains_point(&hit->box, x, y)) {
+		return NULL;
+	}
+	return hit->widget;
+}
+
+bool
+layout_widget_box(struct bar *bar, struct widget *widget, struct box *box)
+{
+	size_t n;
+	const struct layout_hit *hits = layout_hits(bar, &n);
+	for (size_t i = 0; i < n; i++) {
+		if (hits[i].widget == widget && !box_empty(&hits[i].box)) {
+			*box = hits[i].box;
+			return true;
+		}
+	}
+	return false;
+}
+
+void
+layout_forget(struct panel *panel, struct widget *widget)
+{
+	struct bar *bar;
+	wl_list_for_each(bar, &panel->bars, link) {
+		struct layout *layout = bar->layout;
+		if (!layout) {
+			continue;
+		}
+		for (size_t i = 0; i < layout->n_hits; i++) {
+			struct layout_hit *hit = &layout->hits[i];
+			if (hit->widget == widget) {
+				bar_damage_box(bar, &hit->box);
+				hit->widget = NULL;
+				hit->box.width = 0;
+			}
+		}
+		/* Its address may be reused by a new widget */
+		layout->key = 0;
+	}
+}
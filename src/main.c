@@ -16,7 +16,6 @@
 #endif
 #include <sys/signalfd.h>
 #include <sys/stat.h>
-#include <sys/timerfd.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
@@ -26,15 +25,31 @@
 #include "ext-foreign-toplevel-list-v1-client-protocol.h"
 #include "ext-image-capture-source-v1-client-protocol.h"
 #include "ext-image-copy-capture-v1-client-protocol.h"
+#include "linux-dmabuf-v1-client-protocol.h"
 #include "wlr-foreign-toplevel-management-unstable-v1-client-protocol.h"
 #include "wlr-layer-shell-unstable-v1-client-protocol.h"
 #include "xdg-shell-client-protocol.h"
 #include "conf.h"
+#include "config.h"
+#include "common/atlas.h"
 #include "common/box.h"
+#include "common/intern.h"
 #include "common/log.h"
 #include "common/mem.h"
 #include "desktop-entry.h"
+#include "layout.h"
 #include "panel.h"
+#include "stats.h"
+#include "timer.h"
+#include "worker.h"
+
+/* Interval of the stats summary logged with --debug */
+#define STATS_INTERVAL_S 60
+#define STATS_SLACK_MS 5000
+
+/* Quiet period after the last .desktop/icon change before reloading */
+#define RELOAD_DELAY_MS 500
+#define RELOAD_SLACK_MS 100
 
 static void
 init_plugins(struct panel *panel)
@@ -59,64 +74,44 @@ init_plugins(struct panel *panel)
 	}
 }
 
+/* Redraw any widget whose content key no longer matches its surface */
 static void
-update_widget_positions(struct panel *panel)
+update_widgets(struct panel *panel)
 {
-	struct widget *widget, *taskbar = NULL;
-
-	/* Start by working out the width of the taskbar (the expandable widget) */
-	wl_list_for_each(widget, &panel->widgets, link) {
-		if (widget->type == WIDGET_TASKBAR) {
-			taskbar = widget;
-			break;
-		}
-	}
+	plugin_clock_update(panel);
+	plugin_startmenu_update(panel);
+	plugin_kbdlayout_update(panel);
+	plugin_battery_update(panel);
+	plugin_taskbar_update(panel);
+}
 
-	if (taskbar) {
-		int width_left_for_expandable_widget = panel->box.width;
-		wl_list_for_each(widget, &panel->widgets, link) {
-			if (!widget_is_plugin(widget)) {
-				continue;
-			}
-			/* For the time being, only the taskbar can be expandable */
-			if (widget == taskbar) {
-				continue;
-			}
-			width_left_for_expandable_widget -= widget->box.width;
-		}
-		taskbar->box.width = width_left_for_expandable_widget;
-	}
+static cairo_rectangle_int_t
+box_to_rect(const struct box *box)
+{
+	return (cairo_rectangle_int_t){
+		.x = box->x,
+		.y = box->y,
+		.width = box->width,
+		.height = box->height,
+	};
+}
 
-	/* Set plugin x-positions */
-	int x = 0;
-	wl_list_for_each(widget, &panel->widgets, link) {
-		if (!widget_is_plugin(widget)) {
-			continue;
-		}
-		widget->box.x = x;
-		widget->box.y = 0;
-		widget->box.height = panel->box.height;
-		x += widget->box.width;
-	}
-
-	/* Set taskbar toplevel x-positions */
-	if (taskbar) {
-		// TODO: Set toplevel widths more intelligently
-		int spacing = panel->conf->taskbar_spacing;
-		x = taskbar->box.x;
-		wl_list_for_each(widget, &panel->widgets, link) {
-			if (widget->type != WIDGET_TOPLEVEL) {
-				continue;
-			}
-			widget->box.x = x;
-			x += widget->box.width + spacing;
-		}
+void
+bar_damage_box(struct bar *bar, const struct box *box)
+{
+	if (box_empty(box)) {
+		return;
 	}
+	cairo_rectangle_int_t rect = box_to_rect(box);
+	cairo_region_union_rectangle(bar->damage, &rect);
+	bar->dirty = true;
 }
 
 static void
-render_panel(cairo_t *cairo, struct panel *panel)
+render_bar(cairo_t *cairo, struct bar *bar)
 {
+	struct panel *panel = bar->panel;
+
 	// TODO: Create a taskbar->base.surface for this instead
 	/* Draw background */
 	cairo_save(cairo);
@@ -125,17 +120,27 @@ render_panel(cairo_t *cairo, struct panel *panel)
 	cairo_paint(cairo);
 	cairo_restore(cairo);
 
-	/* Render all widgets */
-	struct widget *widget;
-	wl_list_for_each(widget, &panel->widgets, link) {
-		if (!widget->surface) {
-			debug("no wiget surface for %s",
-				widget_type(widget->type));
+	/* Render all widgets on this bar that overlap the damaged area */
+	size_t n;
+	const struct layout_hit *hits = layout_hits(bar, &n);
+	for (size_t i = 0; i < n; i++) {
+		struct widget *widget = hits[i].widget;
+		if (!widget || !widget->surface) {
+			continue;
+		}
+		cairo_rectangle_int_t rect = box_to_rect(&hits[i].box);
+		if (cairo_region_contains_rectangle(bar->damage, &rect)
+				== CAIRO_REGION_OVERLAP_OUT) {
 			continue;
 		}
+		/*
+		 * The surface may be narrower if the widget is shown on other
+		 * bars too, or from before it was resized.
+		 */
 		cairo_save(cairo);
-		cairo_set_source_surface(cairo, widget->surface, widget->box.x,
-			widget->box.y);
+		cairo_rectangle(cairo, rect.x, rect.y, rect.width, rect.height);
+		cairo_clip(cairo);
+		cairo_set_source_surface(cairo, widget->surface, rect.x, rect.y);
 		cairo_paint(cairo);
 		cairo_restore(cairo);
 	}
@@ -143,55 +148,139 @@ render_panel(cairo_t *cairo, struct panel *panel)
 	/* Draw border */
 	cairo_save(cairo);
 	cairo_set_source_u32(cairo, panel->conf->text);
-	cairo_rectangle(cairo, 0, 0, panel->box.width, panel->box.height);
+	cairo_rectangle(cairo, 0, 0, bar->box.width, bar->box.height);
 	cairo_stroke(cairo);
 	cairo_restore(cairo);
 }
 
-void
-render_frame(struct panel *panel)
+static void
+frame_handle_done(void *data, struct wl_callback *callback, uint32_t time)
 {
-	if (!panel->run_display || box_empty(&panel->box)) {
+	struct bar *bar = data;
+	wl_callback_destroy(callback);
+	bar->frame_callback = NULL;
+}
+
+static const struct wl_callback_listener frame_listener = {
+	.done = frame_handle_done,
+};
+
+/*
+ * Draw the damaged parts of @bar and commit them. Only called from the main
+ * loop via panel_flush_frame() so that any number of panel_schedule_frame()
+ * calls end up as a single frame per compositor frame callback.
+ */
+static void
+render_frame(struct bar *bar)
+{
+	struct panel *panel = bar->panel;
+	if (!panel->run_display || box_empty(&bar->box)) {
+		return;
+	}
+
+	uint64_t start = stats_now();
+	uint32_t width = bar->box.width * bar->scale;
+	uint32_t height = bar->box.height * bar->scale;
+	struct pool_buffer *front = bar->current_buffer;
+	if (!front || front->width != width || front->height != height) {
+		bar_damage_box(bar, &bar->box);
+	}
+	if (cairo_region_is_empty(bar->damage)) {
+		bar->dirty = false;
 		return;
 	}
 
-	cairo_surface_t *surface =
-		cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, NULL);
-	cairo_t *cairo = cairo_create(surface);
-	cairo_scale(cairo, panel->scale, panel->scale);
+	/* If all buffers are busy, try again once one is released */
+	struct pool_buffer *buffer = get_next_buffer(panel->shm, &bar->pool,
+		width, height);
+	if (!buffer) {
+		stats.frames_dropped++;
+		return;
+	}
+	buffer_copy_forward(buffer, front);
+
+	/* Damage in buffer coordinates */
+	cairo_region_t *damage = cairo_region_create();
+	int n = cairo_region_num_rectangles(bar->damage);
+	for (int i = 0; i < n; i++) {
+		cairo_rectangle_int_t rect;
+		cairo_region_get_rectangle(bar->damage, i, &rect);
+		rect.x *= bar->scale;
+		rect.y *= bar->scale;
+		rect.width *= bar->scale;
+		rect.height *= bar->scale;
+		cairo_region_union_rectangle(damage, &rect);
+	}
+
+	/*
+	 * Composite straight into the shm buffer, clipped to the damage. The
+	 * background is painted with OPERATOR_SOURCE, so no prior clear is needed.
+	 */
+	cairo_t *cairo = buffer->cairo;
 	cairo_save(cairo);
-	cairo_set_operator(cairo, CAIRO_OPERATOR_CLEAR);
-	cairo_paint(cairo);
+	n = cairo_region_num_rectangles(damage);
+	for (int i = 0; i < n; i++) {
+		cairo_rectangle_int_t rect;
+		cairo_region_get_rectangle(damage, i, &rect);
+		cairo_rectangle(cairo, rect.x, rect.y, rect.width, rect.height);
+		wl_surface_damage_buffer(bar->surface, rect.x, rect.y,
+			rect.width, rect.height);
+	}
+	cairo_clip(cairo);
+	cairo_scale(cairo, bar->scale, bar->scale);
+	render_bar(cairo, bar);
 	cairo_restore(cairo);
+	cairo_surface_flush(buffer->surface);
+
+	wl_surface_set_buffer_scale(bar->surface, bar->scale);
+	wl_surface_attach(bar->surface, buffer->buffer, 0, 0);
+	bar->frame_callback = wl_surface_frame(bar->surface);
+	wl_callback_add_listener(bar->frame_callback, &frame_listener, bar);
+	wl_surface_commit(bar->surface);
+
+	pool_commit_damage(&bar->pool, buffer, damage);
+	cairo_region_destroy(damage);
+	/* Empty it in place rather than making a new region every frame */
+	cairo_region_intersect_rectangle(bar->damage,
+		&(cairo_rectangle_int_t){ 0 });
+	bar->current_buffer = buffer;
+	bar->dirty = false;
+	stats.frames_rendered++;
+	stats_timer_add(&stats.render_frame, start);
+}
 
-	update_widget_positions(panel);
-	render_panel(cairo, panel);
-
-	panel->current_buffer = get_next_buffer(panel->shm, panel->buffers,
-		panel->box.width * panel->scale,
-		panel->box.height * panel->scale);
-	if (!panel->current_buffer) {
-		goto cleanup;
-	}
-
-	cairo_t *shm = panel->current_buffer->cairo;
-	cairo_save(shm);
-	cairo_set_operator(shm, CAIRO_OPERATOR_CLEAR);
-	cairo_paint(shm);
-	cairo_restore(shm);
-	cairo_set_source_surface(shm, surface, 0.0, 0.0);
-	cairo_paint(shm);
-
-	wl_surface_set_buffer_scale(panel->surface, panel->scale);
-	wl_surface_attach(panel->surface, panel->current_buffer->buffer, 0, 0);
-	wl_surface_damage(panel->surface, 0, 0, panel->box.width,
-		panel->box.height);
-	wl_surface_commit(panel->surface);
-	wl_display_roundtrip(panel->display);
+/* Widgets are shared, so any of them changing may show on every bar */
+void
+panel_schedule_frame(struct panel *panel)
+{
+	struct bar *bar;
+	wl_list_for_each(bar, &panel->bars, link) {
+		bar->dirty = true;
+	}
+}
+
+static void
+panel_flush_frame(struct panel *panel)
+{
+	bool dirty = false;
+	struct bar *bar;
+	wl_list_for_each(bar, &panel->bars, link) {
+		dirty |= bar->dirty;
+	}
+	if (!dirty) {
+		return;
+	}
+
+	/* Lays out all bars, so that task buttons get one width for all */
+	layout_update(panel);
 
-cleanup:
-	cairo_surface_destroy(surface);
-	cairo_destroy(cairo);
+	wl_list_for_each(bar, &panel->bars, link) {
+		/* Wait for the compositor to consume the previous frame first */
+		if (bar->dirty && !bar->frame_callback) {
+			render_frame(bar);
+		}
+	}
+	arena_reset(&panel->frame_arena);
 }
 
 static void
@@ -233,19 +322,89 @@ close_pollfd(struct pollfd *pollfd)
 	pollfd->revents = 0;
 }
 
+/*
+ * Widgets are drawn once for all bars, at the largest scale of any of them,
+ * and scaled down when composited onto bars with a smaller one. Redraw them
+ * when that changes.
+ */
+static void
+update_widget_scale(struct panel *panel)
+{
+	int32_t scale = 1;
+	struct bar *bar;
+	wl_list_for_each(bar, &panel->bars, link) {
+		scale = MAX(scale, bar->scale);
+	}
+	if (panel->scale == scale) {
+		return;
+	}
+	debug("drawing widgets at scale %d", scale);
+	panel->scale = scale;
+	/* Otherwise the first configure draws them, or the panel is going */
+	if (panel->run_display && panel->height) {
+		update_widgets(panel);
+		panel_schedule_frame(panel);
+	}
+}
+
+static void
+bar_destroy(struct bar *bar)
+{
+	struct panel *panel = bar->panel;
+
+	/* Popups have to go before the surface they are attached to */
+	if (panel->open_popup && panel->open_popup->bar == bar) {
+		plugin_startmenu_close(panel->open_popup);
+	}
+	if (panel->thumbnail && panel->thumbnail->bar == bar) {
+		panel->hovered_toplevel = NULL;
+		thumbnail_hide(panel);
+	}
+	struct seat *seat;
+	wl_list_for_each(seat, &panel->seats, link) {
+		if (seat->pointer.bar == bar) {
+			seat->pointer.bar = NULL;
+		}
+	}
+
+	if (bar->frame_callback) {
+		wl_callback_destroy(bar->frame_callback);
+	}
+	zwlr_layer_surface_v1_destroy(bar->layer_surface);
+	wl_surface_destroy(bar->surface);
+	pool_finish(&bar->pool);
+	cairo_region_destroy(bar->damage);
+	layout_destroy(bar);
+	bar->output->bar = NULL;
+	wl_list_remove(&bar->link);
+	free(bar);
+	update_widget_scale(panel);
+}
+
+static void
+output_destroy(struct output *output)
+{
+	if (output->bar) {
+		bar_destroy(output->bar);
+	}
+	plugin_taskbar_output_destroy(output->panel, output->wl_output);
+	wl_output_destroy(output->wl_output);
+	zfree(output->name);
+	wl_list_remove(&output->link);
+	free(output);
+}
+
 static void
 panel_destroy(struct panel *panel)
 {
 	panel->run_display = false;
 
+	stats_log(LOG_DEBUG);
 	conf_destroy(panel->conf);
 
-	if (panel->layer_surface) {
-		zwlr_layer_surface_v1_destroy(panel->layer_surface);
-	}
-
-	if (panel->surface) {
-		wl_surface_destroy(panel->surface);
+	struct output *output, *temp;
+	wl_list_for_each_safe(output, temp, &panel->outputs, link) {
+		output_destroy(output);
 	}
 
 	if (panel->layer_shell) {
@@ -264,6 +423,12 @@ panel_destroy(struct panel *panel)
 	widgets_free(panel);
 
 	thumbnail_destroy_all(panel);
+	atlas_destroy(panel->atlas);
+	slab_finish(&panel->toplevel_slab);
+	slab_finish(&panel->ext_toplevel_slab);
+	intern_destroy(panel->app_ids);
+	panel->app_ids = NULL;
+	arena_finish(&panel->frame_arena);
 
 	if (panel->toplevel_manager) {
 		zwlr_foreign_toplevel_manager_v1_destroy(
@@ -271,17 +436,6 @@ panel_destroy(struct panel *panel)
 		panel->toplevel_manager = NULL;
 	}
 
-	destroy_buffer(&panel->buffers[0]);
-	destroy_buffer(&panel->buffers[1]);
-
-	struct output *output, *temp;
-	wl_list_for_each_safe(output, temp, &panel->outputs, link) {
-		wl_output_destroy(output->wl_output);
-		zfree(output->name);
-		wl_list_remove(&output->link);
-		zfree(output);
-	};
-
 	if (panel->xdg_wm_base) {
 		xdg_wm_base_destroy(panel->xdg_wm_base);
 		panel->xdg_wm_base = NULL;
@@ -301,25 +455,42 @@ panel_destroy(struct panel *panel)
 	pango_cairo_font_map_set_default(NULL);
 
 	close_pollfd(&panel->pollfds[FD_SIGNAL]);
-	close_pollfd(&panel->pollfds[FD_CLOCK]);
-	close_pollfd(&panel->pollfds[FD_BATTERY]);
+	close_pollfd(&panel->pollfds[FD_UEVENT]);
+	close_pollfd(&panel->pollfds[FD_INOTIFY]);
+
+	/* Owned by the timer service */
+	timers_destroy(panel->timers);
+	panel->timers = NULL;
+	panel->reload_timer = NULL;
 }
 
 static void
 layer_surface_configure(void *data, struct zwlr_layer_surface_v1 *surface,
 	uint32_t serial, uint32_t width, uint32_t height)
 {
-	struct panel *panel = data;
-	panel->box = (struct box){ .width = (int)width, .height = (int)height };
+	struct bar *bar = data;
+	struct panel *panel = bar->panel;
+	bar->box = (struct box){ .width = (int)width, .height = (int)height };
 	zwlr_layer_surface_v1_ack_configure(surface, serial);
-	render_frame(panel);
+
+	/* All bars have the same height, so this only happens for the first */
+	if (panel->height != (int)height) {
+		panel->height = height;
+		update_widgets(panel);
+		panel_schedule_frame(panel);
+	}
+	bar->dirty = true;
 }
 
 static void
 layer_surface_closed(void *data, struct zwlr_layer_surface_v1 *surface)
 {
-	struct panel *panel = data;
-	panel_destroy(panel);
+	struct bar *bar = data;
+	struct panel *panel = bar->panel;
+	bar_destroy(bar);
+	if (wl_list_empty(&panel->bars)) {
+		panel->run_display = false;
+	}
 }
 
 static const struct zwlr_layer_surface_v1_listener layer_surface_listener = {
@@ -327,35 +498,50 @@ static const struct zwlr_layer_surface_v1_listener layer_surface_listener = {
 	.closed = layer_surface_closed,
 };
 
+/* Show the panel on @output, drawn once the layer surface is configured */
 static void
-surface_enter(void *data, struct wl_surface *surface, struct wl_output *output)
+bar_create(struct output *output)
 {
-	struct panel *panel = data;
-	struct output *panel_output;
-	wl_list_for_each(panel_output, &panel->outputs, link) {
-		if (panel_output->wl_output != output) {
-			continue;
-		}
-		debug("surface enter on output %s", panel_output->name);
-		panel->output = panel_output;
-		panel->scale = panel->output->scale;
-		render_frame(panel);
-		break;
-	}
+	struct panel *panel = output->panel;
+	struct conf *conf = panel->conf;
+	struct bar *bar = znew(*bar);
+	bar->panel = panel;
+	bar->output = output;
+	bar->scale = output->scale;
+	bar->damage = cairo_region_create();
+
+	bar->surface = wl_compositor_create_surface(panel->compositor);
+	assert(bar->surface);
+	bar->layer_surface = zwlr_layer_shell_v1_get_layer_surface(
+		panel->layer_shell, bar->surface, output->wl_output,
+		conf->layer, "t2play");
+	assert(bar->layer_surface);
+	zwlr_layer_surface_v1_add_listener(bar->layer_surface,
+		&layer_surface_listener, bar);
+	zwlr_layer_surface_v1_set_anchor(bar->layer_surface, conf->anchors);
+	zwlr_layer_surface_v1_set_size(bar->layer_surface, 0,
+		conf->panel_breadth);
+	zwlr_layer_surface_v1_set_exclusive_zone(bar->layer_surface,
+		conf->panel_breadth);
+	wl_surface_commit(bar->surface);
+
+	output->bar = bar;
+	wl_list_insert(panel->bars.prev, &bar->link);
+	update_widget_scale(panel);
 }
 
-static void
-surface_leave(void *data, struct wl_surface *wl_surface,
-	struct wl_output *output)
+static struct bar *
+bar_from_surface(struct panel *panel, struct wl_surface *surface)
 {
-	/* nop */
+	struct bar *bar;
+	wl_list_for_each(bar, &panel->bars, link) {
+		if (bar->surface == surface) {
+			return bar;
+		}
+	}
+	return NULL;
 }
 
-static const struct wl_surface_listener surface_listener = {
-	.enter = surface_enter,
-	.leave = surface_leave,
-};
-
 static void
 update_cursor(struct seat *seat)
 {
@@ -375,8 +561,10 @@ update_cursor(struct seat *seat)
 			cursor_size = size;
 		}
 	}
+	/* The cursor surface is only ever shown over a bar */
+	int scale = pointer->bar ? pointer->bar->scale : 1;
 	pointer->cursor_theme = wl_cursor_theme_load(cursor_theme,
-		cursor_size * panel->scale, panel->shm);
+		cursor_size * scale, panel->shm);
 	if (!pointer->cursor_theme) {
 		warn("failed to load cursor theme");
 		return;
@@ -388,13 +576,13 @@ update_cursor(struct seat *seat)
 		return;
 	}
 	pointer->cursor_image = cursor->images[0];
-	wl_surface_set_buffer_scale(pointer->cursor_surface, panel->scale);
+	wl_surface_set_buffer_scale(pointer->cursor_surface, scale);
 	wl_surface_attach(pointer->cursor_surface,
 		wl_cursor_image_get_buffer(pointer->cursor_image), 0, 0);
 	wl_pointer_set_cursor(pointer->pointer, pointer->serial,
 		pointer->cursor_surface,
-		pointer->cursor_image->hotspot_x / panel->scale,
-		pointer->cursor_image->hotspot_y / panel->scale);
+		pointer->cursor_image->hotspot_x / scale,
+		pointer->cursor_image->hotspot_y / scale);
 	wl_surface_damage_buffer(pointer->cursor_surface, 0, 0, INT32_MAX,
 		INT32_MAX);
 	wl_surface_commit(pointer->cursor_surface);
@@ -421,6 +609,7 @@ wl_pointer_enter(void *data, struct wl_pointer *wl_pointer, uint32_t serial,
 	pointer->x = wl_fixed_to_int(surface_x);
 	pointer->y = wl_fixed_to_int(surface_y);
 	pointer->focus_surface = surface;
+	pointer->bar = bar_from_surface(seat->panel, surface);
 
 	if (seat->panel->cursor_shape_manager) {
 		struct wp_cursor_shape_device_v1 *device =
@@ -448,12 +637,17 @@ wl_pointer_leave(void *data, struct wl_pointer *wl_pointer, uint32_t serial,
 	if (panel->thumbnail && surface == panel->thumbnail->popup_surface) {
 		panel->hovered_toplevel = NULL;
 		thumbnail_hide(panel);
-	} else if (surface == panel->surface && panel->hovered_toplevel
-		&& !panel->thumbnail) {
+		thumbnail_end_hover(panel);
+	} else if (seat->pointer.bar
+		&& (!panel->thumbnail
+			|| panel->thumbnail->state != THUMBNAIL_SHOWN)) {
+		/* Also cancels a capture that has not been mapped yet */
 		panel->hovered_toplevel = NULL;
 		thumbnail_hide(panel);
+		thumbnail_end_hover(panel);
 	}
 	seat->pointer.focus_surface = NULL;
+	seat->pointer.bar = NULL;
 }
 
 static void
@@ -464,9 +658,7 @@ wl_pointer_motion(void *data, struct wl_pointer *wl_pointer, uint32_t time,
 	seat->pointer.x = wl_fixed_to_int(surface_x);
 	seat->pointer.y = wl_fixed_to_int(surface_y);
 	struct panel *panel = seat->panel;
-	if (panel->open_popup
-		&& seat->pointer.focus_surface
-			!= panel->surface) {
+	if (panel->open_popup && !seat->pointer.bar) {
 		plugin_startmenu_pointer_motion(panel->open_popup,
 			seat->pointer.y);
 		/* Skip thumbnail hover detection while a popup is open */
@@ -474,21 +666,18 @@ wl_pointer_motion(void *data, struct wl_pointer *wl_pointer, uint32_t time,
 	}
 
 	/* Detect hover over taskbar toplevel buttons */
-	if (seat->pointer.focus_surface == panel->surface) {
+	struct bar *bar = seat->pointer.bar;
+	if (bar) {
 		struct toplevel *hovered = NULL;
-		struct widget *widget;
-		wl_list_for_each_reverse(widget, &panel->widgets, link) {
-			if (widget->type == WIDGET_TOPLEVEL
-					&& box_contains_point(&widget->box,
-						seat->pointer.x, seat->pointer.y)) {
-				hovered = toplevel_from_widget(widget);
-				break;
-			}
+		struct widget *widget = layout_widget_at(bar,
+			seat->pointer.x, seat->pointer.y);
+		if (widget && widget->type == WIDGET_TOPLEVEL) {
+			hovered = toplevel_from_widget(widget);
 		}
 		if (hovered != panel->hovered_toplevel) {
 			panel->hovered_toplevel = hovered;
 			if (hovered) {
-				thumbnail_show(panel, hovered);
+				thumbnail_show(panel, bar, hovered);
 			} else {
 				thumbnail_hide(panel);
 			}
@@ -509,20 +698,19 @@ wl_pointer_button(void *data, struct wl_pointer *wl_pointer, uint32_t serial,
 
 	seat->pointer.button_serial = serial;
 
-	if (panel->open_popup
-		&& seat->pointer.focus_surface != panel->surface) {
+	if (panel->open_popup && !seat->pointer.bar) {
 		plugin_startmenu_popup_click(panel->open_popup,
 			seat->pointer.y);
 		return;
 	}
+	if (!seat->pointer.bar) {
+		return;
+	}
 
-	struct widget *widget;
-	wl_list_for_each_reverse(widget, &panel->widgets, link) {
-		if (box_contains_point(&widget->box, seat->pointer.x,
-				seat->pointer.y)) {
-			widget_on_left_button_press(widget, seat);
-			break;
-		}
+	struct widget *widget = layout_widget_at(seat->pointer.bar,
+		seat->pointer.x, seat->pointer.y);
+	if (widget) {
+		widget_on_left_button_press(widget, seat);
 	}
 }
 
@@ -532,9 +720,7 @@ wl_pointer_axis(void *data, struct wl_pointer *wl_pointer, uint32_t time,
 {
 	struct seat *seat = data;
 	/* WL_POINTER_AXIS_VERTICAL_SCROLL = 0 */
-	if (seat->panel->open_popup && axis == 0
-			&& seat->pointer.focus_surface
-				!= seat->panel->surface) {
+	if (seat->panel->open_popup && axis == 0 && !seat->pointer.bar) {
 		plugin_startmenu_scroll(seat->panel->open_popup,
 			wl_fixed_to_double(value));
 	}
@@ -680,7 +866,7 @@ wl_keyboard_modifiers(void *data, struct wl_keyboard *keyboard,
 	snprintf(panel->kbd_layout, sizeof(panel->kbd_layout), "%s",
 		layout_name);
 	plugin_kbdlayout_update(panel);
-	render_frame(panel);
+	panel_schedule_frame(panel);
 }
 
 static void
@@ -750,23 +936,38 @@ output_mode(void *data, struct wl_output *wl_output, uint32_t flags,
 	/* nop */
 }
 
+/* Called once all properties are known, and again whenever they change */
 static void
-output_done(void *data, struct wl_output *output)
+output_done(void *data, struct wl_output *wl_output)
 {
-	/* nop */
+	struct output *output = data;
+	struct panel *panel = output->panel;
+	const char *wanted = panel->conf->output;
+	if (output->bar || (wanted && (!output->name
+			|| strcmp(wanted, output->name)))) {
+		return;
+	}
+	debug("Using output %s", output->name ? output->name : "?");
+	bar_create(output);
 }
 
+/*
+ * The bar on this output is composited again at the new scale, and the
+ * widgets are only redrawn if that changes the largest scale in use.
+ */
 static void
-output_scale(void *data, struct wl_output *output, int32_t factor)
+output_scale(void *data, struct wl_output *wl_output, int32_t factor)
 {
-	struct output *panel_output = data;
-	panel_output->scale = factor;
-	if (panel_output->panel->output == panel_output) {
-		panel_output->panel->scale = panel_output->scale;
-		if (!panel_output->panel->cursor_shape_manager) {
-			update_all_cursors(panel_output->panel);
+	struct output *output = data;
+	output->scale = factor;
+	struct bar *bar = output->bar;
+	if (bar && bar->scale != factor) {
+		bar->scale = factor;
+		if (!output->panel->cursor_shape_manager) {
+			update_all_cursors(output->panel);
 		}
-		render_frame(panel_output->panel);
+		bar->dirty = true;
+		update_widget_scale(output->panel);
 	}
 }
 
@@ -775,14 +976,6 @@ output_name(void *data, struct wl_output *wl_output, const char *name)
 {
 	struct output *output = data;
 	xstrdup_replace(output->name, name);
-
-	struct panel *panel = output->panel;
-	struct conf *conf = panel->conf;
-
-	if (!panel->output && conf->output && !strcmp(conf->output, name)) {
-		debug("Using output %s", name);
-		panel->output = output;
-	}
 }
 
 static void
@@ -830,16 +1023,14 @@ handle_global(void *data, struct wl_registry *registry, uint32_t name,
 	} else if (!strcmp(interface, wl_shm_interface.name)) {
 		panel->shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
 	} else if (strcmp(interface, wl_output_interface.name) == 0) {
-		if (!panel->output) {
-			struct output *output = znew(*output);
-			output->wl_output = wl_registry_bind(registry, name,
-				&wl_output_interface, 4);
-			output->wl_name = name;
-			output->scale = 1;
-			output->panel = panel;
-			wl_list_insert(&panel->outputs, &output->link);
-			wl_output_add_listener(output->wl_output, &output_listener, output);
-		}
+		struct output *output = znew(*output);
+		output->wl_output = wl_registry_bind(registry, name,
+			&wl_output_interface, 4);
+		output->wl_name = name;
+		output->scale = 1;
+		output->panel = panel;
+		wl_list_insert(&panel->outputs, &output->link);
+		wl_output_add_listener(output->wl_output, &output_listener, output);
 	} else if (!strcmp(interface, zwlr_layer_shell_v1_interface.name)) {
 		panel->layer_shell = wl_registry_bind(registry, name,
 			&zwlr_layer_shell_v1_interface, 1);
@@ -866,6 +1057,11 @@ handle_global(void *data, struct wl_registry *registry, uint32_t name,
 	} else if (!strcmp(interface, ext_image_copy_capture_manager_v1_interface.name)) {
 		panel->ext_image_copy_capture_mgr = wl_registry_bind(registry, name,
 			&ext_image_copy_capture_manager_v1_interface, 1);
+#if HAVE_DMABUF
+	} else if (!strcmp(interface, zwp_linux_dmabuf_v1_interface.name)) {
+		panel->linux_dmabuf = wl_registry_bind(registry, name,
+			&zwp_linux_dmabuf_v1_interface, 3);
+#endif
 	}
 }
 
@@ -873,8 +1069,11 @@ static void
 handle_global_remove(void *data, struct wl_registry *registry, uint32_t name)
 {
 	struct panel *panel = data;
-	if (panel->output->wl_name == name) {
-		panel->run_display = false;
+	struct output *output, *tmpoutput;
+	wl_list_for_each_safe(output, tmpoutput, &panel->outputs, link) {
+		if (output->wl_name == name) {
+			output_destroy(output);
+		}
 	}
 
 	struct seat *seat, *tmpseat;
@@ -904,6 +1103,18 @@ panel_setup_cursors(struct panel *panel)
 	}
 }
 
+static void
+stats_tick(void *data)
+{
+	stats_log_summary();
+}
+
+static void
+reload_tick(void *data)
+{
+	desktop_entry_reload(data);
+}
+
 static void
 panel_setup(struct panel *panel)
 {
@@ -912,13 +1123,12 @@ panel_setup(struct panel *panel)
 		die("unable to connect to the compositor");
 	}
 
-	panel->scale = 1;
-
 	struct wl_registry *registry = wl_display_get_registry(panel->display);
 	wl_registry_add_listener(registry, &registry_listener, panel);
 	if (wl_display_roundtrip(panel->display) < 0) {
 		die("failed to register with the wayland display");
 	}
+	stats.roundtrips++;
 
 	assert(panel->compositor && panel->layer_shell && panel->shm);
 
@@ -928,8 +1138,9 @@ panel_setup(struct panel *panel)
 		panel_destroy(panel);
 		exit(EXIT_FAILURE);
 	}
+	stats.roundtrips++;
 
-	if (!panel->output && panel->conf->output) {
+	if (wl_list_empty(&panel->bars) && panel->conf->output) {
 		warn("output '%s' not found", panel->conf->output);
 		panel_destroy(panel);
 		exit(EXIT_FAILURE);
@@ -942,72 +1153,44 @@ panel_setup(struct panel *panel)
 		panel_setup_cursors(panel);
 	}
 
-	panel->surface = wl_compositor_create_surface(panel->compositor);
-	assert(panel->surface);
-	wl_surface_add_listener(panel->surface, &surface_listener, panel);
-
-	panel->layer_surface = zwlr_layer_shell_v1_get_layer_surface(panel->layer_shell,
-		panel->surface, panel->output ? panel->output->wl_output : NULL,
-		panel->conf->layer, "t2play");
-	assert(panel->layer_surface);
-	zwlr_layer_surface_v1_add_listener(panel->layer_surface,
-		&layer_surface_listener, panel);
-	zwlr_layer_surface_v1_set_anchor(panel->layer_surface,
-		panel->conf->anchors);
-
 	wl_registry_destroy(registry);
 
 	panel->pollfds[FD_WAYLAND].fd = wl_display_get_fd(panel->display);
 	panel->pollfds[FD_WAYLAND].events = POLLIN;
 
-	if (panel->conf->panel_items && strchr(panel->conf->panel_items, 'C')) {
-		panel->pollfds[FD_CLOCK].fd =
-			timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC);
-		panel->pollfds[FD_CLOCK].events = POLLIN;
-		/* Fire at the start of the next minute, then every 60 seconds */
-		struct timespec now;
-		clock_gettime(CLOCK_REALTIME, &now);
-		struct itimerspec clock_timer = {
-			.it_interval.tv_sec = 60,
-			.it_value.tv_sec = now.tv_sec - (now.tv_sec % 60) + 60,
-		};
-		timerfd_settime(panel->pollfds[FD_CLOCK].fd, TFD_TIMER_ABSTIME,
-			&clock_timer, NULL);
-	} else {
-		panel->pollfds[FD_CLOCK].fd = -1;
-	}
+	panel->pollfds[FD_TIMER].fd = timers_get_fd(panel->timers);
+	panel->pollfds[FD_TIMER].events = POLLIN;
 
-	if (panel->conf->panel_items && strchr(panel->conf->panel_items, 'B')
-			&& panel->battery_path[0]) {
-		int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
-		if (tfd < 0) {
-			warn("timerfd_create failed for battery");
-			panel->pollfds[FD_BATTERY].fd = -1;
-		} else {
-			struct itimerspec battery_timer = {
-				.it_interval.tv_sec = 30,
-				.it_value.tv_sec = 30,
-			};
-			if (timerfd_settime(tfd, 0, &battery_timer, NULL) < 0) {
-				warn("timerfd_settime failed for battery");
-				close(tfd);
-				panel->pollfds[FD_BATTERY].fd = -1;
-			} else {
-				panel->pollfds[FD_BATTERY].fd = tfd;
-				panel->pollfds[FD_BATTERY].events = POLLIN;
-			}
-		}
-	} else {
-		panel->pollfds[FD_BATTERY].fd = -1;
+	panel->pollfds[FD_UEVENT].fd = plugin_battery_watch(panel);
+	panel->pollfds[FD_UEVENT].events = POLLIN;
+
+	panel->pollfds[FD_INOTIFY].fd = desktop_entry_watch(panel);
+	panel->pollfds[FD_INOTIFY].events = POLLIN;
+	if (panel->pollfds[FD_INOTIFY].fd >= 0) {
+		panel->reload_timer = timer_add(panel->timers, reload_tick,
+			panel);
 	}
 
 	sigset_t mask;
 	sigemptyset(&mask);
 	sigaddset(&mask, SIGINT);
 	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR1); /* dump stats */
 	sigprocmask(SIG_BLOCK, &mask, NULL);
 	panel->pollfds[FD_SIGNAL].fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
 	panel->pollfds[FD_SIGNAL].events = POLLIN;
+
+	/* With --debug, log a summary of the stats every so often */
+	if (log_get_importance() >= LOG_DEBUG) {
+		timer_set_periodic(timer_add(panel->timers, stats_tick, NULL),
+			STATS_INTERVAL_S * 1000, STATS_SLACK_MS);
+	}
+
+	panel->pollfds[FD_WORKER].fd = worker_get_fd(panel->worker);
+	panel->pollfds[FD_WORKER].events = POLLIN;
+
+	/* Rescan in the background if the desktop cache was out of date */
+	desktop_entry_reload(panel);
 }
 
 static void
@@ -1015,22 +1198,20 @@ panel_run(struct panel *panel)
 {
 	panel->run_display = true;
 
-	zwlr_layer_surface_v1_set_size(panel->layer_surface, 0, panel->conf->panel_breadth);
-	zwlr_layer_surface_v1_set_exclusive_zone(panel->layer_surface, panel->conf->panel_breadth);
-	wl_surface_commit(panel->surface);
+	/* The bars have been committed, wait for them to be configured */
 	wl_display_roundtrip(panel->display);
+	stats.roundtrips++;
 
-	plugin_clock_update(panel);
-	plugin_startmenu_update(panel);
-	plugin_kbdlayout_update(panel);
-	plugin_battery_update(panel);
+	update_widgets(panel);
 
-	render_frame(panel);
+	panel_schedule_frame(panel);
 	while (panel->run_display) {
 		while (wl_display_prepare_read(panel->display) != 0) {
 			wl_display_dispatch_pending(panel->display);
 		}
 
+		panel_flush_frame(panel);
+
 		errno = 0;
 		if (wl_display_flush(panel->display) == -1 && errno != EAGAIN) {
 			break;
@@ -1047,19 +1228,36 @@ panel_run(struct panel *panel)
 			wl_display_cancel_read(panel->display);
 		}
 		if (panel->pollfds[FD_SIGNAL].revents & POLLIN) {
-			break;
+			struct signalfd_siginfo info;
+			if (read(panel->pollfds[FD_SIGNAL].fd, &info,
+					sizeof(info)) == sizeof(info)
+					&& info.ssi_signo == SIGUSR1) {
+				stats_log(LOG_SILENT);
+			} else {
+				break;
+			}
+		}
+		if (panel->pollfds[FD_TIMER].revents & POLLIN) {
+			timers_dispatch(panel->timers);
 		}
-		if (panel->pollfds[FD_CLOCK].revents & POLLIN) {
-			uint64_t exp;
-			read(panel->pollfds[FD_CLOCK].fd, &exp, sizeof(exp));
-			plugin_clock_update(panel);
-			render_frame(panel);
+		if (panel->pollfds[FD_UEVENT].revents & POLLIN) {
+			plugin_battery_handle_uevent(panel,
+				panel->pollfds[FD_UEVENT].fd);
+		}
+		if (panel->pollfds[FD_INOTIFY].revents & POLLIN) {
+			if (desktop_entry_handle_watch(panel,
+					panel->pollfds[FD_INOTIFY].fd)) {
+				/*
+				 * (Re)arm the one-shot reload timer so that a
+				 * burst of writes by a package manager results
+				 * in a single reload once it has settled.
+				 */
+				timer_set_oneshot(panel->reload_timer,
+					RELOAD_DELAY_MS, RELOAD_SLACK_MS);
+			}
 		}
-		if (panel->pollfds[FD_BATTERY].revents & POLLIN) {
-			uint64_t exp;
-			read(panel->pollfds[FD_BATTERY].fd, &exp, sizeof(exp));
-			plugin_battery_update(panel);
-			render_frame(panel);
+		if (panel->pollfds[FD_WORKER].revents & POLLIN) {
+			worker_dispatch(panel->worker);
 		}
 	}
 }
@@ -1078,7 +1276,7 @@ static const char t2conf_usage[] =
 "  -c, --config <file>      Specify config file (with path)\n"
 "  -d, --debug              Enable full logging, including debug information\n"
 "  -h, --help               Show help message and quit\n"
-"  -o  --output <name>      Specify output (monitor)\n"
+"  -o  --output <name>      Only show on this output\n"
 "  -V, --verbose            Enable more verbose logging\n";
 
 static void
@@ -1130,21 +1328,32 @@ main(int argc, char **argv)
 
 	struct panel panel = {
 		.conf = &conf,
+		.scale = 1,
 	};
 
 	desktop_entry_init(&panel);
+	panel.worker = worker_create();
+	panel.timers = timers_create();
 	conf_load(&conf, config_file);
 
 	wl_list_init(&panel.outputs);
 	wl_list_init(&panel.seats);
+	wl_list_init(&panel.bars);
 	wl_list_init(&panel.widgets);
 	wl_list_init(&panel.ext_toplevels);
+	wl_list_init(&panel.thumbnail_lru);
+	slab_init(&panel.toplevel_slab, sizeof(struct toplevel));
+	slab_init(&panel.ext_toplevel_slab, sizeof(struct ext_toplevel));
+	panel.app_ids = intern_create();
 
 	init_plugins(&panel);
 
 	panel_setup(&panel);
 	panel_run(&panel);
 
+	/* Jobs may use libsfdo */
+	worker_destroy(panel.worker);
+	panel.worker = NULL;
 	desktop_entry_finish(&panel);
 	panel_destroy(&panel);
 
@@ -1,50 +1,406 @@
 // SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Battery charge, aggregated over all system batteries in
+ * /sys/class/power_supply. The sysfs attributes are kept open and re-read
+ * with pread() when the kernel sends a power_supply uevent, which it does
+ * whenever a driver reports a change, so there is no periodic wakeup.
+ * Polling is only used if the uevent socket cannot be opened.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/netlink.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
 #include <unistd.h>
 #include "conf.h"
+#include "common/log.h"
 #include "common/mem.h"
 #include "panel.h"
+#include "stats.h"
+#include "timer.h"
+#include "worker.h"
 
+#define POWER_SUPPLY_DIR "/sys/class/power_supply"
+
+/* Fallback polling, in step with the clock */
+#define BATTERY_POLL_MS (30 * 1000)
+#define BATTERY_POLL_SLACK_MS 5000
+
+static struct battery *
+get_battery(struct panel *panel)
+{
+	struct widget *widget;
+	wl_list_for_each(widget, &panel->widgets, link) {
+		if (widget->type == WIDGET_BATTERY) {
+			return (struct battery *)widget;
+		}
+	}
+	return NULL;
+}
+
+static int
+open_attr(int dirfd, const char *name)
+{
+	return openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+}
+
+/* Read a sysfs attribute from the start, without the trailing newline */
+static bool
+read_attr(int fd, char *buf, size_t size)
+{
+	if (fd < 0) {
+		return false;
+	}
+	ssize_t len = pread(fd, buf, size - 1, 0);
+	if (len <= 0) {
+		return false;
+	}
+	buf[len] = '\0';
+	buf[strcspn(buf, "\n")] = '\0';
+	return true;
+}
+
+static bool
+read_attr_long(int fd, long long *value)
+{
+	char buf[32];
+	if (!read_attr(fd, buf, sizeof(buf))) {
+		return false;
+	}
+	char *end;
+	*value = strtoll(buf, &end, 10);
+	return end != buf;
+}
+
+static void
+close_supplies(struct battery *battery)
+{
+	for (int i = 0; i < battery->n_supplies; i++) {
+		struct power_supply *supply = &battery->supplies[i];
+		int fds[] = { supply->capacity_fd, supply->status_fd,
+			supply->now_fd, supply->full_fd, supply->rate_fd };
+		for (size_t j = 0; j < sizeof(fds) / sizeof(fds[0]); j++) {
+			if (fds[j] >= 0) {
+				close(fds[j]);
+			}
+		}
+		free(supply->name);
+	}
+	zfree(battery->supplies);
+	battery->n_supplies = 0;
+}
+
+/* Find the system batteries, leaving out those of mice, keyboards etc */
 static void
-battery_update(struct panel *panel, struct widget *widget)
-{
-	char buf[16] = "--";
-	if (panel->battery_path[0]) {
-		FILE *f = fopen(panel->battery_path, "r");
-		if (f) {
-			int capacity;
-			if (fscanf(f, "%d", &capacity) == 1) {
-				snprintf(buf, sizeof(buf), "%d%%", capacity);
+open_supplies(struct battery *battery)
+{
+	close_supplies(battery);
+	battery->rescan = false;
+
+	DIR *dir = opendir(POWER_SUPPLY_DIR);
+	if (!dir) {
+		return;
+	}
+	struct dirent *entry;
+	while ((entry = readdir(dir))) {
+		if (entry->d_name[0] == '.') {
+			continue;
+		}
+		int fd = openat(dirfd(dir), entry->d_name,
+			O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0) {
+			continue;
+		}
+		char type[32], scope[32];
+		int type_fd = open_attr(fd, "type");
+		int scope_fd = open_attr(fd, "scope");
+		bool is_battery = read_attr(type_fd, type, sizeof(type))
+			&& !strcmp(type, "Battery")
+			&& !(read_attr(scope_fd, scope, sizeof(scope))
+				&& !strcmp(scope, "Device"));
+		if (type_fd >= 0) {
+			close(type_fd);
+		}
+		if (scope_fd >= 0) {
+			close(scope_fd);
+		}
+		if (!is_battery) {
+			close(fd);
+			continue;
+		}
+
+		battery->supplies = xrealloc(battery->supplies,
+			(battery->n_supplies + 1) * sizeof(*battery->supplies));
+		struct power_supply *supply =
+			&battery->supplies[battery->n_supplies++];
+		supply->name = xstrdup(entry->d_name);
+		supply->capacity_fd = open_attr(fd, "capacity");
+		supply->status_fd = open_attr(fd, "status");
+
+		/* Drivers report either energy and power, or charge and current */
+		supply->energy = true;
+		supply->now_fd = open_attr(fd, "energy_now");
+		supply->full_fd = open_attr(fd, "energy_full");
+		supply->rate_fd = open_attr(fd, "power_now");
+		if (supply->now_fd < 0) {
+			if (supply->full_fd >= 0) {
+				close(supply->full_fd);
 			}
-			fclose(f);
+			if (supply->rate_fd >= 0) {
+				close(supply->rate_fd);
+			}
+			supply->energy = false;
+			supply->now_fd = open_attr(fd, "charge_now");
+			supply->full_fd = open_attr(fd, "charge_full");
+			supply->rate_fd = open_attr(fd, "current_now");
+		}
+		close(fd);
+		debug("battery: found %s", supply->name);
+	}
+	closedir(dir);
+}
+
+struct battery_read {
+	struct panel *panel;
+	struct power_supply *supplies; /* kept open until the read is done */
+	int n_supplies;
+	char label[32];
+};
+
+/*
+ * Work out the label from all batteries together: the charge left over the
+ * total capacity, a "+" while charging, and the time to empty while
+ * discharging if the drivers report the rate. sysfs reads can block for a
+ * long time while ACPI wakes the battery up, so this runs on the worker.
+ */
+static void
+battery_read(void *data)
+{
+	struct battery_read *job = data;
+	long long sum_now = 0, sum_full = 0, sum_rate = 0, sum_capacity = 0;
+	int n_capacity = 0, n_energy = 0;
+	bool have_totals = job->n_supplies > 0, have_rate = true;
+	bool charging = false, discharging = false;
+
+	for (int i = 0; i < job->n_supplies; i++) {
+		struct power_supply *supply = &job->supplies[i];
+		long long capacity, now, full, rate;
+		if (read_attr_long(supply->capacity_fd, &capacity)) {
+			sum_capacity += capacity;
+			n_capacity++;
+		}
+		if (read_attr_long(supply->now_fd, &now)
+				&& read_attr_long(supply->full_fd, &full)
+				&& full > 0) {
+			sum_now += now;
+			sum_full += full;
+		} else {
+			have_totals = false;
+		}
+		if (read_attr_long(supply->rate_fd, &rate) && rate != 0) {
+			/* Some drivers report a negative rate when discharging */
+			sum_rate += rate < 0 ? -rate : rate;
+		} else {
+			have_rate = false;
+		}
+		n_energy += supply->energy;
+
+		char status[32];
+		if (read_attr(supply->status_fd, status, sizeof(status))) {
+			charging |= !strcmp(status, "Charging");
+			discharging |= !strcmp(status, "Discharging");
 		}
 	}
 
-	PangoRectangle rect = get_text_size(panel->conf->font_description, buf);
-	widget->box.width = rect.width + 2 * panel->conf->battery_padding;
-	if (widget->surface) {
-		cairo_surface_destroy(widget->surface);
+	/* Energy and charge cannot be added up */
+	if (n_energy != 0 && n_energy != job->n_supplies) {
+		have_totals = false;
 	}
-	widget->surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
-		widget->box.width, panel->box.height);
 
-	cairo_t *cr = cairo_create(widget->surface);
-	cairo_set_source_u32(cr, panel->conf->text);
-	cairo_move_to(cr, panel->conf->battery_padding,
-		(panel->box.height - rect.height) / 2.0);
-	render_text(cr, panel->conf->font_description, 1, false, "%s", buf);
-	cairo_destroy(cr);
+	int percent;
+	if (have_totals) {
+		percent = (sum_now * 100 + sum_full / 2) / sum_full;
+	} else if (n_capacity) {
+		percent = (sum_capacity + n_capacity / 2) / n_capacity;
+	} else {
+		snprintf(job->label, sizeof(job->label), "--");
+		return;
+	}
+	int len = snprintf(job->label, sizeof(job->label), "%d%%%s",
+		percent > 100 ? 100 : percent, charging ? "+" : "");
+
+	if (discharging && !charging && have_totals && have_rate) {
+		long long minutes = sum_now * 60 / sum_rate;
+		snprintf(job->label + len, sizeof(job->label) - len, " %lld:%02lld",
+			minutes / 60, minutes % 60);
+	}
 }
 
+static void battery_update(struct panel *panel, struct battery *battery);
+
+static void
+battery_read_done(void *data, bool cancelled)
+{
+	struct battery_read *job = data;
+	struct panel *panel = job->panel;
+	if (cancelled) {
+		free(job);
+		return;
+	}
+
+	uint64_t start = stats_now();
+	struct battery *battery = get_battery(panel);
+	battery->reading = false;
+	struct widget *widget = &battery->base;
+	if (widget_key_update(widget, widget_label_key(widget, job->label))) {
+		widget_draw_label(widget, panel->conf->battery_padding,
+			job->label);
+		panel_schedule_frame(panel);
+	}
+	stats_timer_add(&stats.battery_update, start);
+	free(job);
+
+	/* A uevent arrived while this read was in progress */
+	if (battery->pending || battery->rescan) {
+		battery_update(panel, battery);
+	}
+}
+
+static void
+battery_update(struct panel *panel, struct battery *battery)
+{
+	/* Closing the files has to wait until no read is using them */
+	if (battery->reading) {
+		battery->pending = true;
+		return;
+	}
+	if (battery->rescan) {
+		open_supplies(battery);
+	}
+	battery->reading = true;
+	battery->pending = false;
+
+	struct battery_read *job = znew(*job);
+	job->panel = panel;
+	job->supplies = battery->supplies;
+	job->n_supplies = battery->n_supplies;
+	worker_submit(panel->worker, battery_read, battery_read_done, job);
+}
+
+/* The label is updated once the batteries have been read */
 void
 plugin_battery_update(struct panel *panel)
 {
-	struct widget *widget;
-	wl_list_for_each(widget, &panel->widgets, link) {
-		if (widget->type == WIDGET_BATTERY) {
-			battery_update(panel, widget);
+	struct battery *battery = get_battery(panel);
+	if (!battery) {
+		return;
+	}
+	/* Without uevents, this is also how a new battery is noticed */
+	if (!battery->n_supplies) {
+		battery->rescan = true;
+	}
+	battery_update(panel, battery);
+}
+
+static void
+battery_poll(void *data)
+{
+	struct panel *panel = data;
+	plugin_battery_update(panel);
+}
+
+static int
+open_uevent_socket(void)
+{
+	int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+		NETLINK_KOBJECT_UEVENT);
+	if (fd < 0) {
+		warn("battery: no uevent socket: %s", strerror(errno));
+		return -1;
+	}
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = 1, /* kernel events, not those relayed by udev */
+	};
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		warn("battery: cannot bind uevent socket: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Subscribe to kernel uevents. Returns the socket for panel->pollfds, or -1
+ * if there is no battery widget or it has to be polled instead.
+ */
+int
+plugin_battery_watch(struct panel *panel)
+{
+	struct battery *battery = get_battery(panel);
+	if (!battery) {
+		return -1;
+	}
+	int fd = open_uevent_socket();
+	if (fd < 0) {
+		battery->poll_timer = timer_add(panel->timers, battery_poll,
+			panel);
+		timer_set_periodic(battery->poll_timer, BATTERY_POLL_MS,
+			BATTERY_POLL_SLACK_MS);
+	}
+	return fd;
+}
+
+/*
+ * Drain pending uevents and re-read the batteries if any of them was about
+ * a power supply. Those include AC adapters, so plugging in is seen at once.
+ */
+void
+plugin_battery_handle_uevent(struct panel *panel, int fd)
+{
+	struct battery *battery = get_battery(panel);
+	bool changed = false;
+
+	for (;;) {
+		/* "<action>@<devpath>" then "KEY=value" pairs, all NUL-terminated */
+		char buf[8192];
+		struct sockaddr_nl addr;
+		socklen_t addr_len = sizeof(addr);
+		ssize_t len = recvfrom(fd, buf, sizeof(buf) - 1, 0,
+			(struct sockaddr *)&addr, &addr_len);
+		if (len < 0) {
+			if (errno != EAGAIN && errno != EINTR) {
+				warn("battery: uevent: %s", strerror(errno));
+			}
 			break;
 		}
+		if (addr.nl_pid != 0) {
+			/* Not from the kernel */
+			continue;
+		}
+		buf[len] = '\0';
+
+		bool power_supply = false, add_remove = false;
+		for (char *p = buf; p < buf + len; p += strlen(p) + 1) {
+			if (!strcmp(p, "SUBSYSTEM=power_supply")) {
+				power_supply = true;
+			} else if (!strcmp(p, "ACTION=add")
+					|| !strcmp(p, "ACTION=remove")) {
+				add_remove = true;
+			}
+		}
+		if (power_supply) {
+			changed = true;
+			battery->rescan |= add_remove;
+		}
+	}
+
+	if (changed) {
+		battery_update(panel, battery);
 	}
 }
 
@@ -54,15 +410,15 @@ plugin_battery_create(struct panel *panel)
 	struct battery *battery = znew(*battery);
 	battery->base.panel = panel;
 	battery->base.type = WIDGET_BATTERY;
-
-	/* Determine battery path: try BAT0 first, then BAT1 */
-	if (access("/sys/class/power_supply/BAT0/capacity", R_OK) == 0) {
-		snprintf(panel->battery_path, sizeof(panel->battery_path),
-			"/sys/class/power_supply/BAT0/capacity");
-	} else if (access("/sys/class/power_supply/BAT1/capacity", R_OK) == 0) {
-		snprintf(panel->battery_path, sizeof(panel->battery_path),
-			"/sys/class/power_supply/BAT1/capacity");
-	}
-
+	open_supplies(battery);
 	wl_list_insert(panel->widgets.prev, &battery->base.link);
 }
+
+void
+plugin_battery_destroy(struct battery *battery)
+{
+	close_supplies(battery);
+	timer_remove(battery->poll_timer);
+	wl_list_remove(&battery->base.link);
+	widget_free(&battery->base);
+}
@@ -2,6 +2,11 @@
 #include "conf.h"
 #include "common/mem.h"
 #include "panel.h"
+#include "stats.h"
+#include "timer.h"
+
+/* The minute may be shown this much late, to share wakeups */
+#define CLOCK_SLACK_MS 500
 
 void
 clock_update(struct panel *panel, struct widget *widget)
@@ -10,26 +15,17 @@ clock_update(struct panel *panel, struct widget *widget)
 	struct tm *tm_info = localtime(&t);
 	char buf[6]; /* "HH:MM\0" */
 	strftime(buf, sizeof(buf), "%H:%M", tm_info);
-
-	PangoRectangle rect = get_text_size(panel->conf->font_description, buf);
-	widget->box.width = rect.width + 2 * panel->conf->clock_padding;
-	if (widget->surface) {
-		cairo_surface_destroy(widget->surface);
+	if (!widget_key_update(widget, widget_label_key(widget, buf))) {
+		return;
 	}
-	widget->surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
-		widget->box.width, panel->box.height);
 
-	cairo_t *cr = cairo_create(widget->surface);
-	cairo_set_source_u32(cr, panel->conf->text);
-	cairo_move_to(cr, panel->conf->clock_padding,
-		(panel->box.height - rect.height) / 2.0);
-	render_text(cr, panel->conf->font_description, 1, false, "%s", buf);
-	cairo_destroy(cr);
+	widget_draw_label(widget, panel->conf->clock_padding, buf);
 }
 
 void
 plugin_clock_update(struct panel *panel)
 {
+	uint64_t start = stats_now();
 	struct widget *widget;
 	wl_list_for_each(widget, &panel->widgets, link) {
 		if (widget->type == WIDGET_CLOCK) {
@@ -37,6 +33,15 @@ plugin_clock_update(struct panel *panel)
 			break;
 		}
 	}
+	stats_timer_add(&stats.clock_update, start);
+}
+
+static void
+clock_tick(void *data)
+{
+	struct panel *panel = data;
+	plugin_clock_update(panel);
+	panel_schedule_frame(panel);
 }
 
 void
@@ -46,4 +51,8 @@ plugin_clock_create(struct panel *panel)
 	clock->base.panel = panel;
 	clock->base.type = WIDGET_CLOCK;
 	wl_list_insert(panel->widgets.prev, &clock->base.link);
+
+	/* On the minute */
+	clock->timer = timer_add(panel->timers, clock_tick, panel);
+	timer_set_periodic(clock->timer, 60 * 1000, CLOCK_SLACK_MS);
 }
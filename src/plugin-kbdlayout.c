@@ -1,32 +1,27 @@
 // SPDX-License-Identifier: GPL-2.0-only
+#include "common/atlas.h"
 #include "conf.h"
 #include "common/mem.h"
 #include "panel.h"
+#include "stats.h"
 
 static void
 kbdlayout_update(struct panel *panel, struct widget *widget)
 {
 	const char *layout = panel->kbd_layout[0] ? panel->kbd_layout : "--";
-
-	PangoRectangle rect = get_text_size(panel->conf->font_description, layout);
-	widget->box.width = rect.width + 2 * panel->conf->keyboard_padding;
-	if (widget->surface) {
-		cairo_surface_destroy(widget->surface);
+	if (!widget_key_update(widget, widget_label_key(widget, layout))) {
+		return;
 	}
-	widget->surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
-		widget->box.width, panel->box.height);
 
-	cairo_t *cr = cairo_create(widget->surface);
-	cairo_set_source_u32(cr, panel->conf->text);
-	cairo_move_to(cr, panel->conf->keyboard_padding,
-		(panel->box.height - rect.height) / 2.0);
-	render_text(cr, panel->conf->font_description, 1, false, "%s", layout);
-	cairo_destroy(cr);
+	/* Layout names are few, so keep each one as an atlas entry */
+	atlas_add(widget_atlas(panel), layout);
+	widget_draw_label(widget, panel->conf->keyboard_padding, layout);
 }
 
 void
 plugin_kbdlayout_update(struct panel *panel)
 {
+	uint64_t start = stats_now();
 	struct widget *widget;
 	wl_list_for_each(widget, &panel->widgets, link) {
 		if (widget->type == WIDGET_KBDLAYOUT) {
@@ -34,6 +29,7 @@ plugin_kbdlayout_update(struct panel *panel)
 			break;
 		}
 	}
+	stats_timer_add(&stats.kbdlayout_update, start);
 }
 
 void
@@ -2,20 +2,26 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <linux/input-event-codes.h>
-#include <sfdo-basedir.h>
-#include <sfdo-desktop.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #include <libxml/parser.h>
 #include <libxml/tree.h>
 #include "conf.h"
 #include "common/box.h"
+#include "common/buf.h"
 #include "common/log.h"
 #include "common/mem.h"
+#include "desktop-entry.h"
+#include "frecency.h"
+#include "layout.h"
 #include "panel.h"
+#include "search.h"
+#include "stats.h"
 #include "common/string-helpers.h"
 #include "wlr-layer-shell-unstable-v1-client-protocol.h"
 #include "xdg-shell-client-protocol.h"
@@ -26,6 +32,13 @@
 /* Maximum number of items visible at once (excluding the search box row) */
 #define MENU_MAX_VISIBLE 12
 
+/*
+ * Score added per recent launch, see frecency.h. Capped so that a good text
+ * match still beats an app that is merely launched a lot.
+ */
+#define FRECENCY_WEIGHT 8
+#define FRECENCY_MAX_LAUNCHES 8
+
 /* ------------------------- Popup UI mini-framework ------------------------ */
 
 enum sm_node_type {
@@ -281,35 +294,17 @@ static void sm_layout_and_cache(struct startmenu *menu, const struct sm_node *n,
 static void startmenu_close(struct startmenu *menu);
 static void startmenu_render_popup(struct startmenu *menu);
 
-/*
- * Case-insensitive substring search (portable, no strcasestr needed).
- */
-static bool
-str_contains_icase(const char *haystack, const char *needle)
-{
-	if (!haystack) {
-		return false;
-	}
-	if (string_null_or_empty(needle)) {
-		return true;
-	}
-	size_t nlen = strlen(needle);
-	for (; *haystack; haystack++) {
-		if (strncasecmp(haystack, needle, nlen) == 0) {
-			return true;
-		}
-	}
-	return false;
-}
-
 /*
  * Rebuild the filtered[] index array based on the current search string.
- * Resets scroll_offset, hover, and selected.
+ * When the string has only grown, the previous matches are narrowed down
+ * rather than searching all apps again. The best MENU_MAX_VISIBLE matches,
+ * scored by the fuzzy match plus how often and recently they were launched,
+ * come first and the rest follow alphabetically. Resets scroll_offset,
+ * hover, and selected.
  */
 static void
 update_filtered(struct startmenu *menu)
 {
-	zfree(menu->filtered);
 	menu->n_filtered = 0;
 	menu->scroll_offset = 0;
 	menu->hover = -1;
@@ -318,22 +313,39 @@ update_filtered(struct startmenu *menu)
 	if (menu->n_apps == 0) {
 		return;
 	}
-
-	menu->filtered = calloc(menu->n_apps, sizeof(int));
-	if (!menu->filtered) {
-		return;
-	}
-
-	for (int i = 0; i < menu->n_apps; i++) {
-		if (str_contains_icase(menu->app_names[i], menu->search)) {
-			menu->filtered[menu->n_filtered++] = i;
-		}
-	}
+	if (!menu->matches) {
+		menu->matches = xzalloc(menu->n_apps * sizeof(int));
+		menu->filtered = xzalloc(menu->n_apps * sizeof(int));
+		menu->scores = xzalloc(menu->n_apps * sizeof(int));
+	}
+
+	char *folded = search_fold(menu->search);
+	bool narrow = menu->search_folded
+		&& strstr(folded, menu->search_folded);
+	menu->n_matches = search_index_match(menu->search_index, folded,
+		narrow ? menu->matches : NULL, menu->n_matches,
+		menu->matches, menu->scores);
+	free(menu->search_folded);
+	menu->search_folded = folded;
+
+	time_t now = time(NULL);
+	for (int i = 0; i < menu->n_matches; i++) {
+		int app_idx = menu->matches[i];
+		double launches = frecency_get(menu->frecency,
+			menu->app_ids[app_idx], now);
+		menu->scores[i] += FRECENCY_WEIGHT
+			* MIN(launches, FRECENCY_MAX_LAUNCHES);
+		menu->filtered[i] = app_idx;
+	}
+	menu->n_filtered = menu->n_matches;
+	search_rank(menu->filtered, menu->scores, menu->n_filtered,
+		MENU_MAX_VISIBLE);
 }
 
 /*
  * Launch an application by its executable name/path using a double-fork
- * so the grandchild is orphaned and no zombie is left.
+ * so the grandchild is orphaned and no zombie is left. This is done right
+ * away rather than on the worker, where a click could wait for a rescan.
  */
 static void
 launch_app(const char *exec)
@@ -350,6 +362,10 @@ launch_app(const char *exec)
 		pid_t grandchild = fork();
 		if (grandchild == 0) {
 			setsid();
+			/* Signals blocked for our signalfd must not stay blocked */
+			sigset_t none;
+			sigemptyset(&none);
+			sigprocmask(SIG_SETMASK, &none, NULL);
 			/* Redirect stdin/stdout/stderr to /dev/null */
 			int devnull = open("/dev/null", O_RDWR);
 			if (devnull >= 0) {
@@ -368,6 +384,17 @@ launch_app(const char *exec)
 	waitpid(pid, NULL, 0);
 }
 
+/* Launch app @app_idx and remember that for ranking */
+static void
+launch(struct startmenu *menu, int app_idx)
+{
+	debug("startmenu: launching %s (%s)", menu->app_names[app_idx],
+		menu->app_execs[app_idx]);
+	frecency_record(menu->frecency, menu->base.panel->worker,
+		menu->app_ids[app_idx], time(NULL));
+	launch_app(menu->app_execs[app_idx]);
+}
+
 static void
 startmenu_render_button(struct startmenu *menu)
 {
@@ -375,35 +402,73 @@ startmenu_render_button(struct startmenu *menu)
 	struct panel *panel = widget->panel;
 
 	const char *label = "↑";
+	if (!widget_key_update(widget, widget_label_key(widget, label))) {
+		return;
+	}
 	PangoRectangle rect = get_text_size(panel->conf->font_description, label);
 	widget->box.width = rect.width + 2 * panel->conf->startmenu_padding;
 
-	if (widget->surface) {
-		cairo_surface_destroy(widget->surface);
-	}
-	widget->surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
-		widget->box.width, panel->box.height);
-	cairo_t *cr = cairo_create(widget->surface);
+	cairo_t *cr = widget_surface_begin(widget, widget->box.width,
+		panel->height);
 
 //	cairo_set_source_u32(cr, panel->conf->task_background_color);
-//	cairo_rectangle(cr, 0, 0, widget->box.width, panel->box.height);
+//	cairo_rectangle(cr, 0, 0, widget->box.width, panel->height);
 //	cairo_fill(cr);
 
 	cairo_set_source_u32(cr, panel->conf->text);
 	cairo_move_to(cr, panel->conf->startmenu_padding,
-		(panel->box.height - rect.height) / 2.0);
+		(panel->height - rect.height) / 2.0);
 	render_text(cr, panel->conf->font_description, 1, false, "%s", label);
-	cairo_destroy(cr);
+	widget_surface_end(widget);
+}
+
+/* ------------------------------ Popup drawing ----------------------------- */
+
+enum menu_row_flags {
+	MENU_ROW_HIGHLIGHT = 1 << 0,
+	MENU_ROW_UP = 1 << 1,   /* more items above */
+	MENU_ROW_DOWN = 1 << 2, /* more items below */
+};
+
+#define MENU_ROW_EMPTY -1
+#define MENU_ROW_NO_RESULTS -2
+
+/* Enough for hovering up and down a full list and for a little scrolling */
+#define ROW_CACHE_SIZE (4 * MENU_MAX_VISIBLE)
+
+struct row_surface {
+	struct menu_row row;
+	int width;
+	cairo_surface_t *surface;
+	struct wl_list link; /* startmenu.row_cache */
+};
+
+static void
+row_cache_flush(struct startmenu *menu)
+{
+	if (!menu->row_cache_size) {
+		return;
+	}
+	struct row_surface *r, *next;
+	wl_list_for_each_safe(r, next, &menu->row_cache, link) {
+		wl_list_remove(&r->link);
+		cairo_surface_destroy(r->surface);
+		free(r);
+	}
+	menu->row_cache_size = 0;
 }
 
+/* Lay out the search box and list, which only depends on n_visible */
 static void
-startmenu_render_popup(struct startmenu *menu)
+popup_layout(struct startmenu *menu)
 {
-	struct panel *panel = menu->base.panel;
+	if (menu->layout_visible == menu->n_visible) {
+		return;
+	}
+	menu->layout_visible = menu->n_visible;
+
 	int width = MENU_WIDTH;
 	int height = (1 + menu->n_visible) * MENU_ITEM_HEIGHT;
-
-	/* Layout pass */
 	menu->ui_search = (struct box){0};
 	menu->ui_list = (struct box){0};
 	if (menu->ui_root) {
@@ -426,145 +491,324 @@ startmenu_render_popup(struct startmenu *menu)
 			.height = menu->n_visible * MENU_ITEM_HEIGHT,
 		};
 	}
+	if (menu->ui_search.height > 0 && !menu->ui_search.width) {
+		menu->ui_search.width = width;
+	}
+	if (menu->ui_list.height > 0 && !menu->ui_list.width) {
+		menu->ui_list.width = width;
+	}
+	menu->popup_height = height;
+}
 
-	struct pool_buffer *buffer = get_next_buffer(panel->shm,
-		menu->popup_buffers, width, height);
-	if (!buffer) {
-		return;
+static int
+popup_visible_rows(struct startmenu *menu)
+{
+	if (menu->ui_list.height <= 0) {
+		return 0;
 	}
+	return MAX(menu->ui_list.height / MENU_ITEM_HEIGHT, 1);
+}
 
-	cairo_t *cr = buffer->cairo;
-	cairo_save(cr);
-	cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
-	cairo_paint(cr);
-	cairo_restore(cr);
+/* Work out what each list row should show, into @rows[visible_rows] */
+static void
+popup_rows(struct startmenu *menu, struct menu_row *rows, int visible_rows)
+{
+	if (!visible_rows) {
+		return;
+	}
+	int highlighted = -1;
+	if (menu->selected >= 0) {
+		int row_of_selected = menu->selected - menu->scroll_offset;
+		if (row_of_selected >= 0 && row_of_selected < visible_rows) {
+			highlighted = row_of_selected;
+		}
+	} else if (menu->hover >= 0) {
+		highlighted = menu->hover;
+	}
 
-	/* --- Search widget --- */
-	if (menu->ui_search.height > 0) {
-		struct box r = menu->ui_search;
-		if (!r.width) {
-			r.width = width;
+	for (int row = 0; row < visible_rows; row++) {
+		int idx = menu->scroll_offset + row;
+		rows[row] = (struct menu_row){ .app_idx = MENU_ROW_EMPTY };
+		if (menu->n_filtered == 0) {
+			if (row == 0) {
+				rows[row].app_idx = MENU_ROW_NO_RESULTS;
+			}
+		} else if (idx < menu->n_filtered) {
+			rows[row].app_idx = menu->filtered[idx];
+			if (row == highlighted) {
+				rows[row].flags |= MENU_ROW_HIGHLIGHT;
+			}
 		}
+	}
+	if (menu->scroll_offset > 0) {
+		rows[0].flags |= MENU_ROW_UP;
+	}
+	if (menu->scroll_offset + visible_rows < menu->n_filtered) {
+		rows[visible_rows - 1].flags |= MENU_ROW_DOWN;
+	}
+}
+
+static bool
+row_equal(const struct menu_row *a, const struct menu_row *b)
+{
+	return a->app_idx == b->app_idx && a->flags == b->flags;
+}
+
+static void
+draw_row_arrow(cairo_t *cr, struct panel *panel, int width, const char *arrow)
+{
+	PangoRectangle rect = get_text_size(panel->conf->font_description, arrow);
+	cairo_set_source_u32(cr, panel->conf->text);
+	cairo_move_to(cr, width - rect.width - panel->conf->startmenu_padding,
+		(MENU_ITEM_HEIGHT - rect.height) / 2.0);
+	render_text(cr, panel->conf->font_description, 1, false, "%s", arrow);
+}
+
+/* Draw @row at 0,0 */
+static void
+draw_row(cairo_t *cr, struct startmenu *menu, const struct menu_row *row,
+		int width)
+{
+	struct panel *panel = menu->base.panel;
+
+	if (row->flags & MENU_ROW_HIGHLIGHT) {
+		cairo_set_source_u32(cr, panel->conf->task_active_background_color);
+	} else {
 		cairo_set_source_u32(cr, panel->conf->task_background_color);
-		cairo_rectangle(cr, r.x, r.y, r.width, r.height);
-		cairo_fill(cr);
+	}
+	cairo_save(cr);
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	cairo_rectangle(cr, 0, 0, width, MENU_ITEM_HEIGHT);
+	cairo_fill(cr);
+	cairo_restore(cr);
 
+	const char *name = NULL;
+	if (row->app_idx == MENU_ROW_NO_RESULTS) {
+		name = "No results";
+	} else if (row->app_idx >= 0) {
+		name = menu->app_names[row->app_idx];
+	}
+	if (name) {
+		PangoRectangle rect = get_text_size(panel->conf->font_description,
+			name);
 		cairo_set_source_u32(cr, panel->conf->text);
-		cairo_set_line_width(cr, 1.0);
-		cairo_rectangle(cr, r.x + 1, r.y + 1, r.width - 2, r.height - 2);
-		cairo_stroke(cr);
+		cairo_move_to(cr, panel->conf->startmenu_padding,
+			(MENU_ITEM_HEIGHT - rect.height) / 2.0);
+		render_text(cr, panel->conf->font_description, 1, false, "%s",
+			name);
+	}
 
-		PangoRectangle search_rect = get_text_size(panel->conf->font_description,
-			*menu->search ? menu->search : " ");
-		cairo_set_source_u32(cr, panel->conf->text);
-		cairo_move_to(cr, r.x + panel->conf->startmenu_padding,
-			r.y + (r.height - search_rect.height) / 2.0);
-		if (*menu->search) {
-			render_text(cr, panel->conf->font_description, 1, false, "%s",
-				menu->search);
-		} else {
-			render_text(cr, panel->conf->font_description, 1, false,
-				"Search...");
-		}
+	if (row->flags & MENU_ROW_UP) {
+		draw_row_arrow(cr, panel, width, "▲");
+	}
+	if (row->flags & MENU_ROW_DOWN) {
+		draw_row_arrow(cr, panel, width, "▼");
 	}
+}
 
-	/* --- App list widget --- */
-	if (menu->ui_list.height > 0) {
-		struct box r = menu->ui_list;
-		if (!r.width) {
-			r.width = width;
-		}
-		int visible_rows = r.height / MENU_ITEM_HEIGHT;
-		if (visible_rows < 1) {
-			visible_rows = 1;
+/* Get @row rasterized, from the cache if it has been drawn recently */
+static cairo_surface_t *
+row_surface(struct startmenu *menu, const struct menu_row *row, int width)
+{
+	if (!menu->row_cache_size) {
+		wl_list_init(&menu->row_cache);
+	}
+	struct row_surface *r;
+	wl_list_for_each(r, &menu->row_cache, link) {
+		if (r->width == width && row_equal(&r->row, row)) {
+			stats.menu_row_cache_hits++;
+			wl_list_remove(&r->link);
+			wl_list_insert(&menu->row_cache, &r->link);
+			return r->surface;
 		}
+	}
+	stats.menu_row_cache_misses++;
 
-		int highlighted = -1;
-		if (menu->selected >= 0) {
-			int row_of_selected = menu->selected - menu->scroll_offset;
-			if (row_of_selected >= 0 && row_of_selected < visible_rows) {
-				highlighted = row_of_selected;
-			}
-		} else if (menu->hover >= 0) {
-			highlighted = menu->hover;
-		}
+	if (menu->row_cache_size >= ROW_CACHE_SIZE) {
+		r = wl_container_of(menu->row_cache.prev, r, link);
+		wl_list_remove(&r->link);
+		cairo_surface_destroy(r->surface);
+	} else {
+		r = znew(*r);
+		menu->row_cache_size++;
+	}
+	r->row = *row;
+	r->width = width;
+	r->surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width,
+		MENU_ITEM_HEIGHT);
+	cairo_t *cr = cairo_create(r->surface);
+	draw_row(cr, menu, row, width);
+	cairo_destroy(cr);
+	wl_list_insert(&menu->row_cache, &r->link);
+	return r->surface;
+}
 
-		if (menu->n_filtered == 0) {
-			int y = r.y;
-			cairo_set_source_u32(cr, panel->conf->task_background_color);
-			cairo_rectangle(cr, r.x, y, r.width, MENU_ITEM_HEIGHT);
-			cairo_fill(cr);
-			PangoRectangle text_rect = get_text_size(
-				panel->conf->font_description, "No results");
-			cairo_set_source_u32(cr, panel->conf->text);
-			cairo_move_to(cr, r.x + panel->conf->startmenu_padding,
-				y + (MENU_ITEM_HEIGHT - text_rect.height) / 2.0);
-			render_text(cr, panel->conf->font_description, 1, false,
-				"No results");
-			for (int row = 1; row < visible_rows; row++) {
-				y = r.y + row * MENU_ITEM_HEIGHT;
-				cairo_set_source_u32(cr, panel->conf->task_background_color);
-				cairo_rectangle(cr, r.x, y, r.width, MENU_ITEM_HEIGHT);
-				cairo_fill(cr);
-			}
-		} else {
-			for (int row = 0; row < visible_rows; row++) {
-				int idx = menu->scroll_offset + row;
-				int y = r.y + row * MENU_ITEM_HEIGHT;
-
-				if (idx >= menu->n_filtered) {
-					cairo_set_source_u32(cr, panel->conf->task_background_color);
-					cairo_rectangle(cr, r.x, y, r.width, MENU_ITEM_HEIGHT);
-					cairo_fill(cr);
-					continue;
-				}
-
-				if (row == highlighted) {
-					cairo_set_source_u32(cr, panel->conf->task_active_background_color);
-				} else {
-					cairo_set_source_u32(cr, panel->conf->task_background_color);
-				}
-				cairo_rectangle(cr, r.x, y, r.width, MENU_ITEM_HEIGHT);
-				cairo_fill(cr);
-
-				int app_idx = menu->filtered[idx];
-				const char *name = menu->app_names[app_idx];
-				PangoRectangle text_rect = get_text_size(
-					panel->conf->font_description, name);
-				cairo_set_source_u32(cr, panel->conf->text);
-				cairo_move_to(cr, r.x + panel->conf->startmenu_padding,
-					y + (MENU_ITEM_HEIGHT - text_rect.height) / 2.0);
-				render_text(cr, panel->conf->font_description, 1, false,
-					"%s", name);
-			}
-		}
+/* Copy a row of @box.width pixels at @box.x from @src_y in @front to @dst_y */
+static void
+copy_row(struct pool_buffer *buffer, struct pool_buffer *front,
+		const struct box *box, int dst_y, int src_y)
+{
+	size_t stride = buffer->width * 4;
+	for (int i = 0; i < MENU_ITEM_HEIGHT; i++) {
+		memcpy((char *)buffer->data + (dst_y + i) * stride + box->x * 4,
+			(char *)front->data + (src_y + i) * stride + box->x * 4,
+			box->width * 4);
+	}
+}
+
+static void
+draw_search(cairo_t *cr, struct startmenu *menu)
+{
+	struct panel *panel = menu->base.panel;
+	struct box r = menu->ui_search;
+
+	cairo_set_source_u32(cr, panel->conf->task_background_color);
+	cairo_save(cr);
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	cairo_rectangle(cr, r.x, r.y, r.width, r.height);
+	cairo_fill(cr);
+	cairo_restore(cr);
+
+	cairo_set_source_u32(cr, panel->conf->text);
+	cairo_set_line_width(cr, 1.0);
+	cairo_rectangle(cr, r.x + 1, r.y + 1, r.width - 2, r.height - 2);
+	cairo_stroke(cr);
+
+	PangoRectangle search_rect = get_text_size(panel->conf->font_description,
+		*menu->search ? menu->search : " ");
+	cairo_set_source_u32(cr, panel->conf->text);
+	cairo_move_to(cr, r.x + panel->conf->startmenu_padding,
+		r.y + (r.height - search_rect.height) / 2.0);
+	if (*menu->search) {
+		render_text(cr, panel->conf->font_description, 1, false, "%s",
+			menu->search);
+	} else {
+		render_text(cr, panel->conf->font_description, 1, false,
+			"Search...");
+	}
+}
+
+static void
+damage_box(cairo_region_t *damage, const struct box *box)
+{
+	cairo_region_union_rectangle(damage, &(cairo_rectangle_int_t){
+		box->x, box->y, box->width, box->height });
+}
+
+/*
+ * Draw the popup into a fresh buffer, redrawing only what differs from the
+ * last committed one. A hover change repaints two rows, a scroll copies the
+ * rows that are still visible and paints the ones that came into view.
+ */
+static void
+startmenu_render_popup(struct startmenu *menu)
+{
+	struct panel *panel = menu->base.panel;
+	if (!menu->configured) {
+		return;
+	}
+	popup_layout(menu);
+	int width = MENU_WIDTH;
+	int height = menu->popup_height;
+
+	int visible_rows = popup_visible_rows(menu);
+	struct menu_row rows[visible_rows + 1];
+	popup_rows(menu, rows, visible_rows);
+
+	struct pool_buffer *front = menu->popup_front;
+	bool full = !front || front->width != (uint32_t)width
+		|| front->height != (uint32_t)height;
+	if (full || menu->n_drawn_rows != visible_rows) {
+		menu->n_drawn_rows = 0;
+		zfree(menu->drawn_search);
+	}
+	bool search_changed = menu->ui_search.height > 0
+		&& (!menu->drawn_search || strcmp(menu->drawn_search, menu->search));
+	if (!full && !search_changed && menu->n_drawn_rows == visible_rows
+			&& !memcmp(rows, menu->drawn_rows,
+				visible_rows * sizeof(*rows))) {
+		return;
+	}
+
+	struct pool_buffer *buffer = get_next_buffer(panel->shm,
+		&menu->popup_pool, width, height);
+	if (!buffer) {
+		return;
+	}
+	cairo_region_t *damage = cairo_region_create();
+	cairo_t *cr = buffer->cairo;
+	if (full) {
+		cairo_save(cr);
+		cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+		cairo_paint(cr);
+		cairo_restore(cr);
+		damage_box(damage, &(struct box){ .width = width, .height = height });
+	} else {
+		buffer_copy_forward(buffer, front);
+	}
+
+	if (search_changed) {
+		draw_search(cr, menu);
+		damage_box(damage, &menu->ui_search);
+		xstrdup_replace(menu->drawn_search, menu->search);
+	}
 
-		if (menu->scroll_offset > 0) {
-			int y = r.y;
-			PangoRectangle arr_rect =
-				get_text_size(panel->conf->font_description, "▲");
-			cairo_set_source_u32(cr, panel->conf->text);
-			cairo_move_to(cr, r.x + r.width - arr_rect.width
-					- panel->conf->startmenu_padding,
-				y + (MENU_ITEM_HEIGHT - arr_rect.height) / 2.0);
-			render_text(cr, panel->conf->font_description, 1, false, "▲");
+	/* Rows can only be copied from a buffer that is not being drawn into */
+	bool can_copy = !full && front != buffer;
+	cairo_surface_flush(buffer->surface);
+	for (int row = 0; row < visible_rows; row++) {
+		bool drawn = row < menu->n_drawn_rows;
+		if (drawn && row_equal(&rows[row], &menu->drawn_rows[row])) {
+			continue;
+		}
+		struct box r = menu->ui_list;
+		r.y += row * MENU_ITEM_HEIGHT;
+		r.height = MENU_ITEM_HEIGHT;
+		damage_box(damage, &r);
+
+		int src = -1;
+		for (int i = 0; can_copy && i < menu->n_drawn_rows; i++) {
+			if (row_equal(&rows[row], &menu->drawn_rows[i])) {
+				src = i;
+				break;
+			}
 		}
-		if (menu->scroll_offset + visible_rows < menu->n_filtered) {
-			int y = r.y + (visible_rows - 1) * MENU_ITEM_HEIGHT;
-			PangoRectangle arr_rect =
-				get_text_size(panel->conf->font_description, "▼");
-			cairo_set_source_u32(cr, panel->conf->text);
-			cairo_move_to(cr, r.x + r.width - arr_rect.width
-					- panel->conf->startmenu_padding,
-				y + (MENU_ITEM_HEIGHT - arr_rect.height) / 2.0);
-			render_text(cr, panel->conf->font_description, 1, false, "▼");
+		if (src >= 0) {
+			copy_row(buffer, front, &r, r.y,
+				menu->ui_list.y + src * MENU_ITEM_HEIGHT);
+			cairo_surface_mark_dirty_rectangle(buffer->surface, r.x, r.y,
+				r.width, r.height);
+			stats.menu_rows_copied++;
+			continue;
 		}
+		cairo_save(cr);
+		cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+		cairo_set_source_surface(cr, row_surface(menu, &rows[row], r.width),
+			r.x, r.y);
+		cairo_rectangle(cr, r.x, r.y, r.width, r.height);
+		cairo_fill(cr);
+		cairo_restore(cr);
 	}
+	cairo_surface_flush(buffer->surface);
 
 	wl_surface_set_buffer_scale(menu->popup_surface, 1);
 	wl_surface_attach(menu->popup_surface, buffer->buffer, 0, 0);
-	wl_surface_damage(menu->popup_surface, 0, 0, width, height);
+	int n = cairo_region_num_rectangles(damage);
+	for (int i = 0; i < n; i++) {
+		cairo_rectangle_int_t rect;
+		cairo_region_get_rectangle(damage, i, &rect);
+		wl_surface_damage_buffer(menu->popup_surface, rect.x, rect.y,
+			rect.width, rect.height);
+	}
 	wl_surface_commit(menu->popup_surface);
+
+	pool_commit_damage(&menu->popup_pool, buffer, damage);
+	cairo_region_destroy(damage);
+	menu->popup_front = buffer;
+	menu->drawn_rows = xrealloc(menu->drawn_rows,
+		(visible_rows + 1) * sizeof(*rows));
+	memcpy(menu->drawn_rows, rows, visible_rows * sizeof(*rows));
+	menu->n_drawn_rows = visible_rows;
 }
 
 static void
@@ -573,6 +817,7 @@ popup_xdg_surface_configure(void *data, struct xdg_surface *xdg_surface,
 {
 	struct startmenu *menu = data;
 	xdg_surface_ack_configure(xdg_surface, serial);
+	menu->configured = true;
 	startmenu_render_popup(menu);
 }
 
@@ -592,7 +837,7 @@ popup_done(void *data, struct xdg_popup *popup)
 {
 	struct startmenu *menu = data;
 	startmenu_close(menu);
-	render_frame(menu->base.panel);
+	panel_schedule_frame(menu->base.panel);
 }
 
 static void
@@ -626,20 +871,35 @@ startmenu_close(struct startmenu *menu)
 		wl_surface_destroy(menu->popup_surface);
 		menu->popup_surface = NULL;
 	}
-	destroy_buffer(&menu->popup_buffers[0]);
-	destroy_buffer(&menu->popup_buffers[1]);
+	pool_finish(&menu->popup_pool);
+	menu->popup_front = NULL;
+	menu->n_drawn_rows = 0;
+	zfree(menu->drawn_search);
+	menu->layout_visible = 0;
 	menu->hover = -1;
 	menu->selected = -1;
 	menu->search[0] = '\0';
 	menu->search_len = 0;
 	menu->popup_open = false;
+	menu->configured = false;
+	menu->bar = NULL;
 	panel->open_popup = NULL;
 }
 
-/* Temporary struct for sorting parallel app_names/app_execs arrays */
+/*
+ * Temporary struct for sorting the parallel app_* arrays. The
+ * strings are copied into a struct buf, which moves as it grows, so they are
+ * recorded as offsets and only turned into pointers once it is complete.
+ */
 struct app_entry {
-	char *name;
-	char *exec;
+	size_t name_offset;
+	size_t exec_offset;
+	size_t id_offset;
+	size_t keywords_offset; /* SIZE_MAX if there are none */
+	const char *name;
+	const char *exec;
+	const char *id;
+	const char *keywords;
 };
 
 static int
@@ -651,140 +911,109 @@ app_entry_cmp(const void *a, const void *b)
 }
 
 /*
- * Load all installed applications from XDG .desktop files using libsfdo.
- * Fills menu->app_names, menu->app_execs, menu->n_apps.
- * The arrays are sorted alphabetically by display name.
+ * Fill the menu->app_* arrays and menu->n_apps from the panel's
+ * desktop entries. The arrays are sorted alphabetically by display name and
+ * point into the single menu->app_strings allocation.
  */
 static void
 load_apps(struct startmenu *menu)
 {
-	// TOOD: Use panel->desktop_ctx etc
-	struct sfdo_basedir_ctx *basedir_ctx = sfdo_basedir_ctx_create();
-	if (!basedir_ctx) {
-		warn("startmenu: failed to create basedir context");
-		return;
+	menu->apps_loaded = true;
+	uint64_t start = stats_now();
+	if (!menu->frecency) {
+		menu->frecency = frecency_load();
 	}
 
-	struct sfdo_desktop_ctx *desktop_ctx =
-		sfdo_desktop_ctx_create(basedir_ctx);
-	sfdo_basedir_ctx_destroy(basedir_ctx);
-	if (!desktop_ctx) {
-		warn("startmenu: failed to create desktop context");
-		return;
-	}
-
-	struct sfdo_desktop_db *db = sfdo_desktop_db_load(desktop_ctx, NULL);
-	sfdo_desktop_ctx_destroy(desktop_ctx);
-	if (!db) {
-		warn("startmenu: failed to load desktop db");
+	size_t n_entries;
+	const struct desktop_app *entries =
+		desktop_entry_get_apps(menu->base.panel, &n_entries);
+	if (!n_entries) {
+		warn("startmenu: no desktop entries");
 		return;
 	}
 
-	size_t n_entries;
-	struct sfdo_desktop_entry **entries =
-		sfdo_desktop_db_get_entries(db, &n_entries);
-
-	/* First pass: count valid application entries */
-	int count = 0;
+	struct app_entry *entries_buf = xzalloc(n_entries * sizeof(struct app_entry));
+	struct buf strings = {0};
+	int j = 0;
 	for (size_t i = 0; i < n_entries; i++) {
-		struct sfdo_desktop_entry *entry = entries[i];
-		if (sfdo_desktop_entry_get_type(entry)
-				!= SFDO_DESKTOP_ENTRY_APPLICATION) {
+		const struct desktop_app *entry = &entries[i];
+		if (!entry->application || entry->no_display
+				|| string_null_or_empty(entry->exec)) {
 			continue;
 		}
-		if (sfdo_desktop_entry_get_no_display(entry)) {
-			continue;
-		}
-		if (!sfdo_desktop_entry_get_exec(entry)) {
-			continue;
-		}
-		count++;
-	}
-
-	if (count == 0) {
-		sfdo_desktop_db_destroy(db);
-		return;
+		const char *name = entry->name && *entry->name
+			? entry->name : entry->exec;
+		entries_buf[j].name_offset = buf_add_str(&strings, name);
+		entries_buf[j].exec_offset = buf_add_str(&strings, entry->exec);
+		entries_buf[j].id_offset = buf_add_str(&strings, entry->id);
+		entries_buf[j].keywords_offset = entry->keywords
+			? buf_add_str(&strings, entry->keywords) : SIZE_MAX;
+		j++;
 	}
 
-	struct app_entry *entries_buf = calloc(count, sizeof(struct app_entry));
-	if (!entries_buf) {
-		sfdo_desktop_db_destroy(db);
+	if (j == 0) {
+		free(entries_buf);
 		return;
 	}
 
-	/* Second pass: populate entries_buf */
-	int j = 0;
-	for (size_t i = 0; i < n_entries; i++) {
-		struct sfdo_desktop_entry *entry = entries[i];
-		if (sfdo_desktop_entry_get_type(entry)
-				!= SFDO_DESKTOP_ENTRY_APPLICATION) {
-			continue;
-		}
-		if (sfdo_desktop_entry_get_no_display(entry)) {
-			continue;
-		}
-		struct sfdo_desktop_exec *exec_tmpl =
-			sfdo_desktop_entry_get_exec(entry);
-		if (!exec_tmpl) {
-			continue;
-		}
-		/*
-		 * Format the exec template without a file argument to get a
-		 * concrete argv list, then take args[0] as the executable.
-		 * This uses only the stable libsfdo API available in all
-		 * releases, avoiding sfdo_desktop_entry_get_exec_arg0() which
-		 * was added later.
-		 */
-		struct sfdo_desktop_exec_command *cmd =
-			sfdo_desktop_exec_format(exec_tmpl, NULL);
-		if (!cmd) {
-			continue;
-		}
-		size_t n_args;
-		const char **args =
-			sfdo_desktop_exec_command_get_args(cmd, &n_args);
-		const char *exec_str =
-			(n_args > 0 && args && args[0]) ? args[0] : NULL;
-		if (string_null_or_empty(exec_str)) {
-			sfdo_desktop_exec_command_destroy(cmd);
-			continue;
+	for (int k = 0; k < j; k++) {
+		entries_buf[k].name = strings.data + entries_buf[k].name_offset;
+		entries_buf[k].exec = strings.data + entries_buf[k].exec_offset;
+		entries_buf[k].id = strings.data + entries_buf[k].id_offset;
+		if (entries_buf[k].keywords_offset != SIZE_MAX) {
+			entries_buf[k].keywords =
+				strings.data + entries_buf[k].keywords_offset;
 		}
-		const char *name = sfdo_desktop_entry_get_name(entry, NULL);
-		entries_buf[j].name = strdup(name && *name ? name : exec_str);
-		entries_buf[j].exec = strdup(exec_str);
-		sfdo_desktop_exec_command_destroy(cmd);
-		j++;
 	}
-	sfdo_desktop_db_destroy(db);
 
 	/* Sort alphabetically by display name */
 	qsort(entries_buf, j, sizeof(struct app_entry), app_entry_cmp);
 
 	/* Unpack into the parallel arrays */
-	menu->app_names = calloc(j, sizeof(char *));
-	menu->app_execs = calloc(j, sizeof(char *));
-	if (!menu->app_names || !menu->app_execs) {
-		for (int k = 0; k < j; k++) {
-			free(entries_buf[k].name);
-			free(entries_buf[k].exec);
-		}
-		free(entries_buf);
-		free(menu->app_names);
-		free(menu->app_execs);
-		menu->app_names = NULL;
-		menu->app_execs = NULL;
-		return;
-	}
+	menu->app_names = xzalloc(j * sizeof(char *));
+	menu->app_execs = xzalloc(j * sizeof(char *));
+	menu->app_ids = xzalloc(j * sizeof(char *));
+	menu->app_keywords = xzalloc(j * sizeof(char *));
 	for (int k = 0; k < j; k++) {
 		menu->app_names[k] = entries_buf[k].name;
 		menu->app_execs[k] = entries_buf[k].exec;
+		menu->app_ids[k] = entries_buf[k].id;
+		menu->app_keywords[k] = entries_buf[k].keywords;
 	}
 	free(entries_buf);
+	menu->app_strings = strings.data;
 	menu->n_apps = j;
+	menu->search_index = search_index_create(menu->app_names,
+		menu->app_execs, menu->app_keywords, j);
 
+	stats_timer_add(&stats.load_apps, start);
 	debug("startmenu: loaded %d applications", menu->n_apps);
 }
 
+static void
+free_apps(struct startmenu *menu)
+{
+	zfree(menu->app_strings);
+	zfree(menu->app_names);
+	zfree(menu->app_execs);
+	zfree(menu->app_ids);
+	zfree(menu->app_keywords);
+	search_index_destroy(menu->search_index);
+	menu->search_index = NULL;
+	zfree(menu->search_folded);
+	zfree(menu->matches);
+	zfree(menu->filtered);
+	zfree(menu->scores);
+	menu->n_matches = 0;
+	menu->n_filtered = 0;
+	menu->n_apps = 0;
+	menu->apps_loaded = false;
+
+	/* The rows refer to apps by index */
+	row_cache_flush(menu);
+	menu->n_drawn_rows = 0;
+}
+
 static void
 startmenu_on_left_button_press(struct widget *widget, struct seat *seat)
 {
@@ -798,10 +1027,21 @@ startmenu_on_left_button_press(struct widget *widget, struct seat *seat)
 
 	if (menu->popup_open) {
 		startmenu_close(menu);
-		render_frame(panel);
+		panel_schedule_frame(panel);
+		return;
+	}
+
+	/* The popup opens from the button on the bar that was clicked */
+	struct bar *bar = seat->pointer.bar;
+	struct box anchor;
+	if (!bar || !layout_widget_box(bar, widget, &anchor)) {
 		return;
 	}
 
+	if (!menu->apps_loaded) {
+		load_apps(menu);
+	}
+
 	/* Reset search and rebuild filter */
 	menu->search[0] = '\0';
 	menu->search_len = 0;
@@ -832,19 +1072,12 @@ startmenu_on_left_button_press(struct widget *widget, struct seat *seat)
 	xdg_surface_add_listener(menu->xdg_surface,
 		&popup_xdg_surface_listener, menu);
 
-	int popup_height = (1 + menu->n_visible) * MENU_ITEM_HEIGHT;
-	if (menu->ui_root) {
-		int mw = 0, mh = 0;
-		sm_measure(menu, (const struct sm_node *)menu->ui_root, &mw, &mh);
-		if (mh > 0) {
-			popup_height = mh;
-		}
-	}
+	popup_layout(menu);
 	struct xdg_positioner *positioner =
 		xdg_wm_base_create_positioner(panel->xdg_wm_base);
-	xdg_positioner_set_size(positioner, MENU_WIDTH, popup_height);
-	xdg_positioner_set_anchor_rect(positioner, widget->box.x, 0,
-		widget->box.width, panel->box.height);
+	xdg_positioner_set_size(positioner, MENU_WIDTH, menu->popup_height);
+	xdg_positioner_set_anchor_rect(positioner, anchor.x, 0, anchor.width,
+		bar->box.height);
 	xdg_positioner_set_anchor(positioner, XDG_POSITIONER_ANCHOR_BOTTOM_LEFT);
 	xdg_positioner_set_gravity(positioner,
 		XDG_POSITIONER_GRAVITY_BOTTOM_RIGHT);
@@ -865,16 +1098,17 @@ startmenu_on_left_button_press(struct widget *widget, struct seat *seat)
 		return;
 	}
 
-	zwlr_layer_surface_v1_get_popup(panel->layer_surface, menu->xdg_popup);
+	zwlr_layer_surface_v1_get_popup(bar->layer_surface, menu->xdg_popup);
+	menu->bar = bar;
 	xdg_popup_add_listener(menu->xdg_popup, &popup_listener, menu);
 	xdg_popup_grab(menu->xdg_popup, seat->wl_seat,
 		seat->pointer.button_serial);
 
-	wl_surface_commit(menu->popup_surface);
-	wl_display_roundtrip(panel->display);
-
 	menu->popup_open = true;
 	panel->open_popup = menu;
+
+	/* The popup is drawn once the configure event arrives */
+	wl_surface_commit(menu->popup_surface);
 }
 
 static const struct widget_impl startmenu_widget_impl = {
@@ -931,19 +1165,15 @@ plugin_startmenu_key(struct panel *panel, uint32_t key)
 			: (menu->hover >= 0
 				? menu->scroll_offset + menu->hover : -1);
 		if (idx >= 0 && idx < menu->n_filtered) {
-			int app_idx = menu->filtered[idx];
-			debug("startmenu: launching %s (%s)",
-				menu->app_names[app_idx],
-				menu->app_execs[app_idx]);
-			launch_app(menu->app_execs[app_idx]);
+			launch(menu, menu->filtered[idx]);
 		}
 		startmenu_close(menu);
-		render_frame(panel);
+		panel_schedule_frame(panel);
 		break;
 	}
 	case KEY_ESC:
 		startmenu_close(menu);
-		render_frame(panel);
+		panel_schedule_frame(panel);
 		break;
 	case KEY_BACKSPACE:
 		if (menu->search_len > 0) {
@@ -1052,12 +1282,9 @@ plugin_startmenu_popup_click(struct startmenu *menu, int y)
 	}
 	int idx = menu->scroll_offset + row;
 	if (idx < menu->n_filtered) {
-		int app_idx = menu->filtered[idx];
-		debug("startmenu: launching %s (%s)",
-			menu->app_names[app_idx], menu->app_execs[app_idx]);
-		launch_app(menu->app_execs[app_idx]);
+		launch(menu, menu->filtered[idx]);
 		startmenu_close(menu);
-		render_frame(menu->base.panel);
+		panel_schedule_frame(menu->base.panel);
 	}
 }
 
@@ -1091,21 +1318,25 @@ plugin_startmenu_destroy(struct startmenu *menu)
 	sm_node_free((struct sm_node *)menu->ui_root);
 	menu->ui_root = NULL;
 
-	for (int i = 0; i < menu->n_apps; i++) {
-		free(menu->app_names[i]);
-		free(menu->app_execs[i]);
-	}
-	free(menu->app_names);
-	free(menu->app_execs);
-	free(menu->filtered);
+	free_apps(menu);
+	frecency_destroy(menu->frecency);
+	free(menu->drawn_rows);
 
 	wl_list_remove(&menu->base.link);
 	widget_free(&menu->base);
 }
 
+/* E.g. because the bar it is attached to is going away */
+void
+plugin_startmenu_close(struct startmenu *menu)
+{
+	startmenu_close(menu);
+}
+
 void
 plugin_startmenu_update(struct panel *panel)
 {
+	uint64_t start = stats_now();
 	struct widget *widget;
 	wl_list_for_each(widget, &panel->widgets, link) {
 		if (widget->type == WIDGET_STARTMENU) {
@@ -1113,6 +1344,29 @@ plugin_startmenu_update(struct panel *panel)
 			break;
 		}
 	}
+	stats_timer_add(&stats.startmenu_update, start);
+}
+
+/*
+ * Pick up a changed set of desktop entries. A closed menu just reloads on
+ * next open; an open one is refreshed in place, keeping the search string.
+ */
+void
+plugin_startmenu_reload(struct panel *panel)
+{
+	struct widget *widget;
+	wl_list_for_each(widget, &panel->widgets, link) {
+		if (widget->type != WIDGET_STARTMENU) {
+			continue;
+		}
+		struct startmenu *menu = (struct startmenu *)widget;
+		free_apps(menu);
+		if (menu->popup_open) {
+			load_apps(menu);
+			update_filtered(menu);
+			startmenu_render_popup(menu);
+		}
+	}
 }
 
 void
@@ -1145,6 +1399,4 @@ plugin_startmenu_create(struct panel *panel)
 		warn("startmenu: failed to parse startmenu_layout, falling back");
 		menu->ui_root = sm_parse_layout("<vbox><search/><applist/></vbox>");
 	}
-
-	load_apps(menu);
 }
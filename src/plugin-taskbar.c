@@ -1,16 +1,21 @@
 // SPDX-License-Identifier: GPL-2.0-only
 #include <assert.h>
+#include <string.h>
 #include "conf.h"
 #include "common/box.h"
+#include "common/hash.h"
+#include "common/intern.h"
 #include "common/mem.h"
 #include "desktop-entry.h"
 #include "panel.h"
+#include "stats.h"
 #include "wlr-foreign-toplevel-management-unstable-v1-client-protocol.h"
 
+#define ICON_SIZE 22
+
 static struct box
 button_size(struct widget *widget, PangoRectangle rect, int padding)
 {
-	int ICON_SIZE = 22;
 	struct conf *conf = widget->panel->conf;
 	struct box box = {
 		.width = rect.width + 3 * padding + ICON_SIZE,
@@ -20,7 +25,11 @@ button_size(struct widget *widget, PangoRectangle rect, int padding)
 	return box;
 }
 
-// TODO: should we pass 'width' to this function?
+/*
+ * Draw the button at the width given by the layout, or at its natural width
+ * until it has been laid out. Buttons may be squeezed down to the icon when
+ * the taskbar is full, so the title is clipped.
+ */
 static void
 toplevel_update_surface(struct toplevel *toplevel)
 {
@@ -29,23 +38,31 @@ toplevel_update_surface(struct toplevel *toplevel)
 	struct panel *panel = widget->panel;
 	assert(panel);
 
-	if (widget->surface) {
-		cairo_surface_destroy(widget->surface);
-	}
 	const char *label = toplevel->title
 		? toplevel->title
 		: (toplevel->app_id ? toplevel->app_id : "?");
+	uint64_t key = widget_label_key(widget, label);
+	key = hash_str(key, toplevel->app_id);
+	key = hash_u64(key, toplevel->active);
+	key = hash_u64(key, widget->box.width);
+	if (!widget_key_update(widget, key)) {
+		return;
+	}
 	PangoRectangle rect =
 		get_text_size(panel->conf->font_description, label);
 	int padding = panel->conf->task_padding;
 	struct box box = button_size(widget, rect, padding);
 
-	widget->surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
-		box.width, box.height);
-	cairo_t *cairo = cairo_create(widget->surface);
+	widget->natural_width = box.width;
+	widget->min_width = ICON_SIZE + 2 * padding;
+	widget->max_width = BUTTON_MAX_WIDTH;
+	widget->shrink = 1;
+	if (widget->box.width) {
+		box.width = widget->box.width;
+	}
+	widget->box.height = box.height;
 
-	toplevel->base.box.width = box.width;
-	toplevel->base.box.height = box.height;
+	cairo_t *cairo = widget_surface_begin(widget, box.width, box.height);
 
 	/* Draw background */
 	cairo_save(cairo);
@@ -59,14 +76,18 @@ toplevel_update_surface(struct toplevel *toplevel)
 	cairo_restore(cairo);
 
 	/* Add icon */
-	int ICON_SIZE = 22;
-	desktop_entry_load_icon_from_app_id(cairo, panel, toplevel->app_id, ICON_SIZE, 1.0);
+	desktop_entry_load_icon_from_app_id(cairo, panel, toplevel->app_id, ICON_SIZE,
+		panel->scale);
 
 	/* Draw text */
+	cairo_save(cairo);
+	cairo_rectangle(cairo, 0, 0, box.width - padding, box.height);
+	cairo_clip(cairo);
 	cairo_set_source_u32(cairo, panel->conf->text);
 	cairo_move_to(cairo, ICON_SIZE + 2 * padding, (box.height - rect.height) / 2.0);
 	render_text(cairo, panel->conf->font_description, 1, false, "%s", label);
-	cairo_destroy(cairo);
+	cairo_restore(cairo);
+	widget_surface_end(widget);
 }
 
 struct toplevel *
@@ -84,18 +105,35 @@ toplevel_on_left_button_press(struct widget *widget, struct seat *seat)
 		seat->wl_seat);
 }
 
+static void
+toplevel_on_resize(struct widget *widget)
+{
+	/* Buttons that did not fit at all are not shown */
+	if (widget->box.width) {
+		toplevel_update_surface(toplevel_from_widget(widget));
+	}
+}
+
 static const struct widget_impl toplevel_widget_impl = {
 	.on_left_button_press = toplevel_on_left_button_press,
+	.on_resize = toplevel_on_resize,
 };
 
 void
 toplevel_destroy(struct toplevel *toplevel)
 {
+	struct panel *panel = toplevel->base.panel;
+	thumbnail_toplevel_destroy(toplevel);
+	if (panel->hovered_toplevel == toplevel) {
+		panel->hovered_toplevel = NULL;
+	}
 	wl_list_remove(&toplevel->base.link);
 	zwlr_foreign_toplevel_handle_v1_destroy(toplevel->handle);
-	zfree(toplevel->title);
-	zfree(toplevel->app_id);
-	widget_free(&toplevel->base);
+	free(toplevel->title);
+	intern_put(panel->app_ids, toplevel->app_id);
+	wl_array_release(&toplevel->outputs);
+	widget_finish(&toplevel->base);
+	slab_free(&panel->toplevel_slab, toplevel);
 }
 
 static void
@@ -103,8 +141,7 @@ handle_toplevel_title(void *data, struct zwlr_foreign_toplevel_handle_v1 *handle
 		const char *title)
 {
 	struct toplevel *toplevel = data;
-	xstrdup_replace(toplevel->title, title);
-	toplevel_update_surface(toplevel);
+	xstrset(&toplevel->title, &toplevel->title_size, title);
 }
 
 static void
@@ -112,16 +149,55 @@ handle_toplevel_app_id(void *data, struct zwlr_foreign_toplevel_handle_v1 *handl
 		const char *app_id)
 {
 	struct toplevel *toplevel = data;
-	xstrdup_replace(toplevel->app_id, app_id);
-	toplevel_update_surface(toplevel);
+	struct intern *app_ids = toplevel->base.panel->app_ids;
+	const char *interned = intern_get(app_ids, app_id);
+	intern_put(app_ids, toplevel->app_id);
+	toplevel->app_id = interned;
 }
 
+bool
+toplevel_on_output(struct toplevel *toplevel, struct output *output)
+{
+	struct wl_output **entry;
+	wl_array_for_each(entry, &toplevel->outputs) {
+		if (*entry == output->wl_output) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Which bars show the button is worked out by the layout */
 static void
 handle_toplevel_output_enter(void *data,
 	struct zwlr_foreign_toplevel_handle_v1 *handle,
 	struct wl_output *output)
 {
-	/* nop */
+	struct toplevel *toplevel = data;
+	struct wl_output **entry = wl_array_add(&toplevel->outputs,
+		sizeof(*entry));
+	if (entry) {
+		*entry = output;
+	}
+	panel_schedule_frame(toplevel->base.panel);
+}
+
+static void
+remove_output(struct toplevel *toplevel, struct wl_output *output)
+{
+	struct wl_output **entry;
+	wl_array_for_each(entry, &toplevel->outputs) {
+		if (*entry != output) {
+			continue;
+		}
+		/* Order does not matter, so move the last one here */
+		struct wl_output **last = (struct wl_output **)
+			((char *)toplevel->outputs.data + toplevel->outputs.size)
+			- 1;
+		*entry = *last;
+		toplevel->outputs.size -= sizeof(*entry);
+		break;
+	}
 }
 
 static void
@@ -129,7 +205,9 @@ handle_toplevel_output_leave(void *data,
 	struct zwlr_foreign_toplevel_handle_v1 *handle,
 	struct wl_output *output)
 {
-	/* nop */
+	struct toplevel *toplevel = data;
+	remove_output(toplevel, output);
+	panel_schedule_frame(toplevel->base.panel);
 }
 
 static void
@@ -144,14 +222,20 @@ handle_toplevel_state(void *data,
 			toplevel->active = true;
 		}
 	}
-	toplevel_update_surface(toplevel);
 }
 
 static void
 handle_toplevel_done(void *data, struct zwlr_foreign_toplevel_handle_v1 *handle)
 {
 	struct toplevel *toplevel = data;
-	render_frame(toplevel->base.panel);
+
+	/* State is applied atomically, so redraw once all of it has arrived */
+	thumbnail_toplevel_done(toplevel);
+	uint32_t generation = toplevel->base.generation;
+	toplevel_update_surface(toplevel);
+	if (toplevel->base.generation != generation) {
+		panel_schedule_frame(toplevel->base.panel);
+	}
 }
 
 static void
@@ -161,7 +245,7 @@ handle_toplevel_closed(void *data,
 	struct toplevel *toplevel = data;
 	struct panel *panel = toplevel->base.panel;
 	toplevel_destroy(toplevel);
-	render_frame(panel);
+	panel_schedule_frame(panel);
 }
 
 static void
@@ -188,13 +272,14 @@ static struct toplevel *
 toplevel_create(struct panel *panel,
 	struct zwlr_foreign_toplevel_handle_v1 *handle)
 {
-	struct toplevel *toplevel = znew(*toplevel);
+	struct toplevel *toplevel = slab_alloc(&panel->toplevel_slab);
 	toplevel->handle = handle;
 	toplevel->base.panel = panel;
 	toplevel->base.type = WIDGET_TOPLEVEL;
 	toplevel->base.impl = &toplevel_widget_impl;
 	toplevel->base.box.y = panel->conf->taskbar_padding;
 	wl_list_init(&toplevel->base.link);
+	wl_array_init(&toplevel->outputs);
 	return toplevel;
 }
 
@@ -210,8 +295,6 @@ handle_toplevel_manager_toplevel(void *data,
 
 	zwlr_foreign_toplevel_handle_v1_add_listener(handle,
 		&toplevel_handle_listener, toplevel);
-
-	toplevel_update_surface(toplevel);
 }
 
 static void
@@ -236,11 +319,62 @@ plugin_taskbar_init(struct panel *panel)
 		&toplevel_manager_listener, panel);
 }
 
+void
+plugin_taskbar_update(struct panel *panel)
+{
+	uint64_t start = stats_now();
+	struct widget *widget;
+	wl_list_for_each(widget, &panel->widgets, link) {
+		if (widget->type == WIDGET_TOPLEVEL) {
+			toplevel_update_surface(toplevel_from_widget(widget));
+		}
+	}
+	stats_timer_add(&stats.taskbar_update, start);
+}
+
+/* Redraw the buttons of @app_id, e.g. because its icon has changed */
+void
+plugin_taskbar_invalidate_app_id(struct panel *panel, const char *app_id)
+{
+	struct widget *widget;
+	wl_list_for_each(widget, &panel->widgets, link) {
+		if (widget->type != WIDGET_TOPLEVEL) {
+			continue;
+		}
+		struct toplevel *toplevel = toplevel_from_widget(widget);
+		if (toplevel->app_id && !strcmp(toplevel->app_id, app_id)) {
+			widget_invalidate(widget);
+			toplevel_update_surface(toplevel);
+			panel_schedule_frame(panel);
+		}
+	}
+}
+
+/*
+ * Forget @output before its proxy is destroyed, as the compositor does not
+ * always send output_leave first, and a new output could get the same
+ * address.
+ */
+void
+plugin_taskbar_output_destroy(struct panel *panel, struct wl_output *output)
+{
+	struct widget *widget;
+	wl_list_for_each(widget, &panel->widgets, link) {
+		if (widget->type == WIDGET_TOPLEVEL) {
+			remove_output(toplevel_from_widget(widget), output);
+		}
+	}
+	panel_schedule_frame(panel);
+}
+
 void
 plugin_taskbar_create(struct panel *panel)
 {
 	struct taskbar *taskbar = znew(*taskbar);
 	taskbar->base.panel = panel;
 	taskbar->base.type = WIDGET_TASKBAR;
+	/* Takes up whatever room the other plugins leave */
+	taskbar->base.grow = 1;
+	taskbar->base.shrink = 1;
 	wl_list_insert(panel->widgets.prev, &taskbar->base.link);
 }
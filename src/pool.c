@@ -17,6 +17,7 @@
 #include <time.h>
 #include <unistd.h>
 #include <wayland-client.h>
+#include "common/log.h"
 #include "panel.h"
 
 static int
@@ -56,43 +57,129 @@ buffer_release(void *data, struct wl_buffer *wl_buffer)
 static const struct wl_buffer_listener buffer_listener = {
 	.release = buffer_release};
 
+/* (Re)create the cairo objects of @buf for the current mapping of @pool */
+static void
+bind_surface(struct pool *pool, struct pool_buffer *buf)
+{
+	if (buf->pango) {
+		g_object_unref(buf->pango);
+	}
+	if (buf->cairo) {
+		cairo_destroy(buf->cairo);
+	}
+	if (buf->surface) {
+		cairo_surface_destroy(buf->surface);
+	}
+	buf->data = (char *)pool->data + buf->offset;
+	buf->surface = cairo_image_surface_create_for_data(buf->data,
+		CAIRO_FORMAT_ARGB32, buf->width, buf->height, buf->width * 4);
+	buf->cairo = cairo_create(buf->surface);
+	buf->pango = pango_cairo_create_context(buf->cairo);
+}
+
+/*
+ * Grow the pool to at least @size bytes. The mapping may move, so the
+ * surfaces of all existing buffers are rebound to it.
+ */
+static bool
+pool_grow(struct pool *pool, struct wl_shm *shm, size_t size)
+{
+	if (size <= pool->size) {
+		return true;
+	}
+	if (!pool->shm_pool) {
+		pool->fd = anonymous_shm_open();
+		if (pool->fd < 0) {
+			return false;
+		}
+	}
+	void *data = MAP_FAILED;
+	if (ftruncate(pool->fd, size) == 0) {
+		data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			pool->fd, 0);
+	}
+	if (data == MAP_FAILED) {
+		if (!pool->shm_pool) {
+			close(pool->fd);
+		}
+		return false;
+	}
+
+	void *old_data = pool->data;
+	size_t old_size = pool->size;
+	pool->data = data;
+	pool->size = size;
+	if (pool->shm_pool) {
+		wl_shm_pool_resize(pool->shm_pool, size);
+	} else {
+		pool->shm_pool = wl_shm_create_pool(shm, pool->fd, size);
+	}
+
+	for (size_t i = 0; i < pool->nr_buffers; i++) {
+		if (pool->buffers[i].buffer) {
+			bind_surface(pool, &pool->buffers[i]);
+		}
+	}
+	if (old_data) {
+		munmap(old_data, old_size);
+	}
+	return true;
+}
+
+/*
+ * Find room for @size bytes that no other buffer in the pool occupies. First
+ * fit, so that space freed by earlier resizes is reused before growing.
+ */
+static size_t
+pool_find_space(struct pool *pool, struct pool_buffer *buf, size_t size)
+{
+	size_t offset = 0;
+	bool again = true;
+	while (again) {
+		again = false;
+		for (size_t i = 0; i < pool->nr_buffers; i++) {
+			struct pool_buffer *other = &pool->buffers[i];
+			if (other == buf || !other->buffer) {
+				continue;
+			}
+			if (offset < other->offset + other->size
+					&& other->offset < offset + size) {
+				offset = other->offset + other->size;
+				again = true;
+			}
+		}
+	}
+	return offset;
+}
+
 static struct pool_buffer *
-create_buffer(struct wl_shm *shm, struct pool_buffer *buf, int32_t width,
-	int32_t height, uint32_t format)
+create_buffer(struct wl_shm *shm, struct pool *pool, struct pool_buffer *buf,
+		int32_t width, int32_t height, uint32_t format)
 {
 	uint32_t stride = width * 4;
-	size_t size = stride * height;
+	size_t size = (size_t)stride * height;
 
-	int fd = anonymous_shm_open();
-	if (fd == -1) {
-		return NULL;
-	}
-	if (ftruncate(fd, size) < 0) {
-		close(fd);
+	size_t offset = pool_find_space(pool, buf, size);
+	if (!pool_grow(pool, shm, offset + size)) {
 		return NULL;
 	}
-	void *data =
-		mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, size);
-	buf->buffer = wl_shm_pool_create_buffer(pool, 0, width, height, stride,
-		format);
-	wl_shm_pool_destroy(pool);
-	close(fd);
-
+	buf->buffer = wl_shm_pool_create_buffer(pool->shm_pool, offset, width,
+		height, stride, format);
+	buf->offset = offset;
 	buf->size = size;
 	buf->width = width;
 	buf->height = height;
-	buf->data = data;
-	buf->surface = cairo_image_surface_create_for_data(data,
-		CAIRO_FORMAT_ARGB32, width, height, stride);
-	buf->cairo = cairo_create(buf->surface);
-	buf->pango = pango_cairo_create_context(buf->cairo);
+	bind_surface(pool, buf);
+
+	/* A fresh buffer has no valid content at all */
+	buf->stale = cairo_region_create_rectangle(&(cairo_rectangle_int_t){
+		.width = width, .height = height });
 
 	wl_buffer_add_listener(buf->buffer, &buffer_listener, buf);
 	return buf;
 }
 
-void
+static void
 destroy_buffer(struct pool_buffer *buffer)
 {
 	if (buffer->buffer) {
@@ -111,27 +198,119 @@ destroy_buffer(struct pool_buffer *buffer)
 		cairo_surface_destroy(buffer->surface);
 		buffer->surface = NULL;
 	}
-	if (buffer->data) {
-		munmap(buffer->data, buffer->size);
-		buffer->data = NULL;
+	buffer->data = NULL;
+	if (buffer->stale) {
+		cairo_region_destroy(buffer->stale);
+		buffer->stale = NULL;
+	}
+	buffer->busy = false;
+}
+
+void
+pool_finish(struct pool *pool)
+{
+	for (size_t i = 0; i < pool->nr_buffers; i++) {
+		destroy_buffer(&pool->buffers[i]);
+	}
+	pool->nr_buffers = 0;
+	if (pool->shm_pool) {
+		wl_shm_pool_destroy(pool->shm_pool);
+		pool->shm_pool = NULL;
+		close(pool->fd);
+	}
+	if (pool->data) {
+		munmap(pool->data, pool->size);
+		pool->data = NULL;
+	}
+	pool->size = 0;
+}
+
+/*
+ * Copy the regions that @buffer missed out on from @front, the most recently
+ * committed buffer, so that only new damage needs to be redrawn into it.
+ * Both buffers must be the same size; if not the caller must redraw
+ * everything anyway and there is nothing worth copying.
+ */
+void
+buffer_copy_forward(struct pool_buffer *buffer, struct pool_buffer *front)
+{
+	if (!front || front == buffer || !front->data
+			|| front->width != buffer->width
+			|| front->height != buffer->height) {
+		return;
+	}
+	if (cairo_region_is_empty(buffer->stale)) {
+		return;
+	}
+
+	cairo_surface_flush(front->surface);
+	cairo_surface_flush(buffer->surface);
+
+	uint32_t stride = buffer->width * 4;
+	int n = cairo_region_num_rectangles(buffer->stale);
+	for (int i = 0; i < n; i++) {
+		cairo_rectangle_int_t rect;
+		cairo_region_get_rectangle(buffer->stale, i, &rect);
+		for (int y = rect.y; y < rect.y + rect.height; y++) {
+			size_t offset = (size_t)y * stride + (size_t)rect.x * 4;
+			memcpy((char *)buffer->data + offset,
+				(char *)front->data + offset, rect.width * 4);
+		}
 	}
+	cairo_surface_mark_dirty(buffer->surface);
+
+	cairo_region_destroy(buffer->stale);
+	buffer->stale = cairo_region_create();
 }
 
+/*
+ * Record that @buffer has been committed with @damage (in buffer pixels).
+ * The other buffers in the pool now lag behind by that much.
+ */
+void
+pool_commit_damage(struct pool *pool, struct pool_buffer *buffer,
+		const cairo_region_t *damage)
+{
+	for (size_t i = 0; i < pool->nr_buffers; ++i) {
+		struct pool_buffer *b = &pool->buffers[i];
+		if (!b->stale) {
+			continue;
+		}
+		if (b == buffer) {
+			cairo_region_destroy(b->stale);
+			b->stale = cairo_region_create();
+		} else {
+			cairo_region_union(b->stale, damage);
+		}
+	}
+}
+
+/*
+ * Get a buffer of the given size that the compositor is not reading from.
+ * Another buffer is added to the pool whenever all are busy, up to
+ * POOL_MAX_BUFFERS, so a slow compositor costs memory rather than frames.
+ * Buffers are sub-allocated from one shm pool, which only ever grows, so
+ * resizing reuses the existing mapping where it can.
+ */
 struct pool_buffer *
-get_next_buffer(struct wl_shm *shm, struct pool_buffer pool[static 2],
-	uint32_t width, uint32_t height)
+get_next_buffer(struct wl_shm *shm, struct pool *pool, uint32_t width,
+		uint32_t height)
 {
 	struct pool_buffer *buffer = NULL;
 
-	for (size_t i = 0; i < 2; ++i) {
-		if (pool[i].busy) {
+	for (size_t i = 0; i < pool->nr_buffers; ++i) {
+		if (pool->buffers[i].busy) {
 			continue;
 		}
-		buffer = &pool[i];
+		buffer = &pool->buffers[i];
 	}
 
 	if (!buffer) {
-		return NULL;
+		if (pool->nr_buffers == POOL_MAX_BUFFERS) {
+			return NULL;
+		}
+		buffer = &pool->buffers[pool->nr_buffers++];
+		debug("pool: growing to %zu buffers", pool->nr_buffers);
 	}
 
 	if (buffer->width != width || buffer->height != height) {
@@ -139,7 +318,7 @@ get_next_buffer(struct wl_shm *shm, struct pool_buffer pool[static 2],
 	}
 
 	if (!buffer->buffer) {
-		if (!create_buffer(shm, buffer, width, height,
+		if (!create_buffer(shm, pool, buffer, width, height,
 			    WL_SHM_FORMAT_ARGB8888)) {
 			return NULL;
 		}
@@ -0,0 +1,281 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Fuzzy matching for start menu search.
+ *
+ * Items are folded once up front. Each also gets a 64-bit mask of the bytes
+ * in it, so that an item lacking any of the query's bytes is rejected with a
+ * single AND before its strings are looked at. Whatever is left is scored by
+ * trying every occurrence of the first query character as the start of a
+ * greedy match and keeping the best.
+ */
+#include <glib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common/mem.h"
+#include "search.h"
+
+#define SCORE_MATCH 16
+#define SCORE_CONSECUTIVE 16
+#define SCORE_WORD_START 24
+#define SCORE_PREFIX 24
+#define MAX_GAP_PENALTY 8
+
+/* Matches in executables and keywords are worth less than in names */
+#define EXEC_PENALTY 8
+#define KEYWORDS_DIVISOR 2
+
+enum field {
+	FIELD_NAME,
+	FIELD_EXEC,
+	FIELD_KEYWORDS,
+
+	NR_FIELDS,
+};
+
+struct item {
+	char *fields[NR_FIELDS]; /* folded, or NULL */
+	uint64_t mask;
+};
+
+struct search_index {
+	struct item *items;
+	size_t n_items;
+};
+
+char *
+search_fold(const char *str)
+{
+	char *folded = g_utf8_casefold(str, -1);
+	char *normalized = g_utf8_normalize(folded, -1, G_NORMALIZE_ALL);
+	g_free(folded);
+	/* Invalid UTF-8 cannot be normalized; fall back to the raw bytes */
+	char *ret = xstrdup(normalized ? normalized : str);
+	g_free(normalized);
+	return ret;
+}
+
+static uint64_t
+byte_mask(const char *s)
+{
+	uint64_t mask = 0;
+	for (const unsigned char *p = (const unsigned char *)s; *p; p++) {
+		mask |= 1ULL << (*p & 63);
+	}
+	return mask;
+}
+
+/* Length of the UTF-8 sequence starting with @c */
+static size_t
+char_len(unsigned char c)
+{
+	if (c >= 0xf0) {
+		return 4;
+	} else if (c >= 0xe0) {
+		return 3;
+	} else if (c >= 0xc0) {
+		return 2;
+	}
+	return 1;
+}
+
+static bool
+is_separator(char c)
+{
+	return c == ' ' || c == '-' || c == '_' || c == '.' || c == '/'
+		|| c == ';';
+}
+
+/* Score of matching @query greedily in @text from @start on, or -1 */
+static int
+score_from(const char *query, const char *text, size_t start)
+{
+	int score = 0;
+	size_t prev_end = start;
+	size_t i = start;
+	for (const char *q = query; *q; ) {
+		size_t len = char_len(*q);
+		while (text[i] && strncmp(text + i, q, len)) {
+			i += char_len(text[i]);
+		}
+		if (!text[i]) {
+			return -1;
+		}
+		score += SCORE_MATCH;
+		if (i == 0) {
+			score += SCORE_PREFIX;
+		}
+		if (i == 0 || is_separator(text[i - 1])) {
+			score += SCORE_WORD_START;
+		}
+		if (q != query) {
+			if (i == prev_end) {
+				score += SCORE_CONSECUTIVE;
+			} else {
+				score -= MIN(i - prev_end, MAX_GAP_PENALTY);
+			}
+		}
+		prev_end = i + len;
+		i += len;
+		q += len;
+	}
+	return score;
+}
+
+/* Best score of @query in @text, or -1 if it does not match */
+static int
+score_field(const char *query, const char *text)
+{
+	if (!text) {
+		return -1;
+	}
+	if (!*query) {
+		return 0;
+	}
+	int best = -1;
+	size_t len = char_len(*query);
+	for (size_t i = 0; text[i]; i += char_len(text[i])) {
+		if (strncmp(text + i, query, len)) {
+			continue;
+		}
+		int score = score_from(query, text, i);
+		if (score < 0) {
+			break; /* later starts cannot match either */
+		}
+		best = MAX(best, score);
+	}
+	return best;
+}
+
+static int
+score_item(const struct item *item, const char *query)
+{
+	int best = score_field(query, item->fields[FIELD_NAME]);
+	int exec = score_field(query, item->fields[FIELD_EXEC]);
+	if (exec >= 0) {
+		best = MAX(best, MAX(exec - EXEC_PENALTY, 0));
+	}
+	int keywords = score_field(query, item->fields[FIELD_KEYWORDS]);
+	if (keywords >= 0) {
+		best = MAX(best, keywords / KEYWORDS_DIVISOR);
+	}
+	return best;
+}
+
+struct search_index *
+search_index_create(const char *const *names, const char *const *execs,
+		const char *const *keywords, size_t n)
+{
+	struct search_index *index = znew(*index);
+	index->items = xzalloc(n * sizeof(*index->items));
+	index->n_items = n;
+
+	for (size_t i = 0; i < n; i++) {
+		struct item *item = &index->items[i];
+		const char *fields[NR_FIELDS] = {
+			[FIELD_NAME] = names[i],
+			[FIELD_EXEC] = execs ? execs[i] : NULL,
+			[FIELD_KEYWORDS] = keywords ? keywords[i] : NULL,
+		};
+		/* Only the command name of an executable is worth matching */
+		if (fields[FIELD_EXEC] && strrchr(fields[FIELD_EXEC], '/')) {
+			fields[FIELD_EXEC] = strrchr(fields[FIELD_EXEC], '/') + 1;
+		}
+		for (int f = 0; f < NR_FIELDS; f++) {
+			if (fields[f]) {
+				item->fields[f] = search_fold(fields[f]);
+				item->mask |= byte_mask(item->fields[f]);
+			}
+		}
+	}
+	return index;
+}
+
+void
+search_index_destroy(struct search_index *index)
+{
+	if (!index) {
+		return;
+	}
+	for (size_t i = 0; i < index->n_items; i++) {
+		for (int f = 0; f < NR_FIELDS; f++) {
+			free(index->items[i].fields[f]);
+		}
+	}
+	free(index->items);
+	free(index);
+}
+
+size_t
+search_index_match(struct search_index *index, const char *folded,
+		const int *candidates, size_t n, int *out, int *scores)
+{
+	if (!candidates) {
+		n = index->n_items;
+	}
+	uint64_t mask = byte_mask(folded);
+	size_t n_out = 0;
+	for (size_t i = 0; i < n; i++) {
+		int id = candidates ? candidates[i] : (int)i;
+		const struct item *item = &index->items[id];
+		if ((item->mask & mask) != mask) {
+			continue;
+		}
+		int score = score_item(item, folded);
+		if (score >= 0) {
+			out[n_out] = id;
+			scores[n_out] = score;
+			n_out++;
+		}
+	}
+	return n_out;
+}
+
+void
+search_rank(int *items, int *scores, size_t n, size_t k)
+{
+	k = MIN(k, n);
+	if (!k) {
+		return;
+	}
+
+	/* Positions of the best k so far, best first */
+	size_t *top = xzalloc(k * sizeof(*top));
+	size_t n_top = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (n_top == k && scores[i] <= scores[top[k - 1]]) {
+			continue;
+		}
+		size_t j = n_top < k ? n_top++ : k - 1;
+		for (; j > 0 && scores[top[j - 1]] < scores[i]; j--) {
+			top[j] = top[j - 1];
+		}
+		top[j] = i;
+	}
+
+	/* The rest keep their order, so shift them back past the gaps */
+	int *top_items = xzalloc(k * sizeof(*top_items));
+	int *top_scores = xzalloc(k * sizeof(*top_scores));
+	bool *taken = xzalloc(n * sizeof(*taken));
+	for (size_t j = 0; j < k; j++) {
+		top_items[j] = items[top[j]];
+		top_scores[j] = scores[top[j]];
+		taken[top[j]] = true;
+	}
+	size_t dst = n;
+	for (size_t i = n; i-- > 0; ) {
+		if (!taken[i]) {
+			dst--;
+			items[dst] = items[i];
+			scores[dst] = scores[i];
+		}
+	}
+	memcpy(items, top_items, k * sizeof(*items));
+	memcpy(scores, top_scores, k * sizeof(*scores));
+
+	free(taken);
+	free(top_scores);
+	free(top_items);
+	free(top);
+}
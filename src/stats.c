@@ -0,0 +1,83 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#include <inttypes.h>
+#include <time.h>
+#include "common/log.h"
+#include "stats.h"
+
+struct stats stats;
+
+uint64_t
+stats_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+stats_timer_add(struct stats_timer *timer, uint64_t start)
+{
+	uint64_t ns = stats_now() - start;
+	timer->count++;
+	timer->total_ns += ns;
+	if (ns > timer->max_ns) {
+		timer->max_ns = ns;
+	}
+}
+
+static void
+log_timer(enum log_importance importance, const char *name,
+		const struct stats_timer *timer)
+{
+	uint64_t avg = timer->count ? timer->total_ns / timer->count : 0;
+	_log(importance, "%s: %" PRIu64 " calls, %" PRIu64 " us avg, %"
+		PRIu64 " us max, %" PRIu64 " ms total", name, timer->count,
+		avg / 1000, timer->max_ns / 1000, timer->total_ns / 1000000);
+}
+
+void
+stats_log(enum log_importance importance)
+{
+	_log(importance, "widget surfaces: %" PRIu64 " allocated, %" PRIu64
+		" reused", stats.widget_surface_allocs,
+		stats.widget_surface_reuses);
+	_log(importance, "icon cache: %" PRIu64 " hits, %" PRIu64 " misses",
+		stats.icon_cache_hits, stats.icon_cache_misses);
+	_log(importance, "thumbnail cache: %" PRIu64 " hits, %" PRIu64
+		" misses, %" PRIu64 " evictions", stats.thumbnail_cache_hits,
+		stats.thumbnail_cache_misses, stats.thumbnail_cache_evictions);
+	_log(importance, "text layout cache: %" PRIu64 " hits, %" PRIu64
+		" misses", stats.text_cache_hits, stats.text_cache_misses);
+	_log(importance, "menu rows: %" PRIu64 " copied, %" PRIu64
+		" cache hits, %" PRIu64 " cache misses", stats.menu_rows_copied,
+		stats.menu_row_cache_hits, stats.menu_row_cache_misses);
+	_log(importance, "frames: %" PRIu64 " rendered, %" PRIu64 " dropped",
+		stats.frames_rendered, stats.frames_dropped);
+	_log(importance, "layouts: %" PRIu64, stats.layouts);
+	_log(importance, "roundtrips: %" PRIu64, stats.roundtrips);
+	_log(importance, "allocated: %" PRIu64 " KiB",
+		stats.bytes_allocated / 1024);
+
+	log_timer(importance, "render_frame", &stats.render_frame);
+	log_timer(importance, "clock update", &stats.clock_update);
+	log_timer(importance, "battery update", &stats.battery_update);
+	log_timer(importance, "kbdlayout update", &stats.kbdlayout_update);
+	log_timer(importance, "startmenu update", &stats.startmenu_update);
+	log_timer(importance, "taskbar update", &stats.taskbar_update);
+	log_timer(importance, "thumbnail capture", &stats.capture);
+	log_timer(importance, "startmenu load_apps", &stats.load_apps);
+	log_timer(importance, "desktop_entry_init", &stats.desktop_entry_init);
+}
+
+void
+stats_log_summary(void)
+{
+	const struct stats_timer *render = &stats.render_frame;
+	debug("stats: %" PRIu64 " frames (%" PRIu64 " dropped), render %"
+		PRIu64 " us avg %" PRIu64 " us max, %" PRIu64 " roundtrips, %"
+		PRIu64 " KiB allocated", stats.frames_rendered,
+		stats.frames_dropped,
+		render->count ? render->total_ns / render->count / 1000 : 0,
+		render->max_ns / 1000, stats.roundtrips,
+		stats.bytes_allocated / 1024);
+}
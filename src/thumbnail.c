@@ -2,16 +2,32 @@
 #include <assert.h>
 #include <string.h>
 #include <wayland-client.h>
+#include "common/intern.h"
 #include "common/log.h"
 #include "common/mem.h"
+#include "common/scale.h"
+#include "conf.h"
+#include "config.h"
 #include "ext-foreign-toplevel-list-v1-client-protocol.h"
 #include "ext-image-capture-source-v1-client-protocol.h"
 #include "ext-image-copy-capture-v1-client-protocol.h"
+#include "layout.h"
+#include "linux-dmabuf-v1-client-protocol.h"
 #include "panel.h"
+#include "stats.h"
 #include "wlr-layer-shell-unstable-v1-client-protocol.h"
 #include "xdg-shell-client-protocol.h"
+#if HAVE_DMABUF
+#include <drm_fourcc.h>
+#include "dmabuf.h"
+#endif
 
 #define THUMBNAIL_WIDTH 200
+#define THUMBNAIL_TILE 16 /* granularity of partial rescaling */
+#define THUMBNAIL_REFRESH_MS 100 /* live preview at up to 10 fps */
+
+static void capture_stop(struct ext_toplevel *t);
+static void cache_remove(struct ext_toplevel *t);
 
 /* ========================================================================= */
 /* ext_foreign_toplevel_list: track ext handles alongside wlr handles         */
@@ -23,7 +39,7 @@ ext_handle_title(void *data,
 	const char *title)
 {
 	struct ext_toplevel *t = data;
-	xstrdup_replace(t->title, title);
+	xstrset(&t->title, &t->title_size, title);
 }
 
 static void
@@ -32,7 +48,9 @@ ext_handle_app_id(void *data,
 	const char *app_id)
 {
 	struct ext_toplevel *t = data;
-	xstrdup_replace(t->app_id, app_id);
+	const char *interned = intern_get(t->panel->app_ids, app_id);
+	intern_put(t->panel->app_ids, t->app_id);
+	t->app_id = interned;
 }
 
 static void
@@ -40,14 +58,112 @@ ext_handle_identifier(void *data,
 	struct ext_foreign_toplevel_handle_v1 *handle,
 	const char *identifier)
 {
-	/* nop: identifier not used for matching */
+	struct ext_toplevel *t = data;
+	xstrdup_replace(t->identifier, identifier);
+}
+
+/* ========================================================================= */
+/* Pairing of ext handles with wlr toplevels                                   */
+/* ========================================================================= */
+
+/*
+ * The wlr and ext protocols describe the same windows, but wlr handles carry
+ * no identifier to correlate them by. So each side is paired with the oldest
+ * unpaired handle on the other side with the same app_id and title, as soon
+ * as either sees its done event. Compositors announce a new window on both
+ * lists together, so creation order tells apart windows that share a title.
+ * Pairs are then kept for the lifetime of the window, whatever its title
+ * becomes, and hover lookups are a pointer dereference.
+ */
+
+static bool
+same_window(struct toplevel *toplevel, struct ext_toplevel *t)
+{
+	/* Both app_ids are interned in panel->app_ids */
+	return toplevel->app_id == t->app_id
+		&& !g_strcmp0(toplevel->title, t->title);
+}
+
+static void
+pair(struct toplevel *toplevel, struct ext_toplevel *t)
+{
+	toplevel->ext = t;
+	t->toplevel = toplevel;
+	debug("thumbnail: paired '%s' with %s",
+		toplevel->title ? toplevel->title : "(null)", t->identifier);
 }
 
 static void
 ext_handle_done(void *data,
 	struct ext_foreign_toplevel_handle_v1 *handle)
 {
-	/* nop */
+	struct ext_toplevel *t = data;
+	t->done = true;
+	if (t->toplevel) {
+		return;
+	}
+
+	struct widget *widget;
+	wl_list_for_each(widget, &t->panel->widgets, link) {
+		if (widget->type != WIDGET_TOPLEVEL) {
+			continue;
+		}
+		struct toplevel *toplevel = toplevel_from_widget(widget);
+		if (!toplevel->ext && same_window(toplevel, t)) {
+			pair(toplevel, t);
+			return;
+		}
+	}
+}
+
+/* Called when @toplevel has received a complete set of its state */
+void
+thumbnail_toplevel_done(struct toplevel *toplevel)
+{
+	if (toplevel->ext) {
+		return;
+	}
+	struct ext_toplevel *t;
+	wl_list_for_each(t, &toplevel->base.panel->ext_toplevels, link) {
+		if (t->done && !t->toplevel && same_window(toplevel, t)) {
+			pair(toplevel, t);
+			return;
+		}
+	}
+}
+
+void
+thumbnail_toplevel_destroy(struct toplevel *toplevel)
+{
+	struct panel *panel = toplevel->base.panel;
+	if (panel->thumbnail && panel->thumbnail->toplevel == toplevel) {
+		thumbnail_hide(panel);
+	}
+	if (toplevel->ext) {
+		toplevel->ext->toplevel = NULL;
+		toplevel->ext = NULL;
+	}
+}
+
+static void
+ext_toplevel_destroy(struct ext_toplevel *t)
+{
+	struct panel *panel = t->panel;
+	if (panel->thumbnail && panel->thumbnail->ext == t) {
+		thumbnail_hide(panel);
+	}
+	if (t->toplevel) {
+		t->toplevel->ext = NULL;
+	}
+	capture_stop(t);
+	cache_remove(t);
+	wl_array_release(&t->dmabuf_modifiers);
+	wl_list_remove(&t->link);
+	ext_foreign_toplevel_handle_v1_destroy(t->handle);
+	free(t->identifier);
+	free(t->title);
+	intern_put(panel->app_ids, t->app_id);
+	slab_free(&panel->ext_toplevel_slab, t);
 }
 
 static void
@@ -55,11 +171,7 @@ ext_handle_closed(void *data,
 	struct ext_foreign_toplevel_handle_v1 *handle)
 {
 	struct ext_toplevel *t = data;
-	wl_list_remove(&t->link);
-	ext_foreign_toplevel_handle_v1_destroy(t->handle);
-	zfree(t->title);
-	zfree(t->app_id);
-	zfree(t);
+	ext_toplevel_destroy(t);
 }
 
 static const struct ext_foreign_toplevel_handle_v1_listener ext_handle_listener = {
@@ -76,9 +188,13 @@ ext_list_toplevel(void *data,
 	struct ext_foreign_toplevel_handle_v1 *handle)
 {
 	struct panel *panel = data;
-	struct ext_toplevel *t = znew(*t);
+	struct ext_toplevel *t = slab_alloc(&panel->ext_toplevel_slab);
 	t->handle = handle;
-	wl_list_insert(&panel->ext_toplevels, &t->link);
+	t->panel = panel;
+	wl_array_init(&t->dmabuf_modifiers);
+	wl_list_init(&t->lru_link);
+	/* Oldest first, see ext_handle_done() */
+	wl_list_insert(panel->ext_toplevels.prev, &t->link);
 	ext_foreign_toplevel_handle_v1_add_listener(handle, &ext_handle_listener, t);
 }
 
@@ -112,45 +228,125 @@ thumbnail_bind_ext_toplevel_list(struct panel *panel)
 }
 
 /*
- * Find the ext_foreign_toplevel_handle_v1 that corresponds to the given
- * wlr toplevel by matching app_id+title, falling back to app_id only.
+ * Get the ext_toplevel for @toplevel. If they have not been paired, which
+ * happens when titles disagree, fall back to an unpaired handle with the same
+ * app_id without pairing it, as that is only a guess.
  */
-static struct ext_foreign_toplevel_handle_v1 *
-find_ext_handle(struct panel *panel, struct toplevel *toplevel)
+static struct ext_toplevel *
+find_ext_toplevel(struct panel *panel, struct toplevel *toplevel)
 {
-	struct ext_toplevel *t;
-
-	/* Exact match: app_id and title */
-	wl_list_for_each(t, &panel->ext_toplevels, link) {
-		if (toplevel->app_id && t->app_id
-				&& strcmp(toplevel->app_id, t->app_id) == 0
-				&& toplevel->title && t->title
-				&& strcmp(toplevel->title, t->title) == 0) {
-			return t->handle;
-		}
+	if (toplevel->ext) {
+		return toplevel->ext;
 	}
-	/* Fallback: app_id only */
+	struct ext_toplevel *t;
 	wl_list_for_each(t, &panel->ext_toplevels, link) {
-		if (toplevel->app_id && t->app_id
-				&& strcmp(toplevel->app_id, t->app_id) == 0) {
-			return t->handle;
+		if (!t->toplevel && toplevel->app_id
+				&& toplevel->app_id == t->app_id) {
+			return t;
 		}
 	}
 	return NULL;
 }
 
+/* ========================================================================= */
+/* Thumbnail cache                                                             */
+/* ========================================================================= */
+
+/*
+ * Scaled thumbnails stay attached to their ext_toplevel after the popup is
+ * hidden, so that hovering a task again can show the last image at once. The
+ * images are kept on panel.thumbnail_lru, most recently used first, and the
+ * oldest ones are dropped once their total size exceeds the configured
+ * budget. A popup holds its own reference, so evicting the image it shows
+ * is harmless.
+ */
+
+static void
+cache_remove(struct ext_toplevel *t)
+{
+	if (!t->image) {
+		return;
+	}
+	t->panel->thumbnail_cache_size -= t->image_size;
+	cairo_surface_destroy(t->image);
+	t->image = NULL;
+	t->image_size = 0;
+	wl_list_remove(&t->lru_link);
+	wl_list_init(&t->lru_link);
+}
+
+static void
+cache_touch(struct ext_toplevel *t)
+{
+	wl_list_remove(&t->lru_link);
+	wl_list_insert(&t->panel->thumbnail_lru, &t->lru_link);
+}
+
+static void
+cache_put(struct ext_toplevel *t, cairo_surface_t *image)
+{
+	struct panel *panel = t->panel;
+	size_t budget = (size_t)panel->conf->thumbnail_cache_size * 1024;
+
+	cache_remove(t);
+	t->image = cairo_surface_reference(image);
+	t->image_size = (size_t)cairo_image_surface_get_stride(image)
+		* cairo_image_surface_get_height(image);
+	panel->thumbnail_cache_size += t->image_size;
+	cache_touch(t);
+
+	while (panel->thumbnail_cache_size > budget
+			&& !wl_list_empty(&panel->thumbnail_lru)) {
+		struct ext_toplevel *oldest = wl_container_of(
+			panel->thumbnail_lru.prev, oldest, lru_link);
+		cache_remove(oldest);
+		stats.thumbnail_cache_evictions++;
+	}
+}
+
 /* ========================================================================= */
 /* Capture session listeners                                                   */
 /* ========================================================================= */
 
+/*
+ * Each ext_toplevel owns its capture session, which is created on first
+ * hover and kept until the pointer leaves the taskbar. The capture runs
+ * asynchronously, driven by the listeners below:
+ *
+ *   CAPTURE_NONE         no session
+ *   CAPTURE_CONSTRAINTS  session created, waiting for buffer constraints
+ *   CAPTURE_IDLE         constraints known, ready to capture a frame
+ *   CAPTURE_FRAME        frame requested, waiting for ready/failed
+ *
+ * A ready frame is scaled down, stored in the thumbnail cache and shown if
+ * the popup is still open for that toplevel.
+ */
+static void capture_frame(struct ext_toplevel *t);
+static void capture_finish(struct ext_toplevel *t);
+static void thumbnail_set_image(struct thumbnail *thumb,
+	cairo_surface_t *image);
+
+/* Constraints come in batches terminated by done; start over on a new one */
+static void
+constraints_begin(struct ext_toplevel *t)
+{
+	if (!t->constraints_done) {
+		return;
+	}
+	t->constraints_done = false;
+	t->dmabuf_format = 0;
+	t->dmabuf_modifiers.size = 0;
+}
+
 static void
 session_buffer_size(void *data,
 	struct ext_image_copy_capture_session_v1 *session,
 	uint32_t width, uint32_t height)
 {
-	struct thumbnail *thumb = data;
-	thumb->capture_width = width;
-	thumb->capture_height = height;
+	struct ext_toplevel *t = data;
+	constraints_begin(t);
+	t->capture_width = width;
+	t->capture_height = height;
 }
 
 static void
@@ -158,9 +354,10 @@ session_shm_format(void *data,
 	struct ext_image_copy_capture_session_v1 *session,
 	uint32_t format)
 {
-	struct thumbnail *thumb = data;
-	if (!thumb->has_shm_format && format == WL_SHM_FORMAT_ARGB8888) {
-		thumb->has_shm_format = true;
+	struct ext_toplevel *t = data;
+	constraints_begin(t);
+	if (!t->has_shm_format && format == WL_SHM_FORMAT_ARGB8888) {
+		t->has_shm_format = true;
 	}
 }
 
@@ -169,7 +366,11 @@ session_dmabuf_device(void *data,
 	struct ext_image_copy_capture_session_v1 *session,
 	struct wl_array *device)
 {
-	/* nop */
+	struct ext_toplevel *t = data;
+	constraints_begin(t);
+	if (device->size == sizeof(t->dmabuf_device)) {
+		memcpy(&t->dmabuf_device, device->data, sizeof(t->dmabuf_device));
+	}
 }
 
 static void
@@ -177,23 +378,65 @@ session_dmabuf_format(void *data,
 	struct ext_image_copy_capture_session_v1 *session,
 	uint32_t format, struct wl_array *modifiers)
 {
-	/* nop */
+#if HAVE_DMABUF
+	struct ext_toplevel *t = data;
+	constraints_begin(t);
+
+	/* Both read back the same way; prefer ARGB8888 like for SHM */
+	if (format != DRM_FORMAT_ARGB8888 && format != DRM_FORMAT_XRGB8888) {
+		return;
+	}
+	if (t->dmabuf_format == DRM_FORMAT_ARGB8888) {
+		return;
+	}
+	t->dmabuf_format = format;
+	t->dmabuf_modifiers.size = 0;
+	void *dst = wl_array_add(&t->dmabuf_modifiers, modifiers->size);
+	if (dst) {
+		memcpy(dst, modifiers->data, modifiers->size);
+	}
+#endif
 }
 
 static void
 session_done(void *data,
 	struct ext_image_copy_capture_session_v1 *session)
 {
-	struct thumbnail *thumb = data;
-	thumb->got_constraints = true;
+	struct ext_toplevel *t = data;
+	t->constraints_done = true;
+
+	/*
+	 * Constraints may change at any time, for example when the window is
+	 * resized. An in-flight frame then fails and is retried from there.
+	 */
+	if (t->capture_state == CAPTURE_FRAME) {
+		return;
+	}
+	t->capture_state = CAPTURE_IDLE;
+	if (t->capture_pending) {
+		capture_frame(t);
+	}
+}
+
+/* The capture for @t went away; drop a popup that has nothing to show */
+static void
+capture_failed(struct ext_toplevel *t)
+{
+	struct panel *panel = t->panel;
+	if (panel->thumbnail && panel->thumbnail->ext == t
+			&& !panel->thumbnail->image) {
+		thumbnail_hide(panel);
+	}
 }
 
 static void
 session_stopped(void *data,
 	struct ext_image_copy_capture_session_v1 *session)
 {
-	struct thumbnail *thumb = data;
-	thumb->frame_failed = true;
+	struct ext_toplevel *t = data;
+	debug("thumbnail: capture session stopped");
+	capture_stop(t);
+	capture_failed(t);
 }
 
 static const struct ext_image_copy_capture_session_v1_listener session_listener = {
@@ -222,7 +465,9 @@ frame_damage(void *data,
 	struct ext_image_copy_capture_frame_v1 *frame,
 	int32_t x, int32_t y, int32_t width, int32_t height)
 {
-	/* nop */
+	struct ext_toplevel *t = data;
+	cairo_region_union_rectangle(t->frame_damage, &(cairo_rectangle_int_t){
+		.x = x, .y = y, .width = width, .height = height });
 }
 
 static void
@@ -237,8 +482,10 @@ static void
 frame_ready(void *data,
 	struct ext_image_copy_capture_frame_v1 *frame)
 {
-	struct thumbnail *thumb = data;
-	thumb->frame_done = true;
+	struct ext_toplevel *t = data;
+	uint64_t start = t->capture_start;
+	capture_finish(t);
+	stats_timer_add(&stats.capture, start);
 }
 
 static void
@@ -246,8 +493,46 @@ frame_failed(void *data,
 	struct ext_image_copy_capture_frame_v1 *frame,
 	uint32_t reason)
 {
-	struct thumbnail *thumb = data;
-	thumb->frame_failed = true;
+	struct ext_toplevel *t = data;
+	struct pool_buffer *cap_buf = t->capture_buffer;
+
+	ext_image_copy_capture_frame_v1_destroy(t->frame);
+	t->frame = NULL;
+	t->capture_buffer = NULL;
+	t->capture_state = CAPTURE_IDLE;
+	cairo_region_destroy(t->frame_damage);
+	t->frame_damage = NULL;
+
+#if HAVE_DMABUF
+	if (!cap_buf) {
+		/* Any dmabuf failure: retry the frame through SHM */
+		debug("thumbnail: dmabuf capture failed (reason %u)", reason);
+		if (reason != EXT_IMAGE_COPY_CAPTURE_FRAME_V1_FAILURE_REASON_STOPPED) {
+			t->dmabuf_failed = true;
+			capture_frame(t);
+			return;
+		}
+		capture_stop(t);
+		capture_failed(t);
+		return;
+	}
+#endif
+	cap_buf->busy = false;
+
+	/* The compositor may have written parts of the buffer */
+	cairo_region_union_rectangle(cap_buf->stale, &(cairo_rectangle_int_t){
+		.width = cap_buf->width, .height = cap_buf->height });
+
+	/* Retry once the buffer matches the constraints sent meanwhile */
+	if (reason == EXT_IMAGE_COPY_CAPTURE_FRAME_V1_FAILURE_REASON_BUFFER_CONSTRAINTS
+			&& (cap_buf->width != t->capture_width
+				|| cap_buf->height != t->capture_height)) {
+		capture_frame(t);
+		return;
+	}
+	debug("thumbnail: frame capture failed (reason %u)", reason);
+	capture_stop(t);
+	capture_failed(t);
 }
 
 static const struct ext_image_copy_capture_frame_v1_listener frame_listener = {
@@ -262,10 +547,50 @@ static const struct ext_image_copy_capture_frame_v1_listener frame_listener = {
 /* Popup surface listeners                                                     */
 /* ========================================================================= */
 
+static void thumbnail_request_frame(struct thumbnail *thumb);
+static bool capture_request(struct ext_toplevel *t);
+
+/*
+ * While the popup is shown, its frame callbacks pace a live preview: each
+ * one requests a new capture, at most every THUMBNAIL_REFRESH_MS. The
+ * compositor holds a capture back until the window changes, so an idle
+ * window costs nothing.
+ */
+static void
+thumbnail_frame_done(void *data, struct wl_callback *callback, uint32_t time)
+{
+	struct thumbnail *thumb = data;
+	wl_callback_destroy(callback);
+	thumb->frame_callback = NULL;
+
+	if (time - thumb->last_refresh < THUMBNAIL_REFRESH_MS) {
+		thumbnail_request_frame(thumb);
+		wl_surface_commit(thumb->popup_surface);
+		return;
+	}
+	thumb->last_refresh = time;
+	capture_request(thumb->ext);
+}
+
+static const struct wl_callback_listener thumbnail_frame_listener = {
+	.done = thumbnail_frame_done,
+};
+
+static void
+thumbnail_request_frame(struct thumbnail *thumb)
+{
+	if (thumb->frame_callback) {
+		return;
+	}
+	thumb->frame_callback = wl_surface_frame(thumb->popup_surface);
+	wl_callback_add_listener(thumb->frame_callback,
+		&thumbnail_frame_listener, thumb);
+}
+
 static void
 thumbnail_render_popup(struct thumbnail *thumb)
 {
-	if (!thumb->image || !thumb->popup_surface) {
+	if (!thumb->image || !thumb->configured) {
 		return;
 	}
 	struct panel *panel = thumb->panel;
@@ -273,7 +598,7 @@ thumbnail_render_popup(struct thumbnail *thumb)
 	int height = thumb->image_height;
 
 	struct pool_buffer *buf = get_next_buffer(panel->shm,
-		thumb->popup_buffers, width, height);
+		&thumb->popup_pool, width, height);
 	if (!buf) {
 		return;
 	}
@@ -288,6 +613,7 @@ thumbnail_render_popup(struct thumbnail *thumb)
 	wl_surface_set_buffer_scale(thumb->popup_surface, 1);
 	wl_surface_attach(thumb->popup_surface, buf->buffer, 0, 0);
 	wl_surface_damage(thumb->popup_surface, 0, 0, width, height);
+	thumbnail_request_frame(thumb);
 	wl_surface_commit(thumb->popup_surface);
 }
 
@@ -297,6 +623,7 @@ thumbnail_xdg_surface_configure(void *data,
 {
 	struct thumbnail *thumb = data;
 	xdg_surface_ack_configure(xdg_surface, serial);
+	thumb->configured = true;
 	thumbnail_render_popup(thumb);
 }
 
@@ -315,8 +642,9 @@ static void
 thumbnail_popup_done(void *data, struct xdg_popup *popup)
 {
 	struct thumbnail *thumb = data;
-	thumbnail_hide(thumb->panel);
-	thumb->panel->hovered_toplevel = NULL;
+	struct panel *panel = thumb->panel;
+	thumbnail_hide(panel);
+	panel->hovered_toplevel = NULL;
 }
 
 static void
@@ -336,11 +664,24 @@ static const struct xdg_popup_listener thumbnail_popup_listener = {
 /* Capture and display                                                         */
 /* ========================================================================= */
 
+/* Capture @t as soon as possible, creating its session if needed */
 static bool
-do_capture(struct thumbnail *thumb,
-	struct ext_foreign_toplevel_handle_v1 *ext_handle)
+capture_request(struct ext_toplevel *t)
 {
-	struct panel *panel = thumb->panel;
+	struct panel *panel = t->panel;
+
+	switch (t->capture_state) {
+	case CAPTURE_NONE:
+		break;
+	case CAPTURE_CONSTRAINTS:
+		t->capture_pending = true;
+		return true;
+	case CAPTURE_IDLE:
+		capture_frame(t);
+		return t->capture_state == CAPTURE_FRAME;
+	case CAPTURE_FRAME:
+		return true;
+	}
 
 	if (!panel->ext_image_capture_source_mgr
 			|| !panel->ext_image_copy_capture_mgr) {
@@ -351,161 +692,369 @@ do_capture(struct thumbnail *thumb,
 	/* Create image capture source for this toplevel */
 	struct ext_image_capture_source_v1 *source =
 		ext_foreign_toplevel_image_capture_source_manager_v1_create_source(
-			panel->ext_image_capture_source_mgr, ext_handle);
+			panel->ext_image_capture_source_mgr, t->handle);
 	if (!source) {
 		debug("thumbnail: failed to create capture source");
 		return false;
 	}
 
-	/* Create capture session */
-	thumb->session = ext_image_copy_capture_manager_v1_create_session(
+	/* Create capture session; buffer constraints arrive via its listener */
+	t->session = ext_image_copy_capture_manager_v1_create_session(
 		panel->ext_image_copy_capture_mgr, source, 0);
 	ext_image_capture_source_v1_destroy(source);
-	if (!thumb->session) {
+	if (!t->session) {
 		debug("thumbnail: failed to create capture session");
 		return false;
 	}
-	ext_image_copy_capture_session_v1_add_listener(thumb->session,
-		&session_listener, thumb);
+	ext_image_copy_capture_session_v1_add_listener(t->session,
+		&session_listener, t);
+	t->capture_state = CAPTURE_CONSTRAINTS;
+	t->capture_pending = true;
+	return true;
+}
+
+#if HAVE_DMABUF
+/*
+ * Capture into a GPU buffer if the compositor offers a format we can sample,
+ * so the full-size window never has to be copied into CPU memory. Returns
+ * false to fall back to SHM.
+ */
+static bool
+capture_frame_dmabuf(struct ext_toplevel *t)
+{
+	struct panel *panel = t->panel;
+	if (t->dmabuf_failed || !t->dmabuf_format || !panel->linux_dmabuf) {
+		return false;
+	}
+	if (!panel->dmabuf && !panel->dmabuf_failed) {
+		panel->dmabuf = dmabuf_create(panel->linux_dmabuf,
+			t->dmabuf_device);
+		panel->dmabuf_failed = !panel->dmabuf;
+	}
+	if (!panel->dmabuf
+			|| dmabuf_get_device(panel->dmabuf) != t->dmabuf_device) {
+		return false;
+	}
+
+	struct dmabuf_buffer *buf = t->dmabuf_buffer;
+	if (buf && (buf->width != t->capture_width
+			|| buf->height != t->capture_height
+			|| buf->format != t->dmabuf_format)) {
+		dmabuf_buffer_destroy(panel->dmabuf, buf);
+		buf = t->dmabuf_buffer = NULL;
+	}
+	if (!buf) {
+		buf = t->dmabuf_buffer = dmabuf_buffer_create(panel->dmabuf,
+			t->capture_width, t->capture_height, t->dmabuf_format,
+			t->dmabuf_modifiers.data,
+			t->dmabuf_modifiers.size / sizeof(uint64_t));
+		if (!buf) {
+			t->dmabuf_failed = true;
+			return false;
+		}
+	}
 
-	/* Wait for buffer constraints (buffer_size, shm_format, done) */
-	thumb->got_constraints = false;
-	thumb->has_shm_format = false;
-	thumb->capture_width = 0;
-	thumb->capture_height = 0;
+	t->frame = ext_image_copy_capture_session_v1_create_frame(t->session);
+	if (!t->frame) {
+		return false;
+	}
+	ext_image_copy_capture_frame_v1_add_listener(t->frame,
+		&frame_listener, t);
+	ext_image_copy_capture_frame_v1_attach_buffer(t->frame, buf->buffer);
+	/* A GPU-side copy is cheap, so do not bother tracking staleness */
+	ext_image_copy_capture_frame_v1_damage_buffer(t->frame, 0, 0,
+		(int32_t)buf->width, (int32_t)buf->height);
+	t->frame_damage = cairo_region_create();
+	ext_image_copy_capture_frame_v1_capture(t->frame);
+	t->capture_buffer = NULL;
+	t->capture_state = CAPTURE_FRAME;
+	return true;
+}
+#endif
 
-	wl_display_roundtrip(panel->display);
+/* Buffer constraints are known: request a frame into a matching buffer */
+static void
+capture_frame(struct ext_toplevel *t)
+{
+	struct panel *panel = t->panel;
+	t->capture_pending = false;
+	t->capture_start = stats_now();
 
 	/* Note: we ignore has_shm_format here, which is what grim does */
-	if (!thumb->got_constraints || !thumb->capture_width || !thumb->capture_height) {
+	if (!t->capture_width || !t->capture_height) {
 		debug("thumbnail: missing buffer constraints");
-		ext_image_copy_capture_session_v1_destroy(thumb->session);
-		thumb->session = NULL;
-		return false;
+		capture_failed(t);
+		return;
+	}
+
+#if HAVE_DMABUF
+	if (capture_frame_dmabuf(t)) {
+		return;
 	}
+#endif
 
 	/* Allocate the capture buffer using the pool */
 	struct pool_buffer *cap_buf = get_next_buffer(panel->shm,
-		thumb->capture_buffers,
-		thumb->capture_width, thumb->capture_height);
+		&t->capture_pool, t->capture_width, t->capture_height);
 	if (!cap_buf) {
 		debug("thumbnail: failed to allocate capture buffer");
-		ext_image_copy_capture_session_v1_destroy(thumb->session);
-		thumb->session = NULL;
-		return false;
+		capture_failed(t);
+		return;
 	}
 
-	/* Create frame, attach buffer, damage entire buffer, then capture */
-	thumb->frame_done = false;
-	thumb->frame_failed = false;
-	thumb->frame = ext_image_copy_capture_session_v1_create_frame(
-		thumb->session);
-	if (!thumb->frame) {
+	/*
+	 * Create frame, attach buffer, damage what the buffer lacks compared to
+	 * the latest frame, then capture. Buffers persist for the session, so
+	 * after the first frame the compositor only copies what changed. The
+	 * pool tracks staleness just like for the panel's own buffers.
+	 */
+	t->frame = ext_image_copy_capture_session_v1_create_frame(t->session);
+	if (!t->frame) {
 		debug("thumbnail: failed to create capture frame");
-		ext_image_copy_capture_session_v1_destroy(thumb->session);
-		thumb->session = NULL;
-		return false;
+		cap_buf->busy = false;
+		capture_failed(t);
+		return;
 	}
-	ext_image_copy_capture_frame_v1_add_listener(thumb->frame,
-		&frame_listener, thumb);
-	ext_image_copy_capture_frame_v1_attach_buffer(thumb->frame,
+	ext_image_copy_capture_frame_v1_add_listener(t->frame,
+		&frame_listener, t);
+	ext_image_copy_capture_frame_v1_attach_buffer(t->frame,
 		cap_buf->buffer);
-	ext_image_copy_capture_frame_v1_damage_buffer(thumb->frame, 0, 0,
-		(int32_t)thumb->capture_width, (int32_t)thumb->capture_height);
-	ext_image_copy_capture_frame_v1_capture(thumb->frame);
-
-	/*
-	 * Wait for the frame to be ready. Most compositors deliver the frame
-	 * within one roundtrip, but allow up to MAX_CAPTURE_ROUNDTRIPS to
-	 * handle compositors that need a full repaint cycle before the frame
-	 * can be captured.
-	 */
-#define MAX_CAPTURE_ROUNDTRIPS 5
-	for (int i = 0; i < MAX_CAPTURE_ROUNDTRIPS
-			&& !thumb->frame_done && !thumb->frame_failed; i++) {
-		wl_display_roundtrip(panel->display);
+	int n = cairo_region_num_rectangles(cap_buf->stale);
+	for (int i = 0; i < n; i++) {
+		cairo_rectangle_int_t rect;
+		cairo_region_get_rectangle(cap_buf->stale, i, &rect);
+		ext_image_copy_capture_frame_v1_damage_buffer(t->frame,
+			rect.x, rect.y, rect.width, rect.height);
 	}
-#undef MAX_CAPTURE_ROUNDTRIPS
+	t->frame_damage = cairo_region_create();
+	ext_image_copy_capture_frame_v1_capture(t->frame);
+	t->capture_buffer = cap_buf;
+	t->capture_state = CAPTURE_FRAME;
+}
 
-	ext_image_copy_capture_frame_v1_destroy(thumb->frame);
-	thumb->frame = NULL;
-	ext_image_copy_capture_session_v1_destroy(thumb->session);
-	thumb->session = NULL;
+/* Map @damage (in capture buffer coordinates) to the tiles of @image it hits */
+static cairo_region_t *
+damaged_tiles(cairo_surface_t *image, struct pool_buffer *cap_buf,
+		const cairo_region_t *damage)
+{
+	double scale = (double)cairo_image_surface_get_width(image)
+		/ cap_buf->width;
+	cairo_region_t *tiles = cairo_region_create();
+	int n = cairo_region_num_rectangles(damage);
+	for (int i = 0; i < n; i++) {
+		cairo_rectangle_int_t r;
+		cairo_region_get_rectangle(damage, i, &r);
+		/* One pixel of slack for the filter footprint */
+		int x0 = (int)(r.x * scale) - 1;
+		int y0 = (int)(r.y * scale) - 1;
+		int x1 = (int)((r.x + r.width) * scale) + 2;
+		int y1 = (int)((r.y + r.height) * scale) + 2;
+		x0 = MAX(x0, 0) / THUMBNAIL_TILE * THUMBNAIL_TILE;
+		y0 = MAX(y0, 0) / THUMBNAIL_TILE * THUMBNAIL_TILE;
+		x1 = (x1 + THUMBNAIL_TILE - 1) / THUMBNAIL_TILE * THUMBNAIL_TILE;
+		y1 = (y1 + THUMBNAIL_TILE - 1) / THUMBNAIL_TILE * THUMBNAIL_TILE;
+		cairo_region_union_rectangle(tiles, &(cairo_rectangle_int_t){
+			.x = x0, .y = y0, .width = x1 - x0, .height = y1 - y0 });
+	}
+	return tiles;
+}
 
-	if (!thumb->frame_done) {
-		debug("thumbnail: frame capture did not complete");
-		return false;
+/*
+ * Scale @cap_buf into @image. Only the tiles of @image touched by @damage (in
+ * capture buffer coordinates) are redrawn, or all of it if @damage is NULL.
+ */
+static void
+scale_into(cairo_surface_t *image, struct pool_buffer *cap_buf,
+		const cairo_region_t *damage)
+{
+	cairo_region_t *tiles = damage
+		? damaged_tiles(image, cap_buf, damage)
+		: cairo_region_create_rectangle(&(cairo_rectangle_int_t){
+			.width = cairo_image_surface_get_width(image),
+			.height = cairo_image_surface_get_height(image) });
+
+	/* The box filter only downscales; tiny windows go through cairo */
+	bool done = true;
+	int n = cairo_region_num_rectangles(tiles);
+	for (int i = 0; i < n && done; i++) {
+		cairo_rectangle_int_t r;
+		cairo_region_get_rectangle(tiles, i, &r);
+		struct box box = { r.x, r.y, r.width, r.height };
+		done = scale_surface_box(image, cap_buf->surface, &box);
+	}
+	if (done) {
+		cairo_region_destroy(tiles);
+		return;
 	}
 
-	/* Scale the captured image down to THUMBNAIL_WIDTH pixels wide */
-	double scale = (double)THUMBNAIL_WIDTH / thumb->capture_width;
-	thumb->image_width = THUMBNAIL_WIDTH;
-	thumb->image_height = (int)(thumb->capture_height * scale);
-	if (thumb->image_height < 1) {
-		thumb->image_height = 1;
+	double scale = (double)cairo_image_surface_get_width(image)
+		/ cap_buf->width;
+	cairo_t *cr = cairo_create(image);
+	for (int i = 0; i < n; i++) {
+		cairo_rectangle_int_t r;
+		cairo_region_get_rectangle(tiles, i, &r);
+		cairo_rectangle(cr, r.x, r.y, r.width, r.height);
 	}
+	cairo_clip(cr);
+	cairo_region_destroy(tiles);
 
-	thumb->image = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
-		thumb->image_width, thumb->image_height);
-	cairo_t *cr = cairo_create(thumb->image);
 	cairo_scale(cr, scale, scale);
 	cairo_set_source_surface(cr, cap_buf->surface, 0, 0);
 	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
 	cairo_paint(cr);
 	cairo_destroy(cr);
+}
 
-	/*
-	 * Mark capture buffer as not-busy so it can be reused next time.
-	 * We already copied the data into thumb->image above.
-	 */
-	cap_buf->busy = false;
+static int
+thumbnail_height(uint32_t width, uint32_t height)
+{
+	int ret = (int)((double)height * THUMBNAIL_WIDTH / width);
+	return ret < 1 ? 1 : ret;
+}
 
-	return true;
+/* Cache and show @image, which is new or was updated in place */
+static void
+capture_show(struct ext_toplevel *t, cairo_surface_t *image)
+{
+	if (image == t->image) {
+		cache_touch(t);
+	} else {
+		cache_put(t, image);
+	}
+	struct thumbnail *thumb = t->panel->thumbnail;
+	if (thumb && thumb->ext == t) {
+		thumbnail_set_image(thumb, image);
+	}
 }
 
-/* ========================================================================= */
-/* Public API                                                                  */
-/* ========================================================================= */
+/*
+ * Get an image of the right size to scale a frame into: the cached one if it
+ * still fits, a fresh one otherwise. The caller owns a reference.
+ */
+static cairo_surface_t *
+capture_image(struct ext_toplevel *t, int height)
+{
+	if (t->image && cairo_image_surface_get_height(t->image) == height) {
+		return cairo_surface_reference(t->image);
+	}
+	return cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+		THUMBNAIL_WIDTH, height);
+}
 
-void
-thumbnail_show(struct panel *panel, struct toplevel *toplevel)
+#if HAVE_DMABUF
+static void
+capture_finish_dmabuf(struct ext_toplevel *t)
 {
-	/* Hide any existing thumbnail first */
-	thumbnail_hide(panel);
+	struct dmabuf_buffer *buf = t->dmabuf_buffer;
+	cairo_region_destroy(t->frame_damage);
+	t->frame_damage = NULL;
+
+	/* The GPU rescales the whole frame, which costs next to nothing */
+	int height = thumbnail_height(buf->width, buf->height);
+	cairo_surface_t *image = capture_image(t, height);
+	if (dmabuf_buffer_scale(t->panel->dmabuf, buf, image)) {
+		capture_show(t, image);
+	} else {
+		warn("thumbnail: GPU scaling failed, falling back to SHM");
+		t->dmabuf_failed = true;
+		capture_frame(t);
+	}
+	cairo_surface_destroy(image);
+}
+#endif
 
-	if (!panel->xdg_wm_base) {
+/* The frame is ready: scale it down, cache it and show it if still wanted */
+static void
+capture_finish(struct ext_toplevel *t)
+{
+	struct pool_buffer *cap_buf = t->capture_buffer;
+
+	ext_image_copy_capture_frame_v1_destroy(t->frame);
+	t->frame = NULL;
+	t->capture_buffer = NULL;
+	t->capture_state = CAPTURE_IDLE;
+
+#if HAVE_DMABUF
+	if (!cap_buf) {
+		capture_finish_dmabuf(t);
 		return;
 	}
+#endif
 
-	struct ext_foreign_toplevel_handle_v1 *ext_handle =
-		find_ext_handle(panel, toplevel);
-	if (!ext_handle) {
-		debug("thumbnail: no ext handle for '%s'",
-			toplevel->title ? toplevel->title : "(null)");
-		return;
+	/* Scale the captured image down to THUMBNAIL_WIDTH pixels wide */
+	int height = thumbnail_height(cap_buf->width, cap_buf->height);
+
+	/*
+	 * The cached image reflects the previous frame, so unless the size
+	 * changed (or it was evicted) only the damaged tiles need rescaling.
+	 */
+	cairo_surface_t *image = capture_image(t, height);
+	scale_into(image, cap_buf, image == t->image ? t->frame_damage : NULL);
+
+	/* The data has been copied into @image, so the buffer can be reused */
+	pool_commit_damage(&t->capture_pool, cap_buf, t->frame_damage);
+	cairo_region_destroy(t->frame_damage);
+	t->frame_damage = NULL;
+	cap_buf->busy = false;
+
+	capture_show(t, image);
+	cairo_surface_destroy(image);
+}
+
+static void
+capture_stop(struct ext_toplevel *t)
+{
+	if (t->frame) {
+		ext_image_copy_capture_frame_v1_destroy(t->frame);
+		t->frame = NULL;
+	}
+	if (t->session) {
+		ext_image_copy_capture_session_v1_destroy(t->session);
+		t->session = NULL;
 	}
+	if (t->frame_damage) {
+		cairo_region_destroy(t->frame_damage);
+		t->frame_damage = NULL;
+	}
+	pool_finish(&t->capture_pool);
+#if HAVE_DMABUF
+	if (t->dmabuf_buffer) {
+		dmabuf_buffer_destroy(t->panel->dmabuf, t->dmabuf_buffer);
+		t->dmabuf_buffer = NULL;
+	}
+#endif
+	t->capture_buffer = NULL;
+	t->capture_state = CAPTURE_NONE;
+	t->capture_pending = false;
+	t->constraints_done = false;
+	t->dmabuf_format = 0;
+	t->dmabuf_modifiers.size = 0;
+	t->dmabuf_failed = false;
+}
 
-	struct thumbnail *thumb = znew(*thumb);
-	thumb->panel = panel;
-	panel->thumbnail = thumb;
+static bool
+create_popup(struct thumbnail *thumb)
+{
+	struct panel *panel = thumb->panel;
+	struct toplevel *toplevel = thumb->toplevel;
 
-	if (!do_capture(thumb, ext_handle)) {
-		zfree(panel->thumbnail);
-		return;
+	struct box anchor;
+	if (!layout_widget_box(thumb->bar, &toplevel->base, &anchor)) {
+		debug("thumbnail: task button is no longer shown");
+		return false;
 	}
 
-	/* Create the popup surface */
 	thumb->popup_surface = wl_compositor_create_surface(panel->compositor);
 	if (!thumb->popup_surface) {
 		debug("thumbnail: failed to create popup surface");
-		goto cleanup_image;
+		return false;
 	}
 
 	thumb->xdg_surface = xdg_wm_base_get_xdg_surface(panel->xdg_wm_base,
 		thumb->popup_surface);
 	if (!thumb->xdg_surface) {
 		debug("thumbnail: failed to create xdg_surface");
-		goto cleanup_surface;
+		return false;
 	}
 	xdg_surface_add_listener(thumb->xdg_surface,
 		&thumbnail_xdg_surface_listener, thumb);
@@ -520,8 +1069,8 @@ thumbnail_show(struct panel *panel, struct toplevel *toplevel)
 	 * from the bottom of the panel (or upward for a bottom panel via
 	 * FLIP_Y constraint adjustment), matching the startmenu behaviour.
 	 */
-	xdg_positioner_set_anchor_rect(positioner, toplevel->base.box.x, 0,
-		toplevel->base.box.width, panel->box.height);
+	xdg_positioner_set_anchor_rect(positioner, anchor.x, 0, anchor.width,
+		thumb->bar->box.height);
 	xdg_positioner_set_anchor(positioner, XDG_POSITIONER_ANCHOR_BOTTOM_LEFT);
 	xdg_positioner_set_gravity(positioner,
 		XDG_POSITIONER_GRAVITY_BOTTOM_RIGHT);
@@ -534,39 +1083,25 @@ thumbnail_show(struct panel *panel, struct toplevel *toplevel)
 	xdg_positioner_destroy(positioner);
 	if (!thumb->xdg_popup) {
 		debug("thumbnail: failed to create xdg_popup");
-		goto cleanup_xdg_surface;
+		return false;
 	}
-	zwlr_layer_surface_v1_get_popup(panel->layer_surface, thumb->xdg_popup);
+	zwlr_layer_surface_v1_get_popup(thumb->bar->layer_surface,
+		thumb->xdg_popup);
 	xdg_popup_add_listener(thumb->xdg_popup, &thumbnail_popup_listener,
 		thumb);
 
+	/* The first buffer is attached once the configure event arrives */
 	wl_surface_commit(thumb->popup_surface);
-	wl_display_roundtrip(panel->display);
-	return;
-
-cleanup_xdg_surface:
-	xdg_surface_destroy(thumb->xdg_surface);
-	thumb->xdg_surface = NULL;
-cleanup_surface:
-	wl_surface_destroy(thumb->popup_surface);
-	thumb->popup_surface = NULL;
-cleanup_image:
-	if (thumb->image) {
-		cairo_surface_destroy(thumb->image);
-		thumb->image = NULL;
-	}
-	zfree(panel->thumbnail);
+	return true;
 }
 
-void
-thumbnail_hide(struct panel *panel)
+static void
+destroy_popup(struct thumbnail *thumb)
 {
-	struct thumbnail *thumb = panel->thumbnail;
-	if (!thumb) {
-		return;
+	if (thumb->frame_callback) {
+		wl_callback_destroy(thumb->frame_callback);
+		thumb->frame_callback = NULL;
 	}
-
-	/* Destroy popup */
 	if (thumb->xdg_popup) {
 		xdg_popup_destroy(thumb->xdg_popup);
 		thumb->xdg_popup = NULL;
@@ -579,30 +1114,126 @@ thumbnail_hide(struct panel *panel)
 		wl_surface_destroy(thumb->popup_surface);
 		thumb->popup_surface = NULL;
 	}
-	destroy_buffer(&thumb->popup_buffers[0]);
-	destroy_buffer(&thumb->popup_buffers[1]);
+	pool_finish(&thumb->popup_pool);
+	thumb->configured = false;
+}
+
+/*
+ * Show @image in the popup, mapping it first if needed. A popup cannot be
+ * resized without repositioning, so a change in size recreates it.
+ */
+static void
+thumbnail_set_image(struct thumbnail *thumb, cairo_surface_t *image)
+{
+	int width = cairo_image_surface_get_width(image);
+	int height = cairo_image_surface_get_height(image);
+	if (thumb->popup_surface && (width != thumb->image_width
+			|| height != thumb->image_height)) {
+		destroy_popup(thumb);
+	}
+
+	if (thumb->image != image) {
+		if (thumb->image) {
+			cairo_surface_destroy(thumb->image);
+		}
+		thumb->image = cairo_surface_reference(image);
+	}
+	thumb->image_width = width;
+	thumb->image_height = height;
+
+	if (thumb->popup_surface) {
+		thumbnail_render_popup(thumb);
+		return;
+	}
+	thumb->state = THUMBNAIL_SHOWN;
+	if (!create_popup(thumb)) {
+		thumbnail_hide(thumb->panel);
+	}
+}
+
+/* ========================================================================= */
+/* Public API                                                                  */
+/* ========================================================================= */
+
+/*
+ * Show the thumbnail of @toplevel, as a popup of @bar. A cached image is
+ * shown straight away and refreshed in the background; otherwise the popup
+ * is mapped from the frame listener once the compositor has delivered the
+ * first image.
+ */
+void
+thumbnail_show(struct panel *panel, struct bar *bar, struct toplevel *toplevel)
+{
+	/* Hide any existing thumbnail first */
+	thumbnail_hide(panel);
+
+	if (!panel->xdg_wm_base) {
+		return;
+	}
+
+	struct ext_toplevel *ext = find_ext_toplevel(panel, toplevel);
+	if (!ext) {
+		debug("thumbnail: no ext handle for '%s'",
+			toplevel->title ? toplevel->title : "(null)");
+		return;
+	}
+
+	struct thumbnail *thumb = znew(*thumb);
+	thumb->panel = panel;
+	thumb->toplevel = toplevel;
+	thumb->ext = ext;
+	thumb->bar = bar;
+	panel->thumbnail = thumb;
+
+	if (ext->image) {
+		stats.thumbnail_cache_hits++;
+		cache_touch(ext);
+		thumbnail_set_image(thumb, ext->image);
+		if (!panel->thumbnail) {
+			return;
+		}
+	} else {
+		stats.thumbnail_cache_misses++;
+	}
 
-	/* Destroy any in-progress capture resources */
-	if (thumb->frame) {
-		ext_image_copy_capture_frame_v1_destroy(thumb->frame);
-		thumb->frame = NULL;
+	/* Failing here may already have hidden a popup without an image */
+	if (!capture_request(ext) && panel->thumbnail
+			&& !panel->thumbnail->image) {
+		thumbnail_hide(panel);
 	}
-	if (thumb->session) {
-		ext_image_copy_capture_session_v1_destroy(thumb->session);
-		thumb->session = NULL;
+}
+
+void
+thumbnail_hide(struct panel *panel)
+{
+	struct thumbnail *thumb = panel->thumbnail;
+	if (!thumb) {
+		return;
 	}
-	destroy_buffer(&thumb->capture_buffers[0]);
-	destroy_buffer(&thumb->capture_buffers[1]);
 
-	/* Free scaled image */
+	destroy_popup(thumb);
 	if (thumb->image) {
 		cairo_surface_destroy(thumb->image);
 		thumb->image = NULL;
 	}
 
+	/* The capture session, if any, stays with thumb->ext */
 	zfree(panel->thumbnail);
 }
 
+/*
+ * The pointer has left the taskbar: close all capture sessions. Cached
+ * images are kept for the next hover.
+ */
+void
+thumbnail_end_hover(struct panel *panel)
+{
+	struct ext_toplevel *t;
+	wl_list_for_each(t, &panel->ext_toplevels, link) {
+		capture_stop(t);
+	}
+}
+
 void
 thumbnail_destroy_all(struct panel *panel)
 {
@@ -611,17 +1242,22 @@ thumbnail_destroy_all(struct panel *panel)
 	/* Destroy ext toplevel list and all tracked handles */
 	struct ext_toplevel *t, *next;
 	wl_list_for_each_safe(t, next, &panel->ext_toplevels, link) {
-		wl_list_remove(&t->link);
-		ext_foreign_toplevel_handle_v1_destroy(t->handle);
-		zfree(t->title);
-		zfree(t->app_id);
-		zfree(t);
+		ext_toplevel_destroy(t);
 	}
 	if (panel->ext_toplevel_list) {
 		ext_foreign_toplevel_list_v1_destroy(panel->ext_toplevel_list);
 		panel->ext_toplevel_list = NULL;
 	}
 
+#if HAVE_DMABUF
+	dmabuf_destroy(panel->dmabuf);
+	panel->dmabuf = NULL;
+	if (panel->linux_dmabuf) {
+		zwp_linux_dmabuf_v1_destroy(panel->linux_dmabuf);
+		panel->linux_dmabuf = NULL;
+	}
+#endif
+
 	/* Destroy capture managers */
 	if (panel->ext_image_capture_source_mgr) {
 		ext_foreign_toplevel_image_capture_source_manager_v1_destroy(
@@ -0,0 +1,289 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * There are only ever a handful of timers, so they are kept in a plain list
+ * and scanned for the next deadline. The timerfd runs on CLOCK_REALTIME so
+ * that aligned timers track the wall clock, also across suspend.
+ *
+ * One-shot timers are about a delay rather than a time of day, so when the
+ * clock is set they are moved by as much as it jumped. That is told from
+ * the offset between CLOCK_REALTIME and CLOCK_BOOTTIME, which only changes
+ * when the clock is set, but not across suspend.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+#include <wayland-util.h>
+#include "common/log.h"
+#include "common/mem.h"
+#include "timer.h"
+
+#define NS_PER_MS 1000000ull
+#define NS_PER_S 1000000000ull
+
+/* Smaller changes in the clock offset are taken as jitter between reads */
+#define CLOCK_STEP_NS NS_PER_MS
+
+struct timer {
+	struct timers *timers;
+	void (*callback)(void *data);
+	void *data;
+	uint64_t deadline; /* realtime ns, 0 if disarmed */
+	uint64_t interval; /* ns, 0 for one-shot */
+	uint64_t slack; /* ns */
+	bool removed; /* freed once dispatch is done with it */
+	struct wl_list link; /* timers.timers */
+};
+
+struct timers {
+	int fd;
+	struct wl_list timers;
+	bool dispatching;
+	int64_t clock_offset; /* ns, realtime - boottime when last checked */
+};
+
+static uint64_t
+clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * NS_PER_S + ts.tv_nsec;
+}
+
+static uint64_t
+now(void)
+{
+	return clock_ns(CLOCK_REALTIME);
+}
+
+static int64_t
+clock_offset(void)
+{
+	return (int64_t)(now() - clock_ns(CLOCK_BOOTTIME));
+}
+
+/* The first multiple of @timer's interval after @time */
+static uint64_t
+next_aligned(const struct timer *timer, uint64_t time)
+{
+	return (time / timer->interval + 1) * timer->interval;
+}
+
+/* Wake up as late as every armed timer's slack allows */
+static void
+rearm(struct timers *timers)
+{
+	if (timers->dispatching) {
+		return;
+	}
+	uint64_t wakeup = 0;
+	struct timer *timer;
+	wl_list_for_each(timer, &timers->timers, link) {
+		if (!timer->deadline || timer->removed) {
+			continue;
+		}
+		uint64_t latest = timer->deadline + timer->slack;
+		if (!wakeup || latest < wakeup) {
+			wakeup = latest;
+		}
+	}
+
+	struct itimerspec spec = {
+		.it_value.tv_sec = wakeup / NS_PER_S,
+		.it_value.tv_nsec = wakeup % NS_PER_S,
+	};
+	if (timerfd_settime(timers->fd,
+			TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET,
+			&spec, NULL) < 0) {
+		warn("timers: timerfd_settime failed");
+	}
+}
+
+struct timers *
+timers_create(void)
+{
+	int fd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (fd < 0) {
+		warn("timers: timerfd_create failed");
+		return NULL;
+	}
+	struct timers *timers = znew(*timers);
+	timers->fd = fd;
+	wl_list_init(&timers->timers);
+	timers->clock_offset = clock_offset();
+	return timers;
+}
+
+void
+timers_destroy(struct timers *timers)
+{
+	if (!timers) {
+		return;
+	}
+	struct timer *timer, *next;
+	wl_list_for_each_safe(timer, next, &timers->timers, link) {
+		wl_list_remove(&timer->link);
+		free(timer);
+	}
+	close(timers->fd);
+	free(timers);
+}
+
+int
+timers_get_fd(struct timers *timers)
+{
+	return timers ? timers->fd : -1;
+}
+
+/*
+ * If the clock was set since the last check, realign the periodic timers
+ * and move the one-shot ones by the same amount, so that they still fire
+ * when they were meant to. Has to be done before any new deadline is set.
+ */
+static void
+check_clock(struct timers *timers)
+{
+	int64_t offset = clock_offset();
+	int64_t step = offset - timers->clock_offset;
+	if (step > -(int64_t)CLOCK_STEP_NS && step < (int64_t)CLOCK_STEP_NS) {
+		return;
+	}
+	debug("timers: clock was set by %" PRId64 " ms, realigning",
+		step / (int64_t)NS_PER_MS);
+	timers->clock_offset = offset;
+
+	uint64_t time = now();
+	struct timer *timer;
+	wl_list_for_each(timer, &timers->timers, link) {
+		if (!timer->deadline) {
+			continue;
+		}
+		if (timer->interval) {
+			timer->deadline = next_aligned(timer, time);
+		} else if (step < 0 && timer->deadline <= (uint64_t)-step) {
+			timer->deadline = 1; /* due right away */
+		} else {
+			timer->deadline += step;
+		}
+	}
+}
+
+void
+timers_dispatch(struct timers *timers)
+{
+	uint64_t expirations;
+	if (read(timers->fd, &expirations, sizeof(expirations)) < 0
+			&& errno != ECANCELED && errno != EAGAIN) {
+		warn("timers: read failed");
+	}
+	/* Also when the clock was set while this fd was not armed */
+	check_clock(timers);
+
+	/*
+	 * Callbacks can change the list, so start over after each one. Timers
+	 * that have run are moved past the current time and are not due again.
+	 */
+	timers->dispatching = true;
+	uint64_t time = now();
+	bool ran;
+	do {
+		ran = false;
+		struct timer *timer;
+		wl_list_for_each(timer, &timers->timers, link) {
+			if (timer->removed || !timer->deadline
+					|| timer->deadline > time) {
+				continue;
+			}
+			if (timer->interval) {
+				timer->deadline = next_aligned(timer, time);
+			} else {
+				timer->deadline = 0;
+			}
+			timer->callback(timer->data);
+			ran = true;
+			break;
+		}
+	} while (ran);
+	timers->dispatching = false;
+
+	struct timer *timer, *next;
+	wl_list_for_each_safe(timer, next, &timers->timers, link) {
+		if (timer->removed) {
+			wl_list_remove(&timer->link);
+			free(timer);
+		}
+	}
+	rearm(timers);
+}
+
+struct timer *
+timer_add(struct timers *timers, void (*callback)(void *data), void *data)
+{
+	if (!timers) {
+		return NULL;
+	}
+	struct timer *timer = znew(*timer);
+	timer->timers = timers;
+	timer->callback = callback;
+	timer->data = data;
+	wl_list_insert(timers->timers.prev, &timer->link);
+	return timer;
+}
+
+void
+timer_remove(struct timer *timer)
+{
+	if (!timer) {
+		return;
+	}
+	struct timers *timers = timer->timers;
+	timer->deadline = 0;
+	if (timers->dispatching) {
+		timer->removed = true;
+		return;
+	}
+	wl_list_remove(&timer->link);
+	free(timer);
+	rearm(timers);
+}
+
+void
+timer_set_periodic(struct timer *timer, uint32_t interval_ms,
+		uint32_t slack_ms)
+{
+	if (!timer || !interval_ms) {
+		return;
+	}
+	check_clock(timer->timers);
+	timer->interval = interval_ms * NS_PER_MS;
+	timer->slack = slack_ms * NS_PER_MS;
+	timer->deadline = next_aligned(timer, now());
+	rearm(timer->timers);
+}
+
+void
+timer_set_oneshot(struct timer *timer, uint32_t delay_ms, uint32_t slack_ms)
+{
+	if (!timer) {
+		return;
+	}
+	check_clock(timer->timers);
+	timer->interval = 0;
+	timer->slack = slack_ms * NS_PER_MS;
+	timer->deadline = now() + delay_ms * NS_PER_MS;
+	rearm(timer->timers);
+}
+
+void
+timer_disarm(struct timer *timer)
+{
+	if (!timer) {
+		return;
+	}
+	timer->deadline = 0;
+	rearm(timer->timers);
+}
@@ -1,7 +1,13 @@
 // SPDX-License-Identifier: GPL-2.0-only
 #include <cairo/cairo.h>
 #include <stdlib.h>
+#include <math.h>
+#include "common/atlas.h"
+#include "common/hash.h"
+#include "conf.h"
+#include "layout.h"
 #include "panel.h"
+#include "stats.h"
 
 void
 widget_on_left_button_press(struct widget *widget, struct seat *seat)
@@ -36,12 +42,153 @@ widget_is_plugin(struct widget *widget)
 		&& widget->type < WIDGET_PLUGINS_END;
 }
 
+/* Fingerprint of a text label drawn at the current panel height and scale */
+uint64_t
+widget_label_key(struct widget *widget, const char *label)
+{
+	uint64_t key = hash_str(HASH_INIT, label);
+	key = hash_u64(key, widget->panel->height);
+	return hash_u64(key, widget->panel->scale);
+}
+
+/*
+ * Record the fingerprint of the content about to be drawn. Returns false if
+ * it matches what the surface already shows, in which case the caller can
+ * skip layout and rasterization altogether.
+ */
+bool
+widget_key_update(struct widget *widget, uint64_t key)
+{
+	if (widget->surface && widget->key && widget->key == key) {
+		return false;
+	}
+	widget->key = key;
+	return true;
+}
+
+/* Force the next update to redraw even if the content key is unchanged */
 void
-widget_free(struct widget *widget)
+widget_invalidate(struct widget *widget)
+{
+	widget->key = 0;
+}
+
+/*
+ * Return a context for redrawing the widget surface at the given size. The
+ * surface and its context are kept across updates and only reallocated when
+ * the size changes; either way the surface is cleared. Must be paired with
+ * widget_surface_end().
+ *
+ * @width and @height are logical. The surface has panel->scale times as
+ * many pixels, and a device scale so that it is drawn to and composited in
+ * logical pixels.
+ */
+cairo_t *
+widget_surface_begin(struct widget *widget, int width, int height)
+{
+	int scale = widget->panel->scale;
+	if (widget->surface
+			&& cairo_image_surface_get_width(widget->surface)
+				== width * scale
+			&& cairo_image_surface_get_height(widget->surface)
+				== height * scale) {
+		stats.widget_surface_reuses++;
+	} else {
+		if (widget->cairo) {
+			cairo_destroy(widget->cairo);
+		}
+		if (widget->surface) {
+			cairo_surface_destroy(widget->surface);
+		}
+		widget->surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+			width * scale, height * scale);
+		cairo_surface_set_device_scale(widget->surface, scale, scale);
+		widget->cairo = cairo_create(widget->surface);
+		stats.widget_surface_allocs++;
+	}
+
+	cairo_t *cairo = widget->cairo;
+	cairo_save(cairo);
+	cairo_set_operator(cairo, CAIRO_OPERATOR_CLEAR);
+	cairo_paint(cairo);
+	cairo_set_operator(cairo, CAIRO_OPERATOR_OVER);
+	return cairo;
+}
+
+void
+widget_surface_end(struct widget *widget)
+{
+	cairo_new_path(widget->cairo);
+	cairo_restore(widget->cairo);
+	cairo_surface_flush(widget->surface);
+	widget->generation++;
+}
+
+/* Get the glyph atlas for the current font, text color and scale */
+struct atlas *
+widget_atlas(struct panel *panel)
 {
+	struct conf *conf = panel->conf;
+	if (panel->atlas && !atlas_matches(panel->atlas,
+			conf->font_description, conf->text, panel->scale)) {
+		atlas_destroy(panel->atlas);
+		panel->atlas = NULL;
+	}
+	if (!panel->atlas) {
+		panel->atlas = atlas_create(conf->font_description, conf->text,
+			panel->scale);
+	}
+	return panel->atlas;
+}
+
+/*
+ * Draw a one-line label, vertically centered with @padding either side, and
+ * size the widget to fit. Labels covered by the glyph atlas are copied from
+ * it; anything else goes through pango.
+ */
+void
+widget_draw_label(struct widget *widget, int padding, const char *label)
+{
+	struct panel *panel = widget->panel;
+	struct atlas *atlas = widget_atlas(panel);
+
+	int width, height;
+	if (atlas_measure(atlas, label, &width, &height)) {
+		widget->box.width = width + 2 * padding;
+		widget_surface_begin(widget, widget->box.width, panel->height);
+		atlas_draw(atlas, widget->surface, padding,
+			lround((panel->height - height) / 2.0), label);
+		widget_surface_end(widget);
+		return;
+	}
+
+	PangoRectangle rect = get_text_size(panel->conf->font_description, label);
+	widget->box.width = rect.width + 2 * padding;
+	cairo_t *cr = widget_surface_begin(widget, widget->box.width,
+		panel->height);
+	cairo_set_source_u32(cr, panel->conf->text);
+	cairo_move_to(cr, padding, (panel->height - rect.height) / 2.0);
+	render_text(cr, panel->conf->font_description, 1, false, "%s", label);
+	widget_surface_end(widget);
+}
+
+/* Release what @widget holds, for widgets embedded in other allocations */
+void
+widget_finish(struct widget *widget)
+{
+	layout_forget(widget->panel, widget);
+	if (widget->cairo) {
+		cairo_destroy(widget->cairo);
+	}
 	if (widget->surface) {
 		cairo_surface_destroy(widget->surface);
 	}
+}
+
+void
+widget_free(struct widget *widget)
+{
+	widget_finish(widget);
 	free(widget);
 }
 
@@ -64,6 +211,8 @@ widgets_free(struct panel *panel)
 		} else if (widget->type == WIDGET_STARTMENU) {
 			struct startmenu *menu = (struct startmenu *)widget;
 			plugin_startmenu_destroy(menu);
+		} else if (widget->type == WIDGET_BATTERY) {
+			plugin_battery_destroy((struct battery *)widget);
 		} else {
 			widget_destroy(widget);
 		}
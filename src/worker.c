@@ -0,0 +1,179 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <wayland-util.h>
+#include "common/log.h"
+#include "common/mem.h"
+#include "worker.h"
+
+struct job {
+	void (*work)(void *data);
+	void (*done)(void *data, bool cancelled);
+	void *data;
+	struct wl_list link; /* worker.pending or worker.finished */
+};
+
+struct worker {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond; /* signalled when a job is queued */
+	struct wl_list pending; /* oldest first */
+	struct wl_list finished;
+	bool stopping;
+	int fd; /* eventfd, counts finished jobs */
+};
+
+static void *
+worker_thread(void *data)
+{
+	struct worker *worker = data;
+
+	pthread_mutex_lock(&worker->lock);
+	while (!worker->stopping) {
+		if (wl_list_empty(&worker->pending)) {
+			pthread_cond_wait(&worker->cond, &worker->lock);
+			continue;
+		}
+		struct job *job = wl_container_of(worker->pending.next, job, link);
+		wl_list_remove(&job->link);
+		pthread_mutex_unlock(&worker->lock);
+
+		job->work(job->data);
+
+		pthread_mutex_lock(&worker->lock);
+		wl_list_insert(worker->finished.prev, &job->link);
+		uint64_t one = 1;
+		if (write(worker->fd, &one, sizeof(one)) != sizeof(one)) {
+			warn("worker: failed to signal completion");
+		}
+	}
+	pthread_mutex_unlock(&worker->lock);
+	return NULL;
+}
+
+struct worker *
+worker_create(void)
+{
+	struct worker *worker = znew(*worker);
+	wl_list_init(&worker->pending);
+	wl_list_init(&worker->finished);
+	pthread_mutex_init(&worker->lock, NULL);
+	pthread_cond_init(&worker->cond, NULL);
+
+	worker->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (worker->fd < 0) {
+		warn("worker: eventfd failed");
+		goto err_eventfd;
+	}
+
+	/* Signals are for the main thread's signalfd, never for the worker */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	int ret = pthread_create(&worker->thread, NULL, worker_thread, worker);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret) {
+		warn("worker: failed to create thread: %s", strerror(ret));
+		goto err_thread;
+	}
+	return worker;
+
+err_thread:
+	close(worker->fd);
+err_eventfd:
+	pthread_cond_destroy(&worker->cond);
+	pthread_mutex_destroy(&worker->lock);
+	free(worker);
+	return NULL;
+}
+
+static void
+cancel_jobs(struct wl_list *jobs)
+{
+	struct job *job, *next;
+	wl_list_for_each_safe(job, next, jobs, link) {
+		wl_list_remove(&job->link);
+		job->done(job->data, true);
+		free(job);
+	}
+}
+
+/* Waits for the job in progress, if any, but drops those still queued */
+void
+worker_destroy(struct worker *worker)
+{
+	if (!worker) {
+		return;
+	}
+	pthread_mutex_lock(&worker->lock);
+	worker->stopping = true;
+	pthread_cond_signal(&worker->cond);
+	pthread_mutex_unlock(&worker->lock);
+	pthread_join(worker->thread, NULL);
+
+	cancel_jobs(&worker->pending);
+	cancel_jobs(&worker->finished);
+	close(worker->fd);
+	pthread_cond_destroy(&worker->cond);
+	pthread_mutex_destroy(&worker->lock);
+	free(worker);
+}
+
+int
+worker_get_fd(struct worker *worker)
+{
+	return worker ? worker->fd : -1;
+}
+
+void
+worker_submit(struct worker *worker, void (*work)(void *data),
+		void (*done)(void *data, bool cancelled), void *data)
+{
+	if (!worker) {
+		work(data);
+		done(data, false);
+		return;
+	}
+
+	struct job *job = znew(*job);
+	job->work = work;
+	job->done = done;
+	job->data = data;
+
+	pthread_mutex_lock(&worker->lock);
+	wl_list_insert(worker->pending.prev, &job->link);
+	pthread_cond_signal(&worker->cond);
+	pthread_mutex_unlock(&worker->lock);
+}
+
+void
+worker_dispatch(struct worker *worker)
+{
+	if (!worker) {
+		return;
+	}
+	uint64_t count;
+	if (read(worker->fd, &count, sizeof(count)) != sizeof(count)) {
+		return;
+	}
+
+	struct wl_list finished;
+	wl_list_init(&finished);
+	pthread_mutex_lock(&worker->lock);
+	wl_list_insert_list(&finished, &worker->finished);
+	wl_list_init(&worker->finished);
+	pthread_mutex_unlock(&worker->lock);
+
+	struct job *job, *next;
+	wl_list_for_each_safe(job, next, &finished, link) {
+		wl_list_remove(&job->link);
+		job->done(job->data, false);
+		free(job);
+	}
+}